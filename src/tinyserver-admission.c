@@ -0,0 +1,245 @@
+#include <time.h>
+
+//================================
+// Internal
+//================================
+
+internal u32
+GetAdmissionClock(void)
+{
+    // Milliseconds, wrapping every 49 days, which buckets take into account.
+#if defined(TT_WINDOWS)
+    return (u32)GetTickCount64();
+#else
+    struct timespec Now;
+    clock_gettime(CLOCK_MONOTONIC, &Now);
+    return (u32)((u64)Now.tv_sec * 1000 + (u64)Now.tv_nsec / 1000000);
+#endif
+}
+
+global const u8 gV4MappedPrefix[12] = { 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0xFF, 0xFF };
+
+internal u32
+HashSourceAddr(ts_sockaddr* Peer)
+{
+    // Only the IP is hashed, not the port: bytes 4-7 of a sockaddr_in, or the
+    // /64 prefix, bytes 8-15, of a sockaddr_in6. IPv4 clients of a dual-stack
+    // socket come as v4-mapped addresses (::ffff:a.b.c.d), all with the same
+    // prefix, so their IPv4 part, bytes 20-23, is hashed instead.
+    u32 Start = 0, End = Peer->Size;
+    if (Peer->Size == 16)
+    {
+        Start = 4;
+        End = 8;
+    }
+    else if (Peer->Size == 28 && memcmp(Peer->Addr + 8, gV4MappedPrefix, 12) == 0)
+    {
+        Start = 20;
+        End = 24;
+    }
+    else if (Peer->Size == 28)
+    {
+        Start = 8;
+        End = 16;
+    }
+    
+    u32 Hash = 2166136261u; // FNV-1a.
+    for (u32 Idx = Start; Idx < End; Idx++)
+    {
+        Hash = (Hash ^ Peer->Addr[Idx]) * 16777619u;
+    }
+    return Hash;
+}
+
+internal bool
+TakeAdmitToken(volatile u64* Bucket, u32 Rate, u32 Burst, u32 Now)
+{
+    // Bucket holds the time of the last take in its high half, and the tokens
+    // left, in thousandths, in its low half, so both change with one CAS. A
+    // rate of N per second refills N thousandths per millisecond.
+    u64 Full = (u64)Burst * 1000;
+#if defined(_MSC_VER)
+    u64 Old = *Bucket;
+#else
+    u64 Old = __atomic_load_n(Bucket, __ATOMIC_RELAXED);
+#endif
+    while (true)
+    {
+        u64 Tokens = Full;
+        if (Old)
+        {
+            // Threads may read the clock in a different order than they take;
+            // time going back just refills nothing.
+            i32 Elapsed = (i32)(Now - (u32)(Old >> 32));
+            Tokens = (u32)Old + (u64)(Elapsed > 0 ? Elapsed : 0) * Rate;
+            Tokens = Min(Tokens, Full);
+        }
+        if (Tokens < 1000)
+        {
+            return false;
+        }
+        
+        u64 New = ((u64)Now << 32) | (Tokens - 1000);
+#if defined(_MSC_VER)
+        u64 Seen = (u64)_InterlockedCompareExchange64((volatile __int64*)Bucket, New, Old);
+        if (Seen == Old)
+        {
+            return true;
+        }
+        Old = Seen;
+#else
+        if (__atomic_compare_exchange_n(Bucket, &Old, New, true,
+                                        __ATOMIC_RELAXED, __ATOMIC_RELAXED))
+        {
+            return true;
+        }
+#endif
+    }
+}
+
+internal ts_admit
+RefuseAdmission(ts_admission* Admission, ts_admit Result)
+{
+    volatile u64* Count = ((Result == Admit_Busy)
+                           ? &Admission->BusyCount : &Admission->RateLimitedCount);
+#if defined(_MSC_VER)
+    _InterlockedIncrement64((volatile __int64*)Count);
+#else
+    __atomic_add_fetch(Count, 1, __ATOMIC_RELAXED);
+#endif
+    return Result;
+}
+
+internal bool
+IsServerOverloaded(ts_admission* Admission)
+{
+    return (Admission->Config.MaxQueueDepth
+            && GetIoQueueDepth() > Admission->Config.MaxQueueDepth);
+}
+
+
+//================================
+// Admission
+//================================
+
+external bool
+InitAdmission(ts_admission* Admission, ts_admission_config* Config, buffer* Arena)
+{
+    u32 Slots = 16;
+    while (Slots < Config->SourceSlots) Slots <<= 1;
+    
+    usz ArenaStart = Arena->WriteCur;
+    u64* ConnBuckets = PushArray(Arena, Slots, u64);
+    u64* RequestBuckets = PushArray(Arena, Slots, u64);
+    if (!ConnBuckets || !RequestBuckets)
+    {
+        Arena->WriteCur = ArenaStart;
+        return false;
+    }
+    
+    memset(Admission, 0, sizeof(ts_admission));
+    memset(ConnBuckets, 0, Slots * sizeof(u64));
+    memset(RequestBuckets, 0, Slots * sizeof(u64));
+    Admission->Config = *Config;
+    Admission->ConnBuckets = ConnBuckets;
+    Admission->RequestBuckets = RequestBuckets;
+    Admission->SlotMask = Slots - 1;
+    
+    // Bursts are kept in thousandths in 32 bits.
+    ts_admission_config* Limits = &Admission->Config;
+    if (!Limits->ConnBurst) Limits->ConnBurst = Limits->ConnRate;
+    if (!Limits->RequestBurst) Limits->RequestBurst = Limits->RequestRate;
+    Limits->ConnBurst = Min(Limits->ConnBurst, U32_MAX / 1000);
+    Limits->RequestBurst = Min(Limits->RequestBurst, U32_MAX / 1000);
+    return true;
+}
+
+external ts_admit
+AdmitConn(ts_admission* Admission, ts_sockaddr* Peer)
+{
+    ts_admission_config* Limits = &Admission->Config;
+    if (IsServerOverloaded(Admission))
+    {
+        return RefuseAdmission(Admission, Admit_Busy);
+    }
+    
+#if defined(_MSC_VER)
+    u32 Active = (u32)_InterlockedIncrement((volatile long*)&Admission->ActiveConns);
+#else
+    u32 Active = __atomic_add_fetch(&Admission->ActiveConns, 1, __ATOMIC_RELAXED);
+#endif
+    ts_admit Result = Admit_Ok;
+    if (Limits->MaxConns && Active > Limits->MaxConns)
+    {
+        Result = Admit_Busy;
+    }
+    else if (Limits->ConnRate)
+    {
+        volatile u64* Bucket = &Admission->ConnBuckets[HashSourceAddr(Peer) & Admission->SlotMask];
+        if (!TakeAdmitToken(Bucket, Limits->ConnRate, Limits->ConnBurst, GetAdmissionClock()))
+        {
+            Result = Admit_RateLimited;
+        }
+    }
+    
+    if (Result != Admit_Ok)
+    {
+        ReleaseConn(Admission);
+        return RefuseAdmission(Admission, Result);
+    }
+    return Admit_Ok;
+}
+
+external void
+ReleaseConn(ts_admission* Admission)
+{
+#if defined(_MSC_VER)
+    _InterlockedDecrement((volatile long*)&Admission->ActiveConns);
+#else
+    __atomic_sub_fetch(&Admission->ActiveConns, 1, __ATOMIC_RELAXED);
+#endif
+}
+
+external ts_admit
+AdmitRequest(ts_admission* Admission, ts_sockaddr* Peer)
+{
+    ts_admission_config* Limits = &Admission->Config;
+    if (IsServerOverloaded(Admission))
+    {
+        return RefuseAdmission(Admission, Admit_Busy);
+    }
+    if (Limits->RequestRate)
+    {
+        volatile u64* Bucket = &Admission->RequestBuckets[HashSourceAddr(Peer) & Admission->SlotMask];
+        if (!TakeAdmitToken(Bucket, Limits->RequestRate, Limits->RequestBurst,
+                            GetAdmissionClock()))
+        {
+            return RefuseAdmission(Admission, Admit_RateLimited);
+        }
+    }
+    return Admit_Ok;
+}
+
+external string
+GetAdmitResponse(ts_admit Result)
+{
+    switch (Result)
+    {
+        case Admit_Ok: break;
+        case Admit_RateLimited:
+        {
+            return StringLit("HTTP/1.1 429 Too Many Requests\r\n"
+                             "Connection: close\r\n"
+                             "Content-Length: 0\r\n"
+                             "Retry-After: 1\r\n\r\n");
+        }
+        case Admit_Busy:
+        {
+            return StringLit("HTTP/1.1 503 Service Unavailable\r\n"
+                             "Connection: close\r\n"
+                             "Content-Length: 0\r\n"
+                             "Retry-After: 1\r\n\r\n");
+        }
+    }
+    return String(NULL, 0, 0, EC_ASCII);
+}
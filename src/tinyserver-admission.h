@@ -0,0 +1,95 @@
+#ifndef TINYSERVER_ADMISSION_H
+//===========================================================================
+// tinyserver-admission.h
+//
+// Module for admission control, so that overload is turned away cheaply at
+// the door, instead of slowing down every connection already in. It limits:
+//   - Connections open at once, across the server.
+//   - New connections and requests per second from each source IP, with
+//     token buckets, so short bursts are allowed.
+//   - Everything, once the IO queue backs up past a given depth (load
+//     shedding), since work queued that deep is already late.
+//
+// Refused connections and requests get a canned HTTP response: 429 when a
+// source goes over its rate, and 503 when the server is over capacity, both
+// asking the client to retry later.
+//
+// Buckets are kept in a fixed table indexed by a hash of the source IP, and
+// are updated with a single CAS each, so admission never locks, and can be
+// called from any thread. Sources whose IPs hash to the same slot share a
+// bucket, so the table should be several times larger than the number of
+// sources expected at once. IPv6 sources are keyed by their /64 prefix,
+// since that's what a single host usually gets.
+//===========================================================================
+#define TINYSERVER_ADMISSION_H
+
+#include "tinyserver.h"
+#include "tinybase-strings.h"
+
+typedef enum ts_admit
+{
+    Admit_Ok,
+    Admit_RateLimited, // Source over its rate, answer 429.
+    Admit_Busy         // Server over capacity, answer 503.
+} ts_admit;
+
+typedef struct ts_admission_config
+{
+    u32 MaxConns;       // Connections admitted at once, or 0 for no limit.
+    u32 ConnRate;       // New connections per second per source, or 0.
+    u32 ConnBurst;      // Most taken at once, or 0 for the same as the rate.
+    u32 RequestRate;    // Requests per second per source, or 0.
+    u32 RequestBurst;   // Most taken at once, or 0 for the same as the rate.
+    usz MaxQueueDepth;  // Shed load past this IO queue depth, or 0.
+    u32 SourceSlots;    // Per-source buckets, rounded up to a power of 2.
+} ts_admission_config;
+
+typedef struct ts_admission
+{
+    ts_admission_config Config;
+    volatile u64* ConnBuckets;
+    volatile u64* RequestBuckets;
+    u32 SlotMask;
+    
+    volatile u32 ActiveConns;
+    volatile u64 RateLimitedCount; // Refused with Admit_RateLimited so far.
+    volatile u64 BusyCount;        // Refused with Admit_Busy so far.
+} ts_admission;
+
+external bool InitAdmission(ts_admission* Admission, ts_admission_config* Config,
+                            buffer* Arena);
+
+/* Sets up [Admission] with the limits in [Config], pushing its buckets to
+|  [Arena], which must have 16 bytes per source slot available.
+|--- Return: true if successful, false if [Arena] is out of space. */
+
+external ts_admit AdmitConn(ts_admission* Admission, ts_sockaddr* Peer);
+
+/* Decides if a new connection from [Peer] (e.g. [.Peer] of an accepted ts_io)
+|  is let in. If so, it counts as open until ReleaseConn() is called for it.
+|  May be called from any thread.
+|--- Return: Admit_Ok if let in, or the reason it was refused. */
+
+external void ReleaseConn(ts_admission* Admission);
+
+/* Counts a connection let in by AdmitConn() as closed.
+|--- Return: nothing. */
+
+external ts_admit AdmitRequest(ts_admission* Admission, ts_sockaddr* Peer);
+
+/* Decides if a request from [Peer], on a connection already let in, is
+|  served. May be called from any thread.
+|--- Return: Admit_Ok if served, or the reason it was refused. */
+
+external string GetAdmitResponse(ts_admit Result);
+
+/* Gets the canned HTTP response for a refusal, with the connection to be
+|  closed after it. Static, so it can be sent as is, by many at once.
+|--- Return: the whole response, or an empty string for Admit_Ok. */
+
+
+#if !defined(TINYSERVER_STATIC_LINKING)
+#include "tinyserver-admission.c"
+#endif
+
+#endif //TINYSERVER_ADMISSION_H
@@ -1,9 +1,13 @@
 #include <arpa/inet.h>
 #include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <netinet/udp.h>
+#include <sched.h>
 #include <semaphore.h>
 #include <sys/epoll.h>
 #include <sys/sendfile.h>
 #include <sys/socket.h>
+#include <sys/uio.h>
 
 #include "tinyserver-internal.h"
 
@@ -19,6 +23,10 @@ internal bool _TerminateConn(ts_io*);
 internal bool _RecvData(ts_io*);
 internal bool _SendData(ts_io*);
 internal bool _SendFile(ts_io*);
+internal bool _SendVector(ts_io*);
+internal bool _RecvDatagrams(ts_io*);
+internal bool _SendDatagrams(ts_io*);
+internal bool _ProxyData(ts_io*);
 
 
 //==============================
@@ -28,7 +36,13 @@ internal bool _SendFile(ts_io*);
 // This is what [.InternalData] member of ts_io translates to.
 typedef struct ts_internal
 {
+    u64 QueuedAt;  // When last pushed to the work queue, for metrics.
     int EventType; // Bitmask with the events returned by epoll.
+    
+    // Used by ProxyData only.
+    int Pipe[2];   // Read and write ends, same value if not created yet.
+    int PipeSize;  // Bytes in the pipe not yet delivered.
+    int OutSocket; // Duplicate of the destination, to wait on it, or 0.
 } ts_internal;
 
 internal file
@@ -76,6 +90,27 @@ OpenNewSocket(ts_protocol Protocol)
 internal bool
 CloseSocket(ts_io* Conn)
 {
+    // Sockets are taken out of the queue before being closed, since a copy made
+    // by dup() (e.g. the one ProxyData() keeps of its destination) keeps the
+    // registration alive, and it would still report events for [Conn].
+    ts_server_info* ServerInfo = (ts_server_info*)gServerArena.Base;
+    ts_internal* Internal = (ts_internal*)Conn->InternalData;
+    if (Internal->Pipe[0] != Internal->Pipe[1])
+    {
+        close(Internal->Pipe[0]);
+        close(Internal->Pipe[1]);
+        if (Internal->OutSocket)
+        {
+            epoll_ctl(ServerInfo->IoQueue, EPOLL_CTL_DEL, Internal->OutSocket, 0);
+            close(Internal->OutSocket);
+        }
+        memset(Internal, 0, sizeof(ts_internal));
+    }
+    
+    if (Conn->Socket != INVALID_FILE)
+    {
+        epoll_ctl(ServerInfo->IoQueue, EPOLL_CTL_DEL, Conn->Socket, 0);
+    }
     if (close(Conn->Socket) == 0)
     {
         Conn->Socket = INVALID_FILE;
@@ -84,19 +119,59 @@ CloseSocket(ts_io* Conn)
     return false;
 }
 
+internal ts_status
+FinishCreateConn(ts_io* Conn)
+{
+    int Error = 0;
+    socklen_t ErrorSize = sizeof(int);
+    if (getsockopt(Conn->Socket, SOL_SOCKET, SO_ERROR, (void*)&Error, &ErrorSize) != 0
+        || Error != 0)
+    {
+        return Status_Error;
+    }
+    
+    // Timeout was only meant for connecting, afterwards it'd cut connections
+    // with data unacknowledged for that long.
+    if (Conn->Timeout)
+    {
+        const u32 NoTimeout = 0;
+        setsockopt(Conn->Socket, IPPROTO_TCP, TCP_USER_TIMEOUT, (const void*)&NoTimeout,
+                   sizeof(u32));
+    }
+    return Status_Connected;
+}
+
 
 //==============================
 // Internal (Work queue)
 //==============================
 
+#define WORK_QUEUE_PUSH_TRIES 64
+
 internal bool
-PushToWorkQueue(ts_io* Conn)
+PushToWorkQueue(ts_io* Conn, bool Wait)
 {
     ts_server_info* ServerInfo = (ts_server_info*)gServerArena.Base;
+    TS_METRIC(((ts_internal*)Conn->InternalData)->QueuedAt = GetMetricsClock());
+    
+    // A full queue means IO threads are behind. The event thread [Wait]s for
+    // room, holding back events instead of losing them with their connections.
+    // IO threads only try for a while and fail, since they may be the very ones
+    // that would make room.
     if (!MPMCRingBufferPush(&ServerInfo->WorkQueue, (void*)Conn))
     {
-        // TODO: Could not insert in ring buffer. Expand buffer size?
+        TS_METRIC(CountMetric(Metric_WorkQueueFull, 1));
+        u32 Tries = 0;
+        while (!MPMCRingBufferPush(&ServerInfo->WorkQueue, (void*)Conn))
+        {
+            if (!Wait && ++Tries > WORK_QUEUE_PUSH_TRIES)
+            {
+                return false;
+            }
+            sched_yield();
+        }
     }
+    __atomic_add_fetch(&ServerInfo->WorkQueueDepth, 1, __ATOMIC_RELAXED);
     sem_post((sem_t*)&ServerInfo->WorkSemaphore);
     return true;
 }
@@ -107,9 +182,39 @@ PopFromWorkQueue(void)
     ts_server_info* ServerInfo = (ts_server_info*)gServerArena.Base;
     sem_wait((sem_t*)&ServerInfo->WorkSemaphore);
     ts_io* Conn = (ts_io*)MPMCRingBufferPop(&ServerInfo->WorkQueue);
+    __atomic_sub_fetch(&ServerInfo->WorkQueueDepth, 1, __ATOMIC_RELAXED);
     return Conn;
 }
 
+#if defined(TINYSERVER_USE_METRICS)
+internal u64
+ReadWorkQueueDepth(void)
+{
+    return (u64)GetIoQueueDepth();
+}
+
+internal void
+RecordOpMetrics(ts_io* Conn, u64 Start)
+{
+    // Datagram bytes are counted by TransferDatagrams(), which sees each one.
+    u32 Metric = METRICS_INVALID_ID;
+    u32 Bytes = Metric_BytesSent;
+    switch (Conn->Operation)
+    {
+        case Op_RecvData: Metric = Metric_OpRecv; Bytes = Metric_BytesReceived; break;
+        case Op_SendData: Metric = Metric_OpSend; break;
+        case Op_SendFile: Metric = Metric_OpSendFile; break;
+        case Op_SendVector: Metric = Metric_OpSendVector; break;
+        case Op_ProxyData: Metric = Metric_OpProxy; break;
+        case Op_RecvDatagrams: Metric = Metric_OpRecvDatagrams; Bytes = METRICS_INVALID_ID; break;
+        case Op_SendDatagrams: Metric = Metric_OpSendDatagrams; Bytes = METRICS_INVALID_ID; break;
+        default: return;
+    }
+    ObserveMetric(Metric, GetMetricsClock() - Start);
+    CountMetric(Bytes, Conn->BytesTransferred);
+}
+#endif // TINYSERVER_USE_METRICS
+
 THREAD_PROC(IoEventProc)
 {
     ts_io* Result = NULL;
@@ -123,6 +228,7 @@ THREAD_PROC(IoEventProc)
         {
             continue; // An error occurred, try again.
         }
+        TS_METRIC(CountMetric(Metric_IoEvents, (u64)EventCount));
         
         for (int Idx = 0; Idx < EventCount; Idx++)
         {
@@ -131,7 +237,7 @@ THREAD_PROC(IoEventProc)
             ts_internal* Internal = (ts_internal*)Conn->InternalData;
             Internal->EventType = Event.events;
             
-            PushToWorkQueue(Conn);
+            PushToWorkQueue(Conn, true);
         }
     }
     
@@ -159,6 +265,11 @@ InitServer(void)
     RecvData = _RecvData;
     SendData = _SendData;
     SendFile = _SendFile;
+    SendVector = _SendVector;
+    RecvDatagrams = _RecvDatagrams;
+    SendDatagrams = _SendDatagrams;
+    ProxyData = _ProxyData;
+    TS_METRIC(SetMetricReader(Metric_WorkQueueDepth, ReadWorkQueueDepth));
     
     gServerArena = GetMemory(TS_ARENA_SIZE, 0, MEM_WRITE);
     if (!gServerArena.Base)
@@ -219,59 +330,87 @@ CreateSockAddr(char* IpAddress, u16 Port, ts_protocol Protocol)
         struct sockaddr_in* Addr = (struct sockaddr_in*)Result.Addr;
         Addr->sin_family = AF_INET;
         Addr->sin_port = FlipEndian16(Port);
-        inet_pton(AF_INET, IpAddress, &Addr->sin_addr);
-        Result.Size = sizeof(struct sockaddr_in);
+        if (inet_pton(AF_INET, IpAddress, &Addr->sin_addr) == 1)
+        {
+            Result.Size = sizeof(struct sockaddr_in);
+        }
     }
     else if (Protocol == Proto_TCPIP6 || Protocol == Proto_UDPIP6)
     {
         struct sockaddr_in6* Addr = (struct sockaddr_in6*)Result.Addr;
         Addr->sin6_family = AF_INET6;
         Addr->sin6_port = FlipEndian16(Port);
-        inet_pton(AF_INET6, IpAddress, &Addr->sin6_addr);
-        Result.Size = sizeof(struct sockaddr_in6);
+        if (inet_pton(AF_INET6, IpAddress, &Addr->sin6_addr) == 1)
+        {
+            Result.Size = sizeof(struct sockaddr_in6);
+        }
     }
     return Result;
 }
 
 external bool
 AddListeningSocket(ts_protocol Protocol, u16 Port)
+{
+    ts_listen_config Config = {0};
+    return AddConfiguredListeningSocket(Protocol, Port, &Config);
+}
+
+external bool
+AddConfiguredListeningSocket(ts_protocol Protocol, u16 Port, ts_listen_config* Config)
 {
     bool Result = false;
     
+    bool IsIp6 = (Protocol == Proto_TCPIP6 || Protocol == Proto_UDPIP6);
+    char* Address = Config->Address ? Config->Address : (IsIp6 ? (char*)"::" : (char*)"0.0.0.0");
+    ts_sockaddr ListenAddr = CreateSockAddr(Address, Port, Protocol);
+    if (!ListenAddr.Size)
+    {
+        return false;
+    }
+    
     file Socket = OpenNewSocket(Protocol);
     if (Socket != INVALID_FILE)
     {
-        u8 ListenAddr[sizeof(struct sockaddr_in6)] = {0};
-        socklen_t ListenAddrSize = 0;
+        const int Value = 1;
+        setsockopt(Socket, SOL_SOCKET, SO_REUSEADDR, (const void*)&Value, sizeof(int));
+        setsockopt(Socket, SOL_SOCKET, SO_REUSEPORT, (const void*)&Value, sizeof(int));
+        if (IsIp6)
+        {
+            const int V6Only = Config->V6Only ? 1 : 0;
+            setsockopt(Socket, IPPROTO_IPV6, IPV6_V6ONLY, (const void*)&V6Only, sizeof(int));
+        }
+        
+        // Buffer sizes are set before listening, so that accepted sockets take
+        // them, and the window scale is agreed on accordingly.
+        if (Config->RecvBufferSize)
+        {
+            setsockopt(Socket, SOL_SOCKET, SO_RCVBUF, (const void*)&Config->RecvBufferSize,
+                       sizeof(u32));
+        }
+        if (Config->SendBufferSize)
+        {
+            setsockopt(Socket, SOL_SOCKET, SO_SNDBUF, (const void*)&Config->SendBufferSize,
+                       sizeof(u32));
+        }
         
-        switch (Protocol)
+        bool IsDatagram = (Protocol == Proto_UDPIP4 || Protocol == Proto_UDPIP6);
+        if (!IsDatagram)
         {
-            case Proto_TCPIP4:
-            case Proto_UDPIP4:
+            if (Config->FastOpenQueue)
             {
-                struct sockaddr_in* Addr = (struct sockaddr_in*)ListenAddr;
-                Addr->sin_family = AF_INET;
-                Addr->sin_port = FlipEndian16(Port);
-                Addr->sin_addr.s_addr = INADDR_ANY;
-                ListenAddrSize = (socklen_t)sizeof(struct sockaddr_in);
-            } break;
-            
-            case Proto_TCPIP6:
-            case Proto_UDPIP6:
+                setsockopt(Socket, SOL_TCP, TCP_FASTOPEN, (const void*)&Config->FastOpenQueue,
+                           sizeof(u32));
+            }
+            if (Config->DeferAcceptSeconds)
             {
-                struct sockaddr_in6* Addr = (struct sockaddr_in6*)ListenAddr;
-                Addr->sin6_family = AF_INET6;
-                Addr->sin6_port = FlipEndian16(Port);
-                Addr->sin6_addr = in6addr_any;
-                ListenAddrSize = (socklen_t)sizeof(struct sockaddr_in6);
-            } break;
+                setsockopt(Socket, SOL_TCP, TCP_DEFER_ACCEPT,
+                           (const void*)&Config->DeferAcceptSeconds, sizeof(u32));
+            }
         }
         
-        const int Value = 1;
-        setsockopt(Socket, SOL_SOCKET, SO_REUSEADDR, (const void*)&Value, sizeof(int));
-        setsockopt(Socket, SOL_SOCKET, SO_REUSEPORT, (const void*)&Value, sizeof(int));
-        if (bind((int)Socket, (struct sockaddr*)ListenAddr, ListenAddrSize) == 0
-            && listen((int)Socket, SOMAXCONN) == 0)
+        int Backlog = Config->Backlog ? Config->Backlog : SOMAXCONN;
+        if (bind((int)Socket, (struct sockaddr*)ListenAddr.Addr, ListenAddr.Size) == 0
+            && (IsDatagram || listen((int)Socket, Backlog) == 0))
         {
             ts_server_info* ServerInfo = (ts_server_info*)gServerArena.Base;
             
@@ -280,7 +419,8 @@ AddListeningSocket(ts_protocol Protocol, u16 Port)
             
             Listen->Socket = Socket;
             Listen->Protocol = Protocol;
-            Listen->SockAddrSize = (u32)ListenAddrSize;
+            Listen->SockAddrSize = (i32)ListenAddr.Size;
+            Listen->ConnConfig = IsDatagram ? NULL : Config->Conn;
             
             struct epoll_event Event = {0};
             Event.events = EPOLLIN | EPOLLET;
@@ -308,6 +448,154 @@ AddListeningSocket(ts_protocol Protocol, u16 Port)
 }
 
 
+//==============================
+// Internal (Datagrams)
+//==============================
+
+#define TS_DATAGRAM_CONTROL_SIZE CMSG_SPACE(sizeof(int))
+
+internal usz
+TransferDatagrams(ts_io* Conn)
+{
+    // Datagrams are moved with one recvmmsg() or sendmmsg() call, whose message
+    // headers are built on the stack. Each gets room for one control message,
+    // carrying the segment size when coalescing (GRO) or splitting (GSO).
+    
+    struct mmsghdr Messages[TS_MAX_DATAGRAMS];
+    struct iovec Vectors[TS_MAX_DATAGRAMS];
+    u64 Control[TS_MAX_DATAGRAMS][TS_DATAGRAM_CONTROL_SIZE / sizeof(u64)];
+    
+    bool IsRecv = (Conn->Operation == Op_RecvDatagrams);
+    u32 Count = Min(Conn->IoSize, TS_MAX_DATAGRAMS);
+    for (u32 Idx = 0; Idx < Count; Idx++)
+    {
+        ts_datagram* Datagram = &Conn->IoDatagrams[Idx];
+        struct msghdr* Header = &Messages[Idx].msg_hdr;
+        memset(Header, 0, sizeof(struct msghdr));
+        Vectors[Idx].iov_base = Datagram->Base;
+        Vectors[Idx].iov_len = Datagram->Size;
+        Header->msg_iov = &Vectors[Idx];
+        Header->msg_iovlen = 1;
+        
+        if (IsRecv)
+        {
+            Header->msg_name = Datagram->Peer.Addr;
+            Header->msg_namelen = MAX_SOCKADDR_SIZE;
+            Header->msg_control = Control[Idx];
+            Header->msg_controllen = TS_DATAGRAM_CONTROL_SIZE;
+        }
+        else
+        {
+            Header->msg_name = Datagram->Peer.Size ? Datagram->Peer.Addr : NULL;
+            Header->msg_namelen = Datagram->Peer.Size;
+            if (Datagram->SegmentSize)
+            {
+                Header->msg_control = Control[Idx];
+                Header->msg_controllen = CMSG_SPACE(sizeof(u16));
+                struct cmsghdr* Message = CMSG_FIRSTHDR(Header);
+                Message->cmsg_level = SOL_UDP;
+                Message->cmsg_type = UDP_SEGMENT;
+                Message->cmsg_len = CMSG_LEN(sizeof(u16));
+                CopyData(CMSG_DATA(Message), sizeof(u16), &Datagram->SegmentSize, sizeof(u16));
+            }
+        }
+    }
+    
+    int Result = IsRecv
+        ? recvmmsg(Conn->Socket, Messages, Count, MSG_DONTWAIT, NULL)
+        : sendmmsg(Conn->Socket, Messages, Count, MSG_DONTWAIT);
+    if (Result == -1)
+    {
+        // Datagram sockets stay usable after most errors, so only a socket
+        // that can't be used at all is reported.
+        if (errno == EBADF || errno == ENOTSOCK)
+        {
+            Conn->Status = Status_Error;
+        }
+        return 0;
+    }
+    
+    u64 TotalBytes = 0;
+    for (int Idx = 0; Idx < Result; Idx++)
+    {
+        ts_datagram* Datagram = &Conn->IoDatagrams[Idx];
+        Datagram->BytesTransferred = Messages[Idx].msg_len;
+        TotalBytes += Messages[Idx].msg_len;
+        if (IsRecv)
+        {
+            struct msghdr* Header = &Messages[Idx].msg_hdr;
+            Datagram->Peer.Size = Header->msg_namelen;
+            Datagram->SegmentSize = 0;
+            
+            struct cmsghdr* Message = CMSG_FIRSTHDR(Header);
+            for (; Message; Message = CMSG_NXTHDR(Header, Message))
+            {
+                if (Message->cmsg_level == SOL_UDP && Message->cmsg_type == UDP_GRO)
+                {
+                    int SegmentSize = 0;
+                    CopyData(&SegmentSize, sizeof(int), CMSG_DATA(Message), sizeof(int));
+                    Datagram->SegmentSize = (u16)SegmentSize;
+                }
+            }
+        }
+    }
+    TS_METRIC(CountMetric(IsRecv ? Metric_BytesReceived : Metric_BytesSent, TotalBytes));
+    
+    return (usz)Result;
+}
+
+
+//==============================
+// Internal (Proxy)
+//==============================
+
+internal usz
+TransferProxyData(ts_io* Conn)
+{
+    // Data goes from the source to a pipe, and from the pipe to the destination,
+    // with splice(), so it's only moved between kernel buffers. What the
+    // destination can't take stays in the pipe, and is sent before reading
+    // more, so the pipe never holds more than one read.
+    
+    ts_internal* Internal = (ts_internal*)Conn->InternalData;
+    int Flags = SPLICE_F_MOVE | SPLICE_F_NONBLOCK;
+    usz Result = 0;
+    
+    if (Internal->PipeSize == 0)
+    {
+        ssize_t BytesRead = splice(Conn->Socket, NULL, Internal->Pipe[1], NULL,
+                                   Conn->IoSize, Flags);
+        if (BytesRead == 0)
+        {
+            Conn->Status = Status_Aborted;
+            return 0;
+        }
+        else if (BytesRead == -1)
+        {
+            if (errno != EAGAIN)
+            {
+                Conn->Status = Status_Error;
+            }
+            return 0;
+        }
+        Internal->PipeSize = (int)BytesRead;
+    }
+    
+    ssize_t BytesSent = splice(Internal->Pipe[0], NULL, Conn->IoFile, NULL,
+                               Internal->PipeSize, Flags);
+    if (BytesSent > 0)
+    {
+        Internal->PipeSize -= (int)BytesSent;
+        Result = (usz)BytesSent;
+    }
+    else if (BytesSent == -1 && errno != EAGAIN)
+    {
+        Conn->Status = Status_Error;
+    }
+    return Result;
+}
+
+
 //==============================
 // Async events
 //==============================
@@ -355,14 +643,45 @@ ListenForConnections(void)
     return ListenForConnections();
 }
 
+external usz
+GetIoQueueDepth(void)
+{
+    ts_server_info* ServerInfo = (ts_server_info*)gServerArena.Base;
+    return __atomic_load_n(&ServerInfo->WorkQueueDepth, __ATOMIC_RELAXED);
+}
+
 external ts_io*
 WaitOnIoQueue(void)
 {
     // This call will block until there is work to be dequeued.
     ts_io* Conn = PopFromWorkQueue();
     ts_internal Internal = *(ts_internal*)Conn->InternalData;
+    TS_METRIC(u64 Start = GetMetricsClock());
+    TS_METRIC(ObserveMetric(Metric_WorkQueueWait, Start - Internal.QueuedAt));
     
-    if (Internal.EventType & EPOLLERR)
+    if (Conn->Operation == Op_CreateConn && Conn->Status == Status_None)
+    {
+        // A connect made in the background completed. If there's a first package
+        // to send, the send is posted, and returned instead once done.
+        Conn->BytesTransferred = 0;
+        Conn->Status = FinishCreateConn(Conn);
+        if (Conn->Status == Status_Connected && Conn->IoBuffer)
+        {
+            if (SendData(Conn))
+            {
+                return WaitOnIoQueue();
+            }
+            Conn->Status = Status_Error;
+        }
+    }
+    
+    else if (Conn->Operation == Op_AcceptConn && Conn->BytesTransferred)
+    {
+        // First package was read by AcceptConn(), so it's returned as a read.
+        Conn->Operation = Op_RecvData;
+    }
+    
+    else if (Internal.EventType & EPOLLERR)
     {
         Conn->BytesTransferred = 0;
         Conn->Status = Status_Error;
@@ -406,8 +725,25 @@ WaitOnIoQueue(void)
         
         else if (Conn->Operation == Op_SendFile)
         {
-            ssize_t BytesTransferred = sendfile(Conn->Socket, Conn->IoFile, NULL,
+            off_t Offset = (off_t)Conn->IoOffset;
+            ssize_t BytesTransferred = sendfile(Conn->Socket, Conn->IoFile, &Offset,
                                                 Conn->IoSize);
+            Conn->IoOffset = (u64)Offset;
+            if (BytesTransferred == -1)
+            {
+                BytesTransferred = 0;
+                Conn->Status = Status_Error;
+            }
+            Conn->BytesTransferred = (usz)BytesTransferred;
+        }
+        
+        else if (Conn->Operation == Op_SendVector)
+        {
+            // ts_io_vec has the same layout as struct iovec.
+            struct msghdr Message = {0};
+            Message.msg_iov = (struct iovec*)Conn->IoVec;
+            Message.msg_iovlen = Conn->IoSize;
+            ssize_t BytesTransferred = sendmsg(Conn->Socket, &Message, MSG_DONTWAIT);
             if (BytesTransferred == -1)
             {
                 BytesTransferred = 0;
@@ -416,9 +752,28 @@ WaitOnIoQueue(void)
             Conn->BytesTransferred = (usz)BytesTransferred;
         }
         
+        else if (Conn->Operation == Op_ProxyData)
+        {
+            Conn->BytesTransferred = TransferProxyData(Conn);
+        }
+        
+        else if (Conn->Operation == Op_RecvDatagrams
+                 || Conn->Operation == Op_SendDatagrams)
+        {
+            Conn->BytesTransferred = TransferDatagrams(Conn);
+        }
+        
         // For other operations, just return the dequeued ts_io.
+        
+        TS_METRIC(RecordOpMetrics(Conn, Start));
     }
     
+#if defined(TINYSERVER_USE_METRICS)
+    if (Conn->Status == Status_Error)
+    {
+        CountMetric(Metric_OpErrors, 1);
+    }
+#endif
     return Conn;
 }
 
@@ -426,7 +781,7 @@ external bool
 SendToIoQueue(ts_io* Conn)
 {
     Conn->Operation = Op_SendToIoQueue;
-    return PushToWorkQueue(Conn);
+    return PushToWorkQueue(Conn, false);
 }
 
 
@@ -438,37 +793,73 @@ internal bool
 _AcceptConn(ts_listen Listening, ts_io* Conn)
 {
     Conn->Operation = Op_AcceptConn;
+    Conn->BytesTransferred = 0;
+    Conn->IoOffset = 0;
+    ((ts_internal*)Conn->InternalData)->EventType = 0;
     ts_server_info* ServerInfo = (ts_server_info*)gServerArena.Base;
     
-    u8 RemoteSockAddr[MAX_SOCKADDR_SIZE] = {0};
-    i32 RemoteSockAddrSize;
-    int Socket = accept4(Listening.Socket, (struct sockaddr*)RemoteSockAddr,
-                         (socklen_t*)&RemoteSockAddrSize, O_NONBLOCK);
+    if (Listening.Protocol == Proto_UDPIP4 || Listening.Protocol == Proto_UDPIP6)
+    {
+        // There's nothing to accept, so the socket itself moves to the IO queue.
+        struct epoll_event Event = {0};
+        if (epoll_ctl(ServerInfo->AcceptQueue, EPOLL_CTL_DEL, Listening.Socket, 0) == 0
+            && epoll_ctl(ServerInfo->IoQueue, EPOLL_CTL_ADD, Listening.Socket, &Event) == 0)
+        {
+            Conn->Socket = Listening.Socket;
+            Conn->Status = Status_Connected;
+            if (Conn->IoDatagrams)
+            {
+                return RecvDatagrams(Conn);
+            }
+            else
+            {
+                return PushToWorkQueue(Conn, false);
+            }
+        }
+        
+        Conn->Socket = INVALID_FILE;
+        Conn->Status = Status_Error;
+        return false;
+    }
+    
+    socklen_t PeerSize = MAX_SOCKADDR_SIZE;
+    int Socket = accept4(Listening.Socket, (struct sockaddr*)Conn->Peer.Addr, &PeerSize,
+                         O_NONBLOCK);
     if (Socket >= 0)
     {
         Conn->Socket = (file)Socket;
         Conn->Status = Status_Connected;
+        Conn->Peer.Size = (u32)PeerSize;
+        TS_METRIC(CountMetric(Metric_Accepts, 1));
+        if (Listening.ConnConfig)
+        {
+            ConfigureConn(Conn, Listening.ConnConfig);
+        }
         
         struct epoll_event Event = {0};
         if (epoll_ctl(ServerInfo->IoQueue, EPOLL_CTL_ADD, Socket, &Event) == 0)
         {
             if (Conn->IoBuffer)
             {
-                u32 TotalAddrSize = RemoteSockAddrSize + 0x10;
-                u8* AddrBuffer = (u8*)Conn->IoBuffer + Conn->IoSize - TotalAddrSize;
-                CopyData(AddrBuffer, RemoteSockAddrSize, RemoteSockAddr, RemoteSockAddrSize);
-                Conn->IoSize -= TotalAddrSize;
-                return RecvData(Conn); // Wait for first package.
+                // The first package is often here already (always, with deferred
+                // accepts), so it's read right away, saving a trip through epoll.
+                ssize_t BytesTransferred = recv(Socket, Conn->IoBuffer, Conn->IoSize,
+                                                MSG_DONTWAIT);
+                if (BytesTransferred <= 0)
+                {
+                    return RecvData(Conn); // Wait for first package.
+                }
+                Conn->BytesTransferred = (usz)BytesTransferred;
+                TS_METRIC(CountMetric(Metric_BytesReceived, Conn->BytesTransferred));
             }
-            else
+            if (PushToWorkQueue(Conn, false))
             {
-                return PushToWorkQueue(Conn); // Just dequeue as accepted.
+                return true; // Dequeued as accepted, or with the first package.
             }
         }
-        else
-        {
-            close(Socket);
-        }
+        
+        // Closing the only descriptor also takes it out of the IO queue.
+        close(Socket);
     }
     
     Conn->Socket = INVALID_FILE;
@@ -481,24 +872,77 @@ internal bool
 _CreateConn(ts_io* Conn, ts_sockaddr SockAddr)
 {
     Conn->Operation = Op_CreateConn;
+    Conn->Peer = SockAddr;
+    Conn->IoOffset = 0;
     ts_server_info* ServerInfo = (ts_server_info*)gServerArena.Base;
     
+    // The socket must be non-blocking, so connect() returns right away, and the
+    // connection is made in the background.
+    bool IsOwnSocket = (Conn->Socket == INVALID_FILE);
+    if (IsOwnSocket)
+    {
+        bool IsIp6 = (((struct sockaddr*)SockAddr.Addr)->sa_family == AF_INET6);
+        Conn->Socket = OpenNewSocket(IsIp6 ? Proto_TCPIP6 : Proto_TCPIP4);
+    }
+    else
+    {
+        int Flags = fcntl(Conn->Socket, F_GETFL, 0);
+        fcntl(Conn->Socket, F_SETFL, Flags | O_NONBLOCK);
+    }
+    if (Conn->Socket == INVALID_FILE)
+    {
+        Conn->Status = Status_Error;
+        return false;
+    }
+    
+    // Handshake retries give up after TCP_USER_TIMEOUT, failing the connect
+    // with ETIMEDOUT, so no timer is needed.
+    if (Conn->Timeout)
+    {
+        setsockopt(Conn->Socket, IPPROTO_TCP, TCP_USER_TIMEOUT, (const void*)&Conn->Timeout,
+                   sizeof(u32));
+    }
+    
     struct epoll_event Event = {0};
     if (connect(Conn->Socket, (const struct sockaddr*)SockAddr.Addr,
-                (socklen_t)SockAddr.Size) == 0
-        && epoll_ctl(ServerInfo->IoQueue, EPOLL_CTL_ADD, (int)Conn->Socket, &Event) == 0)
+                (socklen_t)SockAddr.Size) == 0)
     {
-        Conn->Status = Status_Connected;
-        if (Conn->IoBuffer)
+        if (epoll_ctl(ServerInfo->IoQueue, EPOLL_CTL_ADD, (int)Conn->Socket, &Event) == 0)
         {
-            return SendData(Conn); // Send first package.
+            Conn->Status = FinishCreateConn(Conn);
+            if (Conn->IoBuffer)
+            {
+                return SendData(Conn); // Send first package.
+            }
+            else if (PushToWorkQueue(Conn, false))
+            {
+                return true; // Just dequeue as connected.
+            }
         }
-        else
+    }
+    else if (errno == EINPROGRESS)
+    {
+        // Socket turns writable once connected, or once it failed.
+        Conn->Status = Status_None;
+        Event.data.ptr = (void*)Conn;
+        Event.events = EPOLLOUT | EPOLLET | EPOLLONESHOT;
+        if (epoll_ctl(ServerInfo->IoQueue, EPOLL_CTL_ADD, (int)Conn->Socket, &Event) == 0)
         {
-            return PushToWorkQueue(Conn); // Just dequeue as connected.
+            return true;
         }
     }
     
+    // A socket opened here is closed, one passed in is left to the caller, out
+    // of the IO queue.
+    if (IsOwnSocket)
+    {
+        close(Conn->Socket);
+        Conn->Socket = INVALID_FILE;
+    }
+    else
+    {
+        epoll_ctl(ServerInfo->IoQueue, EPOLL_CTL_DEL, (int)Conn->Socket, 0);
+    }
     Conn->Status = Status_Error;
     return false;
 }
@@ -509,7 +953,7 @@ _DisconnectSocket(ts_io* Conn, int Type)
     Conn->Operation = Op_DisconnectSocket;
     if (shutdown(Conn->Socket, Type) == 0)
     {
-        if (How == TS_DISCONNECT_BOTH)
+        if (Type == TS_DISCONNECT_BOTH)
         {
             Conn->Status = Status_Disconnected;
             ts_server_info* ServerInfo = (ts_server_info*)gServerArena.Base;
@@ -557,6 +1001,135 @@ _SendFile(ts_io* Conn)
     return (epoll_ctl(ServerInfo->IoQueue, EPOLL_CTL_MOD, Conn->Socket, &Event) == 0);
 }
 
+internal bool
+_SendVector(ts_io* Conn)
+{
+    Conn->Operation = Op_SendVector;
+    ts_server_info* ServerInfo = (ts_server_info*)gServerArena.Base;
+    
+    struct epoll_event Event;
+    Event.data.ptr = (void*)Conn;
+    Event.events = EPOLLOUT | EPOLLRDHUP | EPOLLET | EPOLLONESHOT;
+    return (epoll_ctl(ServerInfo->IoQueue, EPOLL_CTL_MOD, Conn->Socket, &Event) == 0);
+}
+
+internal bool
+_RecvDatagrams(ts_io* Conn)
+{
+    Conn->Operation = Op_RecvDatagrams;
+    ts_server_info* ServerInfo = (ts_server_info*)gServerArena.Base;
+    
+    struct epoll_event Event;
+    Event.data.ptr = (void*)Conn;
+    Event.events = EPOLLIN | EPOLLET | EPOLLONESHOT;
+    return (epoll_ctl(ServerInfo->IoQueue, EPOLL_CTL_MOD, Conn->Socket, &Event) == 0);
+}
+
+internal bool
+_SendDatagrams(ts_io* Conn)
+{
+    Conn->Operation = Op_SendDatagrams;
+    ts_server_info* ServerInfo = (ts_server_info*)gServerArena.Base;
+    
+    struct epoll_event Event;
+    Event.data.ptr = (void*)Conn;
+    Event.events = EPOLLOUT | EPOLLET | EPOLLONESHOT;
+    return (epoll_ctl(ServerInfo->IoQueue, EPOLL_CTL_MOD, Conn->Socket, &Event) == 0);
+}
+
+internal bool
+_ProxyData(ts_io* Conn)
+{
+    Conn->Operation = Op_ProxyData;
+    ts_server_info* ServerInfo = (ts_server_info*)gServerArena.Base;
+    ts_internal* Internal = (ts_internal*)Conn->InternalData;
+    
+    if (Internal->Pipe[0] == Internal->Pipe[1]
+        && pipe2(Internal->Pipe, O_NONBLOCK | O_CLOEXEC) != 0)
+    {
+        Internal->Pipe[0] = Internal->Pipe[1] = 0;
+        return false;
+    }
+    
+    struct epoll_event Event;
+    Event.data.ptr = (void*)Conn;
+    if (Internal->PipeSize == 0)
+    {
+        Event.events = EPOLLIN | EPOLLRDHUP | EPOLLET | EPOLLONESHOT;
+        return (epoll_ctl(ServerInfo->IoQueue, EPOLL_CTL_MOD, Conn->Socket, &Event) == 0);
+    }
+    
+    // Data is waiting for the destination to be writable. Its socket is already
+    // in the IO queue for its own ts_io, so a duplicate is added for this one.
+    Event.events = EPOLLOUT | EPOLLET | EPOLLONESHOT;
+    if (!Internal->OutSocket)
+    {
+        int OutSocket = dup(Conn->IoFile);
+        if (OutSocket == -1)
+        {
+            return false;
+        }
+        if (epoll_ctl(ServerInfo->IoQueue, EPOLL_CTL_ADD, OutSocket, &Event) != 0)
+        {
+            close(OutSocket);
+            return false;
+        }
+        Internal->OutSocket = OutSocket;
+        return true;
+    }
+    return (epoll_ctl(ServerInfo->IoQueue, EPOLL_CTL_MOD, Internal->OutSocket, &Event) == 0);
+}
+
+external bool
+EnableDatagramCoalescing(ts_io* Conn)
+{
+    const int Value = 1;
+    return (setsockopt(Conn->Socket, SOL_UDP, UDP_GRO, (const void*)&Value, sizeof(int)) == 0);
+}
+
+external bool
+ConfigureConn(ts_io* Conn, ts_conn_config* Config)
+{
+    bool Result = true;
+    int Socket = (int)Conn->Socket;
+    
+    if (Config->NoDelay)
+    {
+        const int Value = 1;
+        Result &= (setsockopt(Socket, SOL_TCP, TCP_NODELAY, (const void*)&Value, sizeof(int)) == 0);
+    }
+    if (Config->NotSentLowat)
+    {
+        Result &= (setsockopt(Socket, SOL_TCP, TCP_NOTSENT_LOWAT,
+                              (const void*)&Config->NotSentLowat, sizeof(u32)) == 0);
+    }
+    if (Config->KeepAliveIdle)
+    {
+        const int Value = 1;
+        Result &= (setsockopt(Socket, SOL_SOCKET, SO_KEEPALIVE, (const void*)&Value, sizeof(int)) == 0);
+        Result &= (setsockopt(Socket, SOL_TCP, TCP_KEEPIDLE,
+                              (const void*)&Config->KeepAliveIdle, sizeof(u32)) == 0);
+        if (Config->KeepAliveInterval)
+        {
+            Result &= (setsockopt(Socket, SOL_TCP, TCP_KEEPINTVL,
+                                  (const void*)&Config->KeepAliveInterval, sizeof(u32)) == 0);
+        }
+        if (Config->KeepAliveCount)
+        {
+            Result &= (setsockopt(Socket, SOL_TCP, TCP_KEEPCNT,
+                                  (const void*)&Config->KeepAliveCount, sizeof(u32)) == 0);
+        }
+    }
+    return Result;
+}
+
+external bool
+CorkConn(ts_io* Conn, bool Corked)
+{
+    const int Value = Corked ? 1 : 0;
+    return (setsockopt(Conn->Socket, SOL_TCP, TCP_CORK, (const void*)&Value, sizeof(int)) == 0);
+}
+
 internal bool
 _RecvData(ts_io* Conn)
 {
@@ -1,5 +1,33 @@
+#include <time.h>
+
 #include "tinybase-strings.h"
 
+#if defined(__SSE2__)
+# include <emmintrin.h>
+#endif
+
+#if defined(_MSC_VER)
+# include <intrin.h>
+#endif
+
+#if defined(TINYSERVER_USE_ZLIB)
+# include <zlib.h>
+#endif
+
+#if defined(TT_LINUX)
+# include <fcntl.h>
+# include <sys/inotify.h>
+# include <sys/stat.h>
+#endif
+
+//================================
+// Forward declarations
+//================================
+
+internal string GetDateLine(void);
+internal void AppendHeaderStart(ts_response*, string*, char*, usz*);
+internal void AppendHeaderEnd(ts_response*, string*, bool);
+
 //================================
 // Helper functions
 //================================
@@ -59,24 +87,183 @@ EatSubstring(string Src, usz* ReadCur, char StartToken, char EndToken)
     return Result;
 }
 
-internal void
-PercentEncodingToUTF8(string Src, string* Dst)
+internal usz
+FindAnyByte(u8* Data, usz Size, u8 A, u8 B, u8 C, u8 D)
+{
+    // Finds the first of up to four different bytes (repeat one to look for
+    // less). With SSE2 this tests 16 bytes per iteration.
+    
+    usz Cur = 0;
+    
+#if defined(__SSE2__)
+    __m128i SetA = _mm_set1_epi8((char)A);
+    __m128i SetB = _mm_set1_epi8((char)B);
+    __m128i SetC = _mm_set1_epi8((char)C);
+    __m128i SetD = _mm_set1_epi8((char)D);
+    for (; Cur + 16 <= Size; Cur += 16)
+    {
+        __m128i Block = _mm_loadu_si128((__m128i*)(Data + Cur));
+        __m128i Eq = _mm_or_si128(_mm_or_si128(_mm_cmpeq_epi8(Block, SetA),
+                                               _mm_cmpeq_epi8(Block, SetB)),
+                                  _mm_or_si128(_mm_cmpeq_epi8(Block, SetC),
+                                               _mm_cmpeq_epi8(Block, SetD)));
+        u32 Mask = (u32)_mm_movemask_epi8(Eq);
+        if (Mask)
+        {
+            return Cur + __builtin_ctz(Mask);
+        }
+    }
+#endif
+    
+    for (; Cur < Size; Cur++)
+    {
+        u8 Byte = Data[Cur];
+        if (Byte == A || Byte == B || Byte == C || Byte == D)
+        {
+            return Cur;
+        }
+    }
+    return Size;
+}
+
+internal i32
+HexDigitValue(u8 Digit)
 {
-    usz FoundIdx = 0;
-    while ((FoundIdx = CharInString('%', Src, RETURN_IDX_FIND)) != INVALID_IDX)
+    if (Digit >= '0' && Digit <= '9') return Digit - '0';
+    if (Digit >= 'a' && Digit <= 'f') return Digit - 'a' + 10;
+    if (Digit >= 'A' && Digit <= 'F') return Digit - 'A' + 10;
+    return -1;
+}
+
+internal usz
+DecodeUrlInPlace(char* Str, usz Size, bool PlusIsSpace)
+{
+    // Runs of plain bytes are skipped with FindAnyByte(), and only moved back
+    // once something has been decoded before them. Invalid escapes are kept.
+    
+    u8* Data = (u8*)Str;
+    u8 Plus = PlusIsSpace ? '+' : '%';
+    usz ReadCur = 0, WriteCur = 0;
+    while (ReadCur < Size)
     {
-        CopyData(Dst->Base + Dst->WriteCur, Dst->Size, Src.Base, FoundIdx);
-        Dst->WriteCur += FoundIdx;
-        string Byte = String(Src.Base + FoundIdx + 1, 2, 0, Src.Enc);
-        Dst->Base[Dst->WriteCur++] = (u8)StringToHex(Byte);
+        usz Found = ReadCur + FindAnyByte(Data + ReadCur, Size - ReadCur, '%', Plus, '%', '%');
+        if (WriteCur != ReadCur)
+        {
+            memmove(Data + WriteCur, Data + ReadCur, Found - ReadCur);
+        }
+        WriteCur += Found - ReadCur;
+        ReadCur = Found;
         
-        Src.Base += FoundIdx + 3;
-        Src.WriteCur -= FoundIdx + 3;
+        if (ReadCur < Size)
+        {
+            if (Data[ReadCur] == '+')
+            {
+                Data[WriteCur++] = ' ';
+                ReadCur++;
+            }
+            else
+            {
+                i32 High = (ReadCur + 2 < Size) ? HexDigitValue(Data[ReadCur+1]) : -1;
+                i32 Low = (High >= 0) ? HexDigitValue(Data[ReadCur+2]) : -1;
+                if (High >= 0 && Low >= 0)
+                {
+                    Data[WriteCur++] = (u8)((High << 4) | Low);
+                    ReadCur += 3;
+                }
+                else
+                {
+                    Data[WriteCur++] = Data[ReadCur++];
+                }
+            }
+        }
+    }
+    return WriteCur;
+}
+
+internal u32
+HashName(char* Name, usz NameSize)
+{
+    // FNV-1a.
+    u32 Hash = 2166136261u;
+    for (usz Idx = 0; Idx < NameSize; Idx++)
+    {
+        Hash = (Hash ^ (u8)Name[Idx]) * 16777619u;
+    }
+    return Hash;
+}
+
+internal u64
+DaysFromCivil(i64 Year, u32 Month, u32 Day)
+{
+    // Days since 1970-01-01, for a date in the Gregorian calendar.
+    Year -= (Month <= 2) ? 1 : 0;
+    i64 Era = (Year >= 0 ? Year : Year - 399) / 400;
+    u32 YearOfEra = (u32)(Year - Era * 400);
+    u32 DayOfYear = (153 * (Month + (Month > 2 ? -3 : 9)) + 2) / 5 + Day - 1;
+    u32 DayOfEra = YearOfEra * 365 + YearOfEra / 4 - YearOfEra / 100 + DayOfYear;
+    return (u64)(Era * 146097 + (i64)DayOfEra - 719468);
+}
+
+internal datetime
+DatetimeFromUnixTime(u64 Time)
+{
+    datetime Result = {0};
+    
+    u64 Days = Time / 86400;
+    u64 Seconds = Time % 86400;
+    Result.Hour = (u8)(Seconds / 3600);
+    Result.Minute = (u8)((Seconds % 3600) / 60);
+    Result.Second = (u8)(Seconds % 60);
+    Result.WeekDay = (u8)((Days + 4) % 7); // 1970-01-01 was a Thursday.
+    
+    u64 Shifted = Days + 719468;
+    u64 Era = Shifted / 146097;
+    u32 DayOfEra = (u32)(Shifted - Era * 146097);
+    u32 YearOfEra = (DayOfEra - DayOfEra / 1460 + DayOfEra / 36524 - DayOfEra / 146096) / 365;
+    u32 DayOfYear = DayOfEra - (365 * YearOfEra + YearOfEra / 4 - YearOfEra / 100);
+    u32 MonthIdx = (5 * DayOfYear + 2) / 153;
+    Result.Day = (u8)(DayOfYear - (153 * MonthIdx + 2) / 5 + 1);
+    Result.Month = (u8)(MonthIdx < 10 ? MonthIdx + 3 : MonthIdx - 9);
+    Result.Year = (u16)(Era * 400 + YearOfEra + (Result.Month <= 2 ? 1 : 0));
+    
+    return Result;
+}
+
+internal u64
+ParseTimeIMF(string Date)
+{
+    // Only the IMF-fixdate format is accepted ("Sun, 06 Nov 1994 08:49:37 GMT").
+    
+    u8* Data = (u8*)Date.Base;
+    if (Date.WriteCur != IMF_DATE_LENGTH - 1
+        || Data[3] != ',' || Data[7] != ' ' || Data[11] != ' '
+        || Data[19] != ':' || Data[22] != ':')
+    {
+        return 0;
+    }
+    
+    u32 Digits[] = { 5, 6, 12, 13, 14, 15, 17, 18, 20, 21, 23, 24 };
+    for (usz Idx = 0; Idx < sizeof(Digits) / sizeof(u32); Idx++)
+    {
+        if (Data[Digits[Idx]] < '0' || Data[Digits[Idx]] > '9') return 0;
+    }
+    
+    char* Months = "JanFebMarAprMayJunJulAugSepOctNovDec";
+    u32 Month = 0;
+    for (u32 Idx = 0; Idx < 12; Idx++)
+    {
+        if (memcmp(Months + Idx * 3, Data + 8, 3) == 0) Month = Idx + 1;
     }
-    CopyData(Dst->Base + Dst->WriteCur, Dst->Size, Src.Base, Src.WriteCur);
-    Dst->WriteCur += Src.WriteCur;
+    if (!Month) return 0;
+    
+    u32 Day = (Data[5] - '0') * 10 + (Data[6] - '0');
+    u32 Year = (Data[12] - '0') * 1000 + (Data[13] - '0') * 100 + (Data[14] - '0') * 10 + (Data[15] - '0');
+    u32 Hour = (Data[17] - '0') * 10 + (Data[18] - '0');
+    u32 Minute = (Data[20] - '0') * 10 + (Data[21] - '0');
+    u32 Second = (Data[23] - '0') * 10 + (Data[24] - '0');
+    if (Year < 1970) return 0;
     
-    ReplaceByteInBuffer('+', ' ', Dst->Buffer);
+    return DaysFromCivil(Year, Month, Day) * 86400 + Hour * 3600 + Minute * 60 + Second;
 }
 
 //================================
@@ -101,16 +288,46 @@ IsRequestMalicious(string Path, string Query)
     
     if (DirIdx >= 0)
     {
-        // Protects against XSS.
-        if (Query.WriteCur == 0) return false;
-        if (!CharInString('<', Query, RETURN_BOOL)
-            && !CharInString('>', Query, RETURN_BOOL)
-            && !CharInString('\"', Query, RETURN_BOOL)) return false;
+        // Protects against XSS. Query is not decoded at this point, so escaped
+        // characters are checked as well.
+        u8* Data = (u8*)Query.Base;
+        usz Cur = 0;
+        while (Cur < Query.WriteCur)
+        {
+            Cur += FindAnyByte(Data + Cur, Query.WriteCur - Cur, '<', '>', '\"', '%');
+            if (Cur == Query.WriteCur) return false;
+            if (Data[Cur] != '%') return true;
+            
+            i32 High = (Cur + 2 < Query.WriteCur) ? HexDigitValue(Data[Cur+1]) : -1;
+            i32 Low = (High >= 0) ? HexDigitValue(Data[Cur+2]) : -1;
+            if (High >= 0 && Low >= 0)
+            {
+                u8 Byte = (u8)((High << 4) | Low);
+                if (Byte == '<' || Byte == '>' || Byte == '\"') return true;
+            }
+            Cur++;
+        }
+        return false;
     }
     
     return true;
 }
 
+internal u8
+ParseHttpVerb(string Verb)
+{
+    if (EqualStrings(Verb, StringLit("GET"))) return HttpVerb_Get;
+    else if (EqualStrings(Verb, StringLit("HEAD"))) return HttpVerb_Head;
+    else if (EqualStrings(Verb, StringLit("POST"))) return HttpVerb_Post;
+    else if (EqualStrings(Verb, StringLit("PUT"))) return HttpVerb_Put;
+    else if (EqualStrings(Verb, StringLit("DELETE"))) return HttpVerb_Delete;
+    else if (EqualStrings(Verb, StringLit("CONNECT"))) return HttpVerb_Connect;
+    else if (EqualStrings(Verb, StringLit("OPTIONS"))) return HttpVerb_Options;
+    else if (EqualStrings(Verb, StringLit("TRACE"))) return HttpVerb_Trace;
+    else if (EqualStrings(Verb, StringLit("PATCH"))) return HttpVerb_Patch;
+    return HttpVerb_Unknown;
+}
+
 external ts_http_parse
 ParseHttpHeader(string InBuffer, ts_request* Request)
 {
@@ -135,16 +352,8 @@ ParseHttpHeader(string InBuffer, ts_request* Request)
             return HttpParse_HeaderInvalid;
         }
         
-        if (EqualStrings(Verb, StringLit("GET"))) Request->Verb = HttpVerb_Get;
-        else if (EqualStrings(Verb, StringLit("HEAD"))) Request->Verb = HttpVerb_Head;
-        else if (EqualStrings(Verb, StringLit("POST"))) Request->Verb = HttpVerb_Post;
-        else if (EqualStrings(Verb, StringLit("PUT"))) Request->Verb = HttpVerb_Put;
-        else if (EqualStrings(Verb, StringLit("DELETE"))) Request->Verb = HttpVerb_Delete;
-        else if (EqualStrings(Verb, StringLit("CONNECT"))) Request->Verb = HttpVerb_Connect;
-        else if (EqualStrings(Verb, StringLit("OPTIONS"))) Request->Verb = HttpVerb_Options;
-        else if (EqualStrings(Verb, StringLit("TRACE"))) Request->Verb = HttpVerb_Trace;
-        else if (EqualStrings(Verb, StringLit("PATCH"))) Request->Verb = HttpVerb_Patch;
-        else
+        Request->Verb = ParseHttpVerb(Verb);
+        if (Request->Verb == HttpVerb_Unknown)
         {
             return HttpParse_HeaderInvalid;
         }
@@ -161,12 +370,20 @@ ParseHttpHeader(string InBuffer, ts_request* Request)
         }
         Request->UriOffset = Verb.WriteCur + 1;
         
-        string UriDecoded = String(Uri.Base, 0, Uri.WriteCur, EC_UTF8);
-        PercentEncodingToUTF8(Uri, &UriDecoded);
+        // Query is split from the path before decoding, since escaped '?', '&' and
+        // '=' are data. Only the path is decoded here (in place); query values are
+        // decoded on access, see ParseQueryString().
         
-        usz QueryToken = CharInString('?', UriDecoded, RETURN_IDX_FIND);
-        usz PathSize = (QueryToken == INVALID_IDX) ? UriDecoded.WriteCur : QueryToken;
-        usz QuerySize = (QueryToken == INVALID_IDX) ? 0 : UriDecoded.WriteCur - (QueryToken+1);
+        usz QueryToken = CharInString('?', Uri, RETURN_IDX_FIND);
+        usz RawPathSize = (QueryToken == INVALID_IDX) ? Uri.WriteCur : QueryToken;
+        usz QuerySize = (QueryToken == INVALID_IDX) ? 0 : Uri.WriteCur - (QueryToken+1);
+        usz PathSize = DecodeUrlInPlace(Uri.Base, RawPathSize, false);
+        if (QueryToken != INVALID_IDX && PathSize < RawPathSize)
+        {
+            // Keeps the query right after the path.
+            Uri.Base[PathSize] = '?';
+            memmove(Uri.Base + PathSize + 1, Uri.Base + RawPathSize + 1, QuerySize);
+        }
         
         string UriPath = String(Uri.Base, PathSize, 0, EC_UTF8);
         string UriQuery = String(Uri.Base + PathSize + 1, QuerySize, 0, EC_UTF8);
@@ -204,7 +421,7 @@ ParseHttpHeader(string InBuffer, ts_request* Request)
     // Parse Headers
     ReadCur = Request->HeaderSize;
     string Line = EatToken(InBuffer, &ReadCur, '\n');
-    while (ReadCur != INVALID_IDX)
+    while (Line.Base)
     {
         Request->HeaderSize = ReadCur;
         
@@ -248,6 +465,92 @@ ParseHttpHeader(string InBuffer, ts_request* Request)
     return HttpParse_HeaderIncomplete;
 }
 
+external ts_http_parse
+InitHttpRequest(ts_request* Request, string Verb, string Target, u8 Version, buffer* Memory)
+{
+    // Laid out as ParseHttpHeader() leaves the request buffer: the target right
+    // after [.UriOffset], and then each header as key size (u8), key, value
+    // size (u16) and value.
+    
+    memset(Request, 0, sizeof(ts_request));
+    Request->Verb = ParseHttpVerb(Verb);
+    if (Request->Verb == HttpVerb_Unknown || Target.WriteCur == 0)
+    {
+        return HttpParse_HeaderInvalid;
+    }
+    
+    usz TotalSize = Target.WriteCur + 2;
+    if (Memory->WriteCur + TotalSize > Memory->Size || TotalSize > U16_MAX)
+    {
+        return HttpParse_TooManyHeaders;
+    }
+    
+    char* Base = (char*)Memory->Base + Memory->WriteCur;
+    Base[0] = ' ';
+    CopyData(Base + 1, Target.WriteCur, Target.Base, Target.WriteCur);
+    
+    string Uri = String(Base + 1, Target.WriteCur, 0, EC_UTF8);
+    usz QueryToken = CharInString('?', Uri, RETURN_IDX_FIND);
+    usz RawPathSize = (QueryToken == INVALID_IDX) ? Uri.WriteCur : QueryToken;
+    usz QuerySize = (QueryToken == INVALID_IDX) ? 0 : Uri.WriteCur - (QueryToken+1);
+    usz PathSize = DecodeUrlInPlace(Uri.Base, RawPathSize, false);
+    if (QueryToken != INVALID_IDX && PathSize < RawPathSize)
+    {
+        Uri.Base[PathSize] = '?';
+        memmove(Uri.Base + PathSize + 1, Uri.Base + RawPathSize + 1, QuerySize);
+    }
+    if (IsRequestMalicious(String(Uri.Base, PathSize, 0, EC_UTF8),
+                           String(Uri.Base + PathSize + 1, QuerySize, 0, EC_UTF8)))
+    {
+        return HttpParse_HeaderMalicious;
+    }
+    
+    usz UriSize = PathSize + (QueryToken != INVALID_IDX ? QuerySize + 1 : 0);
+    Request->Base = Base;
+    Request->Version = Version;
+    Request->UriOffset = 1;
+    Request->PathSize = (u16)PathSize;
+    Request->QuerySize = (u16)QuerySize;
+    Request->FirstHeaderOffset = (u16)(1 + UriSize);
+    Request->HeaderSize = Request->FirstHeaderOffset;
+    Memory->WriteCur += Request->HeaderSize;
+    
+    return HttpParse_OK;
+}
+
+external ts_http_parse
+AddHttpRequestHeader(ts_request* Request, string Key, string Value, buffer* Memory)
+{
+    if (Request->NumHeaders == MAX_NUM_HEADERS)
+    {
+        return HttpParse_TooManyHeaders;
+    }
+    if (Key.WriteCur == 0 || Key.WriteCur >= 0xFF || Value.WriteCur >= 0xFFFF)
+    {
+        return HttpParse_HeaderInvalid;
+    }
+    
+    usz HeaderSize = sizeof(u8) + Key.WriteCur + sizeof(u16) + Value.WriteCur;
+    if (Memory->WriteCur + HeaderSize > Memory->Size
+        || Request->HeaderSize + HeaderSize > U16_MAX
+        || (char*)Memory->Base + Memory->WriteCur != Request->Base + Request->HeaderSize)
+    {
+        return HttpParse_TooManyHeaders;
+    }
+    
+    u8* Dst = Memory->Base + Memory->WriteCur;
+    u16 ValueSize = (u16)Value.WriteCur;
+    Dst[0] = (u8)Key.WriteCur;
+    CopyData(Dst + 1, Key.WriteCur, Key.Base, Key.WriteCur);
+    CopyData(Dst + 1 + Key.WriteCur, sizeof(u16), &ValueSize, sizeof(u16));
+    CopyData(Dst + 1 + Key.WriteCur + sizeof(u16), Value.WriteCur, Value.Base, Value.WriteCur);
+    
+    Memory->WriteCur += HeaderSize;
+    Request->HeaderSize += (u16)HeaderSize;
+    Request->NumHeaders++;
+    return HttpParse_OK;
+}
+
 internal bool
 HeadersAreEqual(string Header, char* TargetStr)
 {
@@ -307,379 +610,2212 @@ GetHeaderByIdx(ts_request* Request, usz TargetIdx)
     return Value;
 }
 
-//================================
-// Parsing request body
-//================================
+internal string
+TrimSpaces(string Str)
+{
+    while (Str.WriteCur > 0 && Str.Base[0] == ' ')
+    {
+        Str.Base++;
+        Str.WriteCur--;
+    }
+    while (Str.WriteCur > 0 && Str.Base[Str.WriteCur-1] == ' ')
+    {
+        Str.WriteCur--;
+    }
+    return Str;
+}
 
-#pragma pack(push, 1)
-typedef struct ts_form_field_parser
-{
-    u8 IsFile;
-    u8 FieldNameOffset;
-    u16 FieldNameLen;
-    u8 FilenameOffset;
-    u16 FilenameLen;
-    u8 CharsetOffset;
-    u16 CharsetLen;
-    u8 DataOffset;
-    u32 DataLen;
-    u16 NextFieldOffset;
-} ts_form_field_parser;
-#pragma pack(pop)
+internal void
+AddPairToIndex(u8* Index, usz IndexSize, char* Base, ts_pair_span* Pairs, usz PairIdx)
+{
+    // Open addressing, with slots holding pair idx + 1 (0 means empty). When a
+    // name repeats, only the first pair with it gets indexed.
+    
+    ts_pair_span* Pair = &Pairs[PairIdx];
+    string Name = String(Base + Pair->NameOffset, Pair->NameSize, 0, EC_ASCII);
+    usz Mask = IndexSize - 1;
+    usz Slot = HashName(Name.Base, Name.WriteCur) & Mask;
+    while (Index[Slot])
+    {
+        ts_pair_span* Other = &Pairs[Index[Slot] - 1];
+        if (EqualStrings(Name, String(Base + Other->NameOffset, Other->NameSize,
+                                      0, EC_ASCII))) return;
+        Slot = (Slot + 1) & Mask;
+    }
+    Index[Slot] = (u8)(PairIdx + 1);
+}
 
-typedef enum ts_form_parsing_stage
+internal ts_pair_span*
+FindPairInIndex(u8* Index, usz IndexSize, char* Base, ts_pair_span* Pairs, string Target)
 {
-    FormParse_FirstLine,
-    FormParse_SecondLine,
-    FormParse_ThirdLine,
-    FormParse_Data,
-    FormParse_Complete,
-    FormParse_Error
-} ts_form_parsing_stage;
+    usz Mask = IndexSize - 1;
+    usz Slot = HashName(Target.Base, Target.WriteCur) & Mask;
+    while (Index[Slot])
+    {
+        ts_pair_span* Pair = &Pairs[Index[Slot] - 1];
+        string Name = String(Base + Pair->NameOffset, Pair->NameSize, 0, EC_ASCII);
+        if (EqualStrings(Name, Target))
+        {
+            return Pair;
+        }
+        Slot = (Slot + 1) & Mask;
+    }
+    return NULL;
+}
 
-external ts_body
-GetBodyInfo(ts_request* Request)
+external usz
+ParseRequestCookies(ts_request* Request, ts_request_cookies* Cookies)
 {
-    ts_body Result = {0};
+    memset(Cookies, 0, sizeof(ts_request_cookies));
     
-    string EntitySize = GetHeaderByKey(Request, "Content-Length");
-    string ContentType = GetHeaderByKey(Request, "Content-Type");
+    string Header = GetHeaderByKey(Request, "Cookie");
+    Cookies->Base = Header.Base;
     
-    usz BodySize;
-    if (EntitySize.Base
-        && ContentType.Base
-        && (BodySize = StringToUInt(EntitySize)) != USZ_MAX)
+    // Format is [name1=value1; name2=value2], with values optionally quoted.
+    usz ReadCur = 0;
+    while (ReadCur < Header.WriteCur
+           && Cookies->Count < MAX_NUM_COOKIES)
     {
-        Result.Base = (u8*)Request->Base + Request->HeaderSize;
-        Result.Size = BodySize;
-        Result.ContentType = ContentType.Base;
-        Result.ContentTypeSize = ContentType.WriteCur;
+        string Pair = EatToken(Header, &ReadCur, ';');
+        if (!Pair.Base)
+        {
+            Pair = String(Header.Base + ReadCur, Header.WriteCur - ReadCur, 0, EC_ASCII);
+            ReadCur = Header.WriteCur;
+        }
+        
+        usz PairCur = 0;
+        string Name = EatToken(Pair, &PairCur, '=');
+        if (!Name.Base)
+        {
+            continue;
+        }
+        Name = TrimSpaces(Name);
+        string Value = TrimSpaces(String(Pair.Base + PairCur, Pair.WriteCur - PairCur,
+                                         0, EC_ASCII));
+        if (Value.WriteCur >= 2
+            && Value.Base[0] == '\"'
+            && Value.Base[Value.WriteCur-1] == '\"')
+        {
+            Value.Base++;
+            Value.WriteCur -= 2;
+        }
+        if (Name.WriteCur == 0)
+        {
+            continue;
+        }
+        
+        ts_pair_span* Span = &Cookies->Spans[Cookies->Count];
+        Span->NameOffset = (u16)(Name.Base - Header.Base);
+        Span->NameSize = (u16)Name.WriteCur;
+        Span->ValueOffset = (u16)(Value.Base - Header.Base);
+        Span->ValueSize = (u16)Value.WriteCur;
+        AddPairToIndex(Cookies->Index, sizeof(Cookies->Index), Cookies->Base,
+                       Cookies->Spans, Cookies->Count);
+        
+        Cookies->Count++;
     }
     
-    return Result;
+    return Cookies->Count;
 }
 
-external ts_multiform
-ParseFormData(ts_body RequestBody)
+external string
+GetCookieByName(ts_request_cookies* Cookies, char* TargetName)
 {
-    ts_multiform Form = {0}, EmptyForm = {0};
-    
-    // Field boundary is evaluated with a -- before it, so we include it before the
-    // string in the header to facilitate search.
+    string Value = { 0, 0, 0, EC_ASCII };
     
-    string EntityType = String(RequestBody.ContentType, RequestBody.ContentTypeSize,
-                               0, EC_ASCII);
-    char* BoundaryPtr = (char*)CharInString('=', EntityType, RETURN_PTR_FIND);
-    *BoundaryPtr-- = '-';
-    *BoundaryPtr   = '-';
-    string Boundary = String(BoundaryPtr, EntityType.Base+EntityType.WriteCur-BoundaryPtr,
-                             0, EC_ASCII);
+    if (Cookies->Count > 0)
+    {
+        string Target = String(TargetName, strlen(TargetName), 0, EC_ASCII);
+        ts_pair_span* Span = FindPairInIndex(Cookies->Index, sizeof(Cookies->Index),
+                                             Cookies->Base, Cookies->Spans, Target);
+        if (Span)
+        {
+            Value.Base = Cookies->Base + Span->ValueOffset;
+            Value.WriteCur = Span->ValueSize;
+        }
+    }
     
-    // Final boundary ends in "--" (e.g. if boundary is "--s20bHc", final boundary
-    // will be "--s20bHc--").
+    return Value;
+}
+
+external string
+GetCookieByIdx(ts_request_cookies* Cookies, usz TargetIdx, _opt string* OutName)
+{
+    string Value = { 0, 0, 0, EC_ASCII };
     
-    usz FinalBoundarySize = Boundary.Size + 2;
+    if (TargetIdx < Cookies->Count)
+    {
+        ts_pair_span* Span = &Cookies->Spans[TargetIdx];
+        Value.Base = Cookies->Base + Span->ValueOffset;
+        Value.WriteCur = Span->ValueSize;
+        if (OutName)
+        {
+            *OutName = String(Cookies->Base + Span->NameOffset, Span->NameSize, 0, EC_ASCII);
+        }
+    }
     
-    string Body = String(RequestBody.Base, RequestBody.Size, 0, EC_ASCII);
-    usz ReadCur = 0;
-    char* Offset = NULL;
-    ts_form_field_parser Parser = {0};
-    ts_form_field_parser* CurrentField = NULL;
+    return Value;
+}
+
+external usz
+ParseQueryString(ts_request* Request, ts_query* Query)
+{
+    memset(Query, 0, sizeof(ts_query));
     
-    // Jumps the first boundary, because it's useless for us.
-    string Line = EatToken(Body, &ReadCur, '\n');
-    ts_form_parsing_stage ParseStage = FormParse_FirstLine;
+    Query->Base = Request->Base + Request->UriOffset + Request->PathSize + 1;
+    u8* Data = (u8*)Query->Base;
+    usz Size = Request->QuerySize;
     
-    bool FormIsValid = true;
+    // Format is [key1=value1&key2=value2]. A single scan finds every separator,
+    // and also notes which keys and values have escapes in them.
     
-    while (FormIsValid && ReadCur < Body.WriteCur)
+    usz ReadCur = 0;
+    while (ReadCur < Size
+           && Query->Count < MAX_NUM_QUERY_PARAMS)
     {
-        if (ParseStage == FormParse_FirstLine)
+        usz PairStart = ReadCur;
+        usz KeyEnd = INVALID_IDX;
+        bool KeyIsEncoded = false, ValueIsEncoded = false;
+        
+        while (ReadCur < Size)
         {
-            Line = EatToken(Body, &ReadCur, '\n');
-            if (Line.Base)
+            ReadCur += FindAnyByte(Data + ReadCur, Size - ReadCur, '&', '=', '%', '+');
+            if (ReadCur == Size || Data[ReadCur] == '&')
             {
-                string Content = StringLit("Content-Disposition: form-data");
-                if (CompareStrings(Line, Content, Content.WriteCur, RETURN_BOOL))
-                {
-                    usz LineCur = Content.WriteCur;
-                    CurrentField = (ts_form_field_parser*)Line.Base;
-                    
-                    // name="Field".
-                    string FieldName = EatSubstring(Line, &LineCur, '\"', '\"');
-                    usz FieldNameOffset = FieldName.Base - Line.Base;
-                    if (FieldNameOffset <= U8_MAX
-                        && FieldName.WriteCur <= U16_MAX)
-                    {
-                        Parser.FieldNameOffset = (u8)FieldNameOffset;
-                        Parser.FieldNameLen = (u16)FieldName.WriteCur;
-                        Offset = Line.Base + FieldNameOffset + FieldName.WriteCur;
-                        
-                        // If field is file, format is:
-                        //   [name="FieldName";filename="File.ext"].
-                        if (Line.Base[LineCur] == ';')
-                        {
-                            Parser.IsFile = true;
-                            LineCur++;
-                            
-                            // filename="File.ext".
-                            string Filename = EatSubstring(Line, &LineCur, '\"', '\"');
-                            usz FilenameOffset = Filename.Base - Offset;
-                            if (FilenameOffset <= U8_MAX
-                                && Filename.WriteCur <= U16_MAX)
-                            {
-                                Parser.FilenameOffset = (u8)FilenameOffset;
-                                Parser.FilenameLen = (u16)Filename.WriteCur;
-                                Offset += FilenameOffset + Filename.WriteCur;
-                            }
-                            else
-                            {
-                                FormIsValid = false;
-                            }
-                        }
-                        
-                        ParseStage = FormParse_SecondLine;
-                    }
-                    else
-                    {
-                        FormIsValid = false;
-                    }
-                }
-                else
-                {
-                    FormIsValid = false;
-                }
+                break;
             }
-            else
+            if (Data[ReadCur] == '=' && KeyEnd == INVALID_IDX)
             {
-                FormIsValid = false;
+                KeyEnd = ReadCur;
+            }
+            else if (Data[ReadCur] != '=')
+            {
+                if (KeyEnd == INVALID_IDX) KeyIsEncoded = true;
+                else ValueIsEncoded = true;
             }
+            ReadCur++;
         }
+        usz PairEnd = ReadCur++;
         
-        else if (ParseStage == FormParse_SecondLine)
+        if (KeyEnd == INVALID_IDX)
         {
-            Line = EatToken(Body, &ReadCur, '\n');
-            if (Line.Base)
-            {
-                usz LineCur = 0;
-                
-                // If line is not blank, it can only be Content-Type.
-                string Content = StringLit("Content-Type");
-                if (CompareStrings(Line, Content, Content.WriteCur, RETURN_BOOL))
-                {
-                    usz LineCur = Content.WriteCur;
-                    
-                    // Ignores Content-Type (it can later be retrieved from file ext).
-                    // Checks to see if file has encoding information, format is:
-                    //   [charset=Encoding].
-                    string Encoding = EatSubstring(Line, &LineCur, '=', '\n');
-                    if (Encoding.Base)
-                    {
-                        usz CharsetOffset = Encoding.Base - Offset;
-                        if (CharsetOffset <= U8_MAX
-                            && Encoding.WriteCur <= U16_MAX)
-                        {
-                            Parser.CharsetOffset = (u8)CharsetOffset;
-                            Parser.CharsetLen = (u16)Encoding.WriteCur;
-                            Offset += CharsetOffset + Encoding.WriteCur;
-                        }
-                    }
-                    
-                    ParseStage = FormParse_ThirdLine;
-                }
-                
-                // Blank line points to beginning of data.
-                else if (Line.Base[LineCur] == '\r'
-                         || Line.Base[LineCur] == '\n')
-                {
-                    Parser.DataOffset = (u8)(Body.Base + ReadCur - Offset);
-                    
-                    *CurrentField = Parser;
-                    Form.LastField = CurrentField;
-                    if (!Form.FirstField)
-                    {
-                        Form.FirstField = CurrentField;
-                    }
-                    ParseStage = FormParse_Data;
-                }
-                else
-                {
-                    FormIsValid = false;
-                }
-            }
-            else
-            {
-                FormIsValid = false;
-            }
+            KeyEnd = PairEnd;
+        }
+        if (KeyEnd == PairStart)
+        {
+            continue; // Empty pair, or no key.
         }
         
-        else if (ParseStage == FormParse_ThirdLine)
+        // Keys are short and compared on lookup, so they are decoded right away.
+        usz KeySize = KeyEnd - PairStart;
+        if (KeyIsEncoded)
         {
-            Line = EatToken(Body, &ReadCur, '\n');
-            if (Line.Base)
+            KeySize = DecodeUrlInPlace((char*)Data + PairStart, KeySize, true);
+        }
+        
+        ts_pair_span* Param = &Query->Params[Query->Count];
+        Param->NameOffset = (u16)PairStart;
+        Param->NameSize = (u16)KeySize;
+        Param->ValueOffset = (u16)((KeyEnd < PairEnd) ? KeyEnd + 1 : PairEnd);
+        Param->ValueSize = (u16)(PairEnd - Param->ValueOffset);
+        if (ValueIsEncoded)
+        {
+            Query->EncodedMask |= (u64)1 << Query->Count;
+        }
+        AddPairToIndex(Query->Index, sizeof(Query->Index), Query->Base,
+                       Query->Params, Query->Count);
+        
+        Query->Count++;
+    }
+    
+    return Query->Count;
+}
+
+internal string
+GetQueryValue(ts_query* Query, usz ParamIdx)
+{
+    ts_pair_span* Param = &Query->Params[ParamIdx];
+    u64 Bit = (u64)1 << ParamIdx;
+    if (Query->EncodedMask & Bit)
+    {
+        Param->ValueSize = (u16)DecodeUrlInPlace(Query->Base + Param->ValueOffset,
+                                                 Param->ValueSize, true);
+        Query->EncodedMask &= ~Bit;
+    }
+    return String(Query->Base + Param->ValueOffset, Param->ValueSize, 0, EC_UTF8);
+}
+
+external string
+GetQueryParam(ts_query* Query, char* TargetKey)
+{
+    string Value = { 0, 0, 0, EC_UTF8 };
+    
+    if (Query->Count > 0)
+    {
+        string Target = String(TargetKey, strlen(TargetKey), 0, EC_ASCII);
+        ts_pair_span* Param = FindPairInIndex(Query->Index, sizeof(Query->Index),
+                                              Query->Base, Query->Params, Target);
+        if (Param)
+        {
+            Value = GetQueryValue(Query, Param - Query->Params);
+        }
+    }
+    
+    return Value;
+}
+
+external string
+GetQueryParamByIdx(ts_query* Query, usz TargetIdx, _opt string* OutKey)
+{
+    string Value = { 0, 0, 0, EC_UTF8 };
+    
+    if (TargetIdx < Query->Count)
+    {
+        Value = GetQueryValue(Query, TargetIdx);
+        if (OutKey)
+        {
+            ts_pair_span* Param = &Query->Params[TargetIdx];
+            *OutKey = String(Query->Base + Param->NameOffset, Param->NameSize, 0, EC_UTF8);
+        }
+    }
+    
+    return Value;
+}
+
+internal bool
+ETagsAreEqual(string A, string B, bool Weak)
+{
+    // Weak comparison ignores the "W/" prefix; strong one fails if either has it.
+    bool IsWeakA = (A.WriteCur >= 2 && A.Base[0] == 'W' && A.Base[1] == '/');
+    bool IsWeakB = (B.WriteCur >= 2 && B.Base[0] == 'W' && B.Base[1] == '/');
+    if (!Weak && (IsWeakA || IsWeakB)) return false;
+    if (IsWeakA) { A.Base += 2; A.WriteCur -= 2; }
+    if (IsWeakB) { B.Base += 2; B.WriteCur -= 2; }
+    return (A.WriteCur == B.WriteCur && A.WriteCur > 0
+            && memcmp(A.Base, B.Base, A.WriteCur) == 0);
+}
+
+external bool
+IsNotModified(ts_request* Request, string ETag, u64 ModifiedTime)
+{
+    // If-Modified-Since is only looked at when there's no If-None-Match.
+    
+    string IfNoneMatch = GetHeaderByKey(Request, "If-None-Match");
+    if (IfNoneMatch.Base)
+    {
+        usz ReadCur = 0;
+        while (ReadCur < IfNoneMatch.WriteCur)
+        {
+            string Tag = EatToken(IfNoneMatch, &ReadCur, ',');
+            if (!Tag.Base)
             {
-                // Third line can only be blank.
-                if (Line.Base[0] == '\r'
-                    || Line.Base[0] == '\n')
-                {
-                    Parser.DataOffset = (u8)(Body.Base + ReadCur - Offset);
-                    
-                    *CurrentField = Parser;
-                    Form.LastField = CurrentField;
-                    if (!Form.FirstField)
-                    {
-                        Form.FirstField = CurrentField;
-                    }
-                    ParseStage = FormParse_Data;
-                }
-                else
-                {
-                    FormIsValid = false;
-                }
+                Tag = String(IfNoneMatch.Base + ReadCur, IfNoneMatch.WriteCur - ReadCur,
+                             0, EC_ASCII);
+                ReadCur = IfNoneMatch.WriteCur;
             }
-            else
+            Tag = TrimSpaces(Tag);
+            
+            if ((Tag.WriteCur == 1 && Tag.Base[0] == '*')
+                || ETagsAreEqual(Tag, ETag, true))
             {
-                FormIsValid = false;
+                return true;
             }
         }
+        return false;
+    }
+    
+    string IfModifiedSince = GetHeaderByKey(Request, "If-Modified-Since");
+    if (IfModifiedSince.Base && ModifiedTime)
+    {
+        u64 Since = ParseTimeIMF(TrimSpaces(IfModifiedSince));
+        return (Since && ModifiedTime <= Since);
+    }
+    
+    return false;
+}
+
+internal bool
+ParseRangeNumber(string Src, u64* Value)
+{
+    if (Src.WriteCur == 0 || Src.WriteCur > 19) return false;
+    
+    u64 Result = 0;
+    for (usz Idx = 0; Idx < Src.WriteCur; Idx++)
+    {
+        if (Src.Base[Idx] < '0' || Src.Base[Idx] > '9') return false;
+        Result = Result * 10 + (Src.Base[Idx] - '0');
+    }
+    *Value = Result;
+    return true;
+}
+
+external ts_http_range
+ParseHttpRange(ts_request* Request, u64 TotalSize, string ETag, u64 ModifiedTime,
+               u64* RangeStart, u64* RangeSize)
+{
+    string Range = TrimSpaces(GetHeaderByKey(Request, "Range"));
+    string Unit = StringLit("bytes=");
+    if (!Range.Base
+        || Range.WriteCur <= Unit.WriteCur
+        || !CompareStrings(Range, Unit, Unit.WriteCur, RETURN_BOOL))
+    {
+        return HttpRange_None;
+    }
+    
+    // If-Range only lets the range through if the file is still the same: for an
+    // ETag it must match strongly, and for a date it must be the exact one.
+    string IfRange = TrimSpaces(GetHeaderByKey(Request, "If-Range"));
+    if (IfRange.Base)
+    {
+        bool IsETag = (IfRange.Base[0] == '"'
+                       || (IfRange.WriteCur >= 2 && IfRange.Base[0] == 'W' && IfRange.Base[1] == '/'));
+        bool IsSame = (IsETag
+                       ? ETagsAreEqual(IfRange, ETag, false)
+                       : (ModifiedTime && ParseTimeIMF(IfRange) == ModifiedTime));
+        if (!IsSame) return HttpRange_None;
+    }
+    
+    // Only a single range is served. Multiple ranges get the whole file.
+    string Spec = String(Range.Base + Unit.WriteCur, Range.WriteCur - Unit.WriteCur,
+                         0, EC_ASCII);
+    if (CharInString(',', Spec, RETURN_BOOL))
+    {
+        return HttpRange_None;
+    }
+    usz Dash = CharInString('-', Spec, RETURN_IDX_FIND);
+    if (Dash == INVALID_IDX)
+    {
+        return HttpRange_None;
+    }
+    string First = TrimSpaces(String(Spec.Base, Dash, 0, EC_ASCII));
+    string Last = TrimSpaces(String(Spec.Base + Dash + 1, Spec.WriteCur - Dash - 1, 0, EC_ASCII));
+    
+    u64 Start = 0, End = 0;
+    if (First.WriteCur == 0)
+    {
+        // Suffix range ("bytes=-500" is the last 500 bytes).
+        u64 Suffix = 0;
+        if (!ParseRangeNumber(Last, &Suffix)) return HttpRange_None;
+        if (Suffix == 0 || TotalSize == 0) return HttpRange_NotSatisfiable;
+        Start = (Suffix >= TotalSize) ? 0 : TotalSize - Suffix;
+        End = TotalSize - 1;
+    }
+    else
+    {
+        if (!ParseRangeNumber(First, &Start)) return HttpRange_None;
+        if (Last.WriteCur == 0) End = TotalSize - 1;
+        else if (!ParseRangeNumber(Last, &End) || End < Start) return HttpRange_None;
+        
+        if (Start >= TotalSize) return HttpRange_NotSatisfiable;
+        if (End >= TotalSize) End = TotalSize - 1;
+    }
+    
+    *RangeStart = Start;
+    *RangeSize = End - Start + 1;
+    return HttpRange_OK;
+}
+
+internal u32
+ParseQValue(string Param)
+{
+    // Gets q-value as thousandths ("q=0.5" is 500). Anything invalid counts as 1.
+    
+    Param = TrimSpaces(Param);
+    if (Param.WriteCur < 3 || (Param.Base[0] != 'q' && Param.Base[0] != 'Q') || Param.Base[1] != '=')
+    {
+        return 1000;
+    }
+    
+    if (Param.Base[2] != '0') return 1000;
+    
+    u32 Result = 0;
+    u32 Scale = 100;
+    for (usz Idx = 4; Idx < Param.WriteCur && Idx < 7 && Param.Base[3] == '.'; Idx++)
+    {
+        if (Param.Base[Idx] < '0' || Param.Base[Idx] > '9') break;
+        Result += (Param.Base[Idx] - '0') * Scale;
+        Scale /= 10;
+    }
+    return Result;
+}
+
+external u8
+NegotiateHttpEncoding(ts_request* Request, u32 Available)
+{
+    string AcceptEncoding = GetHeaderByKey(Request, "Accept-Encoding");
+    if (!AcceptEncoding.Base)
+    {
+        return HttpEncoding_Identity;
+    }
+    
+    // Quality of each encoding, or of '*' for the ones not listed.
+    u32 Quality[HttpEncoding_Count];
+    bool IsListed[HttpEncoding_Count] = {0};
+    u32 WildcardQuality = 0;
+    
+    usz ReadCur = 0;
+    while (ReadCur < AcceptEncoding.WriteCur)
+    {
+        string Item = EatToken(AcceptEncoding, &ReadCur, ',');
+        if (!Item.Base)
+        {
+            Item = String(AcceptEncoding.Base + ReadCur, AcceptEncoding.WriteCur - ReadCur,
+                          0, EC_ASCII);
+            ReadCur = AcceptEncoding.WriteCur;
+        }
         
-        else if (ParseStage == FormParse_Data)
+        usz ParamIdx = CharInString(';', Item, RETURN_IDX_FIND);
+        string Name = Item;
+        u32 Q = 1000;
+        if (ParamIdx != INVALID_IDX)
         {
-            buffer RawData = Buffer(Body.Base + ReadCur, Body.WriteCur - ReadCur, 0);
-            usz DataEnd = BufferInBuffer(Boundary.Buffer, RawData, RETURN_IDX_FIND);
-            if (DataEnd != INVALID_IDX)
+            Name.WriteCur = ParamIdx;
+            Q = ParseQValue(String(Item.Base + ParamIdx + 1, Item.WriteCur - ParamIdx - 1,
+                                   0, EC_ASCII));
+        }
+        Name = TrimSpaces(Name);
+        
+        u8 Encoding = HttpEncoding_Count;
+        if (EqualStrings(Name, StringLit("gzip")) || EqualStrings(Name, StringLit("x-gzip")))
+            Encoding = HttpEncoding_Gzip;
+        else if (EqualStrings(Name, StringLit("deflate")))
+            Encoding = HttpEncoding_Deflate;
+        else if (EqualStrings(Name, StringLit("br")))
+            Encoding = HttpEncoding_Brotli;
+        else if (EqualStrings(Name, StringLit("*")))
+            WildcardQuality = Q;
+        
+        if (Encoding < HttpEncoding_Count)
+        {
+            Quality[Encoding] = Q;
+            IsListed[Encoding] = true;
+        }
+    }
+    
+    // Highest quality wins, with ties going to the best compression.
+    u8 Preference[] = { HttpEncoding_Brotli, HttpEncoding_Gzip, HttpEncoding_Deflate };
+    u8 Result = HttpEncoding_Identity;
+    u32 BestQuality = 0;
+    for (usz Idx = 0; Idx < sizeof(Preference); Idx++)
+    {
+        u8 Encoding = Preference[Idx];
+        u32 Q = IsListed[Encoding] ? Quality[Encoding] : WildcardQuality;
+        if ((Available & (1 << Encoding)) && Q > BestQuality)
+        {
+            Result = Encoding;
+            BestQuality = Q;
+        }
+    }
+    return Result;
+}
+
+//================================
+// Parsing request body
+//================================
+
+typedef enum ts_form_parsing_stage
+{
+    FormParse_FirstLine,
+    FormParse_SecondLine,
+    FormParse_ThirdLine,
+    FormParse_Data,
+    FormParse_Complete,
+    FormParse_Error
+} ts_form_parsing_stage;
+
+external ts_body
+GetBodyInfo(ts_request* Request)
+{
+    ts_body Result = {0};
+    
+    string EntitySize = GetHeaderByKey(Request, "Content-Length");
+    string ContentType = GetHeaderByKey(Request, "Content-Type");
+    
+    usz BodySize;
+    if (EntitySize.Base
+        && ContentType.Base
+        && (BodySize = StringToUInt(EntitySize)) != USZ_MAX)
+    {
+        Result.Base = (u8*)Request->Base + Request->HeaderSize;
+        Result.Size = BodySize;
+        Result.ContentType = ContentType.Base;
+        Result.ContentTypeSize = ContentType.WriteCur;
+    }
+    
+    return Result;
+}
+
+internal string
+GetPartHeaderParam(string Line, string Key)
+{
+    string Result = { 0, 0, 0, EC_ASCII };
+    
+    usz LineCur = CharInString(';', Line, RETURN_IDX_FIND);
+    while (LineCur != INVALID_IDX && LineCur < Line.WriteCur)
+    {
+        LineCur++;
+        while (LineCur < Line.WriteCur && Line.Base[LineCur] == ' ') LineCur++;
+        
+        string Param = String(Line.Base + LineCur, Line.WriteCur - LineCur, 0, EC_ASCII);
+        if (Param.WriteCur > Key.WriteCur
+            && Param.Base[Key.WriteCur] == '='
+            && CompareStrings(Param, Key, Key.WriteCur, RETURN_BOOL))
+        {
+            usz ParamCur = Key.WriteCur + 1;
+            if (Param.Base[ParamCur] == '\"')
             {
-                ReadCur += DataEnd + Boundary.WriteCur;
-                
-                JumpBackCLRF(RawData.Base, DataEnd);
-                Parser.DataLen = (u32)DataEnd;
-                
-                Form.FieldCount++;
-                if (Body.Base[ReadCur] == '-')
-                {
-                    ParseStage = FormParse_Complete;
-                }
-                else if (Body.Base[ReadCur] == '\r'
-                         || Body.Base[ReadCur] == '\n')
-                {
-                    JumpCLRF(Body.Base, ReadCur, Body.WriteCur);
-                    Parser.NextFieldOffset = (u16)((Body.Base + ReadCur)
-                                                   - ((char*)RawData.Base + DataEnd));
-                    ParseStage = FormParse_FirstLine;
-                }
-                else
-                {
-                    FormIsValid = false;
-                }
-                
-                CurrentField->DataLen = Parser.DataLen;
-                CurrentField->NextFieldOffset = Parser.NextFieldOffset;
-                
-                memset(&Parser, 0, sizeof(Parser));
-                CurrentField = (ts_form_field_parser*)(Body.Base + ReadCur);
+                Result = EatSubstring(Param, &ParamCur, '\"', '\"');
             }
             else
             {
-                FormIsValid = false;
+                Result = EatToken(Param, &ParamCur, ';');
+                if (!Result.Base)
+                {
+                    Result = String(Param.Base + ParamCur, Param.WriteCur - ParamCur,
+                                    0, EC_ASCII);
+                }
             }
+            break;
         }
         
-        else if (ParseStage == FormParse_Complete)
+        usz Next = CharInString(';', Param, RETURN_IDX_FIND);
+        LineCur = (Next == INVALID_IDX) ? INVALID_IDX : LineCur + Next;
+    }
+    
+    return Result;
+}
+
+internal bool
+InitFormBoundary(ts_form_boundary* Boundary, string ContentType)
+{
+    string BoundaryStr = GetPartHeaderParam(ContentType, StringLit("boundary"));
+    if (!BoundaryStr.Base
+        || BoundaryStr.WriteCur == 0
+        || BoundaryStr.WriteCur > MAX_FORM_BOUNDARY_SIZE)
+    {
+        return false;
+    }
+    
+    // Field data ends in CRLF followed by "--" and the boundary, so all of it is
+    // searched for at once.
+    
+    CopyData(Boundary->Delimiter, sizeof(Boundary->Delimiter), (char*)"\r\n--", 4);
+    CopyData(Boundary->Delimiter + 4, sizeof(Boundary->Delimiter) - 4,
+             BoundaryStr.Base, BoundaryStr.WriteCur);
+    Boundary->Size = (u16)(BoundaryStr.WriteCur + 4);
+    
+    // Horspool table: how far the search can jump when a given byte is found
+    // aligned with the last byte of the delimiter.
+    
+    memset(Boundary->Skip, (u8)Boundary->Size, sizeof(Boundary->Skip));
+    for (usz Idx = 0; Idx < (usz)Boundary->Size - 1; Idx++)
+    {
+        Boundary->Skip[Boundary->Delimiter[Idx]] = (u8)(Boundary->Size - 1 - Idx);
+    }
+    
+    return true;
+}
+
+internal usz
+FindFormBoundary(ts_form_boundary* Boundary, u8* Data, usz DataSize)
+{
+    u8* Delim = Boundary->Delimiter;
+    usz DelimSize = Boundary->Size;
+    if (DataSize < DelimSize)
+    {
+        return INVALID_IDX;
+    }
+    
+    usz Cur = 0;
+    usz LastPos = DataSize - DelimSize;
+    
+#if defined(__SSE2__)
+    // First/last byte filter: only positions where both the first and the last
+    // byte of the delimiter match get fully compared, 16 positions at a time.
+    
+    __m128i First = _mm_set1_epi8((char)Delim[0]);
+    __m128i Last = _mm_set1_epi8((char)Delim[DelimSize-1]);
+    for (; Cur + 16 <= LastPos + 1; Cur += 16)
+    {
+        __m128i BlockFirst = _mm_loadu_si128((__m128i*)(Data + Cur));
+        __m128i BlockLast = _mm_loadu_si128((__m128i*)(Data + Cur + DelimSize - 1));
+        __m128i Eq = _mm_and_si128(_mm_cmpeq_epi8(BlockFirst, First),
+                                   _mm_cmpeq_epi8(BlockLast, Last));
+        u32 Mask = (u32)_mm_movemask_epi8(Eq);
+        while (Mask)
         {
-            break;
+            u32 Bit = __builtin_ctz(Mask);
+            if (memcmp(Data + Cur + Bit + 1, Delim + 1, DelimSize - 2) == 0)
+            {
+                return Cur + Bit;
+            }
+            Mask &= Mask - 1;
         }
-        
-        else
+    }
+#endif
+    
+    // Horspool, for the tail and for targets without SSE2.
+    
+    u8 LastByte = Delim[DelimSize-1];
+    while (Cur <= LastPos)
+    {
+        u8 Byte = Data[Cur + DelimSize - 1];
+        if (Byte == LastByte
+            && memcmp(Data + Cur, Delim, DelimSize - 1) == 0)
         {
-            FormIsValid = false;
+            return Cur;
         }
+        Cur += Boundary->Skip[Byte];
     }
     
-    return FormIsValid ? Form : EmptyForm;
+    return INVALID_IDX;
 }
 
-internal ts_form_field
-OrganizeFieldInfo(ts_form_field_parser* Parser)
+internal usz
+PartialFormBoundaryAtEnd(ts_form_boundary* Boundary, u8* Data, usz DataSize)
 {
-    ts_form_field Result = {0};
+    // The delimiter starts with the only '\r' in it, so a partial match at the
+    // end of the chunk can only start at the last '\r' in the tail.
     
-    char* Ptr = (char*)Parser;
-    Result.FieldName = Ptr + Parser->FieldNameOffset;
-    Result.FieldNameSize = Parser->FieldNameLen;
-    Ptr += Parser->FieldNameOffset + Parser->FieldNameLen;
-    
-    if (Parser->FilenameLen)
+    usz TailStart = DataSize - Min(DataSize, (usz)Boundary->Size - 1);
+    for (usz Idx = DataSize; Idx > TailStart; )
     {
-        Result.Filename = Ptr + Parser->FilenameOffset;
-        Result.FilenameSize = Parser->FilenameLen;
-        Ptr += Parser->FilenameOffset + Parser->FilenameLen;
+        Idx--;
+        if (Data[Idx] == '\r')
+        {
+            usz Size = DataSize - Idx;
+            return (memcmp(Data + Idx, Boundary->Delimiter, Size) == 0) ? Size : 0;
+        }
     }
-    if (Parser->CharsetLen)
+    return 0;
+}
+
+internal void
+BuildFormIndex(ts_multiform* Form, buffer* Arena)
+{
+    usz IndexSize = 16;
+    while (IndexSize < Form->FieldCount * 2) IndexSize <<= 1;
+    
+    u32* Index = PushArray(Arena, IndexSize, u32);
+    if (Index)
     {
-        Result.Charset = Ptr + Parser->CharsetOffset;
-        Result.CharsetSize = Parser->CharsetLen;
-        Ptr += Parser->CharsetOffset + Parser->CharsetLen;
+        memset(Index, 0, IndexSize * sizeof(u32));
+        
+        // Open addressing, with slots holding field idx + 1 (0 means empty). When
+        // a name repeats, only the first field with it gets indexed.
+        
+        usz Mask = IndexSize - 1;
+        for (usz FieldIdx = 0; FieldIdx < Form->FieldCount; FieldIdx++)
+        {
+            ts_form_field* Field = &Form->Fields[FieldIdx];
+            string Name = String(Field->FieldName, Field->FieldNameSize, 0, EC_ASCII);
+            usz Slot = HashName(Field->FieldName, Field->FieldNameSize) & Mask;
+            while (Index[Slot])
+            {
+                ts_form_field* Other = &Form->Fields[Index[Slot] - 1];
+                if (EqualStrings(Name, String(Other->FieldName, Other->FieldNameSize,
+                                              0, EC_ASCII))) break;
+                Slot = (Slot + 1) & Mask;
+            }
+            if (!Index[Slot])
+            {
+                Index[Slot] = (u32)(FieldIdx + 1);
+            }
+        }
+        
+        Form->Index = Index;
+        Form->IndexSize = IndexSize;
+    }
+}
+
+external ts_multiform
+ParseFormData(ts_body RequestBody, buffer* Arena)
+{
+    ts_multiform Form = {0}, EmptyForm = {0};
+    usz ArenaStart = Arena->WriteCur;
+    
+    // The boundary search table is built once here, and reused for every field.
+    
+    ts_form_boundary Boundary;
+    string EntityType = String(RequestBody.ContentType, RequestBody.ContentTypeSize,
+                               0, EC_ASCII);
+    if (!InitFormBoundary(&Boundary, EntityType))
+    {
+        return EmptyForm;
+    }
+    
+    string Body = String(RequestBody.Base, RequestBody.Size, 0, EC_ASCII);
+    usz ReadCur = 0;
+    ts_form_field* CurrentField = NULL;
+    
+    // Fields are pushed one after the other, so they form a contiguous table.
+    Form.Fields = (ts_form_field*)(Arena->Base + Arena->WriteCur);
+    
+    // Jumps the first boundary, because it's useless for us.
+    string Line = EatToken(Body, &ReadCur, '\n');
+    ts_form_parsing_stage ParseStage = FormParse_FirstLine;
+    
+    bool FormIsValid = true;
+    
+    while (FormIsValid && ReadCur < Body.WriteCur)
+    {
+        if (ParseStage == FormParse_FirstLine)
+        {
+            Line = EatToken(Body, &ReadCur, '\n');
+            string Content = StringLit("Content-Disposition: form-data");
+            if (Line.Base
+                && CompareStrings(Line, Content, Content.WriteCur, RETURN_BOOL)
+                && (CurrentField = PushStruct(Arena, ts_form_field)) != NULL)
+            {
+                memset(CurrentField, 0, sizeof(ts_form_field));
+                usz LineCur = Content.WriteCur;
+                
+                // name="Field".
+                string FieldName = EatSubstring(Line, &LineCur, '\"', '\"');
+                if (FieldName.Base
+                    && FieldName.WriteCur <= U16_MAX)
+                {
+                    CurrentField->FieldName = FieldName.Base;
+                    CurrentField->FieldNameSize = (u16)FieldName.WriteCur;
+                    
+                    // If field is file, format is:
+                    //   [name="FieldName";filename="File.ext"].
+                    if (Line.Base[LineCur] == ';')
+                    {
+                        LineCur++;
+                        
+                        // filename="File.ext".
+                        string Filename = EatSubstring(Line, &LineCur, '\"', '\"');
+                        if (Filename.Base
+                            && Filename.WriteCur <= U16_MAX)
+                        {
+                            CurrentField->Filename = Filename.Base;
+                            CurrentField->FilenameSize = (u16)Filename.WriteCur;
+                        }
+                        else
+                        {
+                            FormIsValid = false;
+                        }
+                    }
+                    
+                    ParseStage = FormParse_SecondLine;
+                }
+                else
+                {
+                    FormIsValid = false;
+                }
+            }
+            else
+            {
+                FormIsValid = false;
+            }
+        }
+        
+        else if (ParseStage == FormParse_SecondLine)
+        {
+            Line = EatToken(Body, &ReadCur, '\n');
+            if (Line.Base)
+            {
+                // If line is not blank, it can only be Content-Type.
+                string Content = StringLit("Content-Type");
+                if (CompareStrings(Line, Content, Content.WriteCur, RETURN_BOOL))
+                {
+                    // Ignores Content-Type (it can later be retrieved from file ext).
+                    // Checks to see if file has encoding information, format is:
+                    //   [charset=Encoding].
+                    StripCLRF(Line);
+                    string Encoding = GetPartHeaderParam(Line, StringLit("charset"));
+                    if (Encoding.Base
+                        && Encoding.WriteCur <= U16_MAX)
+                    {
+                        CurrentField->Charset = Encoding.Base;
+                        CurrentField->CharsetSize = (u16)Encoding.WriteCur;
+                    }
+                    
+                    ParseStage = FormParse_ThirdLine;
+                }
+                
+                // Blank line points to beginning of data.
+                else if (Line.Base[0] == '\r'
+                         || Line.Base[0] == '\n')
+                {
+                    ParseStage = FormParse_Data;
+                }
+                else
+                {
+                    FormIsValid = false;
+                }
+            }
+            else
+            {
+                FormIsValid = false;
+            }
+        }
+        
+        else if (ParseStage == FormParse_ThirdLine)
+        {
+            Line = EatToken(Body, &ReadCur, '\n');
+            if (Line.Base)
+            {
+                // Third line can only be blank.
+                if (Line.Base[0] == '\r'
+                    || Line.Base[0] == '\n')
+                {
+                    ParseStage = FormParse_Data;
+                }
+                else
+                {
+                    FormIsValid = false;
+                }
+            }
+            else
+            {
+                FormIsValid = false;
+            }
+        }
+        
+        else if (ParseStage == FormParse_Data)
+        {
+            u8* RawData = (u8*)Body.Base + ReadCur;
+            usz DataEnd = FindFormBoundary(&Boundary, RawData, Body.WriteCur - ReadCur);
+            if (DataEnd != INVALID_IDX)
+            {
+                ReadCur += DataEnd + Boundary.Size;
+                CurrentField->Data = RawData;
+                CurrentField->DataLen = DataEnd;
+                
+                Form.FieldCount++;
+                if (Body.Base[ReadCur] == '-')
+                {
+                    ParseStage = FormParse_Complete;
+                }
+                else if (Body.Base[ReadCur] == '\r'
+                         || Body.Base[ReadCur] == '\n')
+                {
+                    JumpCLRF(Body.Base, ReadCur, Body.WriteCur);
+                    ParseStage = FormParse_FirstLine;
+                }
+                else
+                {
+                    FormIsValid = false;
+                }
+            }
+            else
+            {
+                FormIsValid = false;
+            }
+        }
+        
+        else if (ParseStage == FormParse_Complete)
+        {
+            break;
+        }
+        
+        else
+        {
+            FormIsValid = false;
+        }
+    }
+    
+    if (!FormIsValid)
+    {
+        Arena->WriteCur = ArenaStart;
+        return EmptyForm;
+    }
+    
+    if (Form.FieldCount >= FORM_INDEX_MIN_FIELDS)
+    {
+        BuildFormIndex(&Form, Arena);
+    }
+    
+    return Form;
+}
+
+external ts_form_field
+GetFormFieldByName(ts_multiform Form, char* TargetName)
+{
+    ts_form_field Result = {0};
+    
+    string Target = String(TargetName, strlen(TargetName), 0, EC_ASCII);
+    if (Form.Index)
+    {
+        usz Mask = Form.IndexSize - 1;
+        usz Slot = HashName(Target.Base, Target.WriteCur) & Mask;
+        while (Form.Index[Slot])
+        {
+            ts_form_field* Field = &Form.Fields[Form.Index[Slot] - 1];
+            string FieldName = String(Field->FieldName, Field->FieldNameSize, 0, EC_ASCII);
+            if (EqualStrings(FieldName, Target))
+            {
+                Result = *Field;
+                break;
+            }
+            Slot = (Slot + 1) & Mask;
+        }
+    }
+    else
+    {
+        for (usz Count = 0; Count < Form.FieldCount; Count++)
+        {
+            ts_form_field* Field = &Form.Fields[Count];
+            string FieldName = String(Field->FieldName, Field->FieldNameSize, 0, EC_ASCII);
+            if (EqualStrings(FieldName, Target))
+            {
+                Result = *Field;
+                break;
+            }
+        }
+    }
+    
+    return Result;
+}
+
+external ts_form_field
+GetFormFieldByIdx(ts_multiform Form, usz TargetIdx)
+{
+    ts_form_field Result = {0};
+    
+    if (TargetIdx < Form.FieldCount)
+    {
+        Result = Form.Fields[TargetIdx];
+    }
+    
+    return Result;
+}
+
+//================================
+// Streaming request body
+//================================
+
+typedef enum ts_form_stream_stage
+{
+    FormStream_Preamble,
+    FormStream_BoundaryEnd,
+    FormStream_FinalDash,
+    FormStream_PartHeader,
+    FormStream_Data,
+    FormStream_Epilogue,
+    FormStream_Error
+} ts_form_stream_stage;
+
+internal bool
+ParseFormPartHeader(ts_form_stream* Stream)
+{
+    ts_form_field Field = {0};
+    bool HasDisposition = false;
+    
+    string Header = String(Stream->PartHeader, Stream->PartHeaderSize, 0, EC_ASCII);
+    usz ReadCur = 0;
+    string Line = EatToken(Header, &ReadCur, '\n');
+    while (Line.Base && Line.WriteCur > 0)
+    {
+        StripCLRF(Line);
+        
+        string Disposition = StringLit("Content-Disposition: form-data");
+        string ContentType = StringLit("Content-Type:");
+        if (Line.WriteCur >= Disposition.WriteCur
+            && CompareStrings(Line, Disposition, Disposition.WriteCur, RETURN_BOOL))
+        {
+            string FieldName = GetPartHeaderParam(Line, StringLit("name"));
+            string Filename = GetPartHeaderParam(Line, StringLit("filename"));
+            if (!FieldName.Base
+                || FieldName.WriteCur > U16_MAX
+                || Filename.WriteCur > U16_MAX)
+            {
+                return false;
+            }
+            
+            Field.FieldName = FieldName.Base;
+            Field.FieldNameSize = (u16)FieldName.WriteCur;
+            Field.Filename = Filename.Base;
+            Field.FilenameSize = (u16)Filename.WriteCur;
+            HasDisposition = true;
+        }
+        else if (Line.WriteCur >= ContentType.WriteCur
+                 && CompareStrings(Line, ContentType, ContentType.WriteCur, RETURN_BOOL))
+        {
+            // Content-Type is ignored (it can later be retrieved from file ext),
+            // except for the charset.
+            string Charset = GetPartHeaderParam(Line, StringLit("charset"));
+            if (Charset.Base && Charset.WriteCur <= U16_MAX)
+            {
+                Field.Charset = Charset.Base;
+                Field.CharsetSize = (u16)Charset.WriteCur;
+            }
+        }
+        
+        Line = EatToken(Header, &ReadCur, '\n');
+    }
+    
+    Stream->Field = Field;
+    return HasDisposition;
+}
+
+external bool
+InitFormStream(ts_form_stream* Stream, ts_body Body)
+{
+    memset(Stream, 0, sizeof(ts_form_stream));
+    Stream->OutFile = INVALID_FILE;
+    Stream->Stage = FormStream_Error;
+    
+    string EntityType = String(Body.ContentType, Body.ContentTypeSize, 0, EC_ASCII);
+    if (!InitFormBoundary(&Stream->Boundary, EntityType))
+    {
+        return false;
+    }
+    
+    // The first delimiter in the body has no CRLF before it, so it is treated as
+    // if that part had already been matched.
+    
+    Stream->MatchSize = 2;
+    Stream->Stage = FormStream_Preamble;
+    
+    return true;
+}
+
+external ts_form_event
+ParseFormDataChunk(ts_form_stream* Stream, string Chunk, usz* ReadCur)
+{
+    while (*ReadCur < Chunk.WriteCur)
+    {
+        u8* Data = (u8*)Chunk.Base + *ReadCur;
+        usz Size = Chunk.WriteCur - *ReadCur;
+        
+        u8* FieldData = NULL;
+        usz FieldDataSize = 0;
+        
+        if (Stream->Stage == FormStream_Preamble
+            || Stream->Stage == FormStream_Data)
+        {
+            if (Stream->MatchSize)
+            {
+                // Continues matching the delimiter from the end of the last chunk.
+                usz Remaining = Stream->Boundary.Size - Stream->MatchSize;
+                usz CmpSize = Min(Size, Remaining);
+                if (memcmp(Data, Stream->Boundary.Delimiter + Stream->MatchSize, CmpSize) == 0)
+                {
+                    *ReadCur += CmpSize;
+                    Stream->MatchSize += (u16)CmpSize;
+                    if (Stream->MatchSize == Stream->Boundary.Size)
+                    {
+                        ts_form_stream_stage Previous = (ts_form_stream_stage)Stream->Stage;
+                        Stream->MatchSize = 0;
+                        Stream->Stage = FormStream_BoundaryEnd;
+                        if (Previous == FormStream_Data)
+                        {
+                            Stream->OutFile = INVALID_FILE;
+                            return FormEvent_FieldEnd;
+                        }
+                    }
+                    continue;
+                }
+                
+                // Bytes held back were not a delimiter after all, so they are data.
+                // Since they are a delimiter prefix, they can be taken from there.
+                FieldData = Stream->Boundary.Delimiter;
+                FieldDataSize = Stream->MatchSize;
+                Stream->MatchSize = 0;
+            }
+            else
+            {
+                usz DelimIdx = FindFormBoundary(&Stream->Boundary, Data, Size);
+                if (DelimIdx != INVALID_IDX)
+                {
+                    // Data before the delimiter is consumed now; the delimiter
+                    // itself on the next iteration, so that FieldEnd is its own event.
+                    if (DelimIdx == 0)
+                    {
+                        *ReadCur += Stream->Boundary.Size;
+                        
+                        ts_form_stream_stage Previous = (ts_form_stream_stage)Stream->Stage;
+                        Stream->Stage = FormStream_BoundaryEnd;
+                        if (Previous == FormStream_Data)
+                        {
+                            Stream->OutFile = INVALID_FILE;
+                            return FormEvent_FieldEnd;
+                        }
+                        continue;
+                    }
+                    FieldData = Data;
+                    FieldDataSize = DelimIdx;
+                    *ReadCur += DelimIdx;
+                }
+                else
+                {
+                    usz Partial = PartialFormBoundaryAtEnd(&Stream->Boundary, Data, Size);
+                    FieldData = Data;
+                    FieldDataSize = Size - Partial;
+                    Stream->MatchSize = (u16)Partial;
+                    *ReadCur += Size;
+                }
+            }
+            
+            if (Stream->Stage == FormStream_Data && FieldDataSize > 0)
+            {
+                if (Stream->OutFile != INVALID_FILE)
+                {
+                    buffer Src = Buffer(FieldData, FieldDataSize, 0);
+                    if (!WriteToFile(Stream->OutFile, Src, Stream->FieldSize))
+                    {
+                        Stream->Stage = FormStream_Error;
+                        return FormEvent_Error;
+                    }
+                    Stream->FieldSize += FieldDataSize;
+                }
+                else
+                {
+                    Stream->FieldSize += FieldDataSize;
+                    Stream->Field.Data = FieldData;
+                    Stream->Field.DataLen = FieldDataSize;
+                    return FormEvent_FieldData;
+                }
+            }
+        }
+        
+        else if (Stream->Stage == FormStream_BoundaryEnd)
+        {
+            // Delimiter is followed either by "--" (final boundary) or by optional
+            // whitespace and a CRLF (next part).
+            *ReadCur += 1;
+            switch (Data[0])
+            {
+                case '-': Stream->Stage = FormStream_FinalDash; break;
+                case ' ':
+                case '\t':
+                case '\r': break;
+                case '\n':
+                {
+                    Stream->PartHeaderSize = 0;
+                    Stream->Stage = FormStream_PartHeader;
+                } break;
+                default:
+                {
+                    Stream->Stage = FormStream_Error;
+                    return FormEvent_Error;
+                }
+            }
+        }
+        
+        else if (Stream->Stage == FormStream_FinalDash)
+        {
+            *ReadCur += 1;
+            if (Data[0] == '-')
+            {
+                Stream->Stage = FormStream_Epilogue;
+                return FormEvent_Complete;
+            }
+            Stream->Stage = FormStream_Error;
+            return FormEvent_Error;
+        }
+        
+        else if (Stream->Stage == FormStream_PartHeader)
+        {
+            // Part header is accumulated one line at a time, until the blank line.
+            string Search = String(Data, Size, 0, EC_ASCII);
+            usz LineEnd = CharInString('\n', Search, RETURN_IDX_FIND);
+            usz CopySize = (LineEnd == INVALID_IDX) ? Size : LineEnd + 1;
+            usz LineStart = Stream->PartHeaderSize;
+            
+            if (Stream->PartHeaderSize + CopySize > MAX_FORM_PART_HEADER_SIZE)
+            {
+                Stream->Stage = FormStream_Error;
+                return FormEvent_Error;
+            }
+            CopyData(Stream->PartHeader + Stream->PartHeaderSize,
+                     MAX_FORM_PART_HEADER_SIZE - Stream->PartHeaderSize, Data, CopySize);
+            Stream->PartHeaderSize += (u16)CopySize;
+            *ReadCur += CopySize;
+            
+            if (LineEnd != INVALID_IDX)
+            {
+                // Finds the start of the line just completed, as it may have
+                // begun in a previous chunk.
+                while (LineStart > 0 && Stream->PartHeader[LineStart-1] != '\n') LineStart--;
+                
+                u8 First = Stream->PartHeader[LineStart];
+                if (First == '\r' || First == '\n')
+                {
+                    if (!ParseFormPartHeader(Stream))
+                    {
+                        Stream->Stage = FormStream_Error;
+                        return FormEvent_Error;
+                    }
+                    Stream->FieldSize = 0;
+                    Stream->OutFile = INVALID_FILE;
+                    Stream->Stage = FormStream_Data;
+                    return FormEvent_FieldBegin;
+                }
+            }
+        }
+        
+        else if (Stream->Stage == FormStream_Epilogue)
+        {
+            *ReadCur = Chunk.WriteCur;
+        }
+        
+        else
+        {
+            return FormEvent_Error;
+        }
+    }
+    
+    return (Stream->Stage == FormStream_Error) ? FormEvent_Error : FormEvent_None;
+}
+
+//================================
+// Routing
+//================================
+
+internal u32
+HashRouteSegment(u32 Parent, char* Segment, usz SegmentSize)
+{
+    // FNV-1a, seeded with the parent node so equal segments under different
+    // nodes spread over the table.
+    u32 Hash = 2166136261u ^ (Parent * 2654435761u);
+    for (usz Idx = 0; Idx < SegmentSize; Idx++)
+    {
+        Hash = (Hash ^ (u8)Segment[Idx]) * 16777619u;
+    }
+    return Hash;
+}
+
+internal u32
+FindRouteEdge(ts_router* Router, u32 Parent, u32 Hash, char* Segment, usz SegmentSize)
+{
+    usz Slot = Hash & Router->EdgeMask;
+    while (Router->Edges[Slot].Child)
+    {
+        ts_route_edge* Edge = &Router->Edges[Slot];
+        if (Edge->Hash == Hash
+            && Edge->Parent == Parent
+            && Edge->SegmentSize == SegmentSize
+            && memcmp(Edge->Segment, Segment, SegmentSize) == 0)
+        {
+            return Edge->Child;
+        }
+        Slot = (Slot + 1) & Router->EdgeMask;
+    }
+    return 0;
+}
+
+internal u32
+NewRouteNode(ts_router* Router)
+{
+    if (Router->NodeCount == Router->MaxNodes)
+    {
+        return 0;
+    }
+    u32 Result = (u32)Router->NodeCount++;
+    memset(&Router->Nodes[Result], 0, sizeof(ts_route_node));
+    return Result;
+}
+
+external bool
+InitRouter(ts_router* Router, buffer* Arena, usz MaxNodes)
+{
+    memset(Router, 0, sizeof(ts_router));
+    
+    // Edge table is kept at most half full.
+    usz EdgeCount = 16;
+    while (EdgeCount < MaxNodes * 2) EdgeCount <<= 1;
+    
+    usz ArenaStart = Arena->WriteCur;
+    Router->Nodes = PushArray(Arena, MaxNodes + 1, ts_route_node);
+    Router->Edges = PushArray(Arena, EdgeCount, ts_route_edge);
+    if (!Router->Nodes || !Router->Edges)
+    {
+        Arena->WriteCur = ArenaStart;
+        return false;
+    }
+    memset(Router->Edges, 0, EdgeCount * sizeof(ts_route_edge));
+    
+    Router->Arena = Arena;
+    Router->MaxNodes = MaxNodes + 1; // Root is node 0.
+    Router->EdgeMask = EdgeCount - 1;
+    NewRouteNode(Router);
+    
+    return true;
+}
+
+external bool
+AddRoute(ts_router* Router, u8 Verb, char* Pattern, void* Handler)
+{
+    if (Verb == HttpVerb_Unknown || Verb >= ROUTE_VERB_COUNT)
+    {
+        return false;
+    }
+    
+    string Path = String(Pattern, strlen(Pattern), 0, EC_ASCII);
+    u32 Node = 0;
+    u32 ParamCount = 0;
+    usz ReadCur = 0;
+    while (ReadCur < Path.WriteCur)
+    {
+        if (Path.Base[ReadCur] == '/')
+        {
+            ReadCur++;
+            continue;
+        }
+        
+        string Segment = EatToken(Path, &ReadCur, '/');
+        if (!Segment.Base)
+        {
+            Segment = String(Path.Base + ReadCur, Path.WriteCur - ReadCur, 0, EC_ASCII);
+            ReadCur = Path.WriteCur;
+        }
+        
+        ts_route_node* Current = &Router->Nodes[Node];
+        if ((Segment.Base[0] == '*' || Segment.Base[0] == ':')
+            && ++ParamCount > MAX_ROUTE_PARAMS)
+        {
+            return false; // Could never be matched.
+        }
+        
+        if (Segment.Base[0] == '*')
+        {
+            // Wildcard takes the rest of the path, so it must be last.
+            if (ReadCur < Path.WriteCur) return false;
+            if (!Current->WildcardChild
+                && !(Current->WildcardChild = NewRouteNode(Router))) return false;
+            Node = Current->WildcardChild;
+        }
+        else if (Segment.Base[0] == ':')
+        {
+            if (!Current->ParamChild
+                && !(Current->ParamChild = NewRouteNode(Router))) return false;
+            Node = Current->ParamChild;
+        }
+        else
+        {
+            u32 Hash = HashRouteSegment(Node, Segment.Base, Segment.WriteCur);
+            u32 Child = FindRouteEdge(Router, Node, Hash, Segment.Base, Segment.WriteCur);
+            if (!Child)
+            {
+                char* SegmentCopy = PushArray(Router->Arena, Segment.WriteCur, char);
+                if (!SegmentCopy || !(Child = NewRouteNode(Router)))
+                {
+                    return false;
+                }
+                CopyData(SegmentCopy, Segment.WriteCur, Segment.Base, Segment.WriteCur);
+                
+                usz Slot = Hash & Router->EdgeMask;
+                while (Router->Edges[Slot].Child) Slot = (Slot + 1) & Router->EdgeMask;
+                
+                ts_route_edge* Edge = &Router->Edges[Slot];
+                Edge->Segment = SegmentCopy;
+                Edge->SegmentSize = (u32)Segment.WriteCur;
+                Edge->Hash = Hash;
+                Edge->Parent = Node;
+                Edge->Child = Child;
+            }
+            Node = Child;
+        }
+    }
+    
+    ts_route_node* Target = &Router->Nodes[Node];
+    if (Target->Handlers[Verb])
+    {
+        return false; // Route already exists.
+    }
+    Target->Handlers[Verb] = Handler;
+    return true;
+}
+
+external ts_route_result
+MatchRoute(ts_router* Router, ts_request* Request, ts_route_match* Match)
+{
+    Match->Handler = NULL;
+    Match->ParamCount = 0;
+    
+    // Each segment is hashed while it's scanned, and looked up in the edge table,
+    // so the path is only gone through once.
+    
+    char* Path = Request->Base + Request->UriOffset;
+    usz PathSize = Request->PathSize;
+    u32 Node = 0;
+    usz ReadCur = 0;
+    while (ReadCur < PathSize)
+    {
+        if (Path[ReadCur] == '/')
+        {
+            ReadCur++;
+            continue;
+        }
+        
+        usz SegmentStart = ReadCur;
+        u32 Hash = 2166136261u ^ (Node * 2654435761u);
+        while (ReadCur < PathSize && Path[ReadCur] != '/')
+        {
+            Hash = (Hash ^ (u8)Path[ReadCur]) * 16777619u;
+            ReadCur++;
+        }
+        char* Segment = Path + SegmentStart;
+        usz SegmentSize = ReadCur - SegmentStart;
+        
+        ts_route_node* Current = &Router->Nodes[Node];
+        u32 Child = FindRouteEdge(Router, Node, Hash, Segment, SegmentSize);
+        if (Child)
+        {
+            Node = Child;
+        }
+        else if (Current->ParamChild
+                 && Match->ParamCount < MAX_ROUTE_PARAMS)
+        {
+            Match->Params[Match->ParamCount++] = String(Segment, SegmentSize, 0, EC_UTF8);
+            Node = Current->ParamChild;
+        }
+        else if (Current->WildcardChild
+                 && Match->ParamCount < MAX_ROUTE_PARAMS)
+        {
+            Match->Params[Match->ParamCount++] = String(Segment, PathSize - SegmentStart,
+                                                        0, EC_UTF8);
+            Node = Current->WildcardChild;
+            break;
+        }
+        else
+        {
+            return Route_NotFound;
+        }
+    }
+    
+    ts_route_node* Found = &Router->Nodes[Node];
+    if (Request->Verb < ROUTE_VERB_COUNT && Found->Handlers[Request->Verb])
+    {
+        Match->Handler = Found->Handlers[Request->Verb];
+        return Route_Found;
+    }
+    
+    // An empty rest of the path still matches a wildcard (e.g. "/static/*"
+    // matches "/static").
+    if (ReadCur >= PathSize
+        && Found->WildcardChild
+        && Match->ParamCount < MAX_ROUTE_PARAMS)
+    {
+        ts_route_node* Wildcard = &Router->Nodes[Found->WildcardChild];
+        if (Request->Verb < ROUTE_VERB_COUNT && Wildcard->Handlers[Request->Verb])
+        {
+            Match->Params[Match->ParamCount++] = String(Path + PathSize, 0, 0, EC_UTF8);
+            Match->Handler = Wildcard->Handlers[Request->Verb];
+            return Route_Found;
+        }
+        Found = Wildcard;
+    }
+    
+    for (usz Verb = 0; Verb < ROUTE_VERB_COUNT; Verb++)
+    {
+        if (Found->Handlers[Verb])
+        {
+            return Route_MethodNotAllowed;
+        }
+    }
+    return Route_NotFound;
+}
+
+//================================
+// Static files
+//================================
+
+#if defined(TT_LINUX)
+
+internal void
+LockSpin(volatile i32* Lock)
+{
+#if defined(_MSC_VER)
+    while (_InterlockedExchange((volatile long*)Lock, 1))
+#else
+    while (__atomic_exchange_n(Lock, 1, __ATOMIC_ACQUIRE))
+#endif
+    {
+#if defined(__SSE2__) || defined(_M_X64)
+        _mm_pause();
+#endif
+    }
+}
+
+internal void
+UnlockSpin(volatile i32* Lock)
+{
+#if defined(_MSC_VER)
+    _InterlockedExchange((volatile long*)Lock, 0);
+#else
+    __atomic_store_n(Lock, 0, __ATOMIC_RELEASE);
+#endif
+}
+
+typedef struct ts_mime_type
+{
+    char* Ext;
+    char* Type;
+} ts_mime_type;
+
+global ts_mime_type gMimeTypes[] = {
+    { "html",  "text/html; charset=utf-8" },
+    { "htm",   "text/html; charset=utf-8" },
+    { "css",   "text/css; charset=utf-8" },
+    { "js",    "text/javascript; charset=utf-8" },
+    { "mjs",   "text/javascript; charset=utf-8" },
+    { "json",  "application/json" },
+    { "txt",   "text/plain; charset=utf-8" },
+    { "xml",   "application/xml" },
+    { "svg",   "image/svg+xml" },
+    { "png",   "image/png" },
+    { "jpg",   "image/jpeg" },
+    { "jpeg",  "image/jpeg" },
+    { "gif",   "image/gif" },
+    { "webp",  "image/webp" },
+    { "avif",  "image/avif" },
+    { "ico",   "image/x-icon" },
+    { "woff",  "font/woff" },
+    { "woff2", "font/woff2" },
+    { "ttf",   "font/ttf" },
+    { "otf",   "font/otf" },
+    { "pdf",   "application/pdf" },
+    { "wasm",  "application/wasm" },
+    { "mp3",   "audio/mpeg" },
+    { "mp4",   "video/mp4" },
+    { "webm",  "video/webm" }
+};
+
+// Suffix of the compressed versions of a file, indexed by encoding. Deflate has
+// no common suffix, so it isn't looked for.
+global char* gEncodingSuffixes[] = { NULL, ".gz", NULL, ".br" };
+
+internal char*
+GetMimeType(char* Path, usz PathSize)
+{
+    usz ExtStart = PathSize;
+    while (ExtStart > 0 && Path[ExtStart-1] != '.' && Path[ExtStart-1] != '/') ExtStart--;
+    if (ExtStart > 0 && Path[ExtStart-1] == '.')
+    {
+        string Ext = String(Path + ExtStart, PathSize - ExtStart, 0, EC_ASCII);
+        for (usz Idx = 0; Idx < sizeof(gMimeTypes) / sizeof(ts_mime_type); Idx++)
+        {
+            usz TypeExtSize = strlen(gMimeTypes[Idx].Ext);
+            if (TypeExtSize == Ext.WriteCur
+                && CompareStrings(Ext, StringLit(gMimeTypes[Idx].Ext), TypeExtSize, RETURN_BOOL))
+            {
+                return gMimeTypes[Idx].Type;
+            }
+        }
+    }
+    return "application/octet-stream";
+}
+
+internal void
+AppendHexToArray(u64 Value, char* Dst, usz* WriteCur)
+{
+    char Digits[16];
+    usz Count = 0;
+    do
+    {
+        Digits[Count++] = "0123456789abcdef"[Value & 0xF];
+        Value >>= 4;
+    } while (Value);
+    while (Count) Dst[(*WriteCur)++] = Digits[--Count];
+}
+
+internal void
+UnlinkStaticFile(ts_static_files* Files, u32 FileIdx)
+{
+    // Takes the entry out of the index and the LRU list, so no new request finds it.
+    
+    ts_static_file* File = &Files->Files[FileIdx];
+    u32* Link = &Files->Index[File->Hash & Files->IndexMask];
+    while (*Link != FileIdx) Link = &Files->Files[*Link].NextInBucket;
+    *Link = File->NextInBucket;
+    
+    if (File->Prev) Files->Files[File->Prev].Next = File->Next;
+    else Files->LruHead = File->Next;
+    if (File->Next) Files->Files[File->Next].Prev = File->Prev;
+    else Files->LruTail = File->Prev;
+    
+    File->IsStale = 1;
+}
+
+internal void
+LinkStaticFileWatch(ts_static_files* Files, u32 FileIdx)
+{
+    // Files are chained by watch descriptor too, so an event finds its files
+    // without a scan.
+    
+    ts_static_file* File = &Files->Files[FileIdx];
+    if (File->Watch >= 0)
+    {
+        u32* Bucket = &Files->WatchIndex[(u32)File->Watch & Files->IndexMask];
+        File->NextInWatch = *Bucket;
+        *Bucket = FileIdx;
+    }
+}
+
+internal void
+UnlinkStaticFileWatch(ts_static_files* Files, u32 FileIdx)
+{
+    ts_static_file* File = &Files->Files[FileIdx];
+    if (File->Watch >= 0)
+    {
+        u32* Link = &Files->WatchIndex[(u32)File->Watch & Files->IndexMask];
+        while (*Link != FileIdx) Link = &Files->Files[*Link].NextInWatch;
+        *Link = File->NextInWatch;
+    }
+}
+
+internal void
+FreeStaticFile(ts_static_files* Files, u32 FileIdx)
+{
+    ts_static_file* File = &Files->Files[FileIdx];
+    close(File->Handle);
+    
+    // Paths to the same file (e.g. hard links) share the watch, so it's only
+    // removed with the last of them, which are all in the same bucket.
+    UnlinkStaticFileWatch(Files, FileIdx);
+    if (File->Watch >= 0)
+    {
+        u32 OtherIdx = Files->WatchIndex[(u32)File->Watch & Files->IndexMask];
+        while (OtherIdx && Files->Files[OtherIdx].Watch != File->Watch)
+        {
+            OtherIdx = Files->Files[OtherIdx].NextInWatch;
+        }
+        if (!OtherIdx) inotify_rm_watch(Files->Watcher, File->Watch);
+    }
+    if (File->Memory.Base)
+    {
+        Files->MemoryUsed -= File->Memory.Size;
+        FreeMemory(&File->Memory);
+    }
+    File->Handle = INVALID_FILE;
+    File->Next = Files->FreeList;
+    Files->FreeList = FileIdx;
+}
+
+internal ts_static_file*
+FindStaticFile(ts_static_files* Files, char* Path, usz PathSize, u8 Encoding, u32 Hash)
+{
+    // Called with the lock held. A found file is moved to the front of the LRU
+    // list, and gets a reference.
+    
+    u32 FileIdx = Files->Index[Hash & Files->IndexMask];
+    while (FileIdx)
+    {
+        ts_static_file* File = &Files->Files[FileIdx];
+        if (File->Hash == Hash
+            && File->Encoding == Encoding
+            && File->PathSize == PathSize
+            && memcmp(File->Path, Path, PathSize) == 0)
+        {
+            if (File->Prev)
+            {
+                Files->Files[File->Prev].Next = File->Next;
+                if (File->Next) Files->Files[File->Next].Prev = File->Prev;
+                else Files->LruTail = File->Prev;
+                
+                File->Prev = 0;
+                File->Next = Files->LruHead;
+                Files->Files[Files->LruHead].Prev = FileIdx;
+                Files->LruHead = FileIdx;
+            }
+            File->RefCount++;
+            return File;
+        }
+        FileIdx = File->NextInBucket;
+    }
+    return NULL;
+}
+
+internal void
+CheckStaticFileChanges(ts_static_files* Files)
+{
+    // Drains the inotify queue, and unlinks each file changed since the last check.
+    // Called with the lock held.
+    
+    char Events[4096] __attribute__((aligned(__alignof__(struct inotify_event))));
+    ssize_t Size;
+    while ((Size = read(Files->Watcher, Events, sizeof(Events))) > 0)
+    {
+        for (char* Ptr = Events; Ptr < Events + Size;
+             Ptr += sizeof(struct inotify_event) + ((struct inotify_event*)Ptr)->len)
+        {
+            struct inotify_event* Event = (struct inotify_event*)Ptr;
+            u32 FileIdx = Files->WatchIndex[(u32)Event->wd & Files->IndexMask];
+            while (FileIdx)
+            {
+                ts_static_file* File = &Files->Files[FileIdx];
+                u32 NextIdx = File->NextInWatch;
+                if (File->Watch == Event->wd)
+                {
+                    // Kernel drops the watch by itself when the file is gone.
+                    if (Event->mask & IN_IGNORED)
+                    {
+                        UnlinkStaticFileWatch(Files, FileIdx);
+                        File->Watch = -1;
+                    }
+                    if (!File->IsStale)
+                    {
+                        UnlinkStaticFile(Files, FileIdx);
+                        if (!File->RefCount) FreeStaticFile(Files, FileIdx);
+                    }
+                }
+                FileIdx = NextIdx;
+            }
+        }
+    }
+}
+
+external bool
+InitStaticFiles(ts_static_files* Files, char* RootDir, usz MaxFiles, buffer* Arena)
+{
+    memset(Files, 0, sizeof(ts_static_files));
+    
+    usz RootSize = strlen(RootDir);
+    while (RootSize > 0 && RootDir[RootSize-1] == '/') RootSize--;
+    if (RootSize >= MAX_STATIC_PATH_SIZE / 2)
+    {
+        return false;
+    }
+    CopyData(Files->Root, sizeof(Files->Root), RootDir, RootSize);
+    Files->RootSize = (u16)RootSize;
+    
+    usz IndexSize = 16;
+    while (IndexSize < MaxFiles) IndexSize <<= 1;
+    
+    usz ArenaStart = Arena->WriteCur;
+    Files->Files = PushArray(Arena, MaxFiles + 1, ts_static_file); // Entry 0 is unused.
+    Files->Index = PushArray(Arena, IndexSize, u32);
+    Files->WatchIndex = PushArray(Arena, IndexSize, u32);
+    if (!Files->Files || !Files->Index || !Files->WatchIndex)
+    {
+        Arena->WriteCur = ArenaStart;
+        return false;
+    }
+    memset(Files->Files, 0, (MaxFiles + 1) * sizeof(ts_static_file));
+    memset(Files->Index, 0, IndexSize * sizeof(u32));
+    memset(Files->WatchIndex, 0, IndexSize * sizeof(u32));
+    Files->IndexMask = IndexSize - 1;
+    Files->MaxFiles = (u32)MaxFiles;
+    
+    for (u32 Idx = (u32)MaxFiles; Idx >= 1; Idx--)
+    {
+        Files->Files[Idx].Handle = INVALID_FILE;
+        Files->Files[Idx].Next = Files->FreeList;
+        Files->FreeList = Idx;
+    }
+    
+    int Watcher = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+    if (Watcher == -1)
+    {
+        Arena->WriteCur = ArenaStart;
+        return false;
+    }
+    Files->Watcher = (file)Watcher;
+    return true;
+}
+
+external void
+KeepStaticFilesInMemory(ts_static_files* Files, usz MaxFileSize, usz MaxTotalSize,
+                        _opt char* ServerName)
+{
+    Files->MaxMemoryFileSize = MaxFileSize;
+    Files->MaxMemorySize = MaxTotalSize;
+    Files->ServerName = ServerName;
+}
+
+internal buffer
+LoadStaticFileToMemory(ts_static_files* Files, file Handle, ts_response* Shape,
+                       u16* HeaderSize, u16* DateOffset)
+{
+    // Header is crafted for the most common response (200 on keep-alive HTTP/1.1),
+    // and kept right before the contents.
+    
+    buffer Result = {0};
+    u64 Size = Shape->PayloadSize;
+    
+    char HeaderMem[Kilobyte(1)];
+    string Header = String(HeaderMem, 0, sizeof(HeaderMem), EC_ASCII);
+    Shape->StatusCode = 200;
+    Shape->Version = HttpVersion_11;
+    Shape->KeepAlive = 1;
+    
+    usz HeaderDateOffset = 0;
+    AppendHeaderStart(Shape, &Header, Files->ServerName, &HeaderDateOffset);
+    AppendIntToString(Size, &Header);
+    AppendHeaderEnd(Shape, &Header, true);
+    
+    buffer Memory = GetMemory(Header.WriteCur + Size, 0, MEM_WRITE);
+    if (Memory.Base)
+    {
+        CopyData(Memory.Base, Memory.Size, Header.Base, Header.WriteCur);
+        
+        u64 ReadSize = 0;
+        while (ReadSize < Size)
+        {
+            ssize_t BytesRead = pread(Handle, Memory.Base + Header.WriteCur + ReadSize,
+                                      Size - ReadSize, (off_t)ReadSize);
+            if (BytesRead <= 0) break;
+            ReadSize += (u64)BytesRead;
+        }
+        if (ReadSize == Size)
+        {
+            Memory.WriteCur = Header.WriteCur + Size;
+            *HeaderSize = (u16)Header.WriteCur;
+            *DateOffset = (u16)HeaderDateOffset;
+            return Memory;
+        }
+        FreeMemory(&Memory);
+    }
+    
+    return Result;
+}
+
+internal bool
+MakeRoomInMemory(ts_static_files* Files, usz Size)
+{
+    // Drops the contents of the least recently used files not being sent, until
+    // [Size] fits. Called with the lock held.
+    
+    u32 FileIdx = Files->LruTail;
+    while (Files->MemoryUsed + Size > Files->MaxMemorySize && FileIdx)
+    {
+        ts_static_file* File = &Files->Files[FileIdx];
+        if (File->Memory.Base && !File->RefCount)
+        {
+            Files->MemoryUsed -= File->Memory.Size;
+            FreeMemory(&File->Memory);
+        }
+        FileIdx = File->Prev;
+    }
+    return (Files->MemoryUsed + Size <= Files->MaxMemorySize);
+}
+
+external void
+CloseStaticFiles(ts_static_files* Files)
+{
+    for (u32 Idx = 1; Idx <= Files->MaxFiles; Idx++)
+    {
+        if (Files->Files[Idx].Handle != INVALID_FILE)
+        {
+            close(Files->Files[Idx].Handle);
+        }
+        if (Files->Files[Idx].Memory.Base)
+        {
+            FreeMemory(&Files->Files[Idx].Memory);
+        }
+    }
+    close(Files->Watcher);
+    Files->Files = NULL;
+    Files->MaxFiles = 0;
+}
+
+internal ts_static_file*
+GetStaticFileByPath(ts_static_files* Files, char* Path, usz PathSize, u8 Encoding)
+{
+    // A path can be cached once per encoding, since "file.js.gz" is served as is
+    // when asked for by name, but with Content-Encoding when negotiated.
+    u32 Hash = HashName(Path, PathSize) ^ (u32)Encoding;
+    
+    //====================
+    // Lookup in cache.
+    //====================
+    
+    LockSpin(&Files->Lock);
+    
+    i64 Now = (i64)time(NULL);
+    if (Now != Files->LastCheck)
+    {
+        CheckStaticFileChanges(Files);
+        Files->LastCheck = Now;
+    }
+    
+    ts_static_file* Result = FindStaticFile(Files, Path, PathSize, Encoding, Hash);
+    if (Result)
+    {
+        UnlockSpin(&Files->Lock);
+        return Result;
+    }
+    
+    UnlockSpin(&Files->Lock);
+    
+    //===============================
+    // Not cached, open it outside
+    // the lock and add it.
+    //===============================
+    
+    int Handle = open(Path, O_RDONLY | O_CLOEXEC);
+    struct stat Stat;
+    if (Handle == -1)
+    {
+        return NULL;
+    }
+    if (fstat(Handle, &Stat) != 0
+        || !S_ISREG(Stat.st_mode))
+    {
+        close(Handle);
+        return NULL;
+    }
+    int Watch = inotify_add_watch(Files->Watcher, Path, IN_MODIFY | IN_ATTRIB | IN_CLOSE_WRITE
+                                  | IN_MOVE_SELF | IN_DELETE_SELF);
+    
+    // Compressed versions have the type of the original file, and only the original
+    // checks which versions it has.
+    
+    u8 Encodings = 0;
+    char* MimeType;
+    if (Encoding != HttpEncoding_Identity)
+    {
+        MimeType = GetMimeType(Path, PathSize - strlen(gEncodingSuffixes[Encoding]));
+    }
+    else
+    {
+        MimeType = GetMimeType(Path, PathSize);
+        for (u8 Idx = HttpEncoding_Gzip; Idx < HttpEncoding_Count; Idx++)
+        {
+            char* Suffix = gEncodingSuffixes[Idx];
+            if (!Suffix) continue;
+            
+            struct stat EncodedStat;
+            CopyData(Path + PathSize, MAX_STATIC_PATH_SIZE - PathSize, Suffix, strlen(Suffix) + 1);
+            if (stat(Path, &EncodedStat) == 0 && S_ISREG(EncodedStat.st_mode))
+            {
+                Encodings |= (1 << Idx);
+            }
+        }
+        Path[PathSize] = '\0';
+    }
+    u64 Size = (u64)Stat.st_size;
+    u64 ModifiedTime = (u64)Stat.st_mtime;
+    
+    // ETag is "mtime-size" in hex.
+    char ETag[STATIC_ETAG_SIZE];
+    usz ETagSize = 0;
+    ETag[ETagSize++] = '"';
+    AppendHexToArray(ModifiedTime, ETag, &ETagSize);
+    ETag[ETagSize++] = '-';
+    AppendHexToArray(Size, ETag, &ETagSize);
+    ETag[ETagSize++] = '"';
+    
+    buffer Memory = {0};
+    u16 HeaderSize = 0, DateOffset = 0;
+    if (Files->MaxMemoryFileSize && Size <= Files->MaxMemoryFileSize)
+    {
+        ts_response Shape = {0};
+        Shape.PayloadSize = Size;
+        Shape.MimeType = MimeType;
+        Shape.ETag = String(ETag, ETagSize, 0, EC_ASCII);
+        Shape.LastModified = ModifiedTime;
+        Shape.AcceptRanges = 1;
+        Shape.Encoding = Encoding;
+        Shape.VaryEncoding = (Encodings != 0);
+        Memory = LoadStaticFileToMemory(Files, (file)Handle, &Shape, &HeaderSize, &DateOffset);
+    }
+    
+    LockSpin(&Files->Lock);
+    
+    // Another thread may have added the same file in the meantime.
+    Result = FindStaticFile(Files, Path, PathSize, Encoding, Hash);
+    if (Result)
+    {
+        UnlockSpin(&Files->Lock);
+        close(Handle);
+        if (Memory.Base) FreeMemory(&Memory);
+        return Result;
+    }
+    
+    // Evicts the least recently used file not being sent, if no slot is free.
+    if (!Files->FreeList)
+    {
+        u32 Victim = Files->LruTail;
+        while (Victim && Files->Files[Victim].RefCount) Victim = Files->Files[Victim].Prev;
+        if (!Victim)
+        {
+            UnlockSpin(&Files->Lock);
+            close(Handle);
+            if (Memory.Base) FreeMemory(&Memory);
+            return NULL;
+        }
+        UnlinkStaticFile(Files, Victim);
+        FreeStaticFile(Files, Victim);
+    }
+    
+    u32 FileIdx = Files->FreeList;
+    ts_static_file* File = &Files->Files[FileIdx];
+    Files->FreeList = File->Next;
+    
+    File->Handle = (file)Handle;
+    File->Size = Size;
+    File->ModifiedTime = ModifiedTime;
+    File->MimeType = MimeType;
+    File->Encoding = Encoding;
+    File->Encodings = Encodings;
+    File->Watch = Watch;
+    LinkStaticFileWatch(Files, FileIdx);
+    File->Hash = Hash;
+    File->RefCount = 1;
+    File->IsStale = 0;
+    File->PathSize = (u16)PathSize;
+    CopyData(File->Path, sizeof(File->Path), Path, PathSize);
+    
+    CopyData(File->ETag, sizeof(File->ETag), ETag, ETagSize);
+    File->ETagSize = (u8)ETagSize;
+    
+    if (Memory.Base && !MakeRoomInMemory(Files, Memory.Size))
+    {
+        FreeMemory(&Memory);
+    }
+    File->Memory = Memory;
+    File->HeaderSize = HeaderSize;
+    File->DateOffset = DateOffset;
+    if (Memory.Base)
+    {
+        Files->MemoryUsed += Memory.Size;
+    }
+    
+    File->NextInBucket = Files->Index[Hash & Files->IndexMask];
+    Files->Index[Hash & Files->IndexMask] = FileIdx;
+    File->Prev = 0;
+    File->Next = Files->LruHead;
+    if (Files->LruHead) Files->Files[Files->LruHead].Prev = FileIdx;
+    else Files->LruTail = FileIdx;
+    Files->LruHead = FileIdx;
+    
+    UnlockSpin(&Files->Lock);
+    return File;
+}
+
+external ts_static_file*
+GetStaticFile(ts_static_files* Files, ts_request* Request)
+{
+    // Full path is root + request path, plus "index.html" for directories.
+    
+    char Path[MAX_STATIC_PATH_SIZE];
+    string RequestPath = String(Request->Base + Request->UriOffset, Request->PathSize, 0, EC_UTF8);
+    string IndexFile = StringLit("index.html");
+    bool IsDir = (RequestPath.WriteCur == 0 || RequestPath.Base[RequestPath.WriteCur-1] == '/');
+    usz PathSize = Files->RootSize + RequestPath.WriteCur + (IsDir ? IndexFile.WriteCur : 0);
+    if (PathSize + MAX_ENCODING_SUFFIX_SIZE >= MAX_STATIC_PATH_SIZE
+        || CharInString('\0', RequestPath, RETURN_BOOL))
+    {
+        return NULL;
+    }
+    
+    CopyData(Path, sizeof(Path), Files->Root, Files->RootSize);
+    CopyData(Path + Files->RootSize, sizeof(Path) - Files->RootSize,
+             RequestPath.Base, RequestPath.WriteCur);
+    if (IsDir)
+    {
+        CopyData(Path + PathSize - IndexFile.WriteCur, IndexFile.WriteCur,
+                 IndexFile.Base, IndexFile.WriteCur);
+    }
+    Path[PathSize] = '\0';
+    
+    // If the client takes a compressed version that's next to the file (e.g.
+    // "file.js.gz"), that one is sent instead.
+    
+    ts_static_file* Result = GetStaticFileByPath(Files, Path, PathSize, HttpEncoding_Identity);
+    if (Result && Result->Encodings)
+    {
+        u8 Encoding = NegotiateHttpEncoding(Request, Result->Encodings);
+        if (Encoding != HttpEncoding_Identity)
+        {
+            usz SuffixSize = strlen(gEncodingSuffixes[Encoding]);
+            CopyData(Path + PathSize, sizeof(Path) - PathSize, gEncodingSuffixes[Encoding], SuffixSize + 1);
+            ts_static_file* Encoded = GetStaticFileByPath(Files, Path, PathSize + SuffixSize, Encoding);
+            if (Encoded)
+            {
+                ReleaseStaticFile(Files, Result);
+                Result = Encoded;
+            }
+        }
     }
     
-    Result.Data = Ptr + Parser->DataOffset;
-    Result.DataLen = Parser->DataLen;
-    
     return Result;
 }
 
-external ts_form_field
-GetFormFieldByName(ts_multiform Form, char* TargetName)
+external string
+CraftStaticFileResponse(ts_static_files* Files, ts_static_file* File, _opt ts_request* Request,
+                        ts_response* Response, string* Header)
 {
-    ts_form_field Result = {0};
+    usz Start = Header->WriteCur;
+    Response->Payload = NULL;
+    Response->PayloadSize = File->Size;
+    Response->MimeType = File->MimeType;
+    Response->PayloadIsFile = 1;
+    Response->ETag = String(File->ETag, File->ETagSize, 0, EC_ASCII);
+    Response->LastModified = File->ModifiedTime;
+    Response->AcceptRanges = 1;
+    Response->Encoding = File->Encoding;
+    Response->VaryEncoding = (File->Encodings != 0);
+    Response->RangeStart = 0;
+    Response->TotalSize = File->Size;
     
-    string Target = String(TargetName, strlen(TargetName), 0, EC_ASCII);
-    ts_form_field_parser* TargetField = (ts_form_field_parser*)Form.FirstField;
-    for (usz Count = 0; Count < Form.FieldCount; Count++)
+    if (Request && Response->StatusCode == 200)
     {
-        char* Ptr = (char*)TargetField;
-        string FieldName = String(Ptr + TargetField->FieldNameOffset,
-                                  TargetField->FieldNameLen, 0, EC_ASCII);
-        
-        if (EqualStrings(FieldName, Target))
+        u64 RangeStart = 0, RangeSize = 0;
+        if (IsNotModified(Request, Response->ETag, File->ModifiedTime))
         {
-            Result = OrganizeFieldInfo(TargetField);
-            break;
+            Response->StatusCode = 304;
+            Response->PayloadSize = 0;
         }
+        else switch (ParseHttpRange(Request, File->Size, Response->ETag, File->ModifiedTime,
+                                    &RangeStart, &RangeSize))
+        {
+            case HttpRange_OK:
+            {
+                Response->StatusCode = 206;
+                Response->RangeStart = RangeStart;
+                Response->PayloadSize = RangeSize;
+            } break;
+            
+            case HttpRange_NotSatisfiable:
+            {
+                Response->StatusCode = 416;
+                Response->PayloadSize = 0;
+            } break;
+            
+            default: break;
+        }
+    }
+    
+    if (File->Memory.Base
+        && Response->StatusCode == 200
+        && Response->Version == HttpVersion_11
+        && Response->KeepAlive
+        && Response->CookiesSize == 0
+        && Header->Size - Start >= File->HeaderSize)
+    {
+        AppendStringToString(String((char*)File->Memory.Base, File->HeaderSize, 0, EC_ASCII), Header);
         
-        usz NextFieldOffset = (TargetField->FieldNameOffset + TargetField->FieldNameLen +
-                               TargetField->FilenameOffset + TargetField->FilenameLen +
-                               TargetField->CharsetOffset + TargetField->CharsetLen +
-                               TargetField->DataOffset + TargetField->DataLen +
-                               TargetField->NextFieldOffset);
-        TargetField = (ts_form_field_parser*)(Ptr + NextFieldOffset);
+        string DateLine = GetDateLine();
+        usz DatePrefixSize = sizeof("Date: ") - 1;
+        usz DateSize = DateLine.WriteCur - DatePrefixSize - 2;
+        CopyData(Header->Base + Start + File->DateOffset, DateSize,
+                 DateLine.Base + DatePrefixSize, DateSize);
+        Response->HeaderSize = (u16)(Header->WriteCur - Start);
+    }
+    else
+    {
+        CraftHttpResponseHeader(Response, Header, Files->ServerName);
     }
     
+    string Result = { 0, 0, 0, EC_ASCII };
+    if (File->Memory.Base && Response->PayloadSize)
+    {
+        Result = String((char*)File->Memory.Base + File->HeaderSize + Response->RangeStart,
+                        Response->PayloadSize, 0, EC_ASCII);
+    }
     return Result;
 }
 
-external ts_form_field
-GetFormFieldByIdx(ts_multiform Form, usz TargetIdx)
+external void
+ReleaseStaticFile(ts_static_files* Files, ts_static_file* File)
 {
-    ts_form_field Result = {0};
-    
-    if (TargetIdx < Form.FieldCount)
+    LockSpin(&Files->Lock);
+    if (--File->RefCount == 0 && File->IsStale)
     {
-        ts_form_field_parser* TargetField = (ts_form_field_parser*)Form.FirstField;
-        for (usz Count = 0; Count < TargetIdx; Count++)
-        {
-            usz NextFieldOffset = (TargetField->FieldNameOffset + TargetField->FieldNameLen +
-                                   TargetField->FilenameOffset + TargetField->FilenameLen +
-                                   TargetField->CharsetOffset + TargetField->CharsetLen +
-                                   TargetField->DataOffset + TargetField->DataLen +
-                                   TargetField->NextFieldOffset);
-            TargetField = (ts_form_field_parser*)((u8*)TargetField + NextFieldOffset);
-        }
-        Result = OrganizeFieldInfo(TargetField);
+        FreeStaticFile(Files, (u32)(File - Files->Files));
     }
-    
-    return Result;
+    UnlockSpin(&Files->Lock);
 }
 
+#endif // TT_LINUX
+
 //================================
 // Response
 //================================
@@ -732,10 +2868,10 @@ FormatTimeIMF(datetime TimeFormat, string* Dst)
         AppendStringToString(StringLit(" "), Dst);
         if (TimeFormat.Hour < 10) AppendStringToString(StringLit("0"), Dst);
         AppendIntToString(TimeFormat.Hour, Dst);
-        AppendStringToString(StringLit(" "), Dst);
+        AppendStringToString(StringLit(":"), Dst);
         if (TimeFormat.Minute < 10) AppendStringToString(StringLit("0"), Dst);
         AppendIntToString(TimeFormat.Minute, Dst);
-        AppendStringToString(StringLit(" "), Dst);
+        AppendStringToString(StringLit(":"), Dst);
         if (TimeFormat.Second < 10) AppendStringToString(StringLit("0"), Dst);
         AppendIntToString(TimeFormat.Second, Dst);
         AppendStringToString(StringLit(" GMT"), Dst);
@@ -746,8 +2882,166 @@ FormatTimeIMF(datetime TimeFormat, string* Dst)
     return Result;
 }
 
-external void
-CraftHttpResponseHeader(ts_response* Response, string* Header, _opt char* ServerName)
+// Status lines are kept ready for HTTP/1.1, indexed by status code. Each class
+// of codes (1xx, 2xx...) starts at the offset in gStatusClassStart.
+
+typedef struct ts_status_line
+{
+    char* Line;
+    usz Size;
+} ts_status_line;
+
+#define HTTP_STATUS_LINE(Status) { (char*)"HTTP/1.1 " Status "\r\n", sizeof("HTTP/1.1 " Status "\r\n") - 1 }
+#define HTTP_NO_STATUS_LINE { 0, 0 }
+
+global const u8 gStatusClassStart[] = { 0, 2, 9, 18, 70, 82 };
+
+global const ts_status_line gStatusLines[] =
+{
+    // 1xx
+    HTTP_STATUS_LINE("100 Continue"),
+    HTTP_STATUS_LINE("101 Switching Protocol"),
+    // 2xx
+    HTTP_STATUS_LINE("200 OK"),
+    HTTP_STATUS_LINE("201 Created"),
+    HTTP_STATUS_LINE("202 Accepted"),
+    HTTP_STATUS_LINE("203 Non-Authoritative Information"),
+    HTTP_STATUS_LINE("204 No Content"),
+    HTTP_STATUS_LINE("205 Reset Content"),
+    HTTP_STATUS_LINE("206 Partial Content"),
+    // 3xx
+    HTTP_STATUS_LINE("300 Multiple Choices"),
+    HTTP_STATUS_LINE("301 Moved Permanently"),
+    HTTP_STATUS_LINE("302 Found"),
+    HTTP_STATUS_LINE("303 See Other"),
+    HTTP_STATUS_LINE("304 Not Modified"),
+    HTTP_STATUS_LINE("305 Use Proxy"),
+    HTTP_NO_STATUS_LINE,
+    HTTP_STATUS_LINE("307 Temporary Redirect"),
+    HTTP_STATUS_LINE("308 Permanent Redirect"),
+    // 4xx
+    HTTP_STATUS_LINE("400 Bad Request"),
+    HTTP_STATUS_LINE("401 Unauthorized"),
+    HTTP_STATUS_LINE("402 Payment Required"),
+    HTTP_STATUS_LINE("403 Forbidden"),
+    HTTP_STATUS_LINE("404 Not Found"),
+    HTTP_STATUS_LINE("405 Method Not Allowed"),
+    HTTP_STATUS_LINE("406 Not Acceptable"),
+    HTTP_STATUS_LINE("407 Proxy Authorization Required"),
+    HTTP_STATUS_LINE("408 Request Timeout"),
+    HTTP_STATUS_LINE("409 Conflict"),
+    HTTP_STATUS_LINE("410 Gone"),
+    HTTP_STATUS_LINE("411 Length Required"),
+    HTTP_STATUS_LINE("412 Precondition Failed"),
+    HTTP_STATUS_LINE("413 Payload Too Large"),
+    HTTP_STATUS_LINE("414 URI Too Long"),
+    HTTP_STATUS_LINE("415 Unsupported Media Type"),
+    HTTP_STATUS_LINE("416 Range Not Satisfiable"),
+    HTTP_STATUS_LINE("417 Expectation Failed"),
+    HTTP_STATUS_LINE("418 I'm a Teapot"),
+    HTTP_NO_STATUS_LINE,
+    HTTP_NO_STATUS_LINE,
+    HTTP_STATUS_LINE("421 Misdirected Request"),
+    HTTP_NO_STATUS_LINE,
+    HTTP_NO_STATUS_LINE,
+    HTTP_NO_STATUS_LINE,
+    HTTP_STATUS_LINE("425 Too Early"),
+    HTTP_STATUS_LINE("426 Upgrade Required"),
+    HTTP_NO_STATUS_LINE,
+    HTTP_STATUS_LINE("428 Precondition Required"),
+    HTTP_STATUS_LINE("429 Too Many Requests"),
+    HTTP_NO_STATUS_LINE,
+    HTTP_STATUS_LINE("431 Request Header Fields Too Large"),
+    HTTP_NO_STATUS_LINE,
+    HTTP_NO_STATUS_LINE,
+    HTTP_NO_STATUS_LINE,
+    HTTP_NO_STATUS_LINE,
+    HTTP_NO_STATUS_LINE,
+    HTTP_NO_STATUS_LINE,
+    HTTP_NO_STATUS_LINE,
+    HTTP_NO_STATUS_LINE,
+    HTTP_STATUS_LINE("440 Login Timeout"),
+    HTTP_NO_STATUS_LINE,
+    HTTP_NO_STATUS_LINE,
+    HTTP_NO_STATUS_LINE,
+    HTTP_NO_STATUS_LINE,
+    HTTP_NO_STATUS_LINE,
+    HTTP_NO_STATUS_LINE,
+    HTTP_NO_STATUS_LINE,
+    HTTP_NO_STATUS_LINE,
+    HTTP_NO_STATUS_LINE,
+    HTTP_NO_STATUS_LINE,
+    HTTP_STATUS_LINE("451 Unavailable for Legal Reasons"),
+    // 5xx
+    HTTP_STATUS_LINE("500 Internal Server Error"),
+    HTTP_STATUS_LINE("501 Not Implemented"),
+    HTTP_STATUS_LINE("502 Bad Gateway"),
+    HTTP_STATUS_LINE("503 Service Unavailable"),
+    HTTP_STATUS_LINE("504 Gateway Timeout"),
+    HTTP_STATUS_LINE("505 HTTP Version Not Supported"),
+    HTTP_NO_STATUS_LINE,
+    HTTP_STATUS_LINE("507 Insufficient Storage"),
+    HTTP_NO_STATUS_LINE,
+    HTTP_NO_STATUS_LINE,
+    HTTP_STATUS_LINE("510 Not Extended"),
+    HTTP_STATUS_LINE("511 Network Authentication Required"),
+};
+
+internal ts_status_line
+GetStatusLine(u16 StatusCode)
+{
+    u16 Class = StatusCode / 100;
+    if (Class >= 1 && Class <= 5)
+    {
+        usz Idx = gStatusClassStart[Class-1] + (StatusCode % 100);
+        if (Idx < gStatusClassStart[Class] && gStatusLines[Idx].Size)
+        {
+            return gStatusLines[Idx];
+        }
+    }
+    
+    // Codes without a line of their own are sent as 500 Internal Server Error.
+    return gStatusLines[gStatusClassStart[4]];
+}
+
+// The Date line only changes once a second, so each thread keeps its own copy
+// and formats it again only when the second changes.
+
+#if defined(_MSC_VER)
+# define TS_THREAD_LOCAL __declspec(thread)
+#else
+# define TS_THREAD_LOCAL __thread
+#endif
+
+typedef struct ts_date_cache
+{
+    time_t Second;
+    char Line[IMF_DATE_LENGTH + 8]; // "Date: " + date + CRLF.
+    usz Size;
+} ts_date_cache;
+
+global TS_THREAD_LOCAL ts_date_cache tDateCache;
+
+internal string
+GetDateLine(void)
+{
+    time_t Now = time(NULL);
+    if (Now != tDateCache.Second || !tDateCache.Size)
+    {
+        string Line = String(tDateCache.Line, 0, sizeof(tDateCache.Line), EC_ASCII);
+        AppendStringToString(StringLit("Date: "), &Line);
+        FormatTimeIMF(CurrentSystemTime(), &Line);
+        AppendStringToString(StringLit("\r\n"), &Line);
+        
+        tDateCache.Second = Now;
+        tDateCache.Size = Line.WriteCur;
+    }
+    return String(tDateCache.Line, tDateCache.Size, 0, EC_ASCII);
+}
+
+internal void
+AppendHeaderStart(ts_response* Response, string* Header, char* ServerName,
+                  _opt usz* DateOffset)
 {
     string LineBreak = StringLit("\r\n");
     if (!ServerName)
@@ -759,113 +3053,126 @@ CraftHttpResponseHeader(ts_response* Response, string* Header, _opt char* Server
     // Mandatory fields.
     //===================
     
-    string Version = {0};
-    switch (Response->Version)
-    {
-        case HttpVersion_09: Version = StringLit("HTTP/0.9 "); break;
-        case HttpVersion_10: Version = StringLit("HTTP/1.0 "); break;
-        default:
-        case HttpVersion_11: Version = StringLit("HTTP/1.1 "); break;
-        case HttpVersion_20: Version = StringLit("HTTP/2.0 "); break;
-    }
-    AppendStringToString(Version, Header);
-    
-    string StatusCode = {0};
-    switch (Response->StatusCode)
-    {
-        case 100: StatusCode = StringLit("100 Continue"); break;
-        case 101: StatusCode = StringLit("101 Switching Protocol"); break;
-        case 200: StatusCode = StringLit("200 OK"); break;
-        case 201: StatusCode = StringLit("201 Created"); break;
-        case 202: StatusCode = StringLit("202 Accepted"); break;
-        case 203: StatusCode = StringLit("203 Non-Authoritative Information"); break;
-        case 204: StatusCode = StringLit("204 No Content"); break;
-        case 205: StatusCode = StringLit("205 Reset Content"); break;
-        case 300: StatusCode = StringLit("300 Multiple Choices"); break;
-        case 301: StatusCode = StringLit("301 Moved Permanently"); break;
-        case 302: StatusCode = StringLit("302 Found"); break;
-        case 303: StatusCode = StringLit("303 See Other"); break;
-        case 304: StatusCode = StringLit("304 No Modified"); break;
-        case 305: StatusCode = StringLit("305 Use Proxy"); break;
-        case 307: StatusCode = StringLit("307 Temporary Redirect"); break;
-        case 308: StatusCode = StringLit("308 Permanent Redirect"); break;
-        case 400: StatusCode = StringLit("400 Bad Request"); break;
-        case 401: StatusCode = StringLit("401 Unauthorized"); break;
-        case 402: StatusCode = StringLit("402 Payment Required"); break;
-        case 403: StatusCode = StringLit("403 Forbidden"); break;
-        case 404: StatusCode = StringLit("404 Not Found"); break;
-        case 405: StatusCode = StringLit("405 Method Not Allowed"); break;
-        case 406: StatusCode = StringLit("406 Not Acceptable"); break;
-        case 407: StatusCode = StringLit("407 Proxy Authorization Required"); break;
-        case 408: StatusCode = StringLit("408 Request Timeout"); break;
-        case 409: StatusCode = StringLit("409 Conflict"); break;
-        case 410: StatusCode = StringLit("410 Gone"); break;
-        case 411: StatusCode = StringLit("411 Length Required"); break;
-        case 412: StatusCode = StringLit("412 Precondition Failed"); break;
-        case 413: StatusCode = StringLit("413 Payload Too Large"); break;
-        case 414: StatusCode = StringLit("414 URI Too Long"); break;
-        case 415: StatusCode = StringLit("415 Unsupported Media Type"); break;
-        case 416: StatusCode = StringLit("416 Range Not Satisfiable"); break;
-        case 417: StatusCode = StringLit("417 Expectation Failed"); break;
-        case 418: StatusCode = StringLit("418 I'm a Teapot"); break;
-        case 421: StatusCode = StringLit("421 Misdirected Request"); break;
-        case 425: StatusCode = StringLit("425 Too Early"); break;
-        case 426: StatusCode = StringLit("426 Update Required"); break;
-        case 428: StatusCode = StringLit("428 Precondition Required"); break;
-        case 429: StatusCode = StringLit("429 Too Many Requests"); break;
-        case 431: StatusCode = StringLit("431 Request Header Fields Too Large"); break;
-        case 440: StatusCode = StringLit("440 Login Timeout"); break;
-        case 451: StatusCode = StringLit("451 Unavailable for Legal Reasons"); break;
-        case 500: StatusCode = StringLit("500 Internal Server Error"); break;
-        case 501: StatusCode = StringLit("501 Not Implemented"); break;
-        case 502: StatusCode = StringLit("502 Bad Gateway"); break;
-        case 503: StatusCode = StringLit("503 Service Unavailable"); break;
-        case 504: StatusCode = StringLit("504 Gateway Timeout"); break;
-        case 505: StatusCode = StringLit("505 HTTP Version Not Supported"); break;
-        case 507: StatusCode = StringLit("507 Insufficient Storage"); break;
-        case 510: StatusCode = StringLit("510 Not Extended"); break;
-        case 511: StatusCode = StringLit("511 Network Authentication Required"); break;
-        
-        default:
-        {
-            // TODO: Free Payload and Cookies, and return generic 500 error header.
-        }
-    }
-    
-    AppendStringToString(StatusCode, Header);
-    AppendStringToString(LineBreak, Header);
+    // Status line is copied as is for HTTP/1.1, and has its version patched
+    // otherwise ("HTTP/1.1" -> "HTTP/1.0", "HTTP/0.9" or "HTTP/2.0").
     
-    AppendStringToString(StringLit("Date: "), Header);
-    FormatTimeIMF(CurrentSystemTime(), Header);
-    AppendStringToString(LineBreak, Header);
+    ts_status_line StatusLine = GetStatusLine(Response->StatusCode);
+    usz VersionOffset = Header->WriteCur;
+    AppendStringToString(String(StatusLine.Line, StatusLine.Size, 0, EC_ASCII), Header);
+    if (Header->WriteCur == VersionOffset + StatusLine.Size)
+    {
+        // Only patched if the line made it in whole.
+        char* Version = Header->Base + VersionOffset;
+        switch (Response->Version)
+        {
+            case HttpVersion_09: Version[5] = '0'; Version[7] = '9'; break;
+            case HttpVersion_10: Version[7] = '0'; break;
+            case HttpVersion_20: Version[5] = '2'; Version[7] = '0'; break;
+        }
+    }
+    
+    string DateLine = GetDateLine();
+    if (DateOffset)
+    {
+        *DateOffset = Header->WriteCur + sizeof("Date: ") - 1;
+    }
+    AppendStringToString(DateLine, Header);
     
     AppendStringToString(StringLit("Server: "), Header);
     AppendArrayToString(ServerName, Header);
     AppendStringToString(LineBreak, Header);
     
-    AppendStringToString(StringLit("Access-Control-Allow-Origin: *"), Header);
-    AppendStringToString(LineBreak, Header);
-    
-    AppendStringToString(StringLit("Connection: "), Header);
-    string Connection = Response->KeepAlive ? StringLit("keep-alive") : StringLit("close");
+    string Connection = (Response->KeepAlive
+                         ? StringLit("Access-Control-Allow-Origin: *\r\n"
+                                     "Connection: keep-alive\r\n")
+                         : StringLit("Access-Control-Allow-Origin: *\r\n"
+                                     "Connection: close\r\n"));
     AppendStringToString(Connection, Header);
-    AppendStringToString(LineBreak, Header);
     
-    AppendStringToString(StringLit("Content-Length: "), Header);
-    AppendIntToString(Response->PayloadSize, Header);
-    AppendStringToString(LineBreak, Header);
+    // A 304 has no body, and must not send a length other than the one of the
+    // full response, so it sends none.
+    if (Response->StatusCode != 304)
+    {
+        AppendStringToString(StringLit("Content-Length: "), Header);
+    }
+}
+
+internal void
+AppendHeaderEnd(ts_response* Response, string* Header, bool HasContentType)
+{
+    string LineBreak = StringLit("\r\n");
+    if (Response->StatusCode != 304)
+    {
+        AppendStringToString(LineBreak, Header);
+    }
     
     //==================
     // Optional fields.
     //==================
     
-    if (Response->PayloadSize > 0)
+    if (HasContentType)
     {
         AppendStringToString(StringLit("Content-Type: "), Header);
         AppendArrayToString(Response->MimeType, Header);
         AppendStringToString(LineBreak, Header);
     }
     
+    if (Response->Encoding != HttpEncoding_Identity
+        && Response->Encoding < HttpEncoding_Count)
+    {
+        string Encodings[] = { StringLit("Content-Encoding: gzip\r\n"),
+                               StringLit("Content-Encoding: deflate\r\n"),
+                               StringLit("Content-Encoding: br\r\n") };
+        AppendStringToString(Encodings[Response->Encoding - 1], Header);
+    }
+    if (Response->Encoding != HttpEncoding_Identity || Response->VaryEncoding)
+    {
+        AppendStringToString(StringLit("Vary: Accept-Encoding\r\n"), Header);
+    }
+    
+    if (Response->ETag.WriteCur)
+    {
+        AppendStringToString(StringLit("ETag: "), Header);
+        AppendStringToString(Response->ETag, Header);
+        AppendStringToString(LineBreak, Header);
+    }
+    
+    if (Response->Allow.WriteCur)
+    {
+        AppendStringToString(StringLit("Allow: "), Header);
+        AppendStringToString(Response->Allow, Header);
+        AppendStringToString(LineBreak, Header);
+    }
+    
+    if (Response->LastModified)
+    {
+        AppendStringToString(StringLit("Last-Modified: "), Header);
+        FormatTimeIMF(DatetimeFromUnixTime(Response->LastModified), Header);
+        AppendStringToString(LineBreak, Header);
+    }
+    
+    if (Response->AcceptRanges)
+    {
+        AppendStringToString(StringLit("Accept-Ranges: bytes\r\n"), Header);
+    }
+    
+    if (Response->StatusCode == 206)
+    {
+        AppendStringToString(StringLit("Content-Range: bytes "), Header);
+        AppendIntToString(Response->RangeStart, Header);
+        AppendStringToString(StringLit("-"), Header);
+        AppendIntToString(Response->RangeStart + Response->PayloadSize - 1, Header);
+        AppendStringToString(StringLit("/"), Header);
+        AppendIntToString(Response->TotalSize, Header);
+        AppendStringToString(LineBreak, Header);
+    }
+    else if (Response->StatusCode == 416)
+    {
+        AppendStringToString(StringLit("Content-Range: bytes */"), Header);
+        AppendIntToString(Response->TotalSize, Header);
+        AppendStringToString(LineBreak, Header);
+    }
+    
     if (Response->CookiesSize == 0)
     {
         // If there are cookies to be sent, final newline goes in cookies buffer,
@@ -873,6 +3180,354 @@ CraftHttpResponseHeader(ts_response* Response, string* Header, _opt char* Server
         
         AppendStringToString(LineBreak, Header);
     }
+}
+
+external void
+CraftHttpResponseHeader(ts_response* Response, string* Header, _opt char* ServerName)
+{
+    AppendHeaderStart(Response, Header, ServerName, NULL);
+    if (Response->StatusCode != 304)
+    {
+        AppendIntToString(Response->PayloadSize, Header);
+    }
+    AppendHeaderEnd(Response, Header, Response->PayloadSize > 0);
     
     Response->HeaderSize = Header->WriteCur;
 }
+
+external bool
+CompileHttpResponse(ts_response* Shape, _opt char* ServerName, buffer* Arena,
+                    ts_response_template* Template)
+{
+    // Header is crafted as usual, minus the Content-Length value. Its offset is
+    // kept, as well as the offset of the date, so both can be written per request.
+    
+    char HeaderMem[Kilobyte(1)];
+    string Header = String(HeaderMem, 0, sizeof(HeaderMem), EC_ASCII);
+    
+    usz DateOffset = 0;
+    AppendHeaderStart(Shape, &Header, ServerName, &DateOffset);
+    usz LengthOffset = Header.WriteCur;
+    AppendHeaderEnd(Shape, &Header, Shape->MimeType != NULL);
+    
+    char* Base = PushArray(Arena, Header.WriteCur, char);
+    if (!Base)
+    {
+        return false;
+    }
+    CopyData(Base, Header.WriteCur, Header.Base, Header.WriteCur);
+    
+    Template->Base = Base;
+    Template->Size = (u16)Header.WriteCur;
+    Template->DateOffset = (u16)DateOffset;
+    Template->LengthOffset = (u16)LengthOffset;
+    Template->NoLength = (Shape->StatusCode == 304);
+    return true;
+}
+
+external void
+CraftHttpResponseFromTemplate(ts_response_template* Template, usz PayloadSize,
+                              string* Header)
+{
+    usz Start = Header->WriteCur;
+    AppendStringToString(String(Template->Base, Template->LengthOffset, 0, EC_ASCII), Header);
+    
+    string DateLine = GetDateLine();
+    usz DatePrefixSize = sizeof("Date: ") - 1;
+    usz DateSize = DateLine.WriteCur - DatePrefixSize - 2;
+    CopyData(Header->Base + Start + Template->DateOffset, DateSize,
+             DateLine.Base + DatePrefixSize, DateSize);
+    
+    if (!Template->NoLength)
+    {
+        AppendIntToString(PayloadSize, Header);
+    }
+    AppendStringToString(String(Template->Base + Template->LengthOffset,
+                                Template->Size - Template->LengthOffset, 0, EC_ASCII), Header);
+}
+
+external string
+CompileHttpFullResponse(ts_response* Response, _opt char* ServerName, buffer* Arena)
+{
+    string Result = { 0, 0, 0, EC_ASCII };
+    
+    if (!Response->PayloadIsFile
+        && Response->CookiesSize == 0)
+    {
+        char HeaderMem[Kilobyte(1)];
+        string Header = String(HeaderMem, 0, sizeof(HeaderMem), EC_ASCII);
+        CraftHttpResponseHeader(Response, &Header, ServerName);
+        
+        // The buffer is shared by all requests, so it can't have a date that would
+        // need patching. The Date line is cut from the header.
+        
+        ts_status_line StatusLine = GetStatusLine(Response->StatusCode);
+        string DateLine = GetDateLine();
+        usz AfterDate = StatusLine.Size + DateLine.WriteCur;
+        usz HeaderSize = Header.WriteCur - DateLine.WriteCur;
+        
+        usz TotalSize = HeaderSize + Response->PayloadSize;
+        char* Base = PushArray(Arena, TotalSize, char);
+        if (Base)
+        {
+            CopyData(Base, TotalSize, Header.Base, StatusLine.Size);
+            CopyData(Base + StatusLine.Size, TotalSize - StatusLine.Size,
+                     Header.Base + AfterDate, Header.WriteCur - AfterDate);
+            CopyData(Base + HeaderSize, Response->PayloadSize,
+                     Response->Payload, Response->PayloadSize);
+            
+            Result = String(Base, TotalSize, TotalSize, EC_ASCII);
+        }
+    }
+    
+    return Result;
+}
+
+internal usz
+CountDigits(u64 Value)
+{
+    usz Result = 1;
+    while (Value >= 10)
+    {
+        Value /= 10;
+        Result++;
+    }
+    return Result;
+}
+
+internal bool
+IsCookieFieldValid(string Field, bool IsName)
+{
+    // As RFC 6265 asks, no field may have control characters, ';' or
+    // whitespace, which would end the attribute, or the header line with it.
+    // Names are tokens, so they can't be empty, nor have '='.
+    if (IsName && !Field.WriteCur)
+    {
+        return false;
+    }
+    for (usz Idx = 0; Idx < Field.WriteCur; Idx++)
+    {
+        u8 Char = (u8)Field.Base[Idx];
+        if (Char <= ' ' || Char >= 0x7F || Char == ';' || (IsName && Char == '='))
+        {
+            return false;
+        }
+    }
+    return true;
+}
+
+internal bool
+IsCookieValid(ts_cookie* Cookie)
+{
+    return (IsCookieFieldValid(Cookie->Name, true)
+            && IsCookieFieldValid(Cookie->Value, false)
+            && (!(Cookie->AttrFlags & CookieAttr_Domain)
+                || IsCookieFieldValid(Cookie->Domain, false))
+            && (!(Cookie->AttrFlags & CookieAttr_Path)
+                || IsCookieFieldValid(Cookie->Path, false)));
+}
+
+internal usz
+GetCookieSize(ts_cookie* Cookie)
+{
+    usz Result = sizeof("Set-Cookie: =\r\n") - 1 + Cookie->Name.WriteCur + Cookie->Value.WriteCur;
+    u32 Flags = Cookie->AttrFlags;
+    
+    if (Flags & CookieAttr_ExpDate) Result += sizeof("; Expires=") - 1 + IMF_DATE_LENGTH - 1;
+    if (Flags & CookieAttr_MaxAge) Result += sizeof("; Max-Age=") - 1 + CountDigits(Cookie->MaxAge);
+    if (Flags & CookieAttr_Domain) Result += sizeof("; Domain=") - 1 + Cookie->Domain.WriteCur;
+    if (Flags & CookieAttr_Path) Result += sizeof("; Path=") - 1 + Cookie->Path.WriteCur;
+    if (Flags & CookieAttr_Secure) Result += sizeof("; Secure") - 1;
+    if (Flags & CookieAttr_HttpOnly) Result += sizeof("; HttpOnly") - 1;
+    if (Flags & CookieAttr_SameSiteStrict) Result += sizeof("; SameSite=Strict") - 1;
+    else if (Flags & CookieAttr_SameSiteLax) Result += sizeof("; SameSite=Lax") - 1;
+    else if (Flags & CookieAttr_SameSiteNone) Result += sizeof("; SameSite=None") - 1;
+    
+    return Result;
+}
+
+external bool
+CraftHttpCookies(_opt ts_response* Response, ts_cookie* Cookies, usz CookieCount,
+                 string* Header)
+{
+    // If the header already ends on the blank line, cookies go before it.
+    
+    usz WriteCur = Header->WriteCur;
+    bool HasBlankLine = (WriteCur >= 4
+                         && Header->Base[WriteCur-4] == '\r' && Header->Base[WriteCur-3] == '\n'
+                         && Header->Base[WriteCur-2] == '\r' && Header->Base[WriteCur-1] == '\n');
+    if (HasBlankLine)
+    {
+        WriteCur -= 2;
+    }
+    
+    usz TotalSize = 2; // Blank line.
+    for (usz Idx = 0; Idx < CookieCount; Idx++)
+    {
+        if (!IsCookieValid(&Cookies[Idx]))
+        {
+            return false;
+        }
+        TotalSize += GetCookieSize(&Cookies[Idx]);
+    }
+    if (WriteCur + TotalSize > Header->Size)
+    {
+        return false;
+    }
+    Header->WriteCur = WriteCur;
+    
+    for (usz Idx = 0; Idx < CookieCount; Idx++)
+    {
+        ts_cookie* Cookie = &Cookies[Idx];
+        u32 Flags = Cookie->AttrFlags;
+        
+        AppendStringToString(StringLit("Set-Cookie: "), Header);
+        AppendStringToString(Cookie->Name, Header);
+        AppendStringToString(StringLit("="), Header);
+        AppendStringToString(Cookie->Value, Header);
+        
+        if (Flags & CookieAttr_ExpDate)
+        {
+            AppendStringToString(StringLit("; Expires="), Header);
+            FormatTimeIMF(Cookie->ExpDate, Header);
+        }
+        if (Flags & CookieAttr_MaxAge)
+        {
+            AppendStringToString(StringLit("; Max-Age="), Header);
+            AppendIntToString(Cookie->MaxAge, Header);
+        }
+        if (Flags & CookieAttr_Domain)
+        {
+            AppendStringToString(StringLit("; Domain="), Header);
+            AppendStringToString(Cookie->Domain, Header);
+        }
+        if (Flags & CookieAttr_Path)
+        {
+            AppendStringToString(StringLit("; Path="), Header);
+            AppendStringToString(Cookie->Path, Header);
+        }
+        if (Flags & CookieAttr_Secure) AppendStringToString(StringLit("; Secure"), Header);
+        if (Flags & CookieAttr_HttpOnly) AppendStringToString(StringLit("; HttpOnly"), Header);
+        if (Flags & CookieAttr_SameSiteStrict) AppendStringToString(StringLit("; SameSite=Strict"), Header);
+        else if (Flags & CookieAttr_SameSiteLax) AppendStringToString(StringLit("; SameSite=Lax"), Header);
+        else if (Flags & CookieAttr_SameSiteNone) AppendStringToString(StringLit("; SameSite=None"), Header);
+        
+        AppendStringToString(StringLit("\r\n"), Header);
+    }
+    AppendStringToString(StringLit("\r\n"), Header);
+    
+    if (Response)
+    {
+        Response->HeaderSize = (u16)Header->WriteCur;
+        Response->Cookies = NULL;
+        Response->CookiesSize = 0;
+    }
+    
+    return true;
+}
+
+//================================
+// Compression
+//================================
+
+#if defined(TINYSERVER_USE_ZLIB)
+
+// Each thread keeps its compressor state and output buffer, reset and reused
+// for each payload, so nothing is allocated per request once warmed up.
+
+typedef struct ts_compressor
+{
+    z_stream Streams[2]; // Gzip and deflate, as they have different headers.
+    bool IsInit[2];
+    buffer Output;
+} ts_compressor;
+
+global TS_THREAD_LOCAL ts_compressor tCompressor;
+
+#endif
+
+internal bool
+IsCompressibleType(char* MimeType)
+{
+    if (!MimeType) return false;
+    
+    string Type = String(MimeType, strlen(MimeType), 0, EC_ASCII);
+    string Compressible[] = { StringLit("text/"), StringLit("application/json"),
+                              StringLit("application/javascript"), StringLit("application/xml"),
+                              StringLit("image/svg+xml"), StringLit("application/wasm") };
+    for (usz Idx = 0; Idx < sizeof(Compressible) / sizeof(string); Idx++)
+    {
+        if (Type.WriteCur >= Compressible[Idx].WriteCur
+            && CompareStrings(Type, Compressible[Idx], Compressible[Idx].WriteCur, RETURN_BOOL))
+        {
+            return true;
+        }
+    }
+    return false;
+}
+
+external bool
+CompressHttpPayload(ts_response* Response, u8 Encoding)
+{
+    if (Response->PayloadIsFile
+        || Response->PayloadSize < MIN_COMPRESS_SIZE
+        || Response->Encoding != HttpEncoding_Identity
+        || !IsCompressibleType(Response->MimeType))
+    {
+        return false;
+    }
+    
+#if defined(TINYSERVER_USE_ZLIB)
+    if (Encoding != HttpEncoding_Gzip && Encoding != HttpEncoding_Deflate)
+    {
+        return false;
+    }
+    
+    usz StreamIdx = (Encoding == HttpEncoding_Gzip) ? 0 : 1;
+    z_stream* Stream = &tCompressor.Streams[StreamIdx];
+    if (!tCompressor.IsInit[StreamIdx])
+    {
+        int WindowBits = (Encoding == HttpEncoding_Gzip) ? 15 + 16 : 15;
+        if (deflateInit2(Stream, COMPRESS_LEVEL, Z_DEFLATED, WindowBits, 8,
+                         Z_DEFAULT_STRATEGY) != Z_OK)
+        {
+            return false;
+        }
+        tCompressor.IsInit[StreamIdx] = true;
+    }
+    else
+    {
+        deflateReset(Stream);
+    }
+    
+    // Output buffer only grows, and is sized for the worst case so the whole
+    // payload goes through in one call.
+    usz OutputSize = deflateBound(Stream, (uLong)Response->PayloadSize);
+    if (tCompressor.Output.Size < OutputSize)
+    {
+        if (tCompressor.Output.Base) FreeMemory(&tCompressor.Output);
+        tCompressor.Output = GetMemory(OutputSize, 0, MEM_WRITE);
+        if (!tCompressor.Output.Base)
+        {
+            return false;
+        }
+    }
+    
+    Stream->next_in = (Bytef*)Response->Payload;
+    Stream->avail_in = (uInt)Response->PayloadSize;
+    Stream->next_out = (Bytef*)tCompressor.Output.Base;
+    Stream->avail_out = (uInt)tCompressor.Output.Size;
+    if (deflate(Stream, Z_FINISH) != Z_STREAM_END
+        || Stream->total_out >= Response->PayloadSize)
+    {
+        return false;
+    }
+    
+    Response->Payload = (char*)tCompressor.Output.Base;
+    Response->PayloadSize = Stream->total_out;
+    Response->Encoding = Encoding;
+    return true;
+#else
+    return false;
+#endif
+}
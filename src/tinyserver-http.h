@@ -15,13 +15,22 @@
 //   4. If result is HttpParse_BodyIncomplete, the difference between
 //      [.TotalSize] and [.Received] in ts_request_body object shows how
 //      much else to recv.
+//   5. For "multipart/form-data" bodies too large to keep in memory, call
+//      InitFormStream() and feed each received chunk to ParseFormDataChunk().
+//   6. To dispatch the request, add all routes with AddRoute() at startup,
+//      and call MatchRoute() once the header is parsed.
+//   7. To serve files from a directory, call InitStaticFiles() at startup,
+//      and GetStaticFile() with the parsed request. Small files can be
+//      kept in memory with KeepStaticFilesInMemory(). Linux only, as changes
+//      to files are picked up with inotify.
 //
 // Sending outbound data:
 //   1. Create a ts_response object, fill its [.StatusCode], [.Version] and
 //      [.KeepAlive] members with the appropriate info.
-//   2. If response sends cookies, craft the cookies in a separate memory
-//      buffer and fill [.Cookies] and [.CookiesSize] members of ts_response
-//      with the info. Cookies must end on blank /r/n line.
+//   2. If response sends cookies, either call CraftHttpCookies() after
+//      step #5, or craft the cookies in a separate memory buffer and fill
+//      [.Cookies] and [.CookiesSize] members of ts_response with the info.
+//      Cookies must end on blank /r/n line.
 //   3. If response sends payload, write the payload in a separate memory
 //      buffer and fill [.Payload] and [.PayloadSize] members of ts_response
 //      with the info. [.PayloadType] must point to a zero-terminated array
@@ -31,6 +40,10 @@
 //   5. Call CraftHttpResponseHeader().
 //   6. Send the response header buffer, cookies buffer, and payload buffer
 //      in that exact order, if there are cookies and payload to be sent.
+//   7. For responses that share the same shape, CompileHttpResponse() can be
+//      called once, and CraftHttpResponseFromTemplate() used instead of step
+//      #5. Responses that never change can be built whole, once, with
+//      CompileHttpFullResponse().
 //===========================================================================
 #define TINYSERVER_HTTP_H
 
@@ -95,6 +108,26 @@ external ts_http_parse ParseHttpHeader(string InBuffer, ts_request* Request);
 |--- Return: HttpParse_OK if completed successfully, HttpParse_HeaderIncomplete
 |    if there's still more data to read, or an error code if failure. */
 
+external ts_http_parse InitHttpRequest(ts_request* Request, string Verb, string Target,
+                                       u8 Version, buffer* Memory);
+
+/* Creates [Request] from parts of a request that didn't come in HTTP/1 text (e.g.
+|  HTTP/2), so it can be used like one parsed with ParseHttpHeader(). [Verb] and
+|  [Target] (path and query) are copied to [Memory], and the target is decoded
+|  and checked as in ParseHttpHeader(). Headers are added with
+|  AddHttpRequestHeader(), and must be added right after, with nothing else
+|  pushed to [Memory] in between.
+|--- Return: HttpParse_OK if successful, HttpParse_TooManyHeaders if [Memory]
+|    is out of space, or another error code if invalid. */
+
+external ts_http_parse AddHttpRequestHeader(ts_request* Request, string Key, string Value,
+                                            buffer* Memory);
+
+/* Adds the header [Key] with [Value] to a [Request] created with InitHttpRequest(),
+|  copying it to [Memory].
+|--- Return: HttpParse_OK if successful, HttpParse_TooManyHeaders if out of
+|    space, or HttpParse_HeaderInvalid if sizes are beyond limits. */
+
 external string GetHeaderByKey(ts_request* Request, char* TargetKey);
 
 /* Given a fully parsed [Request], search for the value of the [TargetKey] header.
@@ -108,6 +141,118 @@ external string GetHeaderByIdx(ts_request* Request, usz TargetIdx);
 |--- Return: string pointing to data, or empty string if index is beyond limit. */
 
 
+typedef struct ts_pair_span
+{
+    u16 NameOffset;
+    u16 NameSize;
+    u16 ValueOffset;
+    u16 ValueSize;
+} ts_pair_span;
+
+#define MAX_NUM_COOKIES 64
+
+typedef struct ts_request_cookies
+{
+    char* Base; // Value of the Cookie header, which spans are relative to.
+    usz Count;
+    ts_pair_span Spans[MAX_NUM_COOKIES];
+    u8 Index[MAX_NUM_COOKIES * 2]; // Hash of cookie names.
+} ts_request_cookies;
+
+external usz ParseRequestCookies(ts_request* Request, ts_request_cookies* Cookies);
+
+/* Given a fully parsed [Request], indexes the name and value of each cookie in
+|  its Cookie header into [Cookies], up to MAX_NUM_COOKIES. Nothing is copied
+|  nor allocated: the cookies point into the request buffer.
+|--- Return: number of cookies found. */
+
+external string GetCookieByName(ts_request_cookies* Cookies, char* TargetName);
+
+/* Given parsed [Cookies], gets the value of the cookie named [TargetName], in
+|  constant time. [TargetName] must be a zero-terminated array.
+|--- Return: string pointing to value, or empty string if cookie not found. */
+
+external string GetCookieByIdx(ts_request_cookies* Cookies, usz TargetIdx,
+                               _opt string* OutName);
+
+/* Given parsed [Cookies], gets the value of the cookie of count [TargetIdx],
+|  and optionally its name in [OutName]. The index goes from 0..Count member.
+|--- Return: string pointing to value, or empty string if index is beyond limit. */
+
+#define MAX_NUM_QUERY_PARAMS 64
+
+typedef struct ts_query
+{
+    char* Base; // Start of query string, which spans are relative to.
+    usz Count;
+    ts_pair_span Params[MAX_NUM_QUERY_PARAMS];
+    u8 Index[MAX_NUM_QUERY_PARAMS * 2]; // Hash of keys.
+    u64 EncodedMask; // Bit set for each value not yet decoded.
+} ts_query;
+
+external usz ParseQueryString(ts_request* Request, ts_query* Query);
+
+/* Given a fully parsed [Request], indexes the key and value of each parameter
+|  in its query string into [Query], up to MAX_NUM_QUERY_PARAMS. Nothing is
+|  allocated: parameters point into the request buffer. Keys are decoded in
+|  place right away, and values only when first accessed.
+|--- Return: number of parameters found. */
+
+external string GetQueryParam(ts_query* Query, char* TargetKey);
+
+/* Given parsed [Query], gets the decoded value of the parameter with key
+|  [TargetKey], in constant time. [TargetKey] must be a zero-terminated array.
+|--- Return: string pointing to value, or empty string if key not found. */
+
+external string GetQueryParamByIdx(ts_query* Query, usz TargetIdx, _opt string* OutKey);
+
+/* Given parsed [Query], gets the decoded value of the parameter of count
+|  [TargetIdx], and optionally its key in [OutKey]. The index goes from
+|  0..Count member.
+|--- Return: string pointing to value, or empty string if index is beyond limit. */
+
+external bool IsNotModified(ts_request* Request, string ETag, u64 ModifiedTime);
+
+/* Given a fully parsed [Request] for a resource with entity tag [ETag] (quoted)
+|  and last modified at [ModifiedTime] (seconds since Unix epoch, 0 if unknown),
+|  checks its If-None-Match header, or If-Modified-Since if there isn't one.
+|--- Return: true if the requester's copy is still valid, and a 304 can be sent
+|    instead of the resource. */
+
+#define HttpEncoding_Identity 0
+#define HttpEncoding_Gzip     1
+#define HttpEncoding_Deflate  2
+#define HttpEncoding_Brotli   3
+#define HttpEncoding_Count    4
+
+external u8 NegotiateHttpEncoding(ts_request* Request, u32 Available);
+
+/* Given a fully parsed [Request], picks the content encoding to send it with,
+|  from its Accept-Encoding header. [Available] is a bitmask of the encodings
+|  the server can send, with the bit (1 << HttpEncoding_*) set for each. The one
+|  with highest quality is picked, with ties going to brotli, then gzip, then
+|  deflate.
+|--- Return: one of HttpEncoding_*, HttpEncoding_Identity if no compression. */
+
+typedef enum ts_http_range
+{
+    HttpRange_None,          // Send the whole resource.
+    HttpRange_OK,
+    HttpRange_NotSatisfiable // Send 416.
+} ts_http_range;
+
+external ts_http_range ParseHttpRange(ts_request* Request, u64 TotalSize, string ETag,
+                                      u64 ModifiedTime, u64* RangeStart, u64* RangeSize);
+
+/* Given a fully parsed [Request] for a resource of [TotalSize] bytes, with
+|  [ETag] and [ModifiedTime] as in IsNotModified(), parses its Range header
+|  into [RangeStart] and [RangeSize]. The range is ignored if If-Range doesn't
+|  match the resource. Only single byte ranges are served; a request for more
+|  than one gets the whole resource.
+|--- Return: HttpRange_OK if range was parsed, HttpRange_NotSatisfiable if it's
+|    beyond the resource, or HttpRange_None if there's no valid range to use. */
+
+
 //================================
 // Request Body
 //================================
@@ -137,21 +282,28 @@ typedef struct ts_form_field
     u16 CharsetSize;   //charsetlen
     
     void* Data;
-    u32 DataLen; //datalen
+    u64 DataLen; //datalen
 } ts_form_field;
 
+#define FORM_INDEX_MIN_FIELDS 8
+
 typedef struct ts_multiform
 {
     usz FieldCount;
-    void* FirstField;
-    void* LastField;
+    ts_form_field* Fields;
+    
+    u32* Index;   // Hash of field names, only built for larger forms.
+    usz IndexSize;
 } ts_multiform;
 
-external ts_multiform ParseFormData(ts_body Body);
+external ts_multiform ParseFormData(ts_body Body, buffer* Arena);
 
 /* Parses request body of content-type "multipart/form-data". [Body] must be
 |  fully initialised, and the entire content of the body must have been read
-|  to memory already. This function does not support partial parsing.
+|  to memory already (see ParseFormDataChunk() for partial parsing). The field
+|  table is pushed to [Arena], along with a hash of field names if the form has
+|  at least FORM_INDEX_MIN_FIELDS fields. Fields point into the body, which is
+|  not modified, and remain valid for as long as both body and [Arena] are.
 |--- Return: struct with form info, or empty struct if parsing failed. */
 
 external ts_form_field GetFormFieldByName(ts_multiform Form, char* TargetName);
@@ -166,6 +318,278 @@ external ts_form_field GetFormFieldByIdx(ts_multiform Form, usz TargetIdx);
 |  [TargetIdx]. The index goes from 0..FieldCount member in [Form]..
 |--- Return: struct with field info, or empty struct if index is beyond limit. */
 
+#define MAX_FORM_BOUNDARY_SIZE 70 // As per RFC 2046.
+#define MAX_FORM_DELIMITER_SIZE (MAX_FORM_BOUNDARY_SIZE + 4)
+#define MAX_FORM_PART_HEADER_SIZE 1024
+
+typedef enum ts_form_event
+{
+    FormEvent_None,       // Chunk fully consumed, feed more data.
+    FormEvent_FieldBegin, // Field info available in [.Field].
+    FormEvent_FieldData,  // [.Field.Data] points to the next piece of data.
+    FormEvent_FieldEnd,   // All data of current field has been consumed.
+    FormEvent_Complete,   // Final boundary found, form is done.
+    FormEvent_Error       // Error.
+} ts_form_event;
+
+typedef struct ts_form_boundary
+{
+    u8 Delimiter[MAX_FORM_DELIMITER_SIZE]; // "\r\n--" followed by boundary.
+    u8 Skip[256]; // Search table, built once per form.
+    u16 Size;
+} ts_form_boundary;
+
+typedef struct ts_form_stream
+{
+    ts_form_boundary Boundary;
+    u8 PartHeader[MAX_FORM_PART_HEADER_SIZE];
+    u16 MatchSize; // Bytes of delimiter matched at the end of last chunk.
+    u16 PartHeaderSize;
+    u8 Stage;
+    
+    ts_form_field Field;
+    u64 FieldSize; // Bytes of data in current field so far.
+    file OutFile;
+} ts_form_stream;
+
+external bool InitFormStream(ts_form_stream* Stream, ts_body Body);
+
+/* Prepares [Stream] for incremental parsing of a "multipart/form-data" body,
+|  whose boundary is read from [Body]. Only [.ContentType] and [.ContentTypeSize]
+|  are used, and the Content-Type header is left untouched.
+|--- Return: true if successful, false if the boundary is missing or invalid. */
+
+external ts_form_event ParseFormDataChunk(ts_form_stream* Stream, string Chunk,
+                                          usz* ReadCur);
+
+/* Parses a piece of form body in [Chunk], starting at [ReadCur], and advances
+ |  [ReadCur] past the consumed bytes. Must be called in a loop until it returns
+ |  FormEvent_None (at which point the whole chunk was consumed and more data
+ |  must be read), FormEvent_Complete or FormEvent_Error. Chunks may be of any
+ |  size, and the memory may be reused after the call returns FormEvent_None.
+ |  On FormEvent_FieldBegin, [.Field] has the field name, filename and charset,
+ |  which remain valid until the next field begins. If the caller assigns a
+ |  file handle to [.OutFile] at that point, data of that field is written
+ |  straight to the file, and no FormEvent_FieldData is returned for it. On
+ |  FormEvent_FieldData, [.Field.Data] and [.Field.DataLen] point to the next
+ |  piece of data, valid until the next call. On FormEvent_FieldEnd, [.FieldSize]
+ |  has the total size of the field, and [.OutFile] is reset.
+|--- Return: event describing what was parsed. */
+
+
+//================================
+// Routing
+//================================
+
+#define MAX_ROUTE_PARAMS 8
+#define ROUTE_VERB_COUNT (HttpVerb_Patch + 1)
+
+typedef enum ts_route_result
+{
+    Route_Found,
+    Route_NotFound,
+    Route_MethodNotAllowed
+} ts_route_result;
+
+typedef struct ts_route_node
+{
+    void* Handlers[ROUTE_VERB_COUNT]; // Indexed by verb.
+    u32 ParamChild;
+    u32 WildcardChild;
+} ts_route_node;
+
+typedef struct ts_route_edge
+{
+    char* Segment;
+    u32 SegmentSize;
+    u32 Hash;
+    u32 Parent;
+    u32 Child;
+} ts_route_edge;
+
+typedef struct ts_router
+{
+    ts_route_node* Nodes;
+    usz NodeCount;
+    usz MaxNodes;
+    
+    ts_route_edge* Edges; // Hash of (parent node, segment) -> child node.
+    usz EdgeMask;
+    
+    buffer* Arena;
+} ts_router;
+
+typedef struct ts_route_match
+{
+    void* Handler;
+    usz ParamCount;
+    string Params[MAX_ROUTE_PARAMS];
+} ts_route_match;
+
+external bool InitRouter(ts_router* Router, buffer* Arena, usz MaxNodes);
+
+/* Sets up [Router] with room for [MaxNodes] path segments across all routes,
+|  pushing its tables to [Arena]. Routes are added to it with AddRoute(), and it
+|  can be used by any number of threads once all routes are added.
+|--- Return: true if successful, false if [Arena] is out of space. */
+
+external bool AddRoute(ts_router* Router, u8 Verb, char* Pattern, void* Handler);
+
+/* Adds the route for [Verb] (one of HttpVerb_*) and path [Pattern] to [Router],
+|  associating it with [Handler], which is returned when the route matches.
+|  [Pattern] must be a zero-terminated array with segments separated by '/'. A
+|  segment starting with ':' matches any one segment (e.g. "/users/:id"), and
+|  one starting with '*' matches the rest of the path, so it must be the last
+|  (e.g. "/static/" followed by "*file"). At most MAX_ROUTE_PARAMS segments
+|  may start with ':' or '*'. When more than one would match, a fixed segment
+|  wins over ':', which wins over '*', and no other option is tried if that
+|  fails later on. Empty segments (e.g. trailing '/') are ignored. Must be
+|  called at startup.
+|--- Return: true if successful, false if out of nodes, [Pattern] has too many
+|    ':' and '*' segments, or route already exists. */
+
+external ts_route_result MatchRoute(ts_router* Router, ts_request* Request,
+                                    ts_route_match* Match);
+
+/* Matches the path and verb of a parsed [Request] against the routes in
+|  [Router], in a single pass over the path. On success, [Match] gets the route
+|  handler, and the segments matched by ':' and '*' in [.Params], in order.
+|  They point into the request buffer. Cost depends on the path size only,
+|  not on how many routes there are.
+|--- Return: Route_Found if matched, Route_MethodNotAllowed if the path matches
+|    but not for this verb, or Route_NotFound otherwise. */
+
+
+//================================
+// Static files
+//================================
+
+// Only built on Linux, where changes are watched with inotify.
+#if defined(TT_LINUX)
+
+#define MAX_STATIC_PATH_SIZE 256
+#define MAX_ENCODING_SUFFIX_SIZE 3
+#define STATIC_ETAG_SIZE 40
+
+struct ts_response; // See Response below.
+
+typedef struct ts_static_file
+{
+    file Handle;
+    u64 Size;
+    u64 ModifiedTime; // Seconds since Unix epoch.
+    char* MimeType;
+    char ETag[STATIC_ETAG_SIZE]; // Quoted, ready to be sent.
+    u8 ETagSize;
+    u8 Encoding;  // HttpEncoding_* of this file.
+    u8 Encodings; // Bitmask of compressed versions next to it, if any.
+    
+    buffer Memory; // Response header followed by file contents, if in memory.
+    u16 HeaderSize;
+    u16 DateOffset;
+    
+    // Used by the cache.
+    u8 IsStale;
+    u16 PathSize;
+    u32 RefCount;
+    u32 Hash;
+    u32 NextInBucket;
+    u32 Prev;
+    u32 Next;
+    i32 Watch;
+    u32 NextInWatch;
+    char Path[MAX_STATIC_PATH_SIZE];
+} ts_static_file;
+
+typedef struct ts_static_files
+{
+    char Root[MAX_STATIC_PATH_SIZE];
+    u16 RootSize;
+    
+    ts_static_file* Files;
+    u32 MaxFiles;
+    u32 FreeList;
+    u32 LruHead; // Most recently used.
+    u32 LruTail;
+    u32* Index;  // Hash of path -> first file in bucket.
+    u32* WatchIndex; // Watch descriptor -> first file in bucket.
+    usz IndexMask;
+    
+    char* ServerName;
+    usz MaxMemoryFileSize;
+    usz MaxMemorySize;
+    usz MemoryUsed;
+    
+    file Watcher;
+    i64 LastCheck;
+    volatile i32 Lock;
+} ts_static_files;
+
+external bool InitStaticFiles(ts_static_files* Files, char* RootDir, usz MaxFiles,
+                              buffer* Arena);
+
+/* Sets up a cache of up to [MaxFiles] open files from the directory [RootDir], a
+|  zero-terminated array, pushing its tables to [Arena]. Files are served as
+|  they're requested, and kept open until evicted (least recently used first)
+|  or changed on disk. Changes are picked up within one second. Can be used by
+|  any number of threads.
+|--- Return: true if successful, false if not. */
+
+external void KeepStaticFilesInMemory(ts_static_files* Files, usz MaxFileSize,
+                                      usz MaxTotalSize, _opt char* ServerName);
+
+/* Makes [Files] keep the contents of files up to [MaxFileSize] bytes in memory,
+|  along with a ready response header, so they're sent from memory in a single
+|  send, with no file IO. Up to [MaxTotalSize] bytes are kept, and the least
+|  recently used files are dropped from memory (but kept open) when over it.
+|  [ServerName] is the one used when crafting the header (see
+|  CraftHttpResponseHeader()). Must be called after InitStaticFiles(), before
+|  any file is gotten.
+|--- Return: nothing. */
+
+external void CloseStaticFiles(ts_static_files* Files);
+
+/* Closes all files held by [Files]. Must only be called once no file is being
+|  sent anymore.
+|--- Return: nothing. */
+
+external ts_static_file* GetStaticFile(ts_static_files* Files, ts_request* Request);
+
+/* Gets the file for the path of a parsed [Request] from [Files], opening it if
+|  it's not cached yet. A path ending in '/' gets "index.html". If the client
+|  accepts it, and there's a compressed version next to the file (".br" or
+|  ".gz" suffix) when it's first opened, that one is gotten instead. A cached
+|  file costs no syscalls. To send it, craft the header with [.Size] as
+|  [.PayloadSize] and [.MimeType] as [.MimeType] of ts_response, then call
+|  SendFile() with [.Handle] as [.IoFile] of ts_io. The file stays open until
+|  ReleaseStaticFile() is called, which must be done once it's sent.
+|--- Return: pointer to the file, or NULL if it doesn't exist, isn't a regular
+|    file, or all cache entries are being sent. */
+
+external string CraftStaticFileResponse(ts_static_files* Files, ts_static_file* File,
+                                       _opt ts_request* Request,
+                                       struct ts_response* Response, string* OutHeader);
+
+/* Crafts the header for sending [File] into [OutHeader], using [.StatusCode],
+|  [.Version], [.KeepAlive] and cookies of [Response], whose payload members
+|  are filled in, along with ETag and Last-Modified. If [Request] is passed and
+|  [.StatusCode] is 200, it's changed to 304 if the request's copy is still
+|  valid, or 206 (or 416) if it asks for a range. If the file is kept in memory
+|  and [Response] is a plain 200 for HTTP/1.1 with keep-alive, the cached
+|  header is copied with the current date instead of being crafted.
+|--- Return: the payload if the file is kept in memory, to be sent along with
+|    the header in a single SendVector(); or empty string if not, in which case
+|    the payload goes with SendFile() after the header is sent, with
+|    [.RangeStart] as [.IoOffset] and [.PayloadSize] as [.IoSize]. Nothing but
+|    the header is sent if [.PayloadSize] is 0. */
+
+external void ReleaseStaticFile(ts_static_files* Files, ts_static_file* File);
+
+/* Gives back a [File] gotten with GetStaticFile(), after it's been sent.
+|--- Return: nothing. */
+
+#endif // TT_LINUX
+
 
 //================================
 // Response
@@ -212,6 +636,15 @@ typedef struct ts_response
     usz PayloadSize;
 	char* MimeType;
     u8 PayloadIsFile;
+    
+    u8 Encoding;       // HttpEncoding_* the payload is in.
+    u8 VaryEncoding;   // Sends "Vary: Accept-Encoding" even for identity, if set.
+    u8 AcceptRanges;   // Sends "Accept-Ranges: bytes" if set.
+    string ETag;       // Sent if set, must be quoted.
+    string Allow;      // Methods sent in Allow if set, e.g. "GET, HEAD" for 405.
+    u64 LastModified;  // Seconds since Unix epoch, sent if not 0.
+    u64 RangeStart;    // For 206, where the payload starts in the whole of it.
+    u64 TotalSize;     // For 206 and 416, size of the whole payload.
 } ts_response;
 
 external void CraftHttpResponseHeader(ts_response* Response, string* OutHeader,
@@ -222,9 +655,82 @@ external void CraftHttpResponseHeader(ts_response* Response, string* OutHeader,
 |  header (about 1KB is enough). If [Response] contains pointer to cookies
 |  and/or payload, these are not written to OutHeader, but rather must
 |  be sent separately. Optionally, pass in [ServerName] the name that'll be
-|  displayed on the response header (default: TinyServer).
+|  displayed on the response header (default: TinyServer). For 206, the
+|  Content-Range is written from [.RangeStart], [.PayloadSize] and [.TotalSize];
+|  for 416, from [.TotalSize]. A 304 gets no Content-Length. Vary is sent with
+|  any [.Encoding] but identity, and with identity too if [.VaryEncoding] is set
+|  (e.g. when compressed versions of the payload are served to other clients).
+|  Allow is sent if [.Allow] is set.
+|--- Return: nothing. */
+
+typedef struct ts_response_template
+{
+    char* Base;
+    u16 Size;
+    u16 DateOffset;
+    u16 LengthOffset; // Where the Content-Length value goes.
+    u8 NoLength;      // Set for 304s, which send no Content-Length.
+} ts_response_template;
+
+external bool CompileHttpResponse(ts_response* Shape, _opt char* ServerName,
+                                  buffer* Arena, ts_response_template* Template);
+
+/* Crafts the header for responses shaped like [Shape] once, into a [Template]
+|  pushed to [Arena]. All fields of [Shape] used by CraftHttpResponseHeader()
+|  are used, except [.PayloadSize]. Content-Type is written if [.MimeType]
+|  is set.
+|--- Return: true if successful, false if [Arena] is out of space. */
+
+external void CraftHttpResponseFromTemplate(ts_response_template* Template,
+                                            usz PayloadSize, string* OutHeader);
+
+/* Writes the header in [Template] to [OutHeader], with the current date and
+|  [PayloadSize] as Content-Length, unless the shape was a 304, which gets
+|  none. [OutHeader] must have at least the size of the template plus 20 bytes
+|  available.
 |--- Return: nothing. */
 
+external string CompileHttpFullResponse(ts_response* Response, _opt char* ServerName,
+                                        buffer* Arena);
+
+/* Crafts a whole response, header and payload, into a buffer pushed to [Arena],
+|  for responses that never change (e.g. health checks). The buffer is never
+|  written to again, so it can be passed to SendData() on any number of
+|  connections at once. It has no Date header, since the date would need to be
+|  patched. [Response] can't have cookies, nor a file payload.
+|--- Return: string with the whole response, or empty string if failed. */
+
+external bool CraftHttpCookies(_opt ts_response* Response, ts_cookie* Cookies,
+                               usz CookieCount, string* OutHeader);
+
+/* Writes [CookieCount] Set-Cookie lines from [Cookies] to the end of [OutHeader],
+|  to be called right after the header was crafted into it. Each cookie writes
+|  the attributes set in its [.AttrFlags]. The blank line that ends the header
+|  is moved after the cookies, so [Response] can have [.CookiesSize] of 0 when
+|  crafting the header. If [Response] is passed, its [.HeaderSize] is updated.
+|  Nothing is written if [OutHeader] hasn't got enough space for all cookies,
+|  or if any name, value, domain or path has control characters, ';' or
+|  whitespace (which could inject headers), or a name is empty or has '='.
+|--- Return: true if successful, false if not enough space, or a cookie is
+|    invalid. */
+
+#define MIN_COMPRESS_SIZE 256
+#if !defined(COMPRESS_LEVEL)
+# define COMPRESS_LEVEL 5
+#endif
+
+external bool CompressHttpPayload(ts_response* Response, u8 Encoding);
+
+/* Compresses the payload of [Response] with [Encoding], gotten from
+|  NegotiateHttpEncoding(), and points [.Payload] and [.PayloadSize] to the
+|  result, setting [.Encoding]. Must be called before crafting the header. The
+|  compressed payload is in a buffer owned by the calling thread, which is
+|  reused by the next call on the same thread, so it must be sent before that.
+|  Payloads smaller than MIN_COMPRESS_SIZE, files, and types that don't
+|  compress well (e.g. images) are left as they are. Needs zlib, and the
+|  project compiled with TINYSERVER_USE_ZLIB; only gzip and deflate are done.
+|--- Return: true if payload was compressed, false if not. */
+
 
 #if !defined(TINYSERVER_STATIC_LINKING)
 #include "tinyserver-http.c"
@@ -0,0 +1,1808 @@
+#include "tinybase-strings.h"
+
+//================================
+// Helper functions
+//================================
+
+internal u32
+GetU32BE(u8* Src)
+{
+    return ((u32)Src[0] << 24) | ((u32)Src[1] << 16) | ((u32)Src[2] << 8) | (u32)Src[3];
+}
+
+internal void
+PutU32BE(u8* Dst, u32 Value)
+{
+    Dst[0] = (u8)(Value >> 24);
+    Dst[1] = (u8)(Value >> 16);
+    Dst[2] = (u8)(Value >> 8);
+    Dst[3] = (u8)Value;
+}
+
+internal usz
+DecodeBase64Url(string Src, u8* Dst, usz DstSize)
+{
+    u32 Bits = 0;
+    u32 BitCount = 0;
+    usz Size = 0;
+    for (usz Idx = 0; Idx < Src.WriteCur; Idx++)
+    {
+        char Char = Src.Base[Idx];
+        u32 Value;
+        if (Char >= 'A' && Char <= 'Z') Value = Char - 'A';
+        else if (Char >= 'a' && Char <= 'z') Value = Char - 'a' + 26;
+        else if (Char >= '0' && Char <= '9') Value = Char - '0' + 52;
+        else if (Char == '-' || Char == '+') Value = 62;
+        else if (Char == '_' || Char == '/') Value = 63;
+        else if (Char == '=') break;
+        else return INVALID_IDX;
+        
+        Bits = (Bits << 6) | Value;
+        BitCount += 6;
+        if (BitCount >= 8)
+        {
+            BitCount -= 8;
+            if (Size == DstSize) return INVALID_IDX;
+            Dst[Size++] = (u8)(Bits >> BitCount);
+        }
+    }
+    return Size;
+}
+
+internal bool
+IsHttp2ConnectionHeader(string Name)
+{
+    // Fields that only make sense for HTTP/1 connections, and are not allowed
+    // in HTTP/2. Names must be lowercase.
+    return (EqualStrings(Name, StringLit("connection"))
+            || EqualStrings(Name, StringLit("keep-alive"))
+            || EqualStrings(Name, StringLit("proxy-connection"))
+            || EqualStrings(Name, StringLit("transfer-encoding"))
+            || EqualStrings(Name, StringLit("upgrade")));
+}
+
+
+//================================
+// HPACK
+//================================
+
+#define HUFFMAN_MAX_CODE_SIZE 30
+#define HPACK_STATIC_TABLE_SIZE 61
+#define HPACK_ENTRY_OVERHEAD 32
+#define HPACK_MAX_FIELDS (MAX_NUM_HEADERS + 5)
+#define HPACK_MAX_NAME_SIZE 256 // Longest name sent, lowercased on the stack.
+
+// Canonical Huffman code of RFC 7541, Appendix B: number of codes of each size,
+// and symbols sorted by code. Symbol 256 is EOS.
+global const u16 gHuffmanSizeCounts[HUFFMAN_MAX_CODE_SIZE + 1] =
+{
+    0, 0, 0, 0, 0, 10, 26, 32, 6, 0, 5, 3, 2, 6, 2, 3,
+    0, 0, 0, 3, 8, 13, 26, 29, 12, 4, 15, 19, 29, 0, 4,
+};
+
+global const u16 gHuffmanSymbols[257] =
+{
+    48, 49, 50, 97, 99, 101, 105, 111, 115, 116, 32, 37, 45, 46, 47, 51,
+    52, 53, 54, 55, 56, 57, 61, 65, 95, 98, 100, 102, 103, 104, 108, 109,
+    110, 112, 114, 117, 58, 66, 67, 68, 69, 70, 71, 72, 73, 74, 75, 76,
+    77, 78, 79, 80, 81, 82, 83, 84, 85, 86, 87, 89, 106, 107, 113, 118,
+    119, 120, 121, 122, 38, 42, 44, 59, 88, 90, 33, 34, 40, 41, 63, 39,
+    43, 124, 35, 62, 0, 36, 64, 91, 93, 126, 94, 125, 60, 96, 123, 92,
+    195, 208, 128, 130, 131, 162, 184, 194, 224, 226, 153, 161, 167, 172, 176, 177,
+    179, 209, 216, 217, 227, 229, 230, 129, 132, 133, 134, 136, 146, 154, 156, 160,
+    163, 164, 169, 170, 173, 178, 181, 185, 186, 187, 189, 190, 196, 198, 228, 232,
+    233, 1, 135, 137, 138, 139, 140, 141, 143, 147, 149, 150, 151, 152, 155, 157,
+    158, 165, 166, 168, 174, 175, 180, 182, 183, 188, 191, 197, 231, 239, 9, 142,
+    144, 145, 148, 159, 171, 206, 215, 225, 236, 237, 199, 207, 234, 235, 192, 193,
+    200, 201, 202, 205, 210, 213, 218, 219, 238, 240, 242, 243, 255, 203, 204, 211,
+    212, 214, 221, 222, 223, 241, 244, 245, 246, 247, 248, 250, 251, 252, 253, 254,
+    2, 3, 4, 5, 6, 7, 8, 11, 12, 14, 15, 16, 17, 18, 19, 20,
+    21, 23, 24, 25, 26, 27, 28, 29, 30, 31, 127, 220, 249, 10, 13, 22,
+    256,
+};
+
+global const u32 gHuffmanCodes[256] =
+{
+    0x1ff8, 0x7fffd8, 0xfffffe2, 0xfffffe3, 0xfffffe4, 0xfffffe5, 0xfffffe6, 0xfffffe7,
+    0xfffffe8, 0xffffea, 0x3ffffffc, 0xfffffe9, 0xfffffea, 0x3ffffffd, 0xfffffeb, 0xfffffec,
+    0xfffffed, 0xfffffee, 0xfffffef, 0xffffff0, 0xffffff1, 0xffffff2, 0x3ffffffe, 0xffffff3,
+    0xffffff4, 0xffffff5, 0xffffff6, 0xffffff7, 0xffffff8, 0xffffff9, 0xffffffa, 0xffffffb,
+    0x14, 0x3f8, 0x3f9, 0xffa, 0x1ff9, 0x15, 0xf8, 0x7fa,
+    0x3fa, 0x3fb, 0xf9, 0x7fb, 0xfa, 0x16, 0x17, 0x18,
+    0x0, 0x1, 0x2, 0x19, 0x1a, 0x1b, 0x1c, 0x1d,
+    0x1e, 0x1f, 0x5c, 0xfb, 0x7ffc, 0x20, 0xffb, 0x3fc,
+    0x1ffa, 0x21, 0x5d, 0x5e, 0x5f, 0x60, 0x61, 0x62,
+    0x63, 0x64, 0x65, 0x66, 0x67, 0x68, 0x69, 0x6a,
+    0x6b, 0x6c, 0x6d, 0x6e, 0x6f, 0x70, 0x71, 0x72,
+    0xfc, 0x73, 0xfd, 0x1ffb, 0x7fff0, 0x1ffc, 0x3ffc, 0x22,
+    0x7ffd, 0x3, 0x23, 0x4, 0x24, 0x5, 0x25, 0x26,
+    0x27, 0x6, 0x74, 0x75, 0x28, 0x29, 0x2a, 0x7,
+    0x2b, 0x76, 0x2c, 0x8, 0x9, 0x2d, 0x77, 0x78,
+    0x79, 0x7a, 0x7b, 0x7ffe, 0x7fc, 0x3ffd, 0x1ffd, 0xffffffc,
+    0xfffe6, 0x3fffd2, 0xfffe7, 0xfffe8, 0x3fffd3, 0x3fffd4, 0x3fffd5, 0x7fffd9,
+    0x3fffd6, 0x7fffda, 0x7fffdb, 0x7fffdc, 0x7fffdd, 0x7fffde, 0xffffeb, 0x7fffdf,
+    0xffffec, 0xffffed, 0x3fffd7, 0x7fffe0, 0xffffee, 0x7fffe1, 0x7fffe2, 0x7fffe3,
+    0x7fffe4, 0x1fffdc, 0x3fffd8, 0x7fffe5, 0x3fffd9, 0x7fffe6, 0x7fffe7, 0xffffef,
+    0x3fffda, 0x1fffdd, 0xfffe9, 0x3fffdb, 0x3fffdc, 0x7fffe8, 0x7fffe9, 0x1fffde,
+    0x7fffea, 0x3fffdd, 0x3fffde, 0xfffff0, 0x1fffdf, 0x3fffdf, 0x7fffeb, 0x7fffec,
+    0x1fffe0, 0x1fffe1, 0x3fffe0, 0x1fffe2, 0x7fffed, 0x3fffe1, 0x7fffee, 0x7fffef,
+    0xfffea, 0x3fffe2, 0x3fffe3, 0x3fffe4, 0x7ffff0, 0x3fffe5, 0x3fffe6, 0x7ffff1,
+    0x3ffffe0, 0x3ffffe1, 0xfffeb, 0x7fff1, 0x3fffe7, 0x7ffff2, 0x3fffe8, 0x1ffffec,
+    0x3ffffe2, 0x3ffffe3, 0x3ffffe4, 0x7ffffde, 0x7ffffdf, 0x3ffffe5, 0xfffff1, 0x1ffffed,
+    0x7fff2, 0x1fffe3, 0x3ffffe6, 0x7ffffe0, 0x7ffffe1, 0x3ffffe7, 0x7ffffe2, 0xfffff2,
+    0x1fffe4, 0x1fffe5, 0x3ffffe8, 0x3ffffe9, 0xffffffd, 0x7ffffe3, 0x7ffffe4, 0x7ffffe5,
+    0xfffec, 0xfffff3, 0xfffed, 0x1fffe6, 0x3fffe9, 0x1fffe7, 0x1fffe8, 0x7ffff3,
+    0x3fffea, 0x3fffeb, 0x1ffffee, 0x1ffffef, 0xfffff4, 0xfffff5, 0x3ffffea, 0x7ffff4,
+    0x3ffffeb, 0x7ffffe6, 0x3ffffec, 0x3ffffed, 0x7ffffe7, 0x7ffffe8, 0x7ffffe9, 0x7ffffea,
+    0x7ffffeb, 0xffffffe, 0x7ffffec, 0x7ffffed, 0x7ffffee, 0x7ffffef, 0x7fffff0, 0x3ffffee,
+};
+
+global const u8 gHuffmanCodeSizes[256] =
+{
+    13, 23, 28, 28, 28, 28, 28, 28, 28, 24, 30, 28, 28, 30, 28, 28,
+    28, 28, 28, 28, 28, 28, 30, 28, 28, 28, 28, 28, 28, 28, 28, 28,
+    6, 10, 10, 12, 13, 6, 8, 11, 10, 10, 8, 11, 8, 6, 6, 6,
+    5, 5, 5, 6, 6, 6, 6, 6, 6, 6, 7, 8, 15, 6, 12, 10,
+    13, 6, 7, 7, 7, 7, 7, 7, 7, 7, 7, 7, 7, 7, 7, 7,
+    7, 7, 7, 7, 7, 7, 7, 7, 8, 7, 8, 13, 19, 13, 14, 6,
+    15, 5, 6, 5, 6, 5, 6, 6, 6, 5, 7, 7, 6, 6, 6, 5,
+    6, 7, 6, 5, 5, 6, 7, 7, 7, 7, 7, 15, 11, 14, 13, 28,
+    20, 22, 20, 20, 22, 22, 22, 23, 22, 23, 23, 23, 23, 23, 24, 23,
+    24, 24, 22, 23, 24, 23, 23, 23, 23, 21, 22, 23, 22, 23, 23, 24,
+    22, 21, 20, 22, 22, 23, 23, 21, 23, 22, 22, 24, 21, 22, 23, 23,
+    21, 21, 22, 21, 23, 22, 23, 23, 20, 22, 22, 22, 23, 22, 22, 23,
+    26, 26, 20, 19, 22, 23, 22, 25, 26, 26, 26, 27, 27, 26, 24, 25,
+    19, 21, 26, 27, 27, 26, 27, 24, 21, 21, 26, 26, 28, 27, 27, 27,
+    20, 24, 20, 21, 22, 21, 21, 23, 22, 22, 25, 25, 24, 24, 26, 23,
+    26, 27, 26, 26, 27, 27, 27, 27, 27, 28, 27, 27, 27, 27, 27, 26,
+};
+
+#define HPACK_FIELD(Name, Value) { (char*)Name, (char*)Value, sizeof(Name) - 1, sizeof(Value) - 1 }
+
+// Static table of RFC 7541, Appendix A.
+global ts_hpack_field gHpackStaticTable[HPACK_STATIC_TABLE_SIZE] =
+{
+    HPACK_FIELD(":authority", ""),
+    HPACK_FIELD(":method", "GET"),
+    HPACK_FIELD(":method", "POST"),
+    HPACK_FIELD(":path", "/"),
+    HPACK_FIELD(":path", "/index.html"),
+    HPACK_FIELD(":scheme", "http"),
+    HPACK_FIELD(":scheme", "https"),
+    HPACK_FIELD(":status", "200"),
+    HPACK_FIELD(":status", "204"),
+    HPACK_FIELD(":status", "206"),
+    HPACK_FIELD(":status", "304"),
+    HPACK_FIELD(":status", "400"),
+    HPACK_FIELD(":status", "404"),
+    HPACK_FIELD(":status", "500"),
+    HPACK_FIELD("accept-charset", ""),
+    HPACK_FIELD("accept-encoding", "gzip, deflate"),
+    HPACK_FIELD("accept-language", ""),
+    HPACK_FIELD("accept-ranges", ""),
+    HPACK_FIELD("accept", ""),
+    HPACK_FIELD("access-control-allow-origin", ""),
+    HPACK_FIELD("age", ""),
+    HPACK_FIELD("allow", ""),
+    HPACK_FIELD("authorization", ""),
+    HPACK_FIELD("cache-control", ""),
+    HPACK_FIELD("content-disposition", ""),
+    HPACK_FIELD("content-encoding", ""),
+    HPACK_FIELD("content-language", ""),
+    HPACK_FIELD("content-length", ""),
+    HPACK_FIELD("content-location", ""),
+    HPACK_FIELD("content-range", ""),
+    HPACK_FIELD("content-type", ""),
+    HPACK_FIELD("cookie", ""),
+    HPACK_FIELD("date", ""),
+    HPACK_FIELD("etag", ""),
+    HPACK_FIELD("expect", ""),
+    HPACK_FIELD("expires", ""),
+    HPACK_FIELD("from", ""),
+    HPACK_FIELD("host", ""),
+    HPACK_FIELD("if-match", ""),
+    HPACK_FIELD("if-modified-since", ""),
+    HPACK_FIELD("if-none-match", ""),
+    HPACK_FIELD("if-range", ""),
+    HPACK_FIELD("if-unmodified-since", ""),
+    HPACK_FIELD("last-modified", ""),
+    HPACK_FIELD("link", ""),
+    HPACK_FIELD("location", ""),
+    HPACK_FIELD("max-forwards", ""),
+    HPACK_FIELD("proxy-authenticate", ""),
+    HPACK_FIELD("proxy-authorization", ""),
+    HPACK_FIELD("range", ""),
+    HPACK_FIELD("referer", ""),
+    HPACK_FIELD("refresh", ""),
+    HPACK_FIELD("retry-after", ""),
+    HPACK_FIELD("server", ""),
+    HPACK_FIELD("set-cookie", ""),
+    HPACK_FIELD("strict-transport-security", ""),
+    HPACK_FIELD("transfer-encoding", ""),
+    HPACK_FIELD("user-agent", ""),
+    HPACK_FIELD("vary", ""),
+    HPACK_FIELD("via", ""),
+    HPACK_FIELD("www-authenticate", ""),
+};
+
+// Response fields whose values rarely change are added to the table, so from
+// the second response on they take a single byte.
+global char* gHpackIndexedNames[] =
+{
+    "server", "content-type", "content-encoding", "vary", "accept-ranges",
+    "access-control-allow-origin", "cache-control"
+};
+
+internal bool
+DecodeHpackInt(u8* Src, usz SrcSize, usz* ReadCur, u8 PrefixBits, u32* Value)
+{
+    if (*ReadCur >= SrcSize)
+    {
+        return false;
+    }
+    
+    u32 Max = (1u << PrefixBits) - 1;
+    u32 Result = Src[(*ReadCur)++] & Max;
+    if (Result == Max)
+    {
+        u32 Shift = 0;
+        u8 Byte;
+        do
+        {
+            if (*ReadCur >= SrcSize || Shift > 21)
+            {
+                return false;
+            }
+            Byte = Src[(*ReadCur)++];
+            Result += (u32)(Byte & 0x7F) << Shift;
+            Shift += 7;
+        } while (Byte & 0x80);
+    }
+    
+    *Value = Result;
+    return true;
+}
+
+internal bool
+EncodeHpackInt(buffer* Dst, u8 Pattern, u8 PrefixBits, u32 Value)
+{
+    if (Dst->WriteCur + 6 > Dst->Size)
+    {
+        return false;
+    }
+    
+    u8* Out = Dst->Base + Dst->WriteCur;
+    u32 Max = (1u << PrefixBits) - 1;
+    usz Size = 0;
+    if (Value < Max)
+    {
+        Out[Size++] = Pattern | (u8)Value;
+    }
+    else
+    {
+        Out[Size++] = Pattern | (u8)Max;
+        Value -= Max;
+        while (Value >= 0x80)
+        {
+            Out[Size++] = (u8)(Value & 0x7F) | 0x80;
+            Value >>= 7;
+        }
+        Out[Size++] = (u8)Value;
+    }
+    
+    Dst->WriteCur += Size;
+    return true;
+}
+
+internal bool
+DecodeHuffman(u8* Src, usz SrcSize, buffer* Dst)
+{
+    // Canonical code, decoded one bit at a time: codes of each size are
+    // consecutive numbers, so a code is found once it falls under the last
+    // one of its size.
+    
+    u32 Code = 0, First = 0, Index = 0, Size = 0, Padding = 0;
+    for (usz Idx = 0; Idx < SrcSize; Idx++)
+    {
+        for (i32 Bit = 7; Bit >= 0; Bit--)
+        {
+            u32 Value = (Src[Idx] >> Bit) & 1;
+            Code |= Value;
+            Padding = (Padding << 1) | Value;
+            Size++;
+            
+            u32 Count = gHuffmanSizeCounts[Size];
+            if (Code < First + Count)
+            {
+                u16 Symbol = gHuffmanSymbols[Index + (Code - First)];
+                if (Symbol == 256 || Dst->WriteCur == Dst->Size)
+                {
+                    return false;
+                }
+                Dst->Base[Dst->WriteCur++] = (u8)Symbol;
+                Code = First = Index = Size = Padding = 0;
+            }
+            else
+            {
+                if (Size == HUFFMAN_MAX_CODE_SIZE)
+                {
+                    return false;
+                }
+                Index += Count;
+                First = (First + Count) << 1;
+                Code <<= 1;
+            }
+        }
+    }
+    
+    // Leftover bits must be the start of EOS (all ones), and less than a byte.
+    return Size < 8 && Padding == (1u << Size) - 1;
+}
+
+internal usz
+HuffmanSize(string Src)
+{
+    usz Bits = 0;
+    for (usz Idx = 0; Idx < Src.WriteCur; Idx++)
+    {
+        Bits += gHuffmanCodeSizes[(u8)Src.Base[Idx]];
+    }
+    return (Bits + 7) / 8;
+}
+
+internal void
+EncodeHuffman(string Src, u8* Dst)
+{
+    u64 Bits = 0;
+    u32 BitCount = 0;
+    for (usz Idx = 0; Idx < Src.WriteCur; Idx++)
+    {
+        u8 Symbol = (u8)Src.Base[Idx];
+        Bits = (Bits << gHuffmanCodeSizes[Symbol]) | gHuffmanCodes[Symbol];
+        BitCount += gHuffmanCodeSizes[Symbol];
+        while (BitCount >= 8)
+        {
+            BitCount -= 8;
+            *Dst++ = (u8)(Bits >> BitCount);
+        }
+    }
+    if (BitCount)
+    {
+        *Dst = (u8)((Bits << (8 - BitCount)) | (0xFF >> BitCount)); // Padded with EOS.
+    }
+}
+
+internal ts_http2_error
+DecodeHpackString(u8* Src, usz SrcSize, usz* ReadCur, buffer* Dst, char** Out, u16* OutSize)
+{
+    if (*ReadCur >= SrcSize)
+    {
+        return Http2Error_Compression;
+    }
+    
+    bool IsHuffman = (Src[*ReadCur] & 0x80) != 0;
+    u32 Size;
+    if (!DecodeHpackInt(Src, SrcSize, ReadCur, 7, &Size) || Size > SrcSize - *ReadCur)
+    {
+        return Http2Error_Compression;
+    }
+    
+    usz Start = Dst->WriteCur;
+    if (IsHuffman)
+    {
+        if (!DecodeHuffman(Src + *ReadCur, Size, Dst))
+        {
+            return (Dst->WriteCur == Dst->Size) ? Http2Error_EnhanceYourCalm : Http2Error_Compression;
+        }
+    }
+    else
+    {
+        if (Dst->WriteCur + Size > Dst->Size)
+        {
+            return Http2Error_EnhanceYourCalm;
+        }
+        CopyData(Dst->Base + Dst->WriteCur, Size, Src + *ReadCur, Size);
+        Dst->WriteCur += Size;
+    }
+    *ReadCur += Size;
+    
+    if (Dst->WriteCur - Start > U16_MAX)
+    {
+        return Http2Error_EnhanceYourCalm;
+    }
+    *Out = (char*)Dst->Base + Start;
+    *OutSize = (u16)(Dst->WriteCur - Start);
+    return Http2Error_None;
+}
+
+internal bool
+EncodeHpackString(buffer* Dst, string Src)
+{
+    usz HuffSize = HuffmanSize(Src);
+    bool IsHuffman = HuffSize < Src.WriteCur;
+    usz Size = IsHuffman ? HuffSize : Src.WriteCur;
+    if (!EncodeHpackInt(Dst, IsHuffman ? 0x80 : 0, 7, (u32)Size)
+        || Dst->WriteCur + Size > Dst->Size)
+    {
+        return false;
+    }
+    
+    if (IsHuffman)
+    {
+        EncodeHuffman(Src, Dst->Base + Dst->WriteCur);
+    }
+    else
+    {
+        CopyData(Dst->Base + Dst->WriteCur, Size, Src.Base, Size);
+    }
+    Dst->WriteCur += Size;
+    return true;
+}
+
+internal bool
+InitHpackTable(ts_hpack_table* Table, u32 Capacity, buffer* Arena)
+{
+    memset(Table, 0, sizeof(ts_hpack_table));
+    Table->MaxEntries = Capacity / HPACK_ENTRY_OVERHEAD + 1;
+    Table->Entries = PushArray(Arena, Table->MaxEntries, ts_hpack_entry);
+    Table->Data = PushArray(Arena, Capacity, u8);
+    Table->Capacity = Capacity;
+    Table->MaxSize = Capacity;
+    return Table->Data && Table->Entries;
+}
+
+internal ts_hpack_entry*
+GetHpackEntry(ts_hpack_table* Table, u32 Idx)
+{
+    // [Idx] 0 is the newest entry.
+    return &Table->Entries[(Table->FirstEntry + Table->EntryCount - 1 - Idx) % Table->MaxEntries];
+}
+
+internal void
+EvictHpackEntries(ts_hpack_table* Table, u32 MaxSize)
+{
+    while (Table->Size > MaxSize)
+    {
+        ts_hpack_entry* Oldest = &Table->Entries[Table->FirstEntry];
+        Table->Size -= Oldest->NameSize + Oldest->ValueSize + HPACK_ENTRY_OVERHEAD;
+        Table->FirstEntry = (Table->FirstEntry + 1) % Table->MaxEntries;
+        Table->EntryCount--;
+    }
+    
+    if (Table->EntryCount)
+    {
+        Table->DataStart = Table->Entries[Table->FirstEntry].Offset;
+    }
+    else
+    {
+        Table->DataStart = 0;
+        Table->DataEnd = 0;
+    }
+}
+
+internal void
+SetHpackTableSize(ts_hpack_table* Table, u32 MaxSize)
+{
+    Table->MaxSize = MaxSize;
+    EvictHpackEntries(Table, MaxSize);
+}
+
+internal void
+InsertHpackEntry(ts_hpack_table* Table, string Name, string Value)
+{
+    // An entry larger than the table empties it, and is not added.
+    
+    u32 DataSize = (u32)(Name.WriteCur + Value.WriteCur);
+    u32 EntrySize = DataSize + HPACK_ENTRY_OVERHEAD;
+    if (EntrySize > Table->MaxSize)
+    {
+        EvictHpackEntries(Table, 0);
+        return;
+    }
+    EvictHpackEntries(Table, Table->MaxSize - EntrySize);
+    
+    // Entries are only moved when the new one doesn't fit past the newest,
+    // in which case all of them go back to the start of the data.
+    if (Table->DataEnd + DataSize > Table->Capacity)
+    {
+        u32 Shift = Table->DataStart;
+        memmove(Table->Data, Table->Data + Shift, Table->DataEnd - Shift);
+        for (u32 Idx = 0; Idx < Table->EntryCount; Idx++)
+        {
+            Table->Entries[(Table->FirstEntry + Idx) % Table->MaxEntries].Offset -= Shift;
+        }
+        Table->DataStart = 0;
+        Table->DataEnd -= Shift;
+    }
+    
+    ts_hpack_entry* Entry = &Table->Entries[(Table->FirstEntry + Table->EntryCount) % Table->MaxEntries];
+    Entry->Offset = Table->DataEnd;
+    Entry->NameSize = (u16)Name.WriteCur;
+    Entry->ValueSize = (u16)Value.WriteCur;
+    CopyData(Table->Data + Table->DataEnd, Name.WriteCur, Name.Base, Name.WriteCur);
+    CopyData(Table->Data + Table->DataEnd + Name.WriteCur, Value.WriteCur, Value.Base, Value.WriteCur);
+    
+    Table->DataEnd += DataSize;
+    Table->EntryCount++;
+    Table->Size += EntrySize;
+}
+
+internal bool
+GetHpackField(ts_hpack_table* Table, u32 Index, ts_hpack_field* Field)
+{
+    // Index 1..61 is the static table, and the dynamic one follows, newest first.
+    if (Index >= 1 && Index <= HPACK_STATIC_TABLE_SIZE)
+    {
+        *Field = gHpackStaticTable[Index - 1];
+        return true;
+    }
+    
+    u32 Idx = Index - HPACK_STATIC_TABLE_SIZE - 1;
+    if (Index == 0 || Idx >= Table->EntryCount)
+    {
+        return false;
+    }
+    
+    ts_hpack_entry* Entry = GetHpackEntry(Table, Idx);
+    Field->Name = (char*)Table->Data + Entry->Offset;
+    Field->NameSize = Entry->NameSize;
+    Field->Value = Field->Name + Entry->NameSize;
+    Field->ValueSize = Entry->ValueSize;
+    return true;
+}
+
+internal bool
+CopyToScratch(buffer* Scratch, char** Src, u16 Size)
+{
+    if (Scratch->WriteCur + Size > Scratch->Size)
+    {
+        return false;
+    }
+    char* Dst = (char*)Scratch->Base + Scratch->WriteCur;
+    CopyData(Dst, Size, *Src, Size);
+    Scratch->WriteCur += Size;
+    *Src = Dst;
+    return true;
+}
+
+internal ts_http2_error
+DecodeHpackBlock(ts_http2_conn* Conn, u8* Block, usz BlockSize, usz* FieldCount)
+{
+    // Every field is copied to [.Scratch], since later ones may evict the
+    // table entries earlier ones came from.
+    
+    ts_hpack_table* Table = &Conn->Decoder;
+    buffer* Scratch = &Conn->Scratch;
+    Scratch->WriteCur = 0;
+    *FieldCount = 0;
+    
+    usz ReadCur = 0;
+    while (ReadCur < BlockSize)
+    {
+        u8 Byte = Block[ReadCur];
+        ts_hpack_field Field;
+        u32 Index;
+        
+        if (Byte & 0x80)
+        {
+            // Indexed field.
+            if (!DecodeHpackInt(Block, BlockSize, &ReadCur, 7, &Index)
+                || !GetHpackField(Table, Index, &Field))
+            {
+                return Http2Error_Compression;
+            }
+            if (!CopyToScratch(Scratch, &Field.Name, Field.NameSize)
+                || !CopyToScratch(Scratch, &Field.Value, Field.ValueSize))
+            {
+                return Http2Error_EnhanceYourCalm;
+            }
+        }
+        else if ((Byte & 0xE0) == 0x20)
+        {
+            // Table size update, only allowed before the first field.
+            if (*FieldCount > 0
+                || !DecodeHpackInt(Block, BlockSize, &ReadCur, 5, &Index)
+                || Index > Table->Capacity)
+            {
+                return Http2Error_Compression;
+            }
+            SetHpackTableSize(Table, Index);
+            continue;
+        }
+        else
+        {
+            // Literal field, either added to the table (01), or not (0000 and 0001).
+            bool AddToTable = (Byte & 0xC0) == 0x40;
+            if (!DecodeHpackInt(Block, BlockSize, &ReadCur, AddToTable ? 6 : 4, &Index))
+            {
+                return Http2Error_Compression;
+            }
+            
+            ts_http2_error Error = Http2Error_None;
+            if (Index)
+            {
+                if (!GetHpackField(Table, Index, &Field))
+                {
+                    return Http2Error_Compression;
+                }
+                if (!CopyToScratch(Scratch, &Field.Name, Field.NameSize))
+                {
+                    return Http2Error_EnhanceYourCalm;
+                }
+            }
+            else
+            {
+                Error = DecodeHpackString(Block, BlockSize, &ReadCur, Scratch,
+                                          &Field.Name, &Field.NameSize);
+            }
+            if (!Error)
+            {
+                Error = DecodeHpackString(Block, BlockSize, &ReadCur, Scratch,
+                                          &Field.Value, &Field.ValueSize);
+            }
+            if (Error)
+            {
+                return Error;
+            }
+            
+            if (AddToTable)
+            {
+                InsertHpackEntry(Table, String(Field.Name, Field.NameSize, 0, EC_ASCII),
+                                 String(Field.Value, Field.ValueSize, 0, EC_ASCII));
+            }
+        }
+        
+        if (*FieldCount == HPACK_MAX_FIELDS)
+        {
+            return Http2Error_EnhanceYourCalm;
+        }
+        Conn->Fields[(*FieldCount)++] = Field;
+    }
+    
+    return Http2Error_None;
+}
+
+internal bool
+EncodeHpackField(ts_hpack_table* Table, buffer* Block, string Name, string Value)
+{
+    // Fields of the static table with the same name are next to each other.
+    u32 NameIdx = 0;
+    for (u32 Idx = 0; Idx < HPACK_STATIC_TABLE_SIZE; Idx++)
+    {
+        ts_hpack_field* Field = &gHpackStaticTable[Idx];
+        if (EqualStrings(Name, String(Field->Name, Field->NameSize, 0, EC_ASCII)))
+        {
+            if (EqualStrings(Value, String(Field->Value, Field->ValueSize, 0, EC_ASCII)))
+            {
+                return EncodeHpackInt(Block, 0x80, 7, Idx + 1);
+            }
+            if (!NameIdx)
+            {
+                NameIdx = Idx + 1;
+            }
+        }
+        else if (NameIdx)
+        {
+            break;
+        }
+    }
+    
+    bool AddToTable = false;
+    for (usz Idx = 0; Idx < sizeof(gHpackIndexedNames) / sizeof(char*); Idx++)
+    {
+        if (EqualStrings(Name, String(gHpackIndexedNames[Idx], strlen(gHpackIndexedNames[Idx]), 0, EC_ASCII)))
+        {
+            AddToTable = true;
+            break;
+        }
+    }
+    
+    if (AddToTable)
+    {
+        for (u32 Idx = 0; Idx < Table->EntryCount; Idx++)
+        {
+            ts_hpack_entry* Entry = GetHpackEntry(Table, Idx);
+            char* EntryName = (char*)Table->Data + Entry->Offset;
+            if (EqualStrings(Name, String(EntryName, Entry->NameSize, 0, EC_ASCII))
+                && EqualStrings(Value, String(EntryName + Entry->NameSize, Entry->ValueSize, 0, EC_ASCII)))
+            {
+                return EncodeHpackInt(Block, 0x80, 7, HPACK_STATIC_TABLE_SIZE + 1 + Idx);
+            }
+        }
+        if (!EncodeHpackInt(Block, 0x40, 6, NameIdx))
+        {
+            return false;
+        }
+    }
+    else
+    {
+        // Cookies are never added to tables along the way, not even by proxies.
+        bool NeverIndex = EqualStrings(Name, StringLit("set-cookie"));
+        if (!EncodeHpackInt(Block, NeverIndex ? 0x10 : 0x00, 4, NameIdx))
+        {
+            return false;
+        }
+    }
+    
+    if ((!NameIdx && !EncodeHpackString(Block, Name))
+        || !EncodeHpackString(Block, Value))
+    {
+        return false;
+    }
+    if (AddToTable)
+    {
+        InsertHpackEntry(Table, Name, Value);
+    }
+    return true;
+}
+
+internal bool
+CountHttp1Fields(string Lines, usz* LineCount)
+{
+    // Counts lines for sizing the block, and checks that no name is too long
+    // to be encoded, before anything is: the encoder table can't be undone.
+    usz NameSize = 0;
+    bool InName = true;
+    for (usz Idx = 0; Idx < Lines.WriteCur; Idx++)
+    {
+        char Char = Lines.Base[Idx];
+        if (Char == '\n')
+        {
+            (*LineCount)++;
+            NameSize = 0;
+            InName = true;
+        }
+        else if (InName && Char == ':')
+        {
+            InName = false;
+        }
+        else if (InName && ++NameSize > HPACK_MAX_NAME_SIZE)
+        {
+            return false;
+        }
+    }
+    return true;
+}
+
+internal bool
+EncodeHttp1Fields(ts_hpack_table* Table, buffer* Block, string Lines)
+{
+    // Turns "Name: Value" lines of an HTTP/1 header into fields, up to the
+    // blank line. The status line becomes :status.
+    
+    usz ReadCur = 0;
+    while (ReadCur < Lines.WriteCur)
+    {
+        string Line = String(Lines.Base + ReadCur, Lines.WriteCur - ReadCur, 0, EC_ASCII);
+        usz LineSize = CharInString('\n', Line, RETURN_IDX_FIND);
+        if (LineSize == INVALID_IDX)
+        {
+            LineSize = Line.WriteCur;
+        }
+        ReadCur += LineSize + 1;
+        Line.WriteCur = LineSize;
+        if (Line.WriteCur && Line.Base[Line.WriteCur-1] == '\r')
+        {
+            Line.WriteCur--;
+        }
+        if (Line.WriteCur == 0)
+        {
+            break;
+        }
+        
+        if (Line.WriteCur >= 12 && CompareStrings(Line, StringLit("HTTP/"), 5, RETURN_BOOL))
+        {
+            if (!EncodeHpackField(Table, Block, StringLit(":status"),
+                                  String(Line.Base + 9, 3, 0, EC_ASCII)))
+            {
+                return false;
+            }
+            continue;
+        }
+        
+        usz Colon = CharInString(':', Line, RETURN_IDX_FIND);
+        char NameBuffer[HPACK_MAX_NAME_SIZE];
+        if (Colon == INVALID_IDX || Colon == 0)
+        {
+            continue;
+        }
+        if (Colon > sizeof(NameBuffer))
+        {
+            return false;
+        }
+        for (usz Idx = 0; Idx < Colon; Idx++)
+        {
+            char Char = Line.Base[Idx];
+            NameBuffer[Idx] = (Char >= 'A' && Char <= 'Z') ? Char + ('a' - 'A') : Char;
+        }
+        string Name = String(NameBuffer, Colon, 0, EC_ASCII);
+        
+        usz ValueStart = Colon + 1;
+        while (ValueStart < Line.WriteCur && Line.Base[ValueStart] == ' ') ValueStart++;
+        string Value = String(Line.Base + ValueStart, Line.WriteCur - ValueStart, 0, EC_ASCII);
+        
+        if (!IsHttp2ConnectionHeader(Name)
+            && !EncodeHpackField(Table, Block, Name, Value))
+        {
+            return false;
+        }
+    }
+    return true;
+}
+
+
+//================================
+// Connection
+//================================
+
+global const char gHttp2Preface[] = "PRI * HTTP/2.0\r\n\r\nSM\r\n\r\n";
+
+internal void
+PutHttp2FrameHeader(u8* Frame, u8 Type, u8 Flags, u32 StreamId, usz Size)
+{
+    Frame[0] = (u8)(Size >> 16);
+    Frame[1] = (u8)(Size >> 8);
+    Frame[2] = (u8)Size;
+    Frame[3] = Type;
+    Frame[4] = Flags;
+    PutU32BE(Frame + 5, StreamId & 0x7FFFFFFF);
+}
+
+internal bool
+WriteHttp2Frame(ts_http2_conn* Conn, u8 Type, u8 Flags, u32 StreamId, void* Payload,
+                usz Size)
+{
+    buffer* Output = &Conn->Output;
+    if (Output->WriteCur + HTTP2_FRAME_HEADER_SIZE + Size > Output->Size)
+    {
+        return false;
+    }
+    
+    u8* Frame = Output->Base + Output->WriteCur;
+    PutHttp2FrameHeader(Frame, Type, Flags, StreamId, Size);
+    if (Size)
+    {
+        CopyData(Frame + HTTP2_FRAME_HEADER_SIZE, Size, Payload, Size);
+    }
+    
+    Output->WriteCur += HTTP2_FRAME_HEADER_SIZE + Size;
+    return true;
+}
+
+internal void
+WriteHttp2U32Frame(ts_http2_conn* Conn, u8 Type, u32 StreamId, u32 Value)
+{
+    u8 Payload[4];
+    PutU32BE(Payload, Value);
+    WriteHttp2Frame(Conn, Type, 0, StreamId, Payload, sizeof(Payload));
+}
+
+internal ts_http2_event
+FailHttp2Conn(ts_http2_conn* Conn, ts_http2_error Error)
+{
+    if (!Conn->Closing)
+    {
+        u8 Payload[8];
+        PutU32BE(Payload, Conn->LastStreamId);
+        PutU32BE(Payload + 4, Error);
+        WriteHttp2Frame(Conn, Http2Frame_GoAway, 0, 0, Payload, sizeof(Payload));
+        Conn->Closing = 1;
+    }
+    return Http2Event_Close;
+}
+
+internal ts_http2_stream*
+FindHttp2Stream(ts_http2_conn* Conn, u32 StreamId)
+{
+    for (u32 Idx = 0; Idx < Conn->MaxStreams; Idx++)
+    {
+        if (Conn->Streams[Idx].Id == StreamId)
+        {
+            return &Conn->Streams[Idx];
+        }
+    }
+    return NULL;
+}
+
+internal ts_http2_stream*
+NewHttp2Stream(ts_http2_conn* Conn, u32 StreamId)
+{
+    ts_http2_stream* Stream = FindHttp2Stream(Conn, 0);
+    if (Stream)
+    {
+        buffer Memory = Stream->Memory;
+        memset(Stream, 0, sizeof(ts_http2_stream));
+        Stream->Memory = Memory;
+        Stream->Memory.WriteCur = 0;
+        
+        Stream->Id = StreamId;
+        Stream->SendWindow = Conn->PeerInitialWindow;
+        Stream->RecvWindow = HTTP2_WINDOW_SIZE;
+        Conn->ActiveStreams++;
+    }
+    return Stream;
+}
+
+internal void
+ResetHttp2Stream(ts_http2_conn* Conn, ts_http2_stream* Stream, ts_http2_error Error)
+{
+    WriteHttp2U32Frame(Conn, Http2Frame_RstStream, Stream->Id, Error);
+    if (!Stream->LocalDone && !Stream->Reset)
+    {
+        Conn->DoneStreams++;
+    }
+    Stream->Reset = 1;
+    Stream->Pending = NULL;
+    Stream->PendingSize = 0;
+}
+
+internal void
+FinishHttp2Stream(ts_http2_conn* Conn, ts_http2_stream* Stream)
+{
+    // If the request is still coming, the client is told to stop sending it.
+    Stream->LocalDone = 1;
+    Conn->DoneStreams++;
+    if (Conn->ResetBudget < HTTP2_MAX_RESETS)
+    {
+        Conn->ResetBudget++;
+    }
+    if (!Stream->RemoteDone)
+    {
+        WriteHttp2U32Frame(Conn, Http2Frame_RstStream, Stream->Id, Http2Error_None);
+    }
+}
+
+internal void
+FlushHttp2Streams(ts_http2_conn* Conn)
+{
+    // Streams take turns writing one frame each, so a large response doesn't
+    // hold back the others. The last HTTP2_CONTROL_RESERVE bytes of output are
+    // left for control frames.
+    
+    buffer* Output = &Conn->Output;
+    bool Progress = true;
+    while (Progress && Conn->SendWindow > 0)
+    {
+        Progress = false;
+        for (u32 Idx = 0; Idx < Conn->MaxStreams; Idx++)
+        {
+            ts_http2_stream* Stream = &Conn->Streams[Idx];
+            if (!Stream->Id || !Stream->PendingSize || Stream->SendWindow <= 0)
+            {
+                continue;
+            }
+            
+            usz Free = Output->Size - Output->WriteCur;
+            if (Free <= HTTP2_CONTROL_RESERVE + HTTP2_FRAME_HEADER_SIZE || Conn->SendWindow <= 0)
+            {
+                return;
+            }
+            usz Size = Min(Stream->PendingSize, Free - HTTP2_CONTROL_RESERVE - HTTP2_FRAME_HEADER_SIZE);
+            Size = Min(Size, (usz)Conn->PeerMaxFrameSize);
+            Size = Min(Size, (usz)Min(Conn->SendWindow, Stream->SendWindow));
+            
+            bool IsLast = (Size == Stream->PendingSize);
+            WriteHttp2Frame(Conn, Http2Frame_Data, IsLast ? Http2Flag_EndStream : 0, Stream->Id,
+                            Stream->Pending, Size);
+            Stream->Pending += Size;
+            Stream->PendingSize -= Size;
+            Stream->SendWindow -= Size;
+            Conn->SendWindow -= Size;
+            if (IsLast)
+            {
+                FinishHttp2Stream(Conn, Stream);
+            }
+            Progress = true;
+        }
+    }
+}
+
+internal ts_http2_error
+ApplyHttp2Settings(ts_http2_conn* Conn, u8* Payload, usz Size)
+{
+    for (usz Idx = 0; Idx + 6 <= Size; Idx += 6)
+    {
+        u16 Id = (u16)((Payload[Idx] << 8) | Payload[Idx+1]);
+        u32 Value = GetU32BE(Payload + Idx + 2);
+        switch (Id)
+        {
+            case 0x1: // SETTINGS_HEADER_TABLE_SIZE
+            {
+                Value = Min(Value, Conn->Encoder.Capacity);
+                if (Value != Conn->Encoder.MaxSize)
+                {
+                    SetHpackTableSize(&Conn->Encoder, Value);
+                    Conn->Encoder.PendingSizeUpdate = 1;
+                }
+            } break;
+            
+            case 0x2: // SETTINGS_ENABLE_PUSH
+            {
+                if (Value > 1) return Http2Error_Protocol;
+            } break;
+            
+            case 0x4: // SETTINGS_INITIAL_WINDOW_SIZE
+            {
+                if (Value > 0x7FFFFFFF) return Http2Error_FlowControl;
+                
+                // Applies to the streams already open too.
+                i64 Delta = (i64)Value - (i64)Conn->PeerInitialWindow;
+                for (u32 StreamIdx = 0; StreamIdx < Conn->MaxStreams; StreamIdx++)
+                {
+                    ts_http2_stream* Stream = &Conn->Streams[StreamIdx];
+                    if (!Stream->Id) continue;
+                    Stream->SendWindow += Delta;
+                    if (Stream->SendWindow > 0x7FFFFFFF) return Http2Error_FlowControl;
+                }
+                Conn->PeerInitialWindow = Value;
+            } break;
+            
+            case 0x5: // SETTINGS_MAX_FRAME_SIZE
+            {
+                if (Value < 16384 || Value > 16777215) return Http2Error_Protocol;
+                Conn->PeerMaxFrameSize = Value;
+            } break;
+        }
+    }
+    return Http2Error_None;
+}
+
+internal ts_http2_error
+BuildHttp2Request(ts_http2_conn* Conn, ts_http2_stream* Stream, usz FieldCount)
+{
+    // Pseudo-header fields come first, and give the verb and target. Regular
+    // fields are added with their names capitalized as in HTTP/1, so they're
+    // found by GetHeaderByKey().
+    
+    string Method = {0}, Path = {0}, Scheme = {0}, Authority = {0};
+    usz Idx = 0;
+    for (; Idx < FieldCount && Conn->Fields[Idx].NameSize && Conn->Fields[Idx].Name[0] == ':'; Idx++)
+    {
+        ts_hpack_field* Field = &Conn->Fields[Idx];
+        string Name = String(Field->Name, Field->NameSize, 0, EC_ASCII);
+        string* Target = NULL;
+        if (EqualStrings(Name, StringLit(":method"))) Target = &Method;
+        else if (EqualStrings(Name, StringLit(":path"))) Target = &Path;
+        else if (EqualStrings(Name, StringLit(":scheme"))) Target = &Scheme;
+        else if (EqualStrings(Name, StringLit(":authority"))) Target = &Authority;
+        if (!Target || Target->Base)
+        {
+            return Http2Error_Protocol;
+        }
+        *Target = String(Field->Value, Field->ValueSize, 0, EC_ASCII);
+    }
+    if (!Method.Base || !Path.Base || !Scheme.Base)
+    {
+        return Http2Error_Protocol;
+    }
+    
+    ts_request* Request = &Stream->Request;
+    buffer* Memory = &Stream->Memory;
+    ts_http_parse Parse = InitHttpRequest(Request, Method, Path, HttpVersion_20, Memory);
+    if (Parse == HttpParse_OK && Authority.WriteCur)
+    {
+        Parse = AddHttpRequestHeader(Request, StringLit("Host"), Authority, Memory);
+    }
+    
+    // Cookies may come split in many fields, and are joined back into one
+    // header, after the other fields in [.Scratch].
+    buffer* Scratch = &Conn->Scratch;
+    string Cookies = String(Scratch->Base + Scratch->WriteCur, 0, Scratch->Size - Scratch->WriteCur, EC_ASCII);
+    
+    for (; Parse == HttpParse_OK && Idx < FieldCount; Idx++)
+    {
+        ts_hpack_field* Field = &Conn->Fields[Idx];
+        string Name = String(Field->Name, Field->NameSize, 0, EC_ASCII);
+        string Value = String(Field->Value, Field->ValueSize, 0, EC_ASCII);
+        if (Name.WriteCur == 0 || Name.Base[0] == ':' || IsHttp2ConnectionHeader(Name)
+            || (EqualStrings(Name, StringLit("te")) && !EqualStrings(Value, StringLit("trailers"))))
+        {
+            return Http2Error_Protocol;
+        }
+        
+        if (EqualStrings(Name, StringLit("cookie")))
+        {
+            if (Cookies.WriteCur + Value.WriteCur + 2 > Cookies.Size)
+            {
+                return Http2Error_RefusedStream;
+            }
+            if (Cookies.WriteCur)
+            {
+                AppendStringToString(StringLit("; "), &Cookies);
+            }
+            AppendStringToString(Value, &Cookies);
+            continue;
+        }
+        
+        bool WordStart = true;
+        for (usz CharIdx = 0; CharIdx < Name.WriteCur; CharIdx++)
+        {
+            char Char = Name.Base[CharIdx];
+            if (Char >= 'A' && Char <= 'Z')
+            {
+                return Http2Error_Protocol;
+            }
+            if (WordStart && Char >= 'a' && Char <= 'z')
+            {
+                Name.Base[CharIdx] = Char - ('a' - 'A');
+            }
+            WordStart = (Char == '-');
+        }
+        Parse = AddHttpRequestHeader(Request, Name, Value, Memory);
+    }
+    
+    if (Parse == HttpParse_OK && Cookies.WriteCur)
+    {
+        Parse = AddHttpRequestHeader(Request, StringLit("Cookie"), Cookies, Memory);
+    }
+    
+    switch (Parse)
+    {
+        case HttpParse_OK: return Http2Error_None;
+        case HttpParse_TooManyHeaders: return Http2Error_RefusedStream;
+        default: return Http2Error_Protocol;
+    }
+}
+
+internal ts_http2_event
+EndHttp2HeaderBlock(ts_http2_conn* Conn, ts_http2_stream** OutStream, string* OutData)
+{
+    u32 StreamId = Conn->HeaderStreamId;
+    bool EndStream = (Conn->HeaderFlags & Http2Flag_EndStream) != 0;
+    Conn->HeaderStreamId = 0;
+    
+    // The block is decoded even if the stream is dropped, to keep the table
+    // the same as the client's.
+    usz FieldCount;
+    ts_http2_error Error = DecodeHpackBlock(Conn, Conn->HeaderBlock.Base, Conn->HeaderBlock.WriteCur,
+                                            &FieldCount);
+    if (Error)
+    {
+        return FailHttp2Conn(Conn, Error);
+    }
+    
+    ts_http2_stream* Stream = FindHttp2Stream(Conn, StreamId);
+    if (Stream)
+    {
+        // Trailer fields, which end the body. They're dropped.
+        if (Stream->LocalDone || Stream->Reset)
+        {
+            return Http2Event_None;
+        }
+        if (Stream->RemoteDone)
+        {
+            return FailHttp2Conn(Conn, Http2Error_StreamClosed);
+        }
+        if (!EndStream)
+        {
+            ResetHttp2Stream(Conn, Stream, Http2Error_Protocol);
+            return Http2Event_None;
+        }
+        Stream->RemoteDone = 1;
+        *OutStream = Stream;
+        *OutData = String(0, 0, 0, EC_ASCII);
+        return Http2Event_Data;
+    }
+    
+    if (StreamId <= Conn->LastStreamId)
+    {
+        return Http2Event_None; // Stream already closed.
+    }
+    Conn->LastStreamId = StreamId;
+    
+    Stream = NewHttp2Stream(Conn, StreamId);
+    if (!Stream)
+    {
+        if (!Conn->ResetBudget)
+        {
+            return FailHttp2Conn(Conn, Http2Error_EnhanceYourCalm);
+        }
+        Conn->ResetBudget--;
+        WriteHttp2U32Frame(Conn, Http2Frame_RstStream, StreamId, Http2Error_RefusedStream);
+        return Http2Event_None;
+    }
+    
+    Stream->RemoteDone = EndStream;
+    Error = BuildHttp2Request(Conn, Stream, FieldCount);
+    if (Error)
+    {
+        ResetHttp2Stream(Conn, Stream, Error);
+        return Http2Event_None;
+    }
+    
+    Stream->Reported = 1;
+    *OutStream = Stream;
+    return Http2Event_Request;
+}
+
+internal ts_http2_event
+AddHttp2HeaderFragment(ts_http2_conn* Conn, u8* Fragment, u32 Size, u8 Flags,
+                       ts_http2_stream** OutStream, string* OutData)
+{
+    buffer* Block = &Conn->HeaderBlock;
+    if (Block->WriteCur + Size > Block->Size)
+    {
+        return FailHttp2Conn(Conn, Http2Error_EnhanceYourCalm);
+    }
+    CopyData(Block->Base + Block->WriteCur, Size, Fragment, Size);
+    Block->WriteCur += Size;
+    
+    if (Flags & Http2Flag_EndHeaders)
+    {
+        return EndHttp2HeaderBlock(Conn, OutStream, OutData);
+    }
+    return Http2Event_None;
+}
+
+internal bool
+StripHttp2Padding(u8 Flags, u8** Payload, u32* Size)
+{
+    if (Flags & Http2Flag_Padded)
+    {
+        if (*Size == 0 || (*Payload)[0] >= *Size)
+        {
+            return false;
+        }
+        *Size -= 1 + (*Payload)[0];
+        *Payload += 1;
+    }
+    return true;
+}
+
+internal ts_http2_event
+WaitForHttp2Input(ts_http2_conn* Conn)
+{
+    // Unread bytes are moved to the start, so the rest of the frame can be
+    // received after them.
+    buffer* Input = &Conn->Input;
+    usz Left = Input->WriteCur - Conn->InputReadCur;
+    memmove(Input->Base, Input->Base + Conn->InputReadCur, Left);
+    Input->WriteCur = Left;
+    Conn->InputReadCur = 0;
+    return Http2Event_None;
+}
+
+external bool
+IsHttp2Preface(string Data)
+{
+    usz Size = Min(Data.WriteCur, (usz)HTTP2_PREFACE_SIZE);
+    return Size >= 3 && memcmp(Data.Base, gHttp2Preface, Size) == 0;
+}
+
+external bool
+InitHttp2Conn(ts_http2_conn* Conn, usz MaxStreams, buffer* Arena)
+{
+    memset(Conn, 0, sizeof(ts_http2_conn));
+    
+    // Arrays of structs go first, so they're aligned.
+    usz InputSize = 2 * (HTTP2_FRAME_HEADER_SIZE + HTTP2_FRAME_SIZE);
+    usz ArenaStart = Arena->WriteCur;
+    Conn->Fields = PushArray(Arena, HPACK_MAX_FIELDS, ts_hpack_field);
+    Conn->Streams = PushArray(Arena, MaxStreams, ts_http2_stream);
+    bool Success = (Conn->Fields && Conn->Streams
+                    && InitHpackTable(&Conn->Decoder, HTTP2_HEADER_TABLE_SIZE, Arena)
+                    && InitHpackTable(&Conn->Encoder, HTTP2_HEADER_TABLE_SIZE, Arena));
+    for (usz Idx = 0; Success && Idx < MaxStreams; Idx++)
+    {
+        ts_http2_stream* Stream = &Conn->Streams[Idx];
+        memset(Stream, 0, sizeof(ts_http2_stream));
+        Stream->Memory.Base = PushArray(Arena, HTTP2_MAX_HEADER_LIST_SIZE, u8);
+        Stream->Memory.Size = HTTP2_MAX_HEADER_LIST_SIZE;
+        Success = (Stream->Memory.Base != NULL);
+    }
+    u8* Input = PushArray(Arena, InputSize, u8);
+    u8* Output = PushArray(Arena, HTTP2_OUTPUT_SIZE, u8);
+    u8* HeaderBlock = PushArray(Arena, HTTP2_MAX_HEADER_LIST_SIZE, u8);
+    u8* Scratch = PushArray(Arena, HTTP2_MAX_HEADER_LIST_SIZE, u8);
+    Success = Success && Input && Output && HeaderBlock && Scratch;
+    if (!Success)
+    {
+        Arena->WriteCur = ArenaStart;
+        return false;
+    }
+    
+    Conn->Input = Buffer(Input, 0, InputSize);
+    Conn->Output = Buffer(Output, 0, HTTP2_OUTPUT_SIZE);
+    Conn->HeaderBlock = Buffer(HeaderBlock, 0, HTTP2_MAX_HEADER_LIST_SIZE);
+    Conn->Scratch = Buffer(Scratch, 0, HTTP2_MAX_HEADER_LIST_SIZE);
+    Conn->MaxStreams = (u32)MaxStreams;
+    Conn->SendWindow = HTTP2_WINDOW_SIZE;
+    Conn->RecvWindow = HTTP2_WINDOW_SIZE;
+    Conn->PeerInitialWindow = HTTP2_WINDOW_SIZE;
+    Conn->PeerMaxFrameSize = HTTP2_FRAME_SIZE;
+    Conn->ResetBudget = HTTP2_MAX_RESETS;
+    
+    // Server preface: SETTINGS_MAX_CONCURRENT_STREAMS and
+    // SETTINGS_MAX_HEADER_LIST_SIZE, the others are left as default.
+    u8 Settings[12] = { 0x0, 0x3, 0, 0, 0, 0, 0x0, 0x6, 0, 0, 0, 0 };
+    PutU32BE(Settings + 2, (u32)MaxStreams);
+    PutU32BE(Settings + 8, HTTP2_MAX_HEADER_LIST_SIZE);
+    WriteHttp2Frame(Conn, Http2Frame_Settings, 0, 0, Settings, sizeof(Settings));
+    
+    return true;
+}
+
+external bool
+UpgradeToHttp2(ts_http2_conn* Conn, ts_request* Request)
+{
+    string Upgrade = GetHeaderByKey(Request, "Upgrade");
+    string Settings = GetHeaderByKey(Request, "HTTP2-Settings");
+    string ContentLength = GetHeaderByKey(Request, "Content-Length");
+    if (Request->Version != HttpVersion_11
+        || !Settings.Base
+        || !EqualStrings(Upgrade, StringLit("h2c"))
+        || GetHeaderByKey(Request, "Transfer-Encoding").Base
+        || (ContentLength.WriteCur && !EqualStrings(ContentLength, StringLit("0")))
+        || Request->HeaderSize > HTTP2_MAX_HEADER_LIST_SIZE)
+    {
+        return false;
+    }
+    
+    // The client's settings come in the header, base64url encoded, and are
+    // taken as acknowledged.
+    u8 Payload[6 * 16];
+    usz PayloadSize = DecodeBase64Url(Settings, Payload, sizeof(Payload));
+    if (PayloadSize == INVALID_IDX || PayloadSize % 6
+        || ApplyHttp2Settings(Conn, Payload, PayloadSize) != Http2Error_None)
+    {
+        return false;
+    }
+    
+    ts_http2_stream* Stream = NewHttp2Stream(Conn, 1);
+    if (!Stream)
+    {
+        return false;
+    }
+    CopyData(Stream->Memory.Base, Stream->Memory.Size, Request->Base, Request->HeaderSize);
+    Stream->Memory.WriteCur = Request->HeaderSize;
+    Stream->Request = *Request;
+    Stream->Request.Base = (char*)Stream->Memory.Base;
+    Stream->Request.Version = HttpVersion_20;
+    Stream->RemoteDone = 1;
+    Conn->LastStreamId = 1;
+    Conn->Upgraded = Stream;
+    
+    // The 101 goes before the server settings written by InitHttp2Conn().
+    string Switching = StringLit("HTTP/1.1 101 Switching Protocols\r\n"
+                                 "Connection: Upgrade\r\n"
+                                 "Upgrade: h2c\r\n\r\n");
+    buffer* Output = &Conn->Output;
+    memmove(Output->Base + Switching.WriteCur, Output->Base, Output->WriteCur);
+    CopyData(Output->Base, Switching.WriteCur, Switching.Base, Switching.WriteCur);
+    Output->WriteCur += Switching.WriteCur;
+    
+    return true;
+}
+
+external ts_http2_event
+ProcessHttp2Input(ts_http2_conn* Conn, ts_http2_stream** OutStream, string* OutData)
+{
+    buffer* Input = &Conn->Input;
+    buffer* Output = &Conn->Output;
+    
+    for (;;)
+    {
+        if (Conn->Closing)
+        {
+            return Http2Event_Close;
+        }
+        
+        if (Conn->Upgraded)
+        {
+            *OutStream = Conn->Upgraded;
+            Conn->Upgraded->Reported = 1;
+            Conn->Upgraded = NULL;
+            return Http2Event_Request;
+        }
+        
+        // Streams that are done are given back to the caller, and their
+        // slots freed.
+        for (u32 Idx = 0; Conn->DoneStreams && Idx < Conn->MaxStreams; Idx++)
+        {
+            ts_http2_stream* Stream = &Conn->Streams[Idx];
+            if (Stream->Id && (Stream->LocalDone || Stream->Reset))
+            {
+                Stream->Id = 0;
+                Conn->ActiveStreams--;
+                Conn->DoneStreams--;
+                if (Stream->Reported)
+                {
+                    *OutStream = Stream;
+                    return Stream->LocalDone ? Http2Event_StreamDone : Http2Event_StreamReset;
+                }
+            }
+        }
+        
+        // Frames aren't read while output has no room for what they may
+        // answer with, which makes the caller send it first.
+        if (Output->Size - Output->WriteCur < HTTP2_CONTROL_RESERVE)
+        {
+            return Http2Event_None;
+        }
+        
+        u8* Frame = Input->Base + Conn->InputReadCur;
+        usz Available = Input->WriteCur - Conn->InputReadCur;
+        if (!Conn->PrefaceReceived)
+        {
+            if (Available < HTTP2_PREFACE_SIZE)
+            {
+                return WaitForHttp2Input(Conn);
+            }
+            if (memcmp(Frame, gHttp2Preface, HTTP2_PREFACE_SIZE) != 0)
+            {
+                return FailHttp2Conn(Conn, Http2Error_Protocol);
+            }
+            Conn->InputReadCur += HTTP2_PREFACE_SIZE;
+            Conn->PrefaceReceived = 1;
+            continue;
+        }
+        
+        if (Available < HTTP2_FRAME_HEADER_SIZE)
+        {
+            return WaitForHttp2Input(Conn);
+        }
+        u32 Size = ((u32)Frame[0] << 16) | ((u32)Frame[1] << 8) | (u32)Frame[2];
+        if (Size > HTTP2_FRAME_SIZE)
+        {
+            return FailHttp2Conn(Conn, Http2Error_FrameSize);
+        }
+        if (Available < HTTP2_FRAME_HEADER_SIZE + Size)
+        {
+            return WaitForHttp2Input(Conn);
+        }
+        Conn->InputReadCur += HTTP2_FRAME_HEADER_SIZE + Size;
+        
+        u8 Type = Frame[3];
+        u8 Flags = Frame[4];
+        u32 StreamId = GetU32BE(Frame + 5) & 0x7FFFFFFF;
+        u8* Payload = Frame + HTTP2_FRAME_HEADER_SIZE;
+        
+        // The client's settings must come first, and a header block spanning
+        // frames can't have any other frame in the middle.
+        if ((!Conn->SettingsReceived && (Type != Http2Frame_Settings || (Flags & Http2Flag_Ack)))
+            || (Conn->HeaderStreamId && (Type != Http2Frame_Continuation || StreamId != Conn->HeaderStreamId)))
+        {
+            return FailHttp2Conn(Conn, Http2Error_Protocol);
+        }
+        
+        ts_http2_stream* Stream = NULL;
+        if (StreamId)
+        {
+            Stream = FindHttp2Stream(Conn, StreamId);
+            if (Stream && (Stream->LocalDone || Stream->Reset))
+            {
+                Stream = NULL;
+            }
+        }
+        bool IsIdle = StreamId > Conn->LastStreamId;
+        ts_http2_event Event = Http2Event_None;
+        
+        switch (Type)
+        {
+            case Http2Frame_Data:
+            {
+                if (StreamId == 0 || IsIdle)
+                {
+                    return FailHttp2Conn(Conn, Http2Error_Protocol);
+                }
+                
+                // Flow control counts the whole frame, padding included, even
+                // for closed streams. Credit is given back right away, once half
+                // the window is used.
+                if (Size > Conn->RecvWindow)
+                {
+                    return FailHttp2Conn(Conn, Http2Error_FlowControl);
+                }
+                Conn->RecvWindow -= Size;
+                Conn->RecvUnacked += Size;
+                if (Conn->RecvUnacked >= HTTP2_WINDOW_SIZE / 2)
+                {
+                    WriteHttp2U32Frame(Conn, Http2Frame_WindowUpdate, 0, Conn->RecvUnacked);
+                    Conn->RecvWindow += Conn->RecvUnacked;
+                    Conn->RecvUnacked = 0;
+                }
+                
+                u32 FrameSize = Size;
+                if (!StripHttp2Padding(Flags, &Payload, &Size))
+                {
+                    return FailHttp2Conn(Conn, Http2Error_Protocol);
+                }
+                if (!Stream)
+                {
+                    break; // Closed stream, ignored.
+                }
+                if (Stream->RemoteDone)
+                {
+                    ResetHttp2Stream(Conn, Stream, Http2Error_StreamClosed);
+                    break;
+                }
+                if (FrameSize > Stream->RecvWindow)
+                {
+                    ResetHttp2Stream(Conn, Stream, Http2Error_FlowControl);
+                    break;
+                }
+                
+                Stream->RecvWindow -= FrameSize;
+                if (Flags & Http2Flag_EndStream)
+                {
+                    Stream->RemoteDone = 1;
+                }
+                else
+                {
+                    Stream->RecvUnacked += FrameSize;
+                    if (Stream->RecvUnacked >= HTTP2_WINDOW_SIZE / 2)
+                    {
+                        WriteHttp2U32Frame(Conn, Http2Frame_WindowUpdate, StreamId, Stream->RecvUnacked);
+                        Stream->RecvWindow += Stream->RecvUnacked;
+                        Stream->RecvUnacked = 0;
+                    }
+                }
+                
+                *OutStream = Stream;
+                *OutData = String(Payload, Size, 0, EC_ASCII);
+                return Http2Event_Data;
+            }
+            
+            case Http2Frame_Headers:
+            {
+                if (StreamId == 0 || (StreamId & 1) == 0
+                    || !StripHttp2Padding(Flags, &Payload, &Size))
+                {
+                    return FailHttp2Conn(Conn, Http2Error_Protocol);
+                }
+                if (Flags & Http2Flag_Priority)
+                {
+                    if (Size < 5)
+                    {
+                        return FailHttp2Conn(Conn, Http2Error_Protocol);
+                    }
+                    Payload += 5;
+                    Size -= 5;
+                }
+                
+                Conn->HeaderBlock.WriteCur = 0;
+                Conn->HeaderStreamId = StreamId;
+                Conn->HeaderFlags = Flags;
+                Event = AddHttp2HeaderFragment(Conn, Payload, Size, Flags, OutStream, OutData);
+            } break;
+            
+            case Http2Frame_Continuation:
+            {
+                if (!Conn->HeaderStreamId)
+                {
+                    return FailHttp2Conn(Conn, Http2Error_Protocol);
+                }
+                Event = AddHttp2HeaderFragment(Conn, Payload, Size, Flags, OutStream, OutData);
+            } break;
+            
+            case Http2Frame_Priority:
+            {
+                // Priorities are not used, every stream gets the same share.
+                if (StreamId == 0)
+                {
+                    return FailHttp2Conn(Conn, Http2Error_Protocol);
+                }
+                if (Size != 5)
+                {
+                    WriteHttp2U32Frame(Conn, Http2Frame_RstStream, StreamId, Http2Error_FrameSize);
+                }
+            } break;
+            
+            case Http2Frame_RstStream:
+            {
+                if (StreamId == 0 || IsIdle)
+                {
+                    return FailHttp2Conn(Conn, Http2Error_Protocol);
+                }
+                if (Size != 4)
+                {
+                    return FailHttp2Conn(Conn, Http2Error_FrameSize);
+                }
+                if (Stream)
+                {
+                    // Streams opened and reset right away cost work but send
+                    // nothing back, so a client can only reset so many more
+                    // than it lets finish (CVE-2023-44487, "rapid reset").
+                    if (!Conn->ResetBudget)
+                    {
+                        return FailHttp2Conn(Conn, Http2Error_EnhanceYourCalm);
+                    }
+                    Conn->ResetBudget--;
+                    Stream->Reset = 1;
+                    Stream->Pending = NULL;
+                    Stream->PendingSize = 0;
+                    Conn->DoneStreams++;
+                }
+            } break;
+            
+            case Http2Frame_Settings:
+            {
+                if (StreamId != 0)
+                {
+                    return FailHttp2Conn(Conn, Http2Error_Protocol);
+                }
+                if ((Flags & Http2Flag_Ack) ? (Size != 0) : (Size % 6 != 0))
+                {
+                    return FailHttp2Conn(Conn, Http2Error_FrameSize);
+                }
+                if (!(Flags & Http2Flag_Ack))
+                {
+                    ts_http2_error Error = ApplyHttp2Settings(Conn, Payload, Size);
+                    if (Error)
+                    {
+                        return FailHttp2Conn(Conn, Error);
+                    }
+                    WriteHttp2Frame(Conn, Http2Frame_Settings, Http2Flag_Ack, 0, NULL, 0);
+                    Conn->SettingsReceived = 1;
+                    FlushHttp2Streams(Conn);
+                }
+            } break;
+            
+            case Http2Frame_Ping:
+            {
+                if (StreamId != 0)
+                {
+                    return FailHttp2Conn(Conn, Http2Error_Protocol);
+                }
+                if (Size != 8)
+                {
+                    return FailHttp2Conn(Conn, Http2Error_FrameSize);
+                }
+                if (!(Flags & Http2Flag_Ack))
+                {
+                    WriteHttp2Frame(Conn, Http2Frame_Ping, Http2Flag_Ack, 0, Payload, 8);
+                }
+            } break;
+            
+            case Http2Frame_GoAway:
+            {
+                if (StreamId != 0)
+                {
+                    return FailHttp2Conn(Conn, Http2Error_Protocol);
+                }
+                Conn->Closing = 1;
+                return Http2Event_Close;
+            }
+            
+            case Http2Frame_WindowUpdate:
+            {
+                if (Size != 4)
+                {
+                    return FailHttp2Conn(Conn, Http2Error_FrameSize);
+                }
+                if (StreamId && IsIdle)
+                {
+                    return FailHttp2Conn(Conn, Http2Error_Protocol);
+                }
+                
+                u32 Increment = GetU32BE(Payload) & 0x7FFFFFFF;
+                if (StreamId == 0)
+                {
+                    Conn->SendWindow += Increment;
+                    if (Increment == 0 || Conn->SendWindow > 0x7FFFFFFF)
+                    {
+                        return FailHttp2Conn(Conn, Increment ? Http2Error_FlowControl : Http2Error_Protocol);
+                    }
+                }
+                else if (Stream)
+                {
+                    Stream->SendWindow += Increment;
+                    if (Increment == 0 || Stream->SendWindow > 0x7FFFFFFF)
+                    {
+                        ResetHttp2Stream(Conn, Stream, Increment ? Http2Error_FlowControl : Http2Error_Protocol);
+                    }
+                }
+                FlushHttp2Streams(Conn);
+            } break;
+            
+            case Http2Frame_PushPromise:
+            {
+                return FailHttp2Conn(Conn, Http2Error_Protocol);
+            }
+            
+            default: break; // Unknown frames are ignored.
+        }
+        
+        if (Event != Http2Event_None)
+        {
+            return Event;
+        }
+    }
+}
+
+external bool
+SendHttp2Response(ts_http2_conn* Conn, ts_http2_stream* Stream, ts_response* Response,
+                  _opt char* ServerName)
+{
+    if (Stream->Reset)
+    {
+        return true; // Dropped, the caller gets Http2Event_StreamReset.
+    }
+    if (Stream->Responded || Response->PayloadIsFile)
+    {
+        return false;
+    }
+    
+    // The header is crafted as for HTTP/1, and its lines turned into fields,
+    // so both versions send the same ones. It's checked to fit in the output
+    // before anything is encoded, since the encoder table can't be undone.
+    
+    buffer* Scratch = &Conn->Scratch;
+    string Header = String(Scratch->Base, 0, Scratch->Size, EC_ASCII);
+    CraftHttpResponseHeader(Response, &Header, ServerName);
+    string Cookies = String(Response->Cookies, Response->CookiesSize, 0, EC_ASCII);
+    
+    usz LineCount = 0;
+    if (!CountHttp1Fields(Header, &LineCount) || !CountHttp1Fields(Cookies, &LineCount))
+    {
+        return false;
+    }
+    usz MaxBlockSize = Header.WriteCur + Cookies.WriteCur + LineCount * 12 + 6;
+    
+    buffer* Output = &Conn->Output;
+    usz MaxFrameSize = Conn->PeerMaxFrameSize;
+    usz MaxFrameCount = (MaxBlockSize + MaxFrameSize - 1) / MaxFrameSize;
+    usz Needed = MaxFrameCount * HTTP2_FRAME_HEADER_SIZE + MaxBlockSize + HTTP2_CONTROL_RESERVE;
+    if (Output->WriteCur + Needed > Output->Size)
+    {
+        return false;
+    }
+    
+    u8* Frame = Output->Base + Output->WriteCur;
+    buffer Block = Buffer(Frame + HTTP2_FRAME_HEADER_SIZE, 0, MaxBlockSize);
+    if ((Conn->Encoder.PendingSizeUpdate
+         && !EncodeHpackInt(&Block, 0x20, 5, Conn->Encoder.MaxSize))
+        || !EncodeHttp1Fields(&Conn->Encoder, &Block, Header)
+        || !EncodeHttp1Fields(&Conn->Encoder, &Block, Cookies))
+    {
+        // The block was sized to always fit, so this is a bug, but the client
+        // can't follow the encoder table anymore, and the connection must end.
+        FailHttp2Conn(Conn, Http2Error_Internal);
+        return false;
+    }
+    Conn->Encoder.PendingSizeUpdate = 0;
+    
+    // A block larger than the client's frame size is cut into a HEADERS frame
+    // and CONTINUATION frames. Fragments are moved up to make room for their
+    // frame headers, last one first, so none is written over before it's moved.
+    bool HasPayload = (Response->Payload && Response->PayloadSize > 0);
+    usz FrameCount = Max((Block.WriteCur + MaxFrameSize - 1) / MaxFrameSize, (usz)1);
+    for (usz Idx = FrameCount; Idx-- > 0;)
+    {
+        usz FragmentStart = Idx * MaxFrameSize;
+        usz FragmentSize = Min(Block.WriteCur - FragmentStart, MaxFrameSize);
+        u8* FragmentFrame = Frame + Idx * (HTTP2_FRAME_HEADER_SIZE + MaxFrameSize);
+        memmove(FragmentFrame + HTTP2_FRAME_HEADER_SIZE, Block.Base + FragmentStart, FragmentSize);
+        
+        u8 Type = Idx ? Http2Frame_Continuation : Http2Frame_Headers;
+        u8 Flags = ((Idx == FrameCount - 1) ? Http2Flag_EndHeaders : 0)
+            | ((Idx == 0 && !HasPayload) ? Http2Flag_EndStream : 0);
+        PutHttp2FrameHeader(FragmentFrame, Type, Flags, Stream->Id, FragmentSize);
+    }
+    Output->WriteCur += FrameCount * HTTP2_FRAME_HEADER_SIZE + Block.WriteCur;
+    
+    Stream->Responded = 1;
+    if (HasPayload)
+    {
+        Stream->Pending = Response->Payload;
+        Stream->PendingSize = Response->PayloadSize;
+        FlushHttp2Streams(Conn);
+    }
+    else
+    {
+        FinishHttp2Stream(Conn, Stream);
+    }
+    
+    return true;
+}
+
+external void
+ConsumeHttp2Output(ts_http2_conn* Conn, usz BytesSent)
+{
+    buffer* Output = &Conn->Output;
+    BytesSent = Min(BytesSent, Output->WriteCur);
+    memmove(Output->Base, Output->Base + BytesSent, Output->WriteCur - BytesSent);
+    Output->WriteCur -= BytesSent;
+    
+    FlushHttp2Streams(Conn);
+}
@@ -0,0 +1,263 @@
+#ifndef TINYSERVER_HTTP2_H
+//===========================================================================
+// tinyserver-http2.h
+//
+// Module for serving HTTP/2 over cleartext connections (h2c), to clients
+// that either start with it right away ("prior knowledge"), or upgrade to
+// it from HTTP/1.1. Builds on tinyserver-http.h: requests come out as the
+// same ts_request objects, and responses go in as the same ts_response
+// objects, so handlers can be shared between versions. Each connection
+// carries many requests at once, each in its own stream.
+//
+// The module does no IO by itself. Each connection has a ts_http2_conn
+// object with an input and an output buffer, driven from the completions
+// of WaitOnIoQueue():
+//   1. Once a connection is accepted, call InitHttp2Conn() if the first
+//      bytes received pass IsHttp2Preface(), or if it's a parsed HTTP/1.1
+//      request with "Upgrade: h2c", in which case UpgradeToHttp2() must be
+//      called right after. Received bytes not yet parsed are copied to the
+//      end of [.Input].
+//   2. Call ProcessHttp2Input() in a loop, handling each event, until it
+//      returns Http2Event_None or Http2Event_Close.
+//   3. On Http2Event_Request, the stream has a parsed [.Request], and the
+//      response is sent with SendHttp2Response(), now or later. On
+//      Http2Event_Data, the data is a piece of the request body.
+//   4. Then, if [.Output] has data, send it with SendData(), and call
+//      ConsumeHttp2Output() once done. Otherwise, recv into the free space
+//      of [.Input], and add the bytes received to its [.WriteCur]. Either
+//      way, go back to step #2 once it completes.
+//   5. On Http2Event_Close, send what's left in [.Output] and disconnect.
+//
+// Only one thread may use a connection at a time.
+//===========================================================================
+#define TINYSERVER_HTTP2_H
+
+#include "tinyserver-http.h"
+
+#define HTTP2_PREFACE_SIZE 24
+#define HTTP2_FRAME_HEADER_SIZE 9
+#define HTTP2_FRAME_SIZE 16384 // Largest frame received.
+#define HTTP2_WINDOW_SIZE 65535
+#define HTTP2_HEADER_TABLE_SIZE 4096
+#define HTTP2_CONTROL_RESERVE 64
+
+#if !defined(HTTP2_MAX_HEADER_LIST_SIZE)
+# define HTTP2_MAX_HEADER_LIST_SIZE 8192
+#endif
+#if !defined(HTTP2_OUTPUT_SIZE)
+# define HTTP2_OUTPUT_SIZE 65536
+#endif
+#if !defined(HTTP2_MAX_RESETS)
+# define HTTP2_MAX_RESETS 100 // Streams a client may reset beyond those it lets finish.
+#endif
+
+
+//================================
+// HPACK
+//================================
+
+typedef struct ts_hpack_field
+{
+    char* Name;
+    char* Value;
+    u16 NameSize;
+    u16 ValueSize;
+} ts_hpack_field;
+
+typedef struct ts_hpack_entry
+{
+    u32 Offset;
+    u16 NameSize;
+    u16 ValueSize;
+} ts_hpack_entry;
+
+typedef struct ts_hpack_table
+{
+    u8* Data;      // Name and value of entries, oldest first.
+    u32 DataStart;
+    u32 DataEnd;
+    
+    ts_hpack_entry* Entries; // Ring, oldest at [.FirstEntry].
+    u32 FirstEntry;
+    u32 EntryCount;
+    u32 MaxEntries;
+    
+    u32 Size;     // As counted by HPACK: name, value, and 32 per entry.
+    u32 MaxSize;  // Current limit.
+    u32 Capacity; // Limit that can be set.
+    u8 PendingSizeUpdate; // Encoder must tell the limit changed.
+} ts_hpack_table;
+
+
+//================================
+// Connection
+//================================
+
+#define Http2Frame_Data         0x0
+#define Http2Frame_Headers      0x1
+#define Http2Frame_Priority     0x2
+#define Http2Frame_RstStream    0x3
+#define Http2Frame_Settings     0x4
+#define Http2Frame_PushPromise  0x5
+#define Http2Frame_Ping         0x6
+#define Http2Frame_GoAway       0x7
+#define Http2Frame_WindowUpdate 0x8
+#define Http2Frame_Continuation 0x9
+
+#define Http2Flag_EndStream  0x1
+#define Http2Flag_Ack        0x1
+#define Http2Flag_EndHeaders 0x4
+#define Http2Flag_Padded     0x8
+#define Http2Flag_Priority   0x20
+
+typedef enum ts_http2_error
+{
+    Http2Error_None               = 0x0,
+    Http2Error_Protocol           = 0x1,
+    Http2Error_Internal           = 0x2,
+    Http2Error_FlowControl        = 0x3,
+    Http2Error_SettingsTimeout    = 0x4,
+    Http2Error_StreamClosed       = 0x5,
+    Http2Error_FrameSize          = 0x6,
+    Http2Error_RefusedStream      = 0x7,
+    Http2Error_Cancel             = 0x8,
+    Http2Error_Compression        = 0x9,
+    Http2Error_Connect            = 0xA,
+    Http2Error_EnhanceYourCalm    = 0xB,
+    Http2Error_InadequateSecurity = 0xC,
+    Http2Error_Http11Required     = 0xD
+} ts_http2_error;
+
+typedef enum ts_http2_event
+{
+    Http2Event_None,        // All input processed, send output or recv more.
+    Http2Event_Request,     // Stream has a new request.
+    Http2Event_Data,        // Piece of request body.
+    Http2Event_StreamDone,  // Response was fully written to output.
+    Http2Event_StreamReset, // Stream was cancelled, response must not be sent.
+    Http2Event_Close        // Send what's left in output and disconnect.
+} ts_http2_event;
+
+typedef struct ts_http2_stream
+{
+    u32 Id; // 0 if slot is free.
+    u8 RemoteDone;    // Whole request received.
+    u8 LocalDone;     // Whole response written to output.
+    u8 Responded;
+    u8 Reported;      // Caller got Http2Event_Request.
+    u8 Reset;
+    
+    ts_request Request;
+    buffer Memory; // Holds [.Request].
+    
+    i64 SendWindow;
+    i64 RecvWindow;
+    u32 RecvUnacked;
+    
+    char* Pending; // Payload not yet written to output.
+    usz PendingSize;
+    
+    void* UserData; // Free for the caller.
+} ts_http2_stream;
+
+typedef struct ts_http2_conn
+{
+    buffer Input;
+    usz InputReadCur;
+    buffer Output; // [0..WriteCur] is ready to be sent.
+    
+    ts_http2_stream* Streams;
+    u32 MaxStreams;
+    u32 ActiveStreams;
+    u32 DoneStreams;
+    u32 LastStreamId;
+    u32 ResetBudget; // Spent by streams reset or refused, earned back by finished ones.
+    ts_http2_stream* Upgraded;
+    
+    ts_hpack_table Decoder;
+    ts_hpack_table Encoder;
+    buffer HeaderBlock; // Fragments of a header block spanning frames.
+    u32 HeaderStreamId;
+    u8 HeaderFlags;
+    buffer Scratch;
+    ts_hpack_field* Fields;
+    
+    i64 SendWindow;
+    i64 RecvWindow;
+    u32 RecvUnacked;
+    u32 PeerInitialWindow;
+    u32 PeerMaxFrameSize;
+    
+    u8 PrefaceReceived;
+    u8 SettingsReceived;
+    u8 Closing;
+} ts_http2_conn;
+
+external bool IsHttp2Preface(string Data);
+
+/* Checks if [Data], the first bytes received on a connection, is the start of
+|  an HTTP/2 connection preface, sent by clients that start with HTTP/2 right
+|  away. At least 3 bytes must have been received.
+|--- Return: true if it's the preface, false if not. */
+
+external bool InitHttp2Conn(ts_http2_conn* Conn, usz MaxStreams, buffer* Arena);
+
+/* Sets up [Conn] for a new HTTP/2 connection with up to [MaxStreams] requests
+|  at a time, pushing its buffers to [Arena], which must have about 160KB plus
+|  HTTP2_MAX_HEADER_LIST_SIZE per stream available. The server settings are
+|  written to [.Output], to be sent right away. The object may be reused for
+|  another connection by calling this again with the same [Arena] position.
+|--- Return: true if successful, false if [Arena] is out of space. */
+
+external bool UpgradeToHttp2(ts_http2_conn* Conn, ts_request* Request);
+
+/* Upgrades a connection whose HTTP/1.1 [Request] asked for "Upgrade: h2c",
+|  writing the 101 response to [.Output] of [Conn] before the server settings.
+|  Must be called right after InitHttp2Conn(). The request is copied to stream
+|  1, which is handed out by the first ProcessHttp2Input() call, and whose
+|  response goes over HTTP/2. Requests with a body aren't upgraded.
+|--- Return: true if upgraded, false if [Request] can't be upgraded, in which
+|    case it must be answered with HTTP/1.1. */
+
+external ts_http2_event ProcessHttp2Input(ts_http2_conn* Conn, ts_http2_stream** OutStream,
+                                          string* OutData);
+
+/* Processes the frames in [.Input] of [Conn], until something comes up for the
+|  caller, which is returned. Settings, pings, flow control and errors are all
+|  handled here, and the answers written to [.Output]. Must be called in a loop
+|  after each recv or send completes, until Http2Event_None or Http2Event_Close.
+|  On Http2Event_Request, [OutStream] gets a stream whose [.Request] can be used
+|  like one from ParseHttpHeader(), and which lasts until Http2Event_StreamDone
+|  or Http2Event_StreamReset is returned for it. If [.RemoteDone] is set, the
+|  request has no body. On Http2Event_Data, [OutData] gets the next piece of the
+|  body, valid until the next call, and [.RemoteDone] is set on the last one.
+|  Clients that open and reset streams faster than they let them finish (more
+|  than HTTP2_MAX_RESETS ahead) are sent GOAWAY with ENHANCE_YOUR_CALM.
+|--- Return: event that came up. */
+
+external bool SendHttp2Response(ts_http2_conn* Conn, ts_http2_stream* Stream,
+                                ts_response* Response, _opt char* ServerName);
+
+/* Writes the response to [Stream] to [.Output] of [Conn], with the header
+|  fields CraftHttpResponseHeader() would send (except Connection), and the
+|  payload, which must be in memory. A header block larger than the client's
+|  frame size goes on in CONTINUATION frames. The payload goes out as flow control
+|  allows, so it must stay valid until Http2Event_StreamDone is returned for
+|  the stream. If [.Payload] is NULL, only the header is sent (e.g. for HEAD).
+|  [.Version] and [.KeepAlive] of [Response] are ignored.
+|--- Return: true if successful, false if the payload is a file, a header name
+|    is longer than 256 bytes, or there's no room in [.Output] for the header,
+|    in which case it must be tried again after output is sent. */
+
+external void ConsumeHttp2Output(ts_http2_conn* Conn, usz BytesSent);
+
+/* Drops the first [BytesSent] bytes from [.Output] of [Conn] once they were
+|  sent, and writes more of the payloads waiting in its streams, if any.
+|--- Return: nothing. */
+
+
+#if !defined(TINYSERVER_STATIC_LINKING)
+#include "tinyserver-http2.c"
+#endif
+
+#endif //TINYSERVER_HTTP2_H
@@ -0,0 +1,531 @@
+#include "tinybase-strings.h"
+#include "tinyserver-admission.h"
+
+#if defined(TINYSERVER_USE_METRICS)
+# include "tinyserver-metrics.h"
+#endif
+
+#define HttpStage_Closed      0
+#define HttpStage_Reading     1
+#define HttpStage_Handling    2
+#define HttpStage_SendingVec  3
+#define HttpStage_SendingFile 4
+#define HttpStage_Detached    5
+#define HttpStage_Accepting   6
+
+//================================
+// Internal
+//================================
+
+internal bool
+IsConnectionOption(ts_request* Request, string Option)
+{
+    // Connection is a list of options, matched ignoring case.
+    string Value = GetHeaderByKey(Request, "Connection");
+    for (usz Idx = 0; Idx + Option.WriteCur <= Value.WriteCur; Idx++)
+    {
+        usz Size = 0;
+        while (Size < Option.WriteCur
+               && (Value.Base[Idx + Size] | 0x20) == Option.Base[Size])
+        {
+            Size++;
+        }
+        bool StartsToken = (Idx == 0 || Value.Base[Idx-1] == ',' || Value.Base[Idx-1] == ' ');
+        bool EndsToken = (Idx + Size == Value.WriteCur || Value.Base[Idx + Size] == ','
+                          || Value.Base[Idx + Size] == ' ');
+        if (Size == Option.WriteCur && StartsToken && EndsToken)
+        {
+            return true;
+        }
+    }
+    return false;
+}
+
+internal void
+ResetHttpConn(ts_http_conn* Conn)
+{
+    Conn->DataStart = Conn->DataEnd = 0;
+    Conn->RequestSize = 0;
+    Conn->RequestCount = 0;
+    Conn->Responding = 0;
+    Conn->Admitted = 0;
+    memset(&Conn->Request, 0, sizeof(ts_request));
+}
+
+internal bool
+PostHttpConnOp(ts_http_conn* Conn, bool Posted)
+{
+    if (!Posted)
+    {
+        CloseHttpConn(Conn);
+    }
+    return Posted;
+}
+
+internal bool
+RecvMoreHttpData(ts_http_conn* Conn)
+{
+    // Data is only moved when the buffer end is reached, and the request is not
+    // at its start already. The request keeps its parsing state, since the
+    // header is changed while parsed, so it can't be parsed again.
+    
+    ts_http_server* Server = Conn->Server;
+    if (Conn->DataStart == Conn->DataEnd)
+    {
+        Conn->DataStart = Conn->DataEnd = 0;
+    }
+    else if (Conn->DataEnd == Server->BufferSize && Conn->DataStart > 0)
+    {
+        usz Size = Conn->DataEnd - Conn->DataStart;
+        memmove(Conn->Buffer, Conn->Buffer + Conn->DataStart, Size);
+        if (Conn->Request.Base)
+        {
+            Conn->Request.Base -= Conn->DataStart;
+        }
+        Conn->DataStart = 0;
+        Conn->DataEnd = Size;
+    }
+    
+    Conn->Stage = HttpStage_Reading;
+    Conn->Io.IoBuffer = Conn->Buffer + Conn->DataEnd;
+    Conn->Io.IoSize = (u32)(Server->BufferSize - Conn->DataEnd);
+    return PostHttpConnOp(Conn, RecvData(&Conn->Io));
+}
+
+internal bool
+RespondHttpError(ts_http_conn* Conn, u16 StatusCode)
+{
+    ts_response* Response = &Conn->Response;
+    memset(Response, 0, sizeof(ts_response));
+    Response->StatusCode = StatusCode;
+    Response->Version = HttpVersion_11;
+    Response->KeepAlive = 0;
+    Conn->Header.WriteCur = 0;
+    Conn->Responding = 0; // Not the handler's, nothing to release.
+    return SendHttpConnResponse(Conn);
+}
+
+internal bool
+RefuseHttpRequest(ts_http_conn* Conn, ts_admit Admit)
+{
+    string Canned = GetAdmitResponse(Admit);
+    memset(&Conn->Response, 0, sizeof(ts_response));
+    CopyData(Conn->Header.Base, Conn->Header.Size, Canned.Base, Canned.WriteCur);
+    Conn->Header.WriteCur = Canned.WriteCur;
+    Conn->Responding = 0;
+    return SendHttpConnResponse(Conn);
+}
+
+internal bool
+AdmitHttpConn(ts_http_conn* Conn)
+{
+    // Peer is checked before the first read is posted, so refused connections
+    // never take any request data (and with deferred accepts, connections that
+    // never send aren't seen at all).
+    ts_admit Admit = AdmitConn(Conn->Server->Admission, &Conn->Io.Peer);
+    if (Admit != Admit_Ok)
+    {
+        return RefuseHttpRequest(Conn, Admit);
+    }
+    Conn->Admitted = 1;
+    return RecvMoreHttpData(Conn);
+}
+
+internal ts_http_parse
+ParseHttpConnHeader(string Data, ts_request* Request)
+{
+#if defined(TINYSERVER_USE_METRICS)
+    u64 Start = GetMetricsClock();
+    ts_http_parse Result = ParseHttpHeader(Data, Request);
+    ObserveMetric(Metric_HttpParseTime, GetMetricsClock() - Start);
+    
+    if (Result == HttpParse_OK)
+    {
+        CountMetric(Metric_HttpRequests, 1);
+    }
+    else if (Result != HttpParse_HeaderIncomplete)
+    {
+        CountMetric(Metric_HttpParseErrors, 1);
+    }
+    return Result;
+#else
+    return ParseHttpHeader(Data, Request);
+#endif
+}
+
+#if defined(TINYSERVER_USE_METRICS)
+internal void
+ReleaseHttpMetrics(ts_http_conn* Conn)
+{
+    if (Conn->Metrics.Base)
+    {
+        FreeMemory(&Conn->Metrics);
+        Conn->Metrics.Base = NULL;
+    }
+}
+
+internal bool
+RespondHttpMetrics(ts_http_conn* Conn)
+{
+    // Scrapes are few, and can be larger than the connection's buffers, so they
+    // get memory of their own, freed once the response is done.
+    ts_response* Response = &Conn->Response;
+    Conn->Responding = 0; // Not the handler's, nothing to release.
+    if (Conn->Request.Verb != HttpVerb_Get && Conn->Request.Verb != HttpVerb_Head)
+    {
+        Response->StatusCode = 405;
+        Response->Allow = StringLit("GET, HEAD");
+        return SendHttpConnResponse(Conn);
+    }
+    
+    Conn->Metrics = GetMemory(HTTP_CONN_METRICS_SIZE, 0, MEM_WRITE);
+    string Out = String((char*)Conn->Metrics.Base, 0, Conn->Metrics.Size, EC_ASCII);
+    if (!Out.Base || !ExportMetrics(&Out))
+    {
+        ReleaseHttpMetrics(Conn);
+        Response->StatusCode = 500;
+        return SendHttpConnResponse(Conn);
+    }
+    
+    Response->Payload = Out.Base;
+    Response->PayloadSize = Out.WriteCur;
+    Response->MimeType = (char*)"text/plain; version=0.0.4";
+    return SendHttpConnResponse(Conn);
+}
+#endif // TINYSERVER_USE_METRICS
+
+internal bool
+DispatchHttpRequest(ts_http_conn* Conn)
+{
+    ts_http_server* Server = Conn->Server;
+    ts_request* Request = &Conn->Request;
+    ts_response* Response = &Conn->Response;
+    
+    if (Server->Admission)
+    {
+        ts_admit Admit = AdmitRequest(Server->Admission, &Conn->Io.Peer);
+        if (Admit != Admit_Ok)
+        {
+            return RefuseHttpRequest(Conn, Admit);
+        }
+    }
+    
+    // HTTP/1.1 keeps the connection unless asked not to, and older versions
+    // only if asked to.
+    bool KeepAlive = ((Request->Version == HttpVersion_11)
+                      ? !IsConnectionOption(Request, StringLit("close"))
+                      : IsConnectionOption(Request, StringLit("keep-alive")));
+    Conn->RequestCount++;
+    if (Server->MaxRequests && Conn->RequestCount >= Server->MaxRequests)
+    {
+        KeepAlive = false;
+    }
+    
+    memset(Response, 0, sizeof(ts_response));
+    Response->StatusCode = 200;
+    Response->Version = (Request->Version == HttpVersion_11) ? HttpVersion_11 : HttpVersion_10;
+    Response->KeepAlive = (u8)KeepAlive;
+    Conn->Header.WriteCur = 0;
+    Conn->PayloadFile = INVALID_FILE;
+    Conn->Responding = 1;
+    Conn->Stage = HttpStage_Handling;
+    
+#if defined(TINYSERVER_USE_METRICS)
+    if (Server->MetricsPath)
+    {
+        string Path = String(Request->Base + Request->UriOffset, Request->PathSize, 0, EC_UTF8);
+        string MetricsPath = String(Server->MetricsPath, strlen(Server->MetricsPath), 0, EC_UTF8);
+        if (EqualStrings(Path, MetricsPath))
+        {
+            return RespondHttpMetrics(Conn);
+        }
+    }
+#endif
+    
+    ts_http_action Action = Server->Handler(Conn, Request, Response);
+    switch (Action)
+    {
+        case HttpAction_Respond: return SendHttpConnResponse(Conn);
+        case HttpAction_Defer: return true;
+        case HttpAction_Detach:
+        {
+            Conn->Responding = 0;
+            Conn->Stage = HttpStage_Detached;
+            return true;
+        }
+        case HttpAction_Close: break;
+    }
+    CloseHttpConn(Conn);
+    return false;
+}
+
+internal bool
+ProcessHttpConnInput(ts_http_conn* Conn)
+{
+    ts_http_server* Server = Conn->Server;
+    string Data = String(Conn->Buffer + Conn->DataStart, Conn->DataEnd - Conn->DataStart,
+                         0, EC_ASCII);
+    
+    if (!Conn->RequestSize)
+    {
+        ts_http_parse Parse = (Data.WriteCur > 0
+                               ? ParseHttpConnHeader(Data, &Conn->Request)
+                               : HttpParse_HeaderIncomplete);
+        if (Parse == HttpParse_HeaderIncomplete)
+        {
+            if (Data.WriteCur == Server->BufferSize)
+            {
+                return RespondHttpError(Conn, 431);
+            }
+            return RecvMoreHttpData(Conn);
+        }
+        else if (Parse != HttpParse_OK)
+        {
+            return RespondHttpError(Conn, 400);
+        }
+        
+        // Chunked bodies aren't taken, and since the end of the request can't
+        // be known then, the connection is closed after the error.
+        if (GetHeaderByKey(&Conn->Request, "Transfer-Encoding").Base)
+        {
+            return RespondHttpError(Conn, 501);
+        }
+        usz BodySize = 0;
+        string Length = GetHeaderByKey(&Conn->Request, "Content-Length");
+        if (Length.Base && (BodySize = StringToUInt(Length)) == USZ_MAX)
+        {
+            return RespondHttpError(Conn, 400);
+        }
+        if (BodySize > Server->BufferSize - Conn->Request.HeaderSize)
+        {
+            return RespondHttpError(Conn, 413);
+        }
+        Conn->RequestSize = Conn->Request.HeaderSize + BodySize;
+    }
+    
+    if (Data.WriteCur < Conn->RequestSize)
+    {
+        return RecvMoreHttpData(Conn);
+    }
+    return DispatchHttpRequest(Conn);
+}
+
+internal bool
+FinishHttpResponse(ts_http_conn* Conn)
+{
+    if (Conn->Responding && Conn->Server->Done)
+    {
+        Conn->Server->Done(Conn);
+    }
+    Conn->Responding = 0;
+#if defined(TINYSERVER_USE_METRICS)
+    ReleaseHttpMetrics(Conn);
+#endif
+    
+    if (!Conn->Response.KeepAlive)
+    {
+        CloseHttpConn(Conn);
+        return false;
+    }
+    
+    // Next request may already be in the buffer, right after this one.
+    Conn->DataStart += Conn->RequestSize;
+    Conn->RequestSize = 0;
+    memset(&Conn->Request, 0, sizeof(ts_request));
+    return ProcessHttpConnInput(Conn);
+}
+
+
+//================================
+// Connection
+//================================
+
+external bool
+InitHttpConn(ts_http_conn* Conn, ts_http_server* Server, buffer* Arena)
+{
+    usz ArenaStart = Arena->WriteCur;
+    u8* Buffer = PushArray(Arena, Server->BufferSize, u8);
+    char* Header = PushArray(Arena, HTTP_CONN_HEADER_SIZE, char);
+    if (!Buffer || !Header)
+    {
+        Arena->WriteCur = ArenaStart;
+        return false;
+    }
+    
+    memset(Conn, 0, sizeof(ts_http_conn));
+    Conn->Io.Socket = INVALID_FILE;
+    Conn->Server = Server;
+    Conn->Buffer = Buffer;
+    Conn->Header = String(Header, 0, HTTP_CONN_HEADER_SIZE, EC_ASCII);
+    Conn->PayloadFile = INVALID_FILE;
+    return true;
+}
+
+external bool
+AcceptHttpConn(ts_listen Listening, ts_http_conn* Conn)
+{
+    // With admission, the first read waits until the peer is let in, so the
+    // connection is dequeued as accepted instead.
+    ResetHttpConn(Conn);
+    if (Conn->Server->Admission)
+    {
+        Conn->Stage = HttpStage_Accepting;
+        Conn->Io.IoBuffer = NULL;
+        Conn->Io.IoSize = 0;
+    }
+    else
+    {
+        Conn->Stage = HttpStage_Reading;
+        Conn->Io.IoBuffer = Conn->Buffer;
+        Conn->Io.IoSize = (u32)Conn->Server->BufferSize;
+    }
+    if (!AcceptConn(Listening, &Conn->Io))
+    {
+        Conn->Stage = HttpStage_Closed;
+        return false;
+    }
+    return true;
+}
+
+external bool
+StartHttpConn(ts_http_conn* Conn)
+{
+    ResetHttpConn(Conn);
+    return Conn->Server->Admission ? AdmitHttpConn(Conn) : RecvMoreHttpData(Conn);
+}
+
+external bool
+HandleHttpConn(ts_http_conn* Conn)
+{
+    ts_io* Io = &Conn->Io;
+    if (Io->Status != Status_Connected)
+    {
+        CloseHttpConn(Conn);
+        return false;
+    }
+    
+    switch (Conn->Stage)
+    {
+        case HttpStage_Accepting: return AdmitHttpConn(Conn);
+        
+        case HttpStage_Reading:
+        {
+            Conn->DataEnd += Io->BytesTransferred;
+            return ProcessHttpConnInput(Conn);
+        }
+        
+        case HttpStage_SendingVec:
+        {
+            // Partial sends are posted again from where they stopped.
+            usz Sent = Io->BytesTransferred;
+            while (Io->IoSize && Sent >= Io->IoVec[0].Size)
+            {
+                Sent -= Io->IoVec[0].Size;
+                Io->IoVec++;
+                Io->IoSize--;
+            }
+            if (Io->IoSize)
+            {
+                Io->IoVec[0].Base += Sent;
+                Io->IoVec[0].Size -= Sent;
+                return PostHttpConnOp(Conn, SendVector(Io));
+            }
+            
+            ts_response* Response = &Conn->Response;
+            if (Response->PayloadIsFile && Response->PayloadSize
+                && Conn->Request.Verb != HttpVerb_Head)
+            {
+                Conn->Stage = HttpStage_SendingFile;
+                Io->IoFile = Conn->PayloadFile;
+                Io->IoOffset = Response->RangeStart;
+                Io->IoSize = (u32)Min(Response->PayloadSize, U32_MAX);
+                Response->PayloadSize -= Io->IoSize;
+                return PostHttpConnOp(Conn, SendFile(Io));
+            }
+            return FinishHttpResponse(Conn);
+        }
+        
+        case HttpStage_SendingFile:
+        {
+            Io->IoSize -= (u32)Io->BytesTransferred;
+            if (!Io->IoSize && Conn->Response.PayloadSize)
+            {
+                Io->IoSize = (u32)Min(Conn->Response.PayloadSize, U32_MAX);
+                Conn->Response.PayloadSize -= Io->IoSize;
+            }
+            if (Io->IoSize)
+            {
+                return PostHttpConnOp(Conn, SendFile(Io));
+            }
+            return FinishHttpResponse(Conn);
+        }
+    }
+    
+    return true;
+}
+
+external bool
+SendHttpConnResponse(ts_http_conn* Conn)
+{
+    ts_response* Response = &Conn->Response;
+    if (!Conn->Header.WriteCur)
+    {
+#if defined(TINYSERVER_USE_METRICS)
+        u64 Start = GetMetricsClock();
+        CraftHttpResponseHeader(Response, &Conn->Header, Conn->Server->ServerName);
+        ObserveMetric(Metric_HttpCraftTime, GetMetricsClock() - Start);
+#else
+        CraftHttpResponseHeader(Response, &Conn->Header, Conn->Server->ServerName);
+#endif
+    }
+    
+    // Header, cookies and payload go out in a single send.
+    u32 VecCount = 0;
+    Conn->Vec[VecCount].Base = (u8*)Conn->Header.Base;
+    Conn->Vec[VecCount++].Size = Conn->Header.WriteCur;
+    if (Response->Cookies && Response->CookiesSize)
+    {
+        Conn->Vec[VecCount].Base = (u8*)Response->Cookies;
+        Conn->Vec[VecCount++].Size = Response->CookiesSize;
+    }
+    if (!Response->PayloadIsFile && Response->Payload && Response->PayloadSize
+        && Conn->Request.Verb != HttpVerb_Head)
+    {
+        Conn->Vec[VecCount].Base = (u8*)Response->Payload;
+        Conn->Vec[VecCount++].Size = Response->PayloadSize;
+    }
+    
+    Conn->Stage = HttpStage_SendingVec;
+    Conn->Io.IoVec = Conn->Vec;
+    Conn->Io.IoSize = VecCount;
+    return PostHttpConnOp(Conn, SendVector(&Conn->Io));
+}
+
+external void
+CloseHttpConn(ts_http_conn* Conn)
+{
+    if (Conn->Responding && Conn->Server->Done)
+    {
+        Conn->Server->Done(Conn);
+    }
+    Conn->Responding = 0;
+    Conn->Stage = HttpStage_Closed;
+#if defined(TINYSERVER_USE_METRICS)
+    ReleaseHttpMetrics(Conn);
+#endif
+    if (Conn->Admitted)
+    {
+        ReleaseConn(Conn->Server->Admission);
+        Conn->Admitted = 0;
+    }
+    
+    if (Conn->Io.Socket != INVALID_FILE)
+    {
+        if (Conn->Io.Status != Status_Connected
+            || !DisconnectSocket(&Conn->Io, TS_DISCONNECT_BOTH))
+        {
+            TerminateConn(&Conn->Io);
+        }
+    }
+    Conn->Io.Socket = INVALID_FILE;
+}
@@ -0,0 +1,159 @@
+#ifndef TINYSERVER_HTTPCONN_H
+//===========================================================================
+// tinyserver-httpconn.h
+//
+// Module that runs HTTP/1.x connections from start to end, tying the IO of
+// tinyserver.h to the parsing and crafting of tinyserver-http.h: reading,
+// parsing, calling a handler, sending the response, and reading the next
+// request on the same connection, for as long as it's kept alive. Each
+// connection reuses its ts_io and buffer for all of its requests, and
+// pipelined requests already received are parsed where they are, without
+// being copied.
+//
+// Blueprint:
+//   1. At startup, fill a ts_http_server with the request handler and
+//      limits, and call InitHttpConn() for each connection object, which
+//      can be reused for any number of connections, one after another.
+//   2. In the listening loop, call AcceptHttpConn() with a free object.
+//   3. In the io loop, pass each ts_io dequeued from WaitOnIoQueue() that
+//      belongs to an HTTP connection to HandleHttpConn(), cast back to
+//      ts_http_conn. If it returns false, the connection was closed, and
+//      the object is free again.
+//
+// The handler is called once per request, with the whole request (header
+// and body) in the buffer, and a ts_response set up for it. It fills the
+// response and returns HttpAction_Respond, and the header is crafted and
+// everything sent. The handler may also craft the header itself, into
+// [.Header] (e.g. with CraftStaticFileResponse() or a template), in which
+// case it's sent as is. For file payloads, set [.PayloadIsFile] and
+// [.PayloadFile], and the file is sent with SendFile() after the header.
+// On HttpAction_Detach, bytes received after the request, if any, are left
+// in [.Buffer], from [.DataStart] + [.RequestSize] up to [.DataEnd].
+//===========================================================================
+#define TINYSERVER_HTTPCONN_H
+
+#include "tinyserver.h"
+#include "tinyserver-http.h"
+
+#if !defined(HTTP_CONN_HEADER_SIZE)
+# define HTTP_CONN_HEADER_SIZE 2048 // Room for the response header.
+#endif
+#if defined(TINYSERVER_USE_METRICS) && !defined(HTTP_CONN_METRICS_SIZE)
+# define HTTP_CONN_METRICS_SIZE Kilobyte(64) // Room for the metrics exported.
+#endif
+
+typedef enum ts_http_action
+{
+    HttpAction_Respond, // Response is filled, send it.
+    HttpAction_Defer,   // Response is sent later, with SendHttpConnResponse().
+    HttpAction_Close,   // Close the connection without responding.
+    HttpAction_Detach   // Caller takes over the connection (e.g. upgrades).
+} ts_http_action;
+
+struct ts_http_conn;
+struct ts_admission; // See tinyserver-admission.h.
+typedef ts_http_action ts_http_handler(struct ts_http_conn* Conn, ts_request* Request,
+                                       ts_response* Response);
+typedef void ts_http_done(struct ts_http_conn* Conn);
+
+typedef struct ts_http_server
+{
+    ts_http_handler* Handler;
+    ts_http_done* Done; // Optional, called once each response is sent or dropped.
+    char* ServerName;   // Optional, see CraftHttpResponseHeader().
+    usz BufferSize;     // Largest request, header and body.
+    u32 MaxRequests;    // Per connection, 0 for no limit.
+    struct ts_admission* Admission; // Optional, limits connections and requests.
+#if defined(TINYSERVER_USE_METRICS)
+    char* MetricsPath;              // Optional, path ExportMetrics() is served at.
+#endif
+} ts_http_server;
+
+typedef struct ts_http_conn
+{
+    ts_io Io; // Important: must be first member!
+    ts_http_server* Server;
+    void* UserData; // Free for the caller.
+    
+    u8* Buffer;
+    usz DataStart;   // Start of the current request.
+    usz DataEnd;     // End of data received.
+    usz RequestSize; // Header and body, 0 until the header is parsed.
+    u32 RequestCount;
+    u8 Stage;
+    u8 Responding;
+    u8 Admitted;
+    
+    ts_request Request;
+    ts_response Response;
+    string Header;
+    file PayloadFile;
+    ts_io_vec Vec[3];
+#if defined(TINYSERVER_USE_METRICS)
+    buffer Metrics; // Exported for the current request, if asked for.
+#endif
+} ts_http_conn;
+
+external bool InitHttpConn(ts_http_conn* Conn, ts_http_server* Server, buffer* Arena);
+
+/* Sets up [Conn] to run connections of [Server], pushing its buffers to
+|  [Arena], which must have [.BufferSize] of [Server] plus HTTP_CONN_HEADER_SIZE
+|  bytes available.
+|--- Return: true if successful, false if [Arena] is out of space. */
+
+external bool AcceptHttpConn(ts_listen Listening, ts_http_conn* Conn);
+
+/* Accepts a connection on [Listening] into [Conn], which must be free, and
+|  posts the first read. With [.Admission] set in its server, the connection is
+|  dequeued as accepted first, and the read is only posted once the peer is let
+|  in by HandleHttpConn().
+|--- Return: true if successful, false if not. */
+
+external bool StartHttpConn(ts_http_conn* Conn);
+
+/* Posts the first read on [Conn], whose [.Io] was already connected some other
+|  way, e.g. accepted and then taken through a TLS handshake with
+|  tinyserver-tls.h. Only [.Io] is assigned beforehand. With [.Admission] set
+|  in its server, the peer is checked first, as in HandleHttpConn().
+|--- Return: true if successful, false if not, in which case the connection
+|    is closed. */
+
+external bool HandleHttpConn(ts_http_conn* Conn);
+
+/* Moves [Conn] forward after an operation on it was dequeued by
+|  WaitOnIoQueue(), posting the next one. Whole requests received are passed to
+|  the handler. Requests that can't be parsed, are larger than the buffer, or
+|  come with a Transfer-Encoding get an error response, and the connection is
+|  closed. With [.Admission] set, the connection is let in before anything is
+|  read from it, and each request is checked too; refused ones get the canned
+|  response of GetAdmitResponse(), and the connection is closed. When
+|  compiled with TINYSERVER_USE_METRICS, parsing and crafting are recorded in
+|  the HTTP metrics of tinyserver-metrics.h, and with [.MetricsPath] set, GET
+|  and HEAD requests for that path get ExportMetrics() instead of going to the
+|  handler (other verbs get a 405). After a response, the connection is closed if the
+|  request or the response asked for it, or if it reached [.MaxRequests];
+|  otherwise the next request is read, starting from bytes already received,
+|  if any.
+|--- Return: true if the connection goes on (or was deferred or detached), or
+|    false if it was closed, in which case [Conn] is free again. */
+
+external bool SendHttpConnResponse(ts_http_conn* Conn);
+
+/* Sends the response in [.Response] of [Conn], after the handler returned
+|  HttpAction_Defer, e.g. once data from an upstream server arrived. May be
+|  called from any thread, but only once per request.
+|--- Return: true if successful, false if not, in which case the connection
+|    is closed. */
+
+external void CloseHttpConn(ts_http_conn* Conn);
+
+/* Closes the connection in [Conn], e.g. a deferred one that can't be answered,
+|  or one that was detached and is done. [Conn] is free again after this.
+|--- Return: nothing. */
+
+
+#if !defined(TINYSERVER_STATIC_LINKING)
+#include "tinyserver-httpconn.c"
+#endif
+
+#endif //TINYSERVER_HTTPCONN_H
@@ -3,6 +3,15 @@
 
 #define MAX_DEQUEUE 64
 
+// The IO core only records its built-in metrics (see tinyserver-metrics.h)
+// when compiled with TINYSERVER_USE_METRICS, else TS_METRIC() drops them.
+#if defined(TINYSERVER_USE_METRICS)
+# include "tinyserver-metrics.h"
+# define TS_METRIC(Call) Call
+#else
+# define TS_METRIC(Call)
+#endif
+
 typedef struct ts_server_info
 {
     usz ListenCount;
@@ -21,6 +30,7 @@ typedef struct ts_server_info
     mpmc_ringbuf WorkQueue; // Only relevant on epoll.
     buffer WorkQueueMem;    // Only relevant on epoll.
     u8 WorkSemaphore[32];   // Only relevant on epoll.
+    volatile usz WorkQueueDepth; // Only relevant on epoll.
 } ts_server_info;
 
 global buffer gServerArena;
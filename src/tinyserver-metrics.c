@@ -0,0 +1,534 @@
+#include <string.h>
+#include <time.h>
+
+#if defined(_MSC_VER)
+# include <intrin.h>
+#endif
+
+#if !defined(TS_THREAD_LOCAL)
+# if defined(_MSC_VER)
+#  define TS_THREAD_LOCAL __declspec(thread)
+# else
+#  define TS_THREAD_LOCAL __thread
+# endif
+#endif
+
+//================================
+// Internal
+//================================
+
+typedef struct ts_metric
+{
+    const char* Name; // Usually literals, so never written.
+    const char* Labels;
+    const char* Help;
+    ts_metric_type Type;
+    u32 Histogram;        // Slot in each shard, for histograms.
+    ts_metric_read* Read; // For gauges read instead of set.
+    volatile u64 Value;   // For gauges set.
+} ts_metric;
+
+// Each thread only writes to its own shard, which is allocated apart, so no
+// two threads ever share a cache line. The last bucket of each histogram
+// keeps the sum of its values.
+typedef struct ts_metrics_shard
+{
+    volatile u64 Counters[METRICS_MAX];
+    volatile u64 Histograms[METRICS_MAX_HISTOGRAMS][METRICS_HISTOGRAM_BUCKETS + 1];
+} ts_metrics_shard;
+
+#define METRICS_BUILTIN_HISTOGRAMS 10
+
+global ts_metric gMetrics[METRICS_MAX] =
+{
+    { "tinyserver_accepted_connections_total", NULL, "Connections accepted.", Metric_Counter },
+    { "tinyserver_io_events_total", NULL, "Readiness events returned by the kernel.",
+      Metric_Counter },
+    { "tinyserver_work_queue_full_total", NULL, "Times the work queue was found full.",
+      Metric_Counter },
+    { "tinyserver_work_queue_depth", NULL, "Operations waiting in the work queue.",
+      Metric_Gauge },
+    { "tinyserver_work_queue_wait_seconds", NULL, "Time operations waited in the work queue.",
+      Metric_Histogram, 0 },
+    { "tinyserver_received_bytes_total", NULL, "Bytes received.", Metric_Counter },
+    { "tinyserver_sent_bytes_total", NULL, "Bytes sent.", Metric_Counter },
+    { "tinyserver_op_errors_total", NULL, "Operations that failed.", Metric_Counter },
+    { "tinyserver_op_seconds", "op=\"recv\"", "Time doing operations once ready.",
+      Metric_Histogram, 1 },
+    { "tinyserver_op_seconds", "op=\"send\"", NULL, Metric_Histogram, 2 },
+    { "tinyserver_op_seconds", "op=\"sendfile\"", NULL, Metric_Histogram, 3 },
+    { "tinyserver_op_seconds", "op=\"sendvector\"", NULL, Metric_Histogram, 4 },
+    { "tinyserver_op_seconds", "op=\"proxy\"", NULL, Metric_Histogram, 5 },
+    { "tinyserver_op_seconds", "op=\"recvdatagrams\"", NULL, Metric_Histogram, 6 },
+    { "tinyserver_op_seconds", "op=\"senddatagrams\"", NULL, Metric_Histogram, 7 },
+    { "tinyserver_http_requests_total", NULL, "HTTP request headers parsed.", Metric_Counter },
+    { "tinyserver_http_parse_errors_total", NULL, "HTTP request headers refused.",
+      Metric_Counter },
+    { "tinyserver_http_parse_seconds", NULL, "Time parsing HTTP request headers, per call.",
+      Metric_Histogram, 8 },
+    { "tinyserver_http_craft_seconds", NULL, "Time crafting HTTP response headers.",
+      Metric_Histogram, 9 }
+};
+
+global u32 gMetricCount = Metric_BuiltinCount;
+global u32 gHistogramCount = METRICS_BUILTIN_HISTOGRAMS;
+
+global ts_metrics_shard* volatile gMetricsShards[METRICS_MAX_THREADS];
+global volatile u32 gMetricsShardCount;
+global ts_metrics_shard gSharedMetricsShard;
+global TS_THREAD_LOCAL ts_metrics_shard* tMetricsShard;
+
+#if defined(TT_WINDOWS)
+global u64 gMetricsClockFrequency;
+#endif
+
+internal ts_metrics_shard*
+GetMetricsShard(void)
+{
+    ts_metrics_shard* Shard = tMetricsShard;
+    if (!Shard)
+    {
+        // Shard is published before the thread records anything in it, so
+        // readers can skip slots claimed but not published yet.
+        Shard = &gSharedMetricsShard;
+#if defined(_MSC_VER)
+        u32 Idx = (u32)_InterlockedIncrement((volatile long*)&gMetricsShardCount) - 1;
+#else
+        u32 Idx = __atomic_fetch_add(&gMetricsShardCount, 1, __ATOMIC_RELAXED);
+#endif
+        if (Idx < METRICS_MAX_THREADS)
+        {
+            buffer Mem = GetMemory(sizeof(ts_metrics_shard), 0, MEM_WRITE);
+            if (Mem.Base)
+            {
+                Shard = (ts_metrics_shard*)Mem.Base;
+#if defined(_MSC_VER)
+                _InterlockedExchangePointer((void* volatile*)&gMetricsShards[Idx], Shard);
+#else
+                __atomic_store_n(&gMetricsShards[Idx], Shard, __ATOMIC_RELEASE);
+#endif
+            }
+        }
+        tMetricsShard = Shard;
+    }
+    return Shard;
+}
+
+internal u32
+GetMetricsShards(ts_metrics_shard** Shards)
+{
+#if defined(_MSC_VER)
+    u32 Claimed = gMetricsShardCount;
+#else
+    u32 Claimed = __atomic_load_n(&gMetricsShardCount, __ATOMIC_ACQUIRE);
+#endif
+    u32 Count = 0;
+    for (u32 Idx = 0; Idx < Min(Claimed, METRICS_MAX_THREADS); Idx++)
+    {
+#if defined(_MSC_VER)
+        ts_metrics_shard* Shard = gMetricsShards[Idx];
+#else
+        ts_metrics_shard* Shard = __atomic_load_n(&gMetricsShards[Idx], __ATOMIC_ACQUIRE);
+#endif
+        if (Shard)
+        {
+            Shards[Count++] = Shard;
+        }
+    }
+    Shards[Count++] = &gSharedMetricsShard;
+    return Count;
+}
+
+internal void
+AddToMetricSlot(ts_metrics_shard* Shard, volatile u64* Slot, u64 Amount)
+{
+    // A thread's own shard needs no atomic add, only a whole store, so that
+    // readers never see half of it.
+    if (Shard != &gSharedMetricsShard)
+    {
+#if defined(_MSC_VER)
+        *Slot += Amount;
+#else
+        __atomic_store_n(Slot, *Slot + Amount, __ATOMIC_RELAXED);
+#endif
+    }
+    else
+    {
+#if defined(_MSC_VER)
+        _InterlockedExchangeAdd64((volatile __int64*)Slot, (__int64)Amount);
+#else
+        __atomic_add_fetch(Slot, Amount, __ATOMIC_RELAXED);
+#endif
+    }
+}
+
+internal u64
+ReadMetricSlot(volatile u64* Slot)
+{
+#if defined(_MSC_VER)
+    return *Slot;
+#else
+    return __atomic_load_n(Slot, __ATOMIC_RELAXED);
+#endif
+}
+
+internal u32
+GetHistogramBucket(u64 Value)
+{
+    // Values under 4 get a bucket each. Past that, the top bit picks the power
+    // of 2, and the 2 bits below it the quarter of it.
+    if (Value < 4)
+    {
+        return (u32)Value;
+    }
+#if defined(_MSC_VER)
+    unsigned long TopBit;
+    _BitScanReverse64(&TopBit, Value);
+    u32 Exp = (u32)TopBit;
+#else
+    u32 Exp = 63 - (u32)__builtin_clzll(Value);
+#endif
+    u32 Result = (Exp - 1) * 4 + (u32)((Value >> (Exp - 2)) & 3);
+    return Min(Result, METRICS_HISTOGRAM_BUCKETS - 1);
+}
+
+internal u64
+GetHistogramBucketEnd(u32 Bucket)
+{
+    // Largest value that falls in [Bucket].
+    if (Bucket < 4)
+    {
+        return Bucket;
+    }
+    u32 Exp = Bucket / 4 + 1;
+    return ((u64)(5 + Bucket % 4) << (Exp - 2)) - 1;
+}
+
+internal u64
+SumHistogram(u32 Id, u64* Buckets)
+{
+    // [Buckets] takes METRICS_HISTOGRAM_BUCKETS plus the sum.
+    ts_metrics_shard* Shards[METRICS_MAX_THREADS + 1];
+    u32 ShardCount = GetMetricsShards(Shards);
+    u32 Slot = gMetrics[Id].Histogram;
+    
+    memset(Buckets, 0, (METRICS_HISTOGRAM_BUCKETS + 1) * sizeof(u64));
+    for (u32 ShardIdx = 0; ShardIdx < ShardCount; ShardIdx++)
+    {
+        volatile u64* Histogram = Shards[ShardIdx]->Histograms[Slot];
+        for (u32 Idx = 0; Idx <= METRICS_HISTOGRAM_BUCKETS; Idx++)
+        {
+            Buckets[Idx] += ReadMetricSlot(&Histogram[Idx]);
+        }
+    }
+    
+    u64 Count = 0;
+    for (u32 Idx = 0; Idx < METRICS_HISTOGRAM_BUCKETS; Idx++)
+    {
+        Count += Buckets[Idx];
+    }
+    return Count;
+}
+
+internal usz
+FormatMetricValue(char* Dst, u64 Value, bool Seconds)
+{
+    // Seconds are given in nanoseconds, and written with as many decimals as
+    // needed, so bucket bounds come out exact.
+    u64 Whole = Seconds ? Value / 1000000000 : Value;
+    u64 Fraction = Seconds ? Value % 1000000000 : 0;
+    
+    char Digits[20];
+    usz DigitCount = 0;
+    do
+    {
+        Digits[DigitCount++] = (char)('0' + Whole % 10);
+        Whole /= 10;
+    } while (Whole);
+    
+    usz Size = 0;
+    while (DigitCount)
+    {
+        Dst[Size++] = Digits[--DigitCount];
+    }
+    if (Fraction)
+    {
+        Dst[Size++] = '.';
+        for (u64 Unit = 100000000; Fraction; Unit /= 10)
+        {
+            Dst[Size++] = (char)('0' + Fraction / Unit);
+            Fraction %= Unit;
+        }
+    }
+    Dst[Size] = '\0';
+    return Size;
+}
+
+internal bool
+AppendMetricText(string* Out, const char* Text)
+{
+    usz Size = strlen(Text);
+    if (Out->Size - Out->WriteCur < Size)
+    {
+        return false;
+    }
+    CopyData(Out->Base + Out->WriteCur, Size, (char*)Text, Size);
+    Out->WriteCur += Size;
+    return true;
+}
+
+internal bool
+AppendMetricSample(string* Out, ts_metric* Metric, const char* Suffix, _opt const char* Le,
+                   u64 Value, bool Seconds)
+{
+    // Written as: name[suffix]{labels,le="bound"} value
+    bool Result = AppendMetricText(Out, Metric->Name) && AppendMetricText(Out, Suffix);
+    if (Metric->Labels || Le)
+    {
+        Result = Result && AppendMetricText(Out, "{");
+        if (Metric->Labels)
+        {
+            Result = Result && AppendMetricText(Out, Metric->Labels);
+        }
+        if (Le)
+        {
+            Result = (Result && AppendMetricText(Out, Metric->Labels ? ",le=\"" : "le=\"")
+                      && AppendMetricText(Out, Le) && AppendMetricText(Out, "\""));
+        }
+        Result = Result && AppendMetricText(Out, "}");
+    }
+    
+    char Number[32];
+    FormatMetricValue(Number, Value, Seconds);
+    return (Result && AppendMetricText(Out, " ") && AppendMetricText(Out, Number)
+            && AppendMetricText(Out, "\n"));
+}
+
+internal bool
+AppendMetricFamily(string* Out, ts_metric* Metric)
+{
+    const char* Types[] = { "counter", "gauge", "histogram" };
+    bool Result = true;
+    if (Metric->Help)
+    {
+        Result = (AppendMetricText(Out, "# HELP ") && AppendMetricText(Out, Metric->Name)
+                  && AppendMetricText(Out, " ") && AppendMetricText(Out, Metric->Help)
+                  && AppendMetricText(Out, "\n"));
+    }
+    return (Result && AppendMetricText(Out, "# TYPE ") && AppendMetricText(Out, Metric->Name)
+            && AppendMetricText(Out, " ") && AppendMetricText(Out, Types[Metric->Type])
+            && AppendMetricText(Out, "\n"));
+}
+
+
+//================================
+// Recording
+//================================
+
+external u32
+AddMetric(const char* Name, _opt const char* Labels, const char* Help, ts_metric_type Type)
+{
+    if (gMetricCount == METRICS_MAX
+        || (Type == Metric_Histogram && gHistogramCount == METRICS_MAX_HISTOGRAMS))
+    {
+        return METRICS_INVALID_ID;
+    }
+    
+    ts_metric* Metric = &gMetrics[gMetricCount];
+    memset(Metric, 0, sizeof(ts_metric));
+    Metric->Name = Name;
+    Metric->Labels = Labels;
+    Metric->Help = Help;
+    Metric->Type = Type;
+    if (Type == Metric_Histogram)
+    {
+        Metric->Histogram = gHistogramCount++;
+    }
+    return gMetricCount++;
+}
+
+external void
+CountMetric(u32 Id, u64 Amount)
+{
+    if (Id < gMetricCount && gMetrics[Id].Type == Metric_Counter)
+    {
+        ts_metrics_shard* Shard = GetMetricsShard();
+        AddToMetricSlot(Shard, &Shard->Counters[Id], Amount);
+    }
+}
+
+external void
+SetMetricGauge(u32 Id, u64 Value)
+{
+    if (Id < gMetricCount && gMetrics[Id].Type == Metric_Gauge)
+    {
+#if defined(_MSC_VER)
+        gMetrics[Id].Value = Value;
+#else
+        __atomic_store_n(&gMetrics[Id].Value, Value, __ATOMIC_RELAXED);
+#endif
+    }
+}
+
+external void
+SetMetricReader(u32 Id, ts_metric_read* Read)
+{
+    if (Id < gMetricCount && gMetrics[Id].Type == Metric_Gauge)
+    {
+        gMetrics[Id].Read = Read;
+    }
+}
+
+external void
+ObserveMetric(u32 Id, u64 Nanoseconds)
+{
+    if (Id < gMetricCount && gMetrics[Id].Type == Metric_Histogram)
+    {
+        ts_metrics_shard* Shard = GetMetricsShard();
+        volatile u64* Histogram = Shard->Histograms[gMetrics[Id].Histogram];
+        AddToMetricSlot(Shard, &Histogram[GetHistogramBucket(Nanoseconds)], 1);
+        AddToMetricSlot(Shard, &Histogram[METRICS_HISTOGRAM_BUCKETS], Nanoseconds);
+    }
+}
+
+external u64
+GetMetricsClock(void)
+{
+#if defined(TT_WINDOWS)
+    if (!gMetricsClockFrequency)
+    {
+        LARGE_INTEGER Frequency;
+        QueryPerformanceFrequency(&Frequency);
+        gMetricsClockFrequency = (u64)Frequency.QuadPart;
+    }
+    LARGE_INTEGER Counter;
+    QueryPerformanceCounter(&Counter);
+    u64 Ticks = (u64)Counter.QuadPart;
+    return ((Ticks / gMetricsClockFrequency) * 1000000000
+            + (Ticks % gMetricsClockFrequency) * 1000000000 / gMetricsClockFrequency);
+#else
+    struct timespec Now;
+    clock_gettime(CLOCK_MONOTONIC, &Now);
+    return (u64)Now.tv_sec * 1000000000 + (u64)Now.tv_nsec;
+#endif
+}
+
+
+//================================
+// Reading
+//================================
+
+external u64
+GetMetricTotal(u32 Id)
+{
+    if (Id >= gMetricCount)
+    {
+        return 0;
+    }
+    
+    ts_metric* Metric = &gMetrics[Id];
+    u64 Result = 0;
+    if (Metric->Type == Metric_Gauge)
+    {
+        Result = Metric->Read ? Metric->Read() : ReadMetricSlot(&Metric->Value);
+    }
+    else if (Metric->Type == Metric_Histogram)
+    {
+        u64 Buckets[METRICS_HISTOGRAM_BUCKETS + 1];
+        Result = SumHistogram(Id, Buckets);
+    }
+    else
+    {
+        ts_metrics_shard* Shards[METRICS_MAX_THREADS + 1];
+        u32 ShardCount = GetMetricsShards(Shards);
+        for (u32 Idx = 0; Idx < ShardCount; Idx++)
+        {
+            Result += ReadMetricSlot(&Shards[Idx]->Counters[Id]);
+        }
+    }
+    return Result;
+}
+
+external u64
+GetMetricQuantile(u32 Id, f64 Quantile)
+{
+    if (Id >= gMetricCount || gMetrics[Id].Type != Metric_Histogram)
+    {
+        return 0;
+    }
+    
+    u64 Buckets[METRICS_HISTOGRAM_BUCKETS + 1];
+    u64 Count = SumHistogram(Id, Buckets);
+    if (!Count)
+    {
+        return 0;
+    }
+    
+    // Rank of the value wanted, rounded up, from 1 to [Count].
+    f64 Position = Quantile * (f64)Count;
+    u64 Rank = (Position > 0.0) ? (u64)Position : 0;
+    if ((f64)Rank < Position) Rank++;
+    Rank = Min(Max(Rank, 1), Count);
+    
+    u64 Seen = 0;
+    for (u32 Idx = 0; Idx < METRICS_HISTOGRAM_BUCKETS; Idx++)
+    {
+        Seen += Buckets[Idx];
+        if (Seen >= Rank)
+        {
+            return GetHistogramBucketEnd(Idx);
+        }
+    }
+    return GetHistogramBucketEnd(METRICS_HISTOGRAM_BUCKETS - 1);
+}
+
+external bool
+ExportMetrics(string* Out)
+{
+    for (u32 Id = 0; Id < gMetricCount; Id++)
+    {
+        ts_metric* Metric = &gMetrics[Id];
+        if ((Id == 0 || strcmp(Metric->Name, gMetrics[Id-1].Name) != 0)
+            && !AppendMetricFamily(Out, Metric))
+        {
+            return false;
+        }
+        
+        if (Metric->Type != Metric_Histogram)
+        {
+            if (!AppendMetricSample(Out, Metric, "", NULL, GetMetricTotal(Id), false))
+            {
+                return false;
+            }
+            continue;
+        }
+        
+        // Bounds are powers of 2 in nanoseconds, where buckets start, so each
+        // takes all buckets before the one starting there.
+        u64 Buckets[METRICS_HISTOGRAM_BUCKETS + 1];
+        u64 Count = SumHistogram(Id, Buckets);
+        u64 Cumulative = 0;
+        u32 Idx = 0;
+        for (u32 Exp = 10; Exp <= 36; Exp += 2)
+        {
+            for (; Idx < (Exp - 1) * 4; Idx++)
+            {
+                Cumulative += Buckets[Idx];
+            }
+            char Le[32];
+            FormatMetricValue(Le, (u64)1 << Exp, true);
+            if (!AppendMetricSample(Out, Metric, "_bucket", Le, Cumulative, false))
+            {
+                return false;
+            }
+        }
+        if (!AppendMetricSample(Out, Metric, "_bucket", "+Inf", Count, false)
+            || !AppendMetricSample(Out, Metric, "_sum", NULL,
+                                   Buckets[METRICS_HISTOGRAM_BUCKETS], true)
+            || !AppendMetricSample(Out, Metric, "_count", NULL, Count, false))
+        {
+            return false;
+        }
+    }
+    return true;
+}
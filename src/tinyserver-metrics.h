@@ -0,0 +1,142 @@
+#ifndef TINYSERVER_METRICS_H
+//===========================================================================
+// tinyserver-metrics.h
+//
+// Module for keeping counters, gauges and latency histograms of the server,
+// and exporting them in the Prometheus text format. More can be added with
+// AddMetric(). When the project is compiled with TINYSERVER_USE_METRICS, the
+// IO core and tinyserver-httpconn.h record the built-in ones (see
+// ts_builtin_metric); otherwise they don't take the time or include this.
+//
+// Recording never locks, and threads never write to the same cache lines:
+// each thread gets its own shard of counters and histograms the first time
+// it records, and only adds to it, with plain stores. Shards are only added
+// up when read, by GetMetricTotal(), GetMetricQuantile() or ExportMetrics(),
+// and are kept after their threads exit, so counters never go back. Threads
+// past METRICS_MAX_THREADS share one last shard, updated atomically.
+//
+// Histograms are log-linear, as HDR histograms are: each power of 2 is cut
+// in 4 buckets, so values (in nanoseconds) are kept within 25%, from 1ns up
+// to about 36 minutes. They're exported with buckets at every power of 4
+// from about 1us to 68s, in seconds.
+//
+// Blueprint:
+//   1. At startup, before any thread records, add metrics with AddMetric().
+//   2. Record with CountMetric(), SetMetricGauge() and ObserveMetric(), with
+//      times taken from GetMetricsClock().
+//   3. Call ExportMetrics() on each scrape, or set [.MetricsPath] of
+//      ts_http_server in tinyserver-httpconn.h to have it served there
+//      (with TINYSERVER_USE_METRICS only).
+//===========================================================================
+#define TINYSERVER_METRICS_H
+
+#include "tinybase-platform.h"
+#include "tinybase-strings.h"
+
+#if !defined(METRICS_MAX)
+# define METRICS_MAX 64 // Metrics in all, built-in ones included.
+#endif
+#if !defined(METRICS_MAX_HISTOGRAMS)
+# define METRICS_MAX_HISTOGRAMS 24 // Histograms in all, built-in ones included.
+#endif
+#if !defined(METRICS_MAX_THREADS)
+# define METRICS_MAX_THREADS 64 // Threads with a shard of their own.
+#endif
+
+#define METRICS_HISTOGRAM_BUCKETS 160
+#define METRICS_INVALID_ID U32_MAX
+
+typedef enum ts_metric_type
+{
+    Metric_Counter,  // Only goes up, added to with CountMetric().
+    Metric_Gauge,    // Set with SetMetricGauge(), or read with SetMetricReader().
+    Metric_Histogram // Values observed with ObserveMetric(), in nanoseconds.
+} ts_metric_type;
+
+typedef enum ts_builtin_metric
+{
+    Metric_Accepts,           // Connections accepted.
+    Metric_IoEvents,          // Readiness events returned by the kernel.
+    Metric_WorkQueueFull,     // Times the work queue was found full.
+    Metric_WorkQueueDepth,    // Gauge, operations waiting in the work queue.
+    Metric_WorkQueueWait,     // Histogram, time from queued to dequeued.
+    Metric_BytesReceived,
+    Metric_BytesSent,
+    Metric_OpErrors,          // Operations that ended in Status_Error.
+    Metric_OpRecv,            // Histograms, time WaitOnIoQueue() spends doing
+    Metric_OpSend,            // each operation once its socket is ready.
+    Metric_OpSendFile,
+    Metric_OpSendVector,
+    Metric_OpProxy,
+    Metric_OpRecvDatagrams,
+    Metric_OpSendDatagrams,
+    Metric_HttpRequests,      // Request headers parsed.
+    Metric_HttpParseErrors,   // Request headers refused.
+    Metric_HttpParseTime,     // Histogram, time per ParseHttpHeader() call.
+    Metric_HttpCraftTime,     // Histogram, time crafting a response header
+                              // when the handler didn't.
+    Metric_BuiltinCount
+} ts_builtin_metric;
+
+typedef u64 ts_metric_read(void);
+
+external u32 AddMetric(const char* Name, _opt const char* Labels, const char* Help,
+                       ts_metric_type Type);
+
+/* Adds a metric named [Name], with [Labels] (e.g. "op=\"recv\"", or NULL)
+|  and [Help] text, all kept as pointers. Metrics that only differ in labels
+|  must be added one after another, so they're exported together. Not thread
+|  safe: call at startup, before anything is recorded.
+|--- Return: id of the metric, or METRICS_INVALID_ID if there's no room left. */
+
+external void CountMetric(u32 Id, u64 Amount);
+
+/* Adds [Amount] to the counter [Id].
+|--- Return: nothing. */
+
+external void SetMetricGauge(u32 Id, u64 Value);
+
+/* Sets the gauge [Id] to [Value].
+|--- Return: nothing. */
+
+external void SetMetricReader(u32 Id, ts_metric_read* Read);
+
+/* Has the gauge [Id] read with [Read] each time it's read, instead of being
+|  set, for values kept somewhere else (e.g. a queue depth).
+|--- Return: nothing. */
+
+external void ObserveMetric(u32 Id, u64 Nanoseconds);
+
+/* Adds a value of [Nanoseconds] to the histogram [Id].
+|--- Return: nothing. */
+
+external u64 GetMetricsClock(void);
+
+/* Gets the time for measuring durations to observe, from a monotonic clock.
+|--- Return: time in nanoseconds, from an arbitrary start. */
+
+external u64 GetMetricTotal(u32 Id);
+
+/* Adds up the counter [Id] from all threads, or reads the gauge [Id].
+|--- Return: value of the metric, or values observed for a histogram. */
+
+external u64 GetMetricQuantile(u32 Id, f64 Quantile);
+
+/* Estimates the [Quantile] (e.g. 0.99) of the values observed for the
+|  histogram [Id], from all threads.
+|--- Return: upper bound of the bucket the quantile falls in, in
+|    nanoseconds, or 0 if nothing was observed. */
+
+external bool ExportMetrics(string* Out);
+
+/* Writes all metrics to [Out] in the Prometheus text format (version
+|  0.0.4), histograms in seconds. May be called from any thread, while
+|  others record.
+|--- Return: true if successful, false if [Out] ran out of space. */
+
+
+#if !defined(TINYSERVER_STATIC_LINKING)
+#include "tinyserver-metrics.c"
+#endif
+
+#endif //TINYSERVER_METRICS_H
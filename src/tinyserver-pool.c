@@ -0,0 +1,330 @@
+#include <time.h>
+
+//================================
+// Internal
+//================================
+
+internal u32
+HashSockAddr(ts_sockaddr Addr)
+{
+    u32 Hash = 2166136261u; // FNV-1a.
+    for (u32 Idx = 0; Idx < Addr.Size; Idx++)
+    {
+        Hash = (Hash ^ Addr.Addr[Idx]) * 16777619u;
+    }
+    return Hash;
+}
+
+internal ts_pool_host*
+GetPoolHost(ts_conn_pool* Pool, ts_sockaddr Addr)
+{
+    // Lookups go on past removed hosts, and a new host takes the first one it
+    // went past, if any. The table is kept at most 3/4 full of hosts in use, and
+    // a new host is refused once it's reached.
+    u32 Hash = HashSockAddr(Addr);
+    u32 Idx = Hash & Pool->HostMask;
+    ts_pool_host* Free = NULL;
+    for (u32 Probes = 0; Probes <= Pool->HostMask; Probes++)
+    {
+        ts_pool_host* Host = &Pool->Hosts[Idx];
+        if (!Host->Addr.Size)
+        {
+            if (!Free) Free = Host;
+            if (!Host->IsRemoved) break;
+        }
+        else if (Host->Hash == Hash && Host->Addr.Size == Addr.Size
+                 && memcmp(Host->Addr.Addr, Addr.Addr, Addr.Size) == 0)
+        {
+            return Host;
+        }
+        Idx = (Idx + 1) & Pool->HostMask;
+    }
+    
+    if (!Free || (Pool->HostCount + 1) * 4 > (Pool->HostMask + 1) * 3)
+    {
+        return NULL;
+    }
+    Free->Addr = Addr;
+    Free->Hash = Hash;
+    Free->IsRemoved = 0;
+    Pool->HostCount++;
+    return Free;
+}
+
+internal void
+ReleasePoolHost(ts_conn_pool* Pool, ts_pool_host* Host, i64 Now)
+{
+    // A host left without connections, and without recent failures to remember,
+    // is removed, and its slot turns into a tombstone. Tombstones only matter if
+    // a host in use comes after them, so a run of them that ends in an empty
+    // slot (or fills the table) is emptied.
+    if (Host->ActiveCount || Host->IdleCount || (Host->Failures && Host->DownUntil > Now))
+    {
+        return;
+    }
+    
+    u32 Idx = (u32)(Host - Pool->Hosts);
+    memset(Host, 0, sizeof(ts_pool_host));
+    Host->IsRemoved = 1;
+    Pool->HostCount--;
+    
+    u32 End = Idx;
+    for (u32 Probes = 0; Probes <= Pool->HostMask && Pool->Hosts[End].IsRemoved; Probes++)
+    {
+        End = (End + 1) & Pool->HostMask;
+    }
+    if (!Pool->Hosts[End].Addr.Size)
+    {
+        if (!Pool->Hosts[End].IsRemoved) End = (End - 1) & Pool->HostMask;
+        while (Pool->Hosts[End].IsRemoved)
+        {
+            Pool->Hosts[End].IsRemoved = 0;
+            End = (End - 1) & Pool->HostMask;
+        }
+    }
+}
+
+internal bool
+IsConnStillOpen(ts_pooled_conn* Conn)
+{
+    // An idle connection has nothing to read, unless the upstream closed it
+    // (recv of 0), or sent something unasked for. Either way it can't be used.
+#if defined(TT_LINUX)
+    u8 Byte;
+    ssize_t Result = recv(Conn->Io.Socket, &Byte, 1, MSG_PEEK | MSG_DONTWAIT);
+    return (Result == -1 && (errno == EAGAIN || errno == EWOULDBLOCK));
+#else
+    return true;
+#endif
+}
+
+internal void
+FreePooledConn(ts_conn_pool* Pool, ts_pooled_conn* Conn)
+{
+    if (Conn->Io.Socket != INVALID_FILE)
+    {
+        TerminateConn(&Conn->Io);
+    }
+    Conn->Next = Pool->Free;
+    Pool->Free = Conn;
+}
+
+internal void
+TakeBackConns(ts_conn_pool* Pool)
+{
+    // Other threads push to [.Returned] with a CAS, and the owner takes the
+    // whole list at once, so there's no ABA problem.
+#if defined(_MSC_VER)
+    ts_pooled_conn* Conn = (ts_pooled_conn*)_InterlockedExchangePointer((void* volatile*)&Pool->Returned, NULL);
+#else
+    ts_pooled_conn* Conn = __atomic_exchange_n(&Pool->Returned, NULL, __ATOMIC_ACQUIRE);
+#endif
+    
+    // List is newest first, so it's reversed to keep idle connections in the
+    // order they were returned.
+    ts_pooled_conn* Reversed = NULL;
+    while (Conn)
+    {
+        ts_pooled_conn* Next = Conn->Next;
+        Conn->Next = Reversed;
+        Reversed = Conn;
+        Conn = Next;
+    }
+    Conn = Reversed;
+    
+    i64 Now = (i64)time(NULL);
+    while (Conn)
+    {
+        ts_pooled_conn* Next = Conn->Next;
+        ts_pool_host* Host = &Pool->Hosts[Conn->Host];
+        Host->ActiveCount--;
+        
+        if (Conn->Io.Status == Status_Connected)
+        {
+            Host->Failures = 0;
+        }
+        else if (Conn->Io.Operation == Op_CreateConn)
+        {
+            // Host is down once it reaches the max, and failures short of it are
+            // kept for as long.
+            Host->Failures++;
+            Host->DownUntil = Now + POOL_DOWN_SECONDS;
+        }
+        
+        if (Conn->Reusable && Conn->Io.Status == Status_Connected)
+        {
+            Conn->IdleSince = Now;
+            Conn->Next = Host->Idle;
+            Host->Idle = Conn;
+            Host->IdleCount++;
+        }
+        else
+        {
+            FreePooledConn(Pool, Conn);
+            ReleasePoolHost(Pool, Host, Now);
+        }
+        Conn = Next;
+    }
+}
+
+
+//================================
+// Pool
+//================================
+
+external bool
+InitConnPool(ts_conn_pool* Pool, u32 MaxConns, u32 MaxPerHost,
+             u32 IdleTimeout, u32 ConnectTimeout, buffer* Arena)
+{
+    u32 HostSlots = 16;
+    while (HostSlots < MaxConns * 2) HostSlots <<= 1;
+    
+    usz ArenaStart = Arena->WriteCur;
+    ts_pooled_conn* Conns = PushArray(Arena, MaxConns, ts_pooled_conn);
+    ts_pool_host* Hosts = PushArray(Arena, HostSlots, ts_pool_host);
+    if (!Conns || !Hosts)
+    {
+        Arena->WriteCur = ArenaStart;
+        return false;
+    }
+    
+    memset(Pool, 0, sizeof(ts_conn_pool));
+    memset(Conns, 0, MaxConns * sizeof(ts_pooled_conn));
+    memset(Hosts, 0, HostSlots * sizeof(ts_pool_host));
+    for (u32 Idx = 0; Idx < MaxConns; Idx++)
+    {
+        Conns[Idx].Io.Socket = INVALID_FILE;
+        Conns[Idx].Next = (Idx + 1 < MaxConns) ? &Conns[Idx + 1] : NULL;
+    }
+    
+    Pool->Conns = Conns;
+    Pool->Free = Conns;
+    Pool->MaxConns = MaxConns;
+    Pool->MaxPerHost = MaxPerHost;
+    Pool->IdleTimeout = IdleTimeout;
+    Pool->ConnectTimeout = ConnectTimeout;
+    Pool->Hosts = Hosts;
+    Pool->HostMask = HostSlots - 1;
+    return true;
+}
+
+external ts_pool_result
+CheckoutConn(ts_conn_pool* Pool, ts_sockaddr Addr, ts_pooled_conn** OutConn)
+{
+    TakeBackConns(Pool);
+    
+    ts_pool_host* Host = GetPoolHost(Pool, Addr);
+    if (!Host)
+    {
+        return PoolResult_Full;
+    }
+    i64 Now = (i64)time(NULL);
+    
+    while (Host->Idle)
+    {
+        ts_pooled_conn* Conn = Host->Idle;
+        Host->Idle = Conn->Next;
+        Host->IdleCount--;
+        if (IsConnStillOpen(Conn))
+        {
+            Conn->Reusable = 0;
+            Host->ActiveCount++;
+            *OutConn = Conn;
+            return PoolResult_Reused;
+        }
+        FreePooledConn(Pool, Conn);
+    }
+    
+    if (Host->Failures >= POOL_MAX_FAILURES && Host->DownUntil > Now)
+    {
+        return PoolResult_HostDown;
+    }
+    if (Host->ActiveCount >= Pool->MaxPerHost || !Pool->Free)
+    {
+        ReleasePoolHost(Pool, Host, Now);
+        return PoolResult_Full;
+    }
+    
+    ts_pooled_conn* Conn = Pool->Free;
+    Pool->Free = Conn->Next;
+    memset(&Conn->Io, 0, sizeof(ts_io));
+    Conn->Io.Socket = INVALID_FILE;
+    Conn->Io.Timeout = Pool->ConnectTimeout;
+    Conn->UserData = NULL;
+    Conn->Host = (u32)(Host - Pool->Hosts);
+    Conn->Reusable = 0;
+    Host->ActiveCount++;
+    
+    if (CreateConn(&Conn->Io, Addr))
+    {
+        *OutConn = Conn;
+        return PoolResult_Connecting;
+    }
+    
+    Host->ActiveCount--;
+    FreePooledConn(Pool, Conn);
+    ReleasePoolHost(Pool, Host, Now);
+    return PoolResult_Error;
+}
+
+external void
+ReturnConn(ts_conn_pool* Pool, ts_pooled_conn* Conn, bool Reusable)
+{
+    Conn->Reusable = (u8)Reusable;
+#if defined(_MSC_VER)
+    ts_pooled_conn* Head;
+    do
+    {
+        Head = Pool->Returned;
+        Conn->Next = Head;
+    } while (_InterlockedCompareExchangePointer((void* volatile*)&Pool->Returned, Conn, Head) != Head);
+#else
+    ts_pooled_conn* Head = __atomic_load_n(&Pool->Returned, __ATOMIC_RELAXED);
+    do
+    {
+        Conn->Next = Head;
+    } while (!__atomic_compare_exchange_n(&Pool->Returned, &Head, Conn, true,
+                                          __ATOMIC_RELEASE, __ATOMIC_RELAXED));
+#endif
+}
+
+external usz
+EvictIdleConns(ts_conn_pool* Pool)
+{
+    TakeBackConns(Pool);
+    
+    usz Result = 0;
+    i64 Now = (i64)time(NULL);
+    for (u32 Idx = 0; Idx <= Pool->HostMask; Idx++)
+    {
+        ts_pool_host* Host = &Pool->Hosts[Idx];
+        ts_pooled_conn** Link = &Host->Idle;
+        while (*Link)
+        {
+            ts_pooled_conn* Conn = *Link;
+            if (Now - Conn->IdleSince >= (i64)Pool->IdleTimeout)
+            {
+                *Link = Conn->Next;
+                Host->IdleCount--;
+                FreePooledConn(Pool, Conn);
+                Result++;
+            }
+            else
+            {
+                Link = &Conn->Next;
+            }
+        }
+        if (Host->Addr.Size)
+        {
+            ReleasePoolHost(Pool, Host, Now);
+        }
+    }
+    return Result;
+}
+
+external bool
+IsPooledConn(ts_conn_pool* Pool, ts_io* Conn)
+{
+    ts_pooled_conn* Pooled = (ts_pooled_conn*)Conn;
+    return (Pooled >= Pool->Conns && Pooled < Pool->Conns + Pool->MaxConns);
+}
@@ -0,0 +1,133 @@
+#ifndef TINYSERVER_POOL_H
+//===========================================================================
+// tinyserver-pool.h
+//
+// Module for keeping outbound connections to upstream servers open between
+// uses, so that proxies and backend clients don't pay for a new handshake
+// on every request. Connections are kept per host, keyed by their address,
+// and built on the same ts_io objects and IO queue as everything else.
+//
+// Each IO thread keeps its own pool, so taking connections out never locks:
+//   1. At startup, call InitConnPool() once per thread.
+//   2. To talk to a host, call CheckoutConn() with its ts_sockaddr. If it
+//      returns PoolResult_Reused, the connection is open and ready to send
+//      on. If PoolResult_Connecting, CreateConn() was called on it, and it's
+//      ready once dequeued from WaitOnIoQueue() as Status_Connected.
+//   3. Use [.Io] of the returned ts_pooled_conn like any other ts_io. The
+//      ts_io dequeued by WaitOnIoQueue() can be cast back to ts_pooled_conn,
+//      and IsPooledConn() tells if it belongs to a pool.
+//   4. Once done with it, or if connecting failed, call ReturnConn(). This
+//      may be done from any thread.
+//   5. Call EvictIdleConns() every now and then, to close connections that
+//      sat unused for too long.
+//===========================================================================
+#define TINYSERVER_POOL_H
+
+#include "tinyserver.h"
+
+#if !defined(POOL_MAX_FAILURES)
+# define POOL_MAX_FAILURES 3 // Failed connects in a row before a host is down.
+#endif
+#if !defined(POOL_DOWN_SECONDS)
+# define POOL_DOWN_SECONDS 5 // How long a host is down for.
+#endif
+
+typedef enum ts_pool_result
+{
+    PoolResult_Reused,     // Idle connection, ready to use.
+    PoolResult_Connecting, // New connection, wait for Op_CreateConn.
+    PoolResult_Full,       // Host at its limit, or pool out of connections.
+    PoolResult_HostDown,   // Host failed to connect recently.
+    PoolResult_Error       // Could not start connecting.
+} ts_pool_result;
+
+typedef struct ts_pooled_conn
+{
+    ts_io Io; // Important: must be first member!
+    void* UserData; // Free for the caller.
+    
+    struct ts_pooled_conn* Next; // In idle, free, or returned list.
+    i64 IdleSince;
+    u32 Host;
+    u8 Reusable;
+} ts_pooled_conn;
+
+typedef struct ts_pool_host
+{
+    ts_sockaddr Addr;
+    u32 Hash;
+    u32 ActiveCount; // Checked out, or connecting.
+    u32 IdleCount;
+    u32 Failures;    // Connects failed in a row.
+    i64 DownUntil;   // Also when the failures are forgotten, if fewer than the max.
+    ts_pooled_conn* Idle; // Most recently returned first.
+    u8 IsRemoved;    // Tombstone, lookups go on past it.
+} ts_pool_host;
+
+typedef struct ts_conn_pool
+{
+    ts_pooled_conn* Conns;
+    ts_pooled_conn* Free;
+    u32 MaxConns;
+    u32 MaxPerHost;
+    u32 IdleTimeout;    // Seconds.
+    u32 ConnectTimeout; // Milliseconds.
+    
+    ts_pool_host* Hosts; // Open addressing, with tombstones.
+    u32 HostMask;
+    u32 HostCount;
+    
+    ts_pooled_conn* volatile Returned; // Pushed by any thread.
+} ts_conn_pool;
+
+external bool InitConnPool(ts_conn_pool* Pool, u32 MaxConns, u32 MaxPerHost,
+                           u32 IdleTimeout, u32 ConnectTimeout, buffer* Arena);
+
+/* Sets up [Pool] with up to [MaxConns] connections in all, and [MaxPerHost]
+|  to the same host, pushing them to [Arena], which must have about 256 bytes
+|  per connection available. Connections unused for [IdleTimeout] seconds are
+|  closed by EvictIdleConns(), and new ones wait up to [ConnectTimeout]
+|  milliseconds to connect (0 for the system default).
+|--- Return: true if successful, false if [Arena] is out of space. */
+
+external ts_pool_result CheckoutConn(ts_conn_pool* Pool, ts_sockaddr Addr,
+                                     ts_pooled_conn** OutConn);
+
+/* Takes a connection to [Addr] out of [Pool], writing it to [OutConn]. Idle
+|  connections are taken most recently used first, and checked to still be
+|  open. If none is left, and the host is under its limit, a new connection is
+|  made with CreateConn(). Hosts that failed to connect POOL_MAX_FAILURES times
+|  in a row aren't tried again for POOL_DOWN_SECONDS. Hosts are forgotten once
+|  they have no connections left and no failures in the last POOL_DOWN_SECONDS,
+|  so any number of them can be used over time. Must only be called from the
+|  thread that owns [Pool].
+|--- Return: result of the checkout. [OutConn] is only written to on
+|    PoolResult_Reused and PoolResult_Connecting. */
+
+external void ReturnConn(ts_conn_pool* Pool, ts_pooled_conn* Conn, bool Reusable);
+
+/* Gives [Conn] back to [Pool]. If [Reusable] is true, the connection is kept
+|  open for the next checkout; it must be connected, with no data still in
+|  flight either way (e.g. a whole response was read). Otherwise, or if it
+|  failed to connect, it's closed. May be called from any thread, without
+|  locking; the connection is taken back by the next call of the owning thread.
+|--- Return: nothing. */
+
+external usz EvictIdleConns(ts_conn_pool* Pool);
+
+/* Closes connections in [Pool] that have been idle for longer than its idle
+|  timeout, and forgets the hosts left without any. Must only be called from
+|  the thread that owns [Pool].
+|--- Return: number of connections closed. */
+
+external bool IsPooledConn(ts_conn_pool* Pool, ts_io* Conn);
+
+/* Checks if [Conn], dequeued by WaitOnIoQueue(), belongs to [Pool].
+|--- Return: true if it does, false if not. */
+
+
+#if !defined(TINYSERVER_STATIC_LINKING)
+#include "tinyserver-pool.c"
+#endif
+
+#endif //TINYSERVER_POOL_H
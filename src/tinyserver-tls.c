@@ -0,0 +1,226 @@
+#if defined(TT_LINUX)
+# include <netinet/tcp.h>
+# include <linux/tls.h>
+# if !defined(SOL_TLS)
+#  define SOL_TLS 282
+# endif
+#endif
+
+//================================
+// Internal
+//================================
+
+#if defined(TT_LINUX)
+internal bool
+InstallTlsSecret(file Socket, int Direction, ts_tls_version Version, ts_tls_cipher Cipher,
+                 ts_tls_secret* Secret)
+{
+    // Kernel takes the IV as salt and nonce for AES-GCM, and whole for ChaCha20.
+    union
+    {
+        struct tls12_crypto_info_aes_gcm_128 Gcm128;
+#if defined(TLS_CIPHER_AES_GCM_256)
+        struct tls12_crypto_info_aes_gcm_256 Gcm256;
+#endif
+#if defined(TLS_CIPHER_CHACHA20_POLY1305)
+        struct tls12_crypto_info_chacha20_poly1305 Chacha;
+#endif
+    } Info;
+    memset(&Info, 0, sizeof(Info));
+    socklen_t InfoSize = 0;
+    
+    switch (Cipher)
+    {
+        case TlsCipher_AesGcm128:
+        {
+            Info.Gcm128.info.version = (u16)Version;
+            Info.Gcm128.info.cipher_type = TLS_CIPHER_AES_GCM_128;
+            memcpy(Info.Gcm128.key, Secret->Key, TLS_CIPHER_AES_GCM_128_KEY_SIZE);
+            memcpy(Info.Gcm128.salt, Secret->Iv, TLS_CIPHER_AES_GCM_128_SALT_SIZE);
+            memcpy(Info.Gcm128.iv, Secret->Iv + TLS_CIPHER_AES_GCM_128_SALT_SIZE,
+                   TLS_CIPHER_AES_GCM_128_IV_SIZE);
+            memcpy(Info.Gcm128.rec_seq, Secret->RecSeq, TLS_CIPHER_AES_GCM_128_REC_SEQ_SIZE);
+            InfoSize = sizeof(Info.Gcm128);
+        } break;
+#if defined(TLS_CIPHER_AES_GCM_256)
+        case TlsCipher_AesGcm256:
+        {
+            Info.Gcm256.info.version = (u16)Version;
+            Info.Gcm256.info.cipher_type = TLS_CIPHER_AES_GCM_256;
+            memcpy(Info.Gcm256.key, Secret->Key, TLS_CIPHER_AES_GCM_256_KEY_SIZE);
+            memcpy(Info.Gcm256.salt, Secret->Iv, TLS_CIPHER_AES_GCM_256_SALT_SIZE);
+            memcpy(Info.Gcm256.iv, Secret->Iv + TLS_CIPHER_AES_GCM_256_SALT_SIZE,
+                   TLS_CIPHER_AES_GCM_256_IV_SIZE);
+            memcpy(Info.Gcm256.rec_seq, Secret->RecSeq, TLS_CIPHER_AES_GCM_256_REC_SEQ_SIZE);
+            InfoSize = sizeof(Info.Gcm256);
+        } break;
+#endif
+#if defined(TLS_CIPHER_CHACHA20_POLY1305)
+        case TlsCipher_Chacha20Poly1305:
+        {
+            Info.Chacha.info.version = (u16)Version;
+            Info.Chacha.info.cipher_type = TLS_CIPHER_CHACHA20_POLY1305;
+            memcpy(Info.Chacha.key, Secret->Key, TLS_CIPHER_CHACHA20_POLY1305_KEY_SIZE);
+            memcpy(Info.Chacha.iv, Secret->Iv, TLS_CIPHER_CHACHA20_POLY1305_IV_SIZE);
+            memcpy(Info.Chacha.rec_seq, Secret->RecSeq,
+                   TLS_CIPHER_CHACHA20_POLY1305_REC_SEQ_SIZE);
+            InfoSize = sizeof(Info.Chacha);
+        } break;
+#endif
+        default: return false;
+    }
+    
+    bool Result = (setsockopt(Socket, SOL_TLS, Direction, &Info, InfoSize) == 0);
+    memset(&Info, 0, sizeof(Info));
+    return Result;
+}
+#endif //TT_LINUX
+
+internal usz
+TlsRecordEnd(ts_tls_session* Tls)
+{
+    usz Result = TLS_RECORD_HEADER_SIZE;
+    if (Tls->InSize >= TLS_RECORD_HEADER_SIZE)
+    {
+        Result += ((usz)Tls->In[3] << 8) | Tls->In[4];
+    }
+    return Result;
+}
+
+internal ts_tls_result ContinueTlsHandshake(ts_io* Conn, ts_tls_session* Tls);
+
+internal ts_tls_result
+StepTlsHandshake(ts_io* Conn, ts_tls_session* Tls, u8* In, usz InSize)
+{
+    usz Written = 0;
+    Tls->Step = Tls->Handshake(Tls->Context, In, InSize, Tls->Out, TLS_HANDSHAKE_OUT_SIZE,
+                               &Written, &Tls->Keys);
+    Tls->InSize = 0;
+    Tls->OutSize = Min(Written, TLS_HANDSHAKE_OUT_SIZE);
+    Tls->OutSent = 0;
+    return ContinueTlsHandshake(Conn, Tls);
+}
+
+internal ts_tls_result
+ContinueTlsHandshake(ts_io* Conn, ts_tls_session* Tls)
+{
+    // Data of the last step always goes out first, even alerts before failing.
+    if (Tls->OutSent < Tls->OutSize)
+    {
+        Conn->IoBuffer = Tls->Out + Tls->OutSent;
+        Conn->IoSize = (u32)(Tls->OutSize - Tls->OutSent);
+        return SendData(Conn) ? TlsResult_Pending : TlsResult_Failed;
+    }
+    
+    switch (Tls->Step)
+    {
+        case TlsStep_Read:
+        {
+            // Only the header is read first, and then exactly the rest of the
+            // record, so nothing after the handshake is taken from the kernel.
+            Conn->IoBuffer = Tls->In + Tls->InSize;
+            Conn->IoSize = (u32)(TlsRecordEnd(Tls) - Tls->InSize);
+            return RecvData(Conn) ? TlsResult_Pending : TlsResult_Failed;
+        }
+        
+        case TlsStep_Write: return StepTlsHandshake(Conn, Tls, NULL, 0);
+        
+        case TlsStep_Done:
+        {
+            bool Enabled = EnableKernelTls(Conn, &Tls->Keys, Tls->ZeroCopySendFile);
+            memset(&Tls->Keys, 0, sizeof(ts_tls_keys));
+            return Enabled ? TlsResult_Ready : TlsResult_NoKernel;
+        }
+        
+        // The alert, if any, went out above.
+        case TlsStep_Error: break;
+    }
+    return TlsResult_Failed;
+}
+
+
+//================================
+// Handshake
+//================================
+
+external bool
+InitTlsSession(ts_tls_session* Tls, ts_tls_handshake* Handshake, buffer* Arena)
+{
+    usz ArenaStart = Arena->WriteCur;
+    u8* In = PushArray(Arena, TLS_RECORD_HEADER_SIZE + TLS_MAX_RECORD_SIZE, u8);
+    u8* Out = PushArray(Arena, TLS_HANDSHAKE_OUT_SIZE, u8);
+    if (!In || !Out)
+    {
+        Arena->WriteCur = ArenaStart;
+        return false;
+    }
+    
+    memset(Tls, 0, sizeof(ts_tls_session));
+    Tls->Handshake = Handshake;
+    Tls->In = In;
+    Tls->Out = Out;
+    return true;
+}
+
+external bool
+StartTlsHandshake(ts_io* Conn, ts_tls_session* Tls, void* Context)
+{
+    Tls->Context = Context;
+    Tls->InSize = 0;
+    memset(&Tls->Keys, 0, sizeof(ts_tls_keys));
+    return (StepTlsHandshake(Conn, Tls, NULL, 0) == TlsResult_Pending);
+}
+
+external ts_tls_result
+HandleTlsHandshake(ts_io* Conn, ts_tls_session* Tls)
+{
+    if (Conn->Status != Status_Connected || Conn->BytesTransferred == 0)
+    {
+        memset(&Tls->Keys, 0, sizeof(ts_tls_keys));
+        return TlsResult_Failed;
+    }
+    
+    if (Conn->Operation == Op_SendData)
+    {
+        Tls->OutSent += Conn->BytesTransferred;
+        return ContinueTlsHandshake(Conn, Tls);
+    }
+    
+    Tls->InSize += Conn->BytesTransferred;
+    usz RecordEnd = TlsRecordEnd(Tls);
+    if (Tls->InSize == TLS_RECORD_HEADER_SIZE
+        && (RecordEnd == TLS_RECORD_HEADER_SIZE
+            || RecordEnd > TLS_RECORD_HEADER_SIZE + TLS_MAX_RECORD_SIZE))
+    {
+        memset(&Tls->Keys, 0, sizeof(ts_tls_keys));
+        return TlsResult_Failed;
+    }
+    if (Tls->InSize < RecordEnd)
+    {
+        return ContinueTlsHandshake(Conn, Tls);
+    }
+    return StepTlsHandshake(Conn, Tls, Tls->In, Tls->InSize);
+}
+
+external bool
+EnableKernelTls(ts_io* Conn, ts_tls_keys* Keys, bool ZeroCopySendFile)
+{
+#if defined(TT_LINUX)
+    if (setsockopt(Conn->Socket, SOL_TCP, TCP_ULP, "tls", sizeof("tls")) != 0
+        || !InstallTlsSecret(Conn->Socket, TLS_TX, Keys->Version, Keys->Cipher, &Keys->Tx)
+        || !InstallTlsSecret(Conn->Socket, TLS_RX, Keys->Version, Keys->Cipher, &Keys->Rx))
+    {
+        return false;
+    }
+# if defined(TLS_TX_ZEROCOPY_RO)
+    if (ZeroCopySendFile)
+    {
+        int Enable = 1;
+        setsockopt(Conn->Socket, SOL_TLS, TLS_TX_ZEROCOPY_RO, &Enable, sizeof(Enable));
+    }
+# endif
+    return true;
+#else
+    return false;
+#endif
+}
@@ -0,0 +1,153 @@
+#ifndef TINYSERVER_TLS_H
+//===========================================================================
+// tinyserver-tls.h
+//
+// Module for serving TLS connections with the kernel doing the encryption
+// (kTLS). The handshake is done in user space by a TLS library plugged in
+// as a ts_tls_handshake procedure, and once it's done its keys are handed to
+// the kernel. From then on the connection is used like any other: RecvData,
+// SendData and SendVector move plain data, and SendFile keeps sending files
+// straight from the page cache, encrypted on the way out.
+//
+// Blueprint:
+//   1. At startup, call InitTlsSession() for each session object, which can
+//      be reused for any number of connections, one after another.
+//   2. Once a connection is accepted (AcceptConn() without a buffer, so no
+//      data is read), set up the library's state for it, and pass it to
+//      StartTlsHandshake() along with the connection and a free session.
+//   3. In the io loop, pass each ts_io dequeued from WaitOnIoQueue() that's
+//      in a handshake to HandleTlsHandshake(), until it returns something
+//      other than TlsResult_Pending. On TlsResult_Ready, the connection is
+//      used as usual, e.g. with StartHttpConn() of tinyserver-httpconn.h.
+//      Otherwise, it must be closed.
+//
+// The handshake procedure is given one whole TLS record at a time, and the
+// records are read one by one, so nothing past the handshake is ever read in
+// user space; whatever the peer sends after it is left to the kernel.
+//
+// Requires Linux 4.17 or later, built with CONFIG_TLS (module "tls"), and
+// 5.11 for ChaCha20-Poly1305. Once the kernel takes over, records other than
+// application data (alerts, or TLS 1.3 key updates) fail RecvData, which is
+// seen as the connection being aborted.
+//===========================================================================
+#define TINYSERVER_TLS_H
+
+#include "tinyserver.h"
+
+#define TLS_RECORD_HEADER_SIZE 5
+#define TLS_MAX_RECORD_SIZE (16384 + 2048) // Largest ciphertext allowed.
+
+#if !defined(TLS_HANDSHAKE_OUT_SIZE)
+# define TLS_HANDSHAKE_OUT_SIZE 16384 // Room for the handshake data to send.
+#endif
+
+typedef enum ts_tls_version
+{
+    TlsVersion_12 = 0x0303,
+    TlsVersion_13 = 0x0304
+} ts_tls_version;
+
+typedef enum ts_tls_cipher
+{
+    TlsCipher_AesGcm128,
+    TlsCipher_AesGcm256,
+    TlsCipher_Chacha20Poly1305
+} ts_tls_cipher;
+
+typedef struct ts_tls_secret
+{
+    u8 Key[32];   // 16 bytes used for AES-128.
+    u8 Iv[12];    // 4-byte salt, then 8-byte nonce, or the whole ChaCha20 IV.
+    u8 RecSeq[8]; // Sequence number of the next record, big endian.
+} ts_tls_secret;
+
+typedef struct ts_tls_keys
+{
+    ts_tls_version Version;
+    ts_tls_cipher Cipher;
+    ts_tls_secret Tx; // For sending.
+    ts_tls_secret Rx; // For receiving.
+} ts_tls_keys;
+
+typedef enum ts_tls_step
+{
+    TlsStep_Read,  // Send [Out], if any, then give the next record.
+    TlsStep_Write, // [Out] is full: send it, then call again with no record.
+    TlsStep_Done,  // Handshake done, and [Keys] filled. Send [Out], if any.
+    TlsStep_Error  // Handshake failed. Send [Out] (e.g. an alert), if any.
+} ts_tls_step;
+
+typedef ts_tls_step ts_tls_handshake(void* Context, u8* In, usz InSize,
+                                     u8* Out, usz OutSize, usz* OutWritten,
+                                     ts_tls_keys* Keys);
+
+/* Moves the handshake of the library state in [Context] forward with the
+|  record in [In], of [InSize] bytes (header included), or NULL and 0 on the
+|  first call, and after TlsStep_Write. Handshake data to send is written to
+|  [Out], up to [OutSize] bytes, with the bytes written in [OutWritten]. On
+|  TlsStep_Done, [Keys] must be filled, with [.RecSeq] accounting for records
+|  already written with those keys (e.g. the TLS 1.3 session tickets, or the
+|  TLS 1.2 Finished message).
+|--- Return: what to do next. */
+
+typedef enum ts_tls_result
+{
+    TlsResult_Pending,  // Handshake still going.
+    TlsResult_Ready,    // Kernel took over, connection ready to use.
+    TlsResult_Failed,   // Handshake failed, or connection lost.
+    TlsResult_NoKernel  // Handshake done, but the kernel can't take the keys.
+} ts_tls_result;
+
+typedef struct ts_tls_session
+{
+    ts_tls_handshake* Handshake;
+    void* Context;
+    u8 ZeroCopySendFile; // See EnableKernelTls().
+    
+    u8* In;   // Current record.
+    usz InSize;
+    u8* Out;  // Handshake data being sent.
+    usz OutSize;
+    usz OutSent;
+    ts_tls_step Step;
+    ts_tls_keys Keys;
+} ts_tls_session;
+
+external bool InitTlsSession(ts_tls_session* Tls, ts_tls_handshake* Handshake, buffer* Arena);
+
+/* Sets up [Tls] to run handshakes with [Handshake], pushing its buffers to
+|  [Arena], which must have TLS_RECORD_HEADER_SIZE + TLS_MAX_RECORD_SIZE +
+|  TLS_HANDSHAKE_OUT_SIZE bytes available. [.ZeroCopySendFile] may be set after.
+|--- Return: true if successful, false if [Arena] is out of space. */
+
+external bool StartTlsHandshake(ts_io* Conn, ts_tls_session* Tls, void* Context);
+
+/* Starts the handshake on the connection in [Conn], which must have no data
+|  read from it yet, calling the handshake procedure of [Tls] with [Context]
+|  first with no record, so that clients can send theirs, and posting the
+|  first operation.
+|--- Return: true if successful, false if not. */
+
+external ts_tls_result HandleTlsHandshake(ts_io* Conn, ts_tls_session* Tls);
+
+/* Moves the handshake on [Conn] forward after an operation on it was dequeued
+|  by WaitOnIoQueue(), posting the next one. Once the handshake procedure is
+|  done, and its data sent, the keys are given to the kernel with
+|  EnableKernelTls(), and wiped from [Tls], which is free again.
+|--- Return: result of the handshake so far. */
+
+external bool EnableKernelTls(ts_io* Conn, ts_tls_keys* Keys, bool ZeroCopySendFile);
+
+/* Hands the keys in [Keys] to the kernel for the connection in [Conn], which
+|  then encrypts all data sent and decrypts all data received on it. Can be
+|  used directly when the handshake was done some other way. If
+|  [ZeroCopySendFile] is true, SendFile encrypts straight from the page cache
+|  (Linux 5.19 or later), so files must not be changed while being sent.
+|--- Return: true if successful, false if not supported. */
+
+
+#if !defined(TINYSERVER_STATIC_LINKING)
+#include "tinyserver-tls.c"
+#endif
+
+#endif //TINYSERVER_TLS_H
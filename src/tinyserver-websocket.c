@@ -0,0 +1,570 @@
+#include "tinybase-strings.h"
+
+#if defined(__SSE2__)
+# include <emmintrin.h>
+#endif
+
+#if defined(__AVX2__)
+# include <immintrin.h>
+#endif
+
+//================================
+// Upgrade
+//================================
+
+internal void
+Sha1(u8* Data, usz Size, u8* Digest)
+{
+    u32 State[5] = { 0x67452301, 0xEFCDAB89, 0x98BADCFE, 0x10325476, 0xC3D2E1F0 };
+    
+    // Data is padded with 0x80, zeros, and its size in bits, to a multiple of
+    // 64 bytes. Only the last one or two blocks are built separately.
+    u8 Tail[128] = {0};
+    usz FullSize = Size - (Size % 64);
+    usz TailSize = (Size % 64 < 56) ? 64 : 128;
+    CopyData(Tail, sizeof(Tail), Data + FullSize, Size - FullSize);
+    Tail[Size - FullSize] = 0x80;
+    u64 Bits = (u64)Size * 8;
+    for (usz Idx = 0; Idx < 8; Idx++)
+    {
+        Tail[TailSize - 1 - Idx] = (u8)(Bits >> (Idx * 8));
+    }
+    
+    for (usz Offset = 0; Offset < FullSize + TailSize; Offset += 64)
+    {
+        u8* Block = (Offset < FullSize) ? Data + Offset : Tail + (Offset - FullSize);
+        u32 W[80];
+        for (usz Idx = 0; Idx < 16; Idx++)
+        {
+            W[Idx] = ((u32)Block[Idx*4] << 24) | ((u32)Block[Idx*4+1] << 16)
+                | ((u32)Block[Idx*4+2] << 8) | (u32)Block[Idx*4+3];
+        }
+        for (usz Idx = 16; Idx < 80; Idx++)
+        {
+            u32 Value = W[Idx-3] ^ W[Idx-8] ^ W[Idx-14] ^ W[Idx-16];
+            W[Idx] = (Value << 1) | (Value >> 31);
+        }
+        
+        u32 A = State[0], B = State[1], C = State[2], D = State[3], E = State[4];
+        for (usz Idx = 0; Idx < 80; Idx++)
+        {
+            u32 F, K;
+            if (Idx < 20)      { F = (B & C) | (~B & D);          K = 0x5A827999; }
+            else if (Idx < 40) { F = B ^ C ^ D;                   K = 0x6ED9EBA1; }
+            else if (Idx < 60) { F = (B & C) | (B & D) | (C & D); K = 0x8F1BBCDC; }
+            else               { F = B ^ C ^ D;                   K = 0xCA62C1D6; }
+            
+            u32 Temp = ((A << 5) | (A >> 27)) + F + E + K + W[Idx];
+            E = D;
+            D = C;
+            C = (B << 30) | (B >> 2);
+            B = A;
+            A = Temp;
+        }
+        State[0] += A;
+        State[1] += B;
+        State[2] += C;
+        State[3] += D;
+        State[4] += E;
+    }
+    
+    for (usz Idx = 0; Idx < 20; Idx++)
+    {
+        Digest[Idx] = (u8)(State[Idx/4] >> (24 - (Idx % 4) * 8));
+    }
+}
+
+internal bool
+AppendBase64ToString(u8* Src, usz Size, string* Dst)
+{
+    if (Dst->WriteCur + (Size + 2) / 3 * 4 > Dst->Size)
+    {
+        return false;
+    }
+    
+    char* Alphabet = "ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789+/";
+    char* Out = Dst->Base + Dst->WriteCur;
+    for (usz Idx = 0; Idx < Size; Idx += 3)
+    {
+        u32 Left = (u32)(Size - Idx);
+        u32 Value = ((u32)Src[Idx] << 16)
+            | ((Left > 1) ? (u32)Src[Idx+1] << 8 : 0)
+            | ((Left > 2) ? (u32)Src[Idx+2] : 0);
+        *Out++ = Alphabet[(Value >> 18) & 0x3F];
+        *Out++ = Alphabet[(Value >> 12) & 0x3F];
+        *Out++ = (Left > 1) ? Alphabet[(Value >> 6) & 0x3F] : '=';
+        *Out++ = (Left > 2) ? Alphabet[Value & 0x3F] : '=';
+    }
+    Dst->WriteCur = Out - Dst->Base;
+    return true;
+}
+
+internal bool
+HasHeaderToken(string Header, char* Token)
+{
+    // Checks a comma-separated list, ignoring case (e.g. "keep-alive, Upgrade").
+    usz TokenSize = strlen(Token);
+    usz ReadCur = 0;
+    while (ReadCur < Header.WriteCur)
+    {
+        while (ReadCur < Header.WriteCur && (Header.Base[ReadCur] == ' ' || Header.Base[ReadCur] == ',')) ReadCur++;
+        usz Start = ReadCur;
+        while (ReadCur < Header.WriteCur && Header.Base[ReadCur] != ',') ReadCur++;
+        usz End = ReadCur;
+        while (End > Start && Header.Base[End-1] == ' ') End--;
+        
+        if (End - Start == TokenSize)
+        {
+            usz Idx = 0;
+            for (; Idx < TokenSize; Idx++)
+            {
+                char Char = Header.Base[Start + Idx];
+                if (Char >= 'A' && Char <= 'Z') Char += 'a' - 'A';
+                if (Char != Token[Idx]) break;
+            }
+            if (Idx == TokenSize)
+            {
+                return true;
+            }
+        }
+    }
+    return false;
+}
+
+external bool
+CraftWebSocketAccept(ts_request* Request, _opt char* Protocol, string* OutHeader)
+{
+    string Upgrade = GetHeaderByKey(Request, "Upgrade");
+    string Connection = GetHeaderByKey(Request, "Connection");
+    string Version = GetHeaderByKey(Request, "Sec-WebSocket-Version");
+    string Key = GetHeaderByKey(Request, "Sec-WebSocket-Key");
+    if (Request->Verb != HttpVerb_Get
+        || Request->Version != HttpVersion_11
+        || !HasHeaderToken(Upgrade, "websocket")
+        || !HasHeaderToken(Connection, "upgrade")
+        || !EqualStrings(Version, StringLit("13"))
+        || Key.WriteCur != 24) // Base64 of 16 bytes.
+    {
+        return false;
+    }
+    
+    // Accept key is the base64 of the SHA-1 of the client key followed by a
+    // fixed GUID.
+    u8 Input[24 + 36];
+    u8 Digest[20];
+    CopyData(Input, sizeof(Input), Key.Base, Key.WriteCur);
+    CopyData(Input + 24, 36, (char*)"258EAFA5-E914-47DA-95CA-C5AB0DC85B11", 36);
+    Sha1(Input, sizeof(Input), Digest);
+    
+    // Whole size is checked first, so nothing is written if it doesn't fit.
+    string Start = StringLit("HTTP/1.1 101 Switching Protocols\r\n"
+                             "Upgrade: websocket\r\n"
+                             "Connection: Upgrade\r\n"
+                             "Sec-WebSocket-Accept: ");
+    string ProtocolField = StringLit("Sec-WebSocket-Protocol: ");
+    string LineBreak = StringLit("\r\n");
+    usz ProtocolSize = Protocol ? strlen(Protocol) : 0;
+    usz Needed = Start.WriteCur + 28 + LineBreak.WriteCur * 2
+        + (Protocol ? ProtocolField.WriteCur + ProtocolSize + LineBreak.WriteCur : 0);
+    if (OutHeader->WriteCur + Needed > OutHeader->Size)
+    {
+        return false;
+    }
+    
+    AppendStringToString(Start, OutHeader);
+    AppendBase64ToString(Digest, sizeof(Digest), OutHeader);
+    AppendStringToString(LineBreak, OutHeader);
+    if (Protocol)
+    {
+        AppendStringToString(ProtocolField, OutHeader);
+        AppendStringToString(String(Protocol, ProtocolSize, 0, EC_ASCII), OutHeader);
+        AppendStringToString(LineBreak, OutHeader);
+    }
+    AppendStringToString(LineBreak, OutHeader);
+    
+    return true;
+}
+
+
+//================================
+// Frames
+//================================
+
+#define WsStage_Header  0
+#define WsStage_Payload 1
+#define WsStage_Closed  2
+
+internal void
+UnmaskWebSocketData(u8* Data, usz Size, u8* Mask, u64 Offset)
+{
+    // The mask repeats every 4 bytes, so it's rotated to where [Data] starts
+    // in the frame, and then XORed 32 bytes at a time with AVX2, or 16 with
+    // SSE2. All steps go in multiples of 4, so the key stays in place.
+    
+    u8 Key[4];
+    for (usz Idx = 0; Idx < 4; Idx++)
+    {
+        Key[Idx] = Mask[(Offset + Idx) & 3];
+    }
+    u32 Key32;
+    memcpy(&Key32, Key, sizeof(u32));
+    
+    usz Idx = 0;
+#if defined(__AVX2__)
+    __m256i Key256 = _mm256_set1_epi32((int)Key32);
+    for (; Idx + 32 <= Size; Idx += 32)
+    {
+        __m256i Block = _mm256_loadu_si256((__m256i*)(Data + Idx));
+        _mm256_storeu_si256((__m256i*)(Data + Idx), _mm256_xor_si256(Block, Key256));
+    }
+#endif
+#if defined(__SSE2__)
+    __m128i Key128 = _mm_set1_epi32((int)Key32);
+    for (; Idx + 16 <= Size; Idx += 16)
+    {
+        __m128i Block = _mm_loadu_si128((__m128i*)(Data + Idx));
+        _mm_storeu_si128((__m128i*)(Data + Idx), _mm_xor_si128(Block, Key128));
+    }
+#endif
+    u64 Key64 = ((u64)Key32 << 32) | Key32;
+    for (; Idx + 8 <= Size; Idx += 8)
+    {
+        u64 Block;
+        memcpy(&Block, Data + Idx, sizeof(u64));
+        Block ^= Key64;
+        memcpy(Data + Idx, &Block, sizeof(u64));
+    }
+    for (; Idx < Size; Idx++)
+    {
+        Data[Idx] ^= Key[Idx & 3];
+    }
+}
+
+internal bool
+CheckWebSocketUtf8(ts_websocket* Ws, u8* Data, usz Size)
+{
+    // Text is checked as it comes, so a character may be split across pieces.
+    // The range of the next continuation byte rules out overlong forms,
+    // surrogates and code points past U+10FFFF (RFC 3629).
+    usz Idx = 0;
+    while (Idx < Size)
+    {
+        if (Ws->Utf8Needed == 0 && Idx + 8 <= Size)
+        {
+            u64 Block;
+            memcpy(&Block, Data + Idx, sizeof(u64));
+            if (!(Block & 0x8080808080808080ull))
+            {
+                Idx += 8; // All ASCII.
+                continue;
+            }
+        }
+        
+        u8 Byte = Data[Idx++];
+        if (Ws->Utf8Needed)
+        {
+            if (Byte < Ws->Utf8Min || Byte > Ws->Utf8Max)
+            {
+                return false;
+            }
+            Ws->Utf8Min = 0x80;
+            Ws->Utf8Max = 0xBF;
+            Ws->Utf8Needed--;
+        }
+        else if (Byte >= 0x80)
+        {
+            if (Byte >= 0xC2 && Byte <= 0xDF) Ws->Utf8Needed = 1;
+            else if (Byte >= 0xE0 && Byte <= 0xEF) Ws->Utf8Needed = 2;
+            else if (Byte >= 0xF0 && Byte <= 0xF4) Ws->Utf8Needed = 3;
+            else return false;
+            Ws->Utf8Min = (Byte == 0xE0) ? 0xA0 : (Byte == 0xF0) ? 0x90 : 0x80;
+            Ws->Utf8Max = (Byte == 0xED) ? 0x9F : (Byte == 0xF4) ? 0x8F : 0xBF;
+        }
+    }
+    return true;
+}
+
+internal ts_ws_event
+FailWebSocket(ts_websocket* Ws, u16 CloseCode)
+{
+    Ws->Stage = WsStage_Closed;
+    Ws->CloseCode = CloseCode;
+    Ws->Data = String(0, 0, 0, EC_ASCII);
+    return WsEvent_Error;
+}
+
+internal usz
+GetWebSocketHeaderSize(u8* Header)
+{
+    u8 Size = Header[1] & 0x7F;
+    return 2 + ((Size == 126) ? 2 : (Size == 127) ? 8 : 0) + ((Header[1] & 0x80) ? 4 : 0);
+}
+
+internal ts_ws_event
+StartWebSocketFrame(ts_websocket* Ws)
+{
+    u8* Header = Ws->Header;
+    bool Final = (Header[0] & 0x80) != 0;
+    u8 Opcode = Header[0] & 0x0F;
+    bool IsControl = (Opcode & 0x8) != 0;
+    
+    u64 Size = Header[1] & 0x7F;
+    usz Cur = 2;
+    if (Size == 126)
+    {
+        Size = ((u64)Header[2] << 8) | Header[3];
+        Cur = 4;
+    }
+    else if (Size == 127)
+    {
+        Size = 0;
+        for (usz Idx = 0; Idx < 8; Idx++) Size = (Size << 8) | Header[2 + Idx];
+        Cur = 10;
+    }
+    
+    // No extensions are agreed on, so reserved bits must be 0, and client
+    // frames must always be masked.
+    if ((Header[0] & 0x70) || !(Header[1] & 0x80) || (Size >> 63))
+    {
+        return FailWebSocket(Ws, WsClose_ProtocolError);
+    }
+    if (IsControl)
+    {
+        if (!Final || Size > WS_MAX_CONTROL_SIZE
+            || (Opcode != WsOpcode_Close && Opcode != WsOpcode_Ping && Opcode != WsOpcode_Pong))
+        {
+            return FailWebSocket(Ws, WsClose_ProtocolError);
+        }
+    }
+    else
+    {
+        // A continuation only comes inside a message, and a new message only
+        // outside one.
+        if ((Opcode == WsOpcode_Continuation) != (Ws->InMessage != 0)
+            || Opcode > WsOpcode_Binary)
+        {
+            return FailWebSocket(Ws, WsClose_ProtocolError);
+        }
+        if (!Ws->InMessage)
+        {
+            Ws->InMessage = 1;
+            Ws->MessageType = Opcode;
+            Ws->MessageSize = 0;
+        }
+        if (Ws->MaxMessageSize && Size > Ws->MaxMessageSize - Ws->MessageSize)
+        {
+            return FailWebSocket(Ws, WsClose_MessageTooBig);
+        }
+        Ws->MessageSize += Size;
+    }
+    
+    CopyData(Ws->Mask, 4, Header + Cur, 4);
+    Ws->Opcode = Opcode;
+    Ws->Final = Final;
+    Ws->FrameSize = Size;
+    Ws->FrameReceived = 0;
+    Ws->HeaderSize = 0;
+    Ws->Stage = WsStage_Payload;
+    return WsEvent_None;
+}
+
+internal ts_ws_event
+EndWebSocketControlFrame(ts_websocket* Ws)
+{
+    u8* Payload = Ws->Control;
+    usz Size = (usz)Ws->FrameSize;
+    UnmaskWebSocketData(Payload, Size, Ws->Mask, 0);
+    Ws->Data = String(Payload, Size, 0, EC_ASCII);
+    Ws->Stage = WsStage_Header;
+    
+    switch (Ws->Opcode)
+    {
+        case WsOpcode_Ping: return WsEvent_Ping;
+        case WsOpcode_Pong: return WsEvent_Pong;
+    }
+    
+    // Close frame has an optional code, followed by an optional reason. Codes
+    // are only valid if defined for use in frames, or private (3000-4999).
+    Ws->Stage = WsStage_Closed;
+    Ws->CloseCode = WsClose_NoStatus;
+    if (Size == 1)
+    {
+        return FailWebSocket(Ws, WsClose_ProtocolError);
+    }
+    if (Size >= 2)
+    {
+        u16 Code = (u16)((Payload[0] << 8) | Payload[1]);
+        bool IsValid = ((Code >= 1000 && Code <= 1003) || (Code >= 1007 && Code <= 1011)
+                        || (Code >= 3000 && Code <= 4999));
+        if (!IsValid)
+        {
+            return FailWebSocket(Ws, WsClose_ProtocolError);
+        }
+        Ws->Utf8Needed = 0; // Nothing else is parsed, the message can't go on.
+        if (!CheckWebSocketUtf8(Ws, Payload + 2, Size - 2) || Ws->Utf8Needed)
+        {
+            return FailWebSocket(Ws, WsClose_InvalidData);
+        }
+        Ws->CloseCode = Code;
+        Ws->Data = String(Payload + 2, Size - 2, 0, EC_ASCII);
+    }
+    return WsEvent_Close;
+}
+
+external void
+InitWebSocket(ts_websocket* Ws, u64 MaxMessageSize)
+{
+    memset(Ws, 0, sizeof(ts_websocket));
+    Ws->MaxMessageSize = MaxMessageSize;
+}
+
+external ts_ws_event
+ParseWebSocketChunk(ts_websocket* Ws, string Chunk, usz* ReadCur)
+{
+    u8* Data = (u8*)Chunk.Base;
+    while (*ReadCur < Chunk.WriteCur || Ws->Stage == WsStage_Payload)
+    {
+        if (Ws->Stage == WsStage_Closed)
+        {
+            *ReadCur = Chunk.WriteCur;
+            break;
+        }
+        
+        if (Ws->Stage == WsStage_Header)
+        {
+            // Header is gathered in [.Header], since it may be split across
+            // chunks. Its size is known once the first 2 bytes are in.
+            usz HeaderSize = (Ws->HeaderSize < 2) ? 2 : GetWebSocketHeaderSize(Ws->Header);
+            while (Ws->HeaderSize < HeaderSize && *ReadCur < Chunk.WriteCur)
+            {
+                Ws->Header[Ws->HeaderSize++] = Data[(*ReadCur)++];
+                if (Ws->HeaderSize == 2)
+                {
+                    HeaderSize = GetWebSocketHeaderSize(Ws->Header);
+                }
+            }
+            if (Ws->HeaderSize < HeaderSize)
+            {
+                break;
+            }
+            
+            ts_ws_event Event = StartWebSocketFrame(Ws);
+            if (Event != WsEvent_None)
+            {
+                return Event;
+            }
+        }
+        
+        u64 Left = Ws->FrameSize - Ws->FrameReceived;
+        usz Available = (usz)Min((u64)(Chunk.WriteCur - *ReadCur), Left);
+        if (Ws->Opcode & 0x8)
+        {
+            CopyData(Ws->Control + Ws->FrameReceived, Available, Data + *ReadCur, Available);
+            *ReadCur += Available;
+            Ws->FrameReceived += Available;
+            if (Ws->FrameReceived == Ws->FrameSize)
+            {
+                return EndWebSocketControlFrame(Ws);
+            }
+            break;
+        }
+        
+        // Data is handed out as it comes, even if the frame isn't whole yet.
+        // Empty pieces are only handed out to end a message.
+        bool FrameDone = (Available == Left);
+        if (Available == 0 && !(FrameDone && Ws->Final))
+        {
+            if (FrameDone)
+            {
+                Ws->Stage = WsStage_Header;
+                continue;
+            }
+            break;
+        }
+        
+        UnmaskWebSocketData(Data + *ReadCur, Available, Ws->Mask, Ws->FrameReceived);
+        if (Ws->MessageType == WsOpcode_Text
+            && (!CheckWebSocketUtf8(Ws, Data + *ReadCur, Available)
+                || (FrameDone && Ws->Final && Ws->Utf8Needed)))
+        {
+            return FailWebSocket(Ws, WsClose_InvalidData);
+        }
+        Ws->Data = String(Data + *ReadCur, Available, 0, EC_ASCII);
+        *ReadCur += Available;
+        Ws->FrameReceived += Available;
+        Ws->MessageDone = 0;
+        if (FrameDone)
+        {
+            Ws->Stage = WsStage_Header;
+            if (Ws->Final)
+            {
+                Ws->MessageDone = 1;
+                Ws->InMessage = 0;
+            }
+        }
+        return WsEvent_Data;
+    }
+    
+    return WsEvent_None;
+}
+
+external usz
+CraftWebSocketFrameHeader(u8* OutHeader, u8 Opcode, bool Final, u64 PayloadSize)
+{
+    // Server frames are never masked.
+    usz Size = 2;
+    OutHeader[0] = (Final ? 0x80 : 0) | (Opcode & 0x0F);
+    if (PayloadSize < 126)
+    {
+        OutHeader[1] = (u8)PayloadSize;
+    }
+    else if (PayloadSize <= U16_MAX)
+    {
+        OutHeader[1] = 126;
+        OutHeader[2] = (u8)(PayloadSize >> 8);
+        OutHeader[3] = (u8)PayloadSize;
+        Size = 4;
+    }
+    else
+    {
+        OutHeader[1] = 127;
+        for (usz Idx = 0; Idx < 8; Idx++)
+        {
+            OutHeader[2 + Idx] = (u8)(PayloadSize >> (56 - Idx * 8));
+        }
+        Size = 10;
+    }
+    return Size;
+}
+
+external bool
+AppendWebSocketFrame(buffer* Out, u8 Opcode, bool Final, string Payload)
+{
+    u8 Header[WS_MAX_FRAME_HEADER_SIZE];
+    usz HeaderSize = CraftWebSocketFrameHeader(Header, Opcode, Final, Payload.WriteCur);
+    if (Out->WriteCur + HeaderSize + Payload.WriteCur > Out->Size)
+    {
+        return false;
+    }
+    
+    CopyData(Out->Base + Out->WriteCur, HeaderSize, Header, HeaderSize);
+    CopyData(Out->Base + Out->WriteCur + HeaderSize, Payload.WriteCur, Payload.Base, Payload.WriteCur);
+    Out->WriteCur += HeaderSize + Payload.WriteCur;
+    return true;
+}
+
+external bool
+AppendWebSocketClose(buffer* Out, u16 CloseCode, string Reason)
+{
+    u8 Payload[WS_MAX_CONTROL_SIZE];
+    usz Size = 0;
+    if (CloseCode != WsClose_NoStatus)
+    {
+        Payload[0] = (u8)(CloseCode >> 8);
+        Payload[1] = (u8)CloseCode;
+        Size = Min(Reason.WriteCur, sizeof(Payload) - 2);
+        CopyData(Payload + 2, Size, Reason.Base, Size);
+        Size += 2;
+    }
+    return AppendWebSocketFrame(Out, WsOpcode_Close, true, String(Payload, Size, 0, EC_ASCII));
+}
@@ -0,0 +1,163 @@
+#ifndef TINYSERVER_WEBSOCKET_H
+//===========================================================================
+// tinyserver-websocket.h
+//
+// Module for working with the WebSocket protocol (RFC 6455), on connections
+// upgraded from HTTP/1.1. Builds on tinyserver-http.h for the upgrade, and
+// does no IO by itself: frames are parsed from whatever RecvData() brings,
+// and crafted into buffers that go out with SendData() or SendVector().
+//
+// Upgrading:
+//   1. Parse the request with ParseHttpHeader(), and call
+//      CraftWebSocketAccept(). If it succeeds, send the header it crafted,
+//      and call InitWebSocket(). Received bytes after the request header,
+//      if any, are the first chunk of frames.
+//
+// Reading inbound data:
+//   1. Recv incoming data, and call ParseWebSocketChunk() in a loop on it,
+//      handling each event, until it returns WsEvent_None. The chunk memory
+//      may then be reused for the next recv.
+//   2. On WsEvent_Data, [.Data] has the next piece of a message, in the
+//      order sent. Messages split in many frames come out as one stream of
+//      pieces, and [.MessageDone] is set on the last piece.
+//   3. On WsEvent_Ping, send back a pong with the same [.Data]. On
+//      WsEvent_Close or WsEvent_Error, send a close frame with [.CloseCode]
+//      and disconnect.
+//
+// Sending outbound data:
+//   1. Small frames (e.g. notifications and pongs) can be appended to one
+//      buffer with AppendWebSocketFrame(), and all of it sent with a single
+//      SendData() call.
+//   2. For large payloads, craft just the header with
+//      CraftWebSocketFrameHeader(), and send header and payload together
+//      with SendVector(), so the payload isn't copied.
+//===========================================================================
+#define TINYSERVER_WEBSOCKET_H
+
+#include "tinyserver-http.h"
+
+#define WS_MAX_FRAME_HEADER_SIZE 14
+#define WS_MAX_CONTROL_SIZE 125
+
+#define WsOpcode_Continuation 0x0
+#define WsOpcode_Text         0x1
+#define WsOpcode_Binary       0x2
+#define WsOpcode_Close        0x8
+#define WsOpcode_Ping         0x9
+#define WsOpcode_Pong         0xA
+
+#define WsClose_Normal          1000
+#define WsClose_GoingAway       1001
+#define WsClose_ProtocolError   1002
+#define WsClose_UnsupportedData 1003
+#define WsClose_NoStatus        1005 // Never sent, close frame had no code.
+#define WsClose_InvalidData     1007
+#define WsClose_PolicyViolation 1008
+#define WsClose_MessageTooBig   1009
+#define WsClose_InternalError   1011
+
+
+//================================
+// Upgrade
+//================================
+
+external bool CraftWebSocketAccept(ts_request* Request, _opt char* Protocol,
+                                   string* OutHeader);
+
+/* Checks that a parsed [Request] is a valid WebSocket upgrade (version 13),
+|  and writes the 101 response header that accepts it to [OutHeader], with
+|  its Sec-WebSocket-Accept. [Protocol], if passed, is the subprotocol picked
+|  from the request's Sec-WebSocket-Protocol, and is sent back.
+|--- Return: true if successful, false if [Request] is not a valid upgrade, or
+|    [OutHeader] hasn't got enough space, in which case nothing is written. */
+
+
+//================================
+// Frames
+//================================
+
+typedef enum ts_ws_event
+{
+    WsEvent_None,  // Chunk fully consumed, feed more data.
+    WsEvent_Data,  // [.Data] points to the next piece of a message.
+    WsEvent_Ping,  // [.Data] has the ping payload.
+    WsEvent_Pong,  // [.Data] has the pong payload.
+    WsEvent_Close, // Client is closing, [.CloseCode] and [.Data] have why.
+    WsEvent_Error  // Error, [.CloseCode] has the code to close with.
+} ts_ws_event;
+
+typedef struct ts_websocket
+{
+    u8 Header[WS_MAX_FRAME_HEADER_SIZE]; // Of the current frame.
+    u8 HeaderSize;
+    u8 Control[WS_MAX_CONTROL_SIZE];     // Payload of control frames.
+    u8 Stage;
+    u8 Opcode;
+    u8 Final;
+    u8 InMessage;
+    u8 Mask[4];
+    u64 FrameSize;
+    u64 FrameReceived;
+    u64 MessageSize;
+    u64 MaxMessageSize;
+    
+    u8 MessageType; // WsOpcode_Text or WsOpcode_Binary.
+    u8 MessageDone;
+    u8 Utf8Needed;  // Continuation bytes still due in a text message.
+    u8 Utf8Min;     // Range of the next one.
+    u8 Utf8Max;
+    u16 CloseCode;
+    string Data;
+} ts_websocket;
+
+external void InitWebSocket(ts_websocket* Ws, u64 MaxMessageSize);
+
+/* Prepares [Ws] for parsing frames of a newly upgraded connection. Messages
+|  larger than [MaxMessageSize] fail with WsClose_MessageTooBig (0 for no
+|  limit).
+|--- Return: nothing. */
+
+external ts_ws_event ParseWebSocketChunk(ts_websocket* Ws, string Chunk, usz* ReadCur);
+
+/* Parses a piece of frames received in [Chunk], starting at [ReadCur], and
+|  advances [ReadCur] past the consumed bytes. Must be called in a loop until
+|  it returns WsEvent_None, at which point the whole chunk was consumed and
+|  more data must be read. Chunks may be of any size, and frames may span
+|  any number of them. Payloads are unmasked in place, in [Chunk], so on
+|  WsEvent_Data, [.Data] points into it, and is valid until the chunk memory
+|  is reused; [.MessageType] has the type of the message, and [.MessageDone]
+|  is set on its last piece. Control frames are only returned once whole, and
+|  their [.Data] is valid until the next call. Text messages and close reasons
+|  are checked to be valid UTF-8, and fail with WsClose_InvalidData if not;
+|  a piece of text may end inside a character the next piece finishes. After
+|  WsEvent_Close or WsEvent_Error, nothing else is parsed.
+|--- Return: event describing what was parsed. */
+
+external usz CraftWebSocketFrameHeader(u8* OutHeader, u8 Opcode, bool Final,
+                                       u64 PayloadSize);
+
+/* Writes the header of a server frame with [Opcode] and [PayloadSize] bytes of
+|  payload to [OutHeader], which must have WS_MAX_FRAME_HEADER_SIZE bytes
+|  available. [Final] is false for all but the last frame of a message split
+|  in many, whose other frames have WsOpcode_Continuation.
+|--- Return: size of the header. */
+
+external bool AppendWebSocketFrame(buffer* Out, u8 Opcode, bool Final, string Payload);
+
+/* Writes a whole frame, header and [Payload], to the end of [Out], for
+|  sending many frames at once. See CraftWebSocketFrameHeader().
+|--- Return: true if successful, false if [Out] hasn't got enough space. */
+
+external bool AppendWebSocketClose(buffer* Out, u16 CloseCode, string Reason);
+
+/* Writes a close frame with [CloseCode] and [Reason] to the end of [Out]. No
+|  code is sent if [CloseCode] is WsClose_NoStatus. [Reason] is cut to fit a
+|  control frame.
+|--- Return: true if successful, false if [Out] hasn't got enough space. */
+
+
+#if !defined(TINYSERVER_STATIC_LINKING)
+#include "tinyserver-websocket.c"
+#endif
+
+#endif //TINYSERVER_WEBSOCKET_H
@@ -32,6 +32,12 @@
 //      not complete upon dequeue. Check [.BytesReceived] how much IO was
 //      performed; adjust [.IoBuffer] and [.IoSize] to post again if needed.
 //   4) Repeat from #1.
+//
+// Datagram (UDP) sockets have no connections: ListenForConnections() returns
+// them once the first datagram arrives, and AcceptConn() binds the socket
+// itself to the ts_io object. From then on, RecvDatagrams and SendDatagrams
+// move many datagrams per call, each with its peer address. Adding the same
+// UDP port more than once spreads its datagrams across the sockets.
 //===========================================================================
 #define TINYSERVER_H
 
@@ -71,6 +77,10 @@ typedef enum ts_op
     Op_RecvData,
     Op_SendData,
     Op_SendFile,
+    Op_SendVector,
+    Op_RecvDatagrams,
+    Op_SendDatagrams,
+    Op_ProxyData,
     Op_SendToIoQueue
 } ts_op;
 
@@ -82,18 +92,57 @@ typedef struct ts_sockaddr
     u32 Size;
 } ts_sockaddr;
 
+typedef struct ts_io_vec
+{
+    u8* Base;
+    usz Size;
+} ts_io_vec;
+
+#define TS_MAX_DATAGRAMS 64 // Most datagrams moved per operation.
+
+typedef struct ts_datagram
+{
+    u8* Base;
+    u32 Size;             // Buffer size on recv, bytes to send on send.
+    u32 BytesTransferred;
+    ts_sockaddr Peer;     // Source on recv, destination on send.
+    u16 SegmentSize;      // Size of each datagram coalesced in [.Base], or 0.
+} ts_datagram;
+
+typedef struct ts_conn_config
+{
+    u8 NoDelay;            // Sends small writes right away (TCP_NODELAY).
+    u32 NotSentLowat;      // Most unsent bytes queued before waiting, or 0.
+    u32 KeepAliveIdle;     // Seconds idle before probing the peer, or 0 for none.
+    u32 KeepAliveInterval; // Seconds between probes, or 0 for default.
+    u32 KeepAliveCount;    // Probes unanswered before dropping, or 0 for default.
+} ts_conn_config;
+
+typedef struct ts_listen_config
+{
+    char* Address;           // IP address to bind to, or NULL for any.
+    i32 Backlog;             // Pending connections queued, or 0 for SOMAXCONN.
+    u32 DeferAcceptSeconds;  // Accept only once data arrives, up to this long.
+    u32 FastOpenQueue;       // Pending TCP Fast Open connections, or 0 for none.
+    u32 RecvBufferSize;      // Bytes, or 0 for default.
+    u32 SendBufferSize;      // Bytes, or 0 for default.
+    u8 V6Only;               // IPv6 sockets take no IPv4 connections.
+    ts_conn_config* Conn;    // Applied to accepted connections, or NULL.
+} ts_listen_config;
+
 typedef struct ts_listen
 {
     file Socket;
     file Event;
     ts_protocol Protocol;
     i32 SockAddrSize;
+    ts_conn_config* ConnConfig;
 } ts_listen;
 
 #if defined(TT_WINDOWS)
 # define TS_INTERNAL_DATA_SIZE 48 // See tinyserver-win32.c for more info.
 #elif defined(TT_LINUX)
-# define TS_INTERNAL_DATA_SIZE 4  // See tinyserver-epoll.c for more info.
+# define TS_INTERNAL_DATA_SIZE 32 // See tinyserver-epoll.c for more info.
 #endif
 
 typedef struct ts_io
@@ -109,8 +158,14 @@ typedef struct ts_io
     {
         u8* IoBuffer;
         file IoFile;
+        ts_io_vec* IoVec;
+        ts_datagram* IoDatagrams;
     };
     u32 IoSize;
+    u64 IoOffset; // File offset for SendFile, advanced as the file is sent,
+                  // and reset to 0 by AcceptConn and CreateConn.
+    u32 Timeout;  // Milliseconds CreateConn waits to connect, or 0 for default.
+    ts_sockaddr Peer; // Remote address, set by AcceptConn and CreateConn.
 } ts_io;
 
 
@@ -133,13 +188,23 @@ external ts_sockaddr CreateSockAddr(char* IpAddress, u16 Port, ts_protocol Proto
 
 /* Creates and populates a sockaddr struct for the desired [Protocol], with a
  |  specified [IpAddress] and [Port]. Meant to be passed as-is to CreateConn().
-|--- Return: filled ts_sockaddr struct. */
+|--- Return: filled ts_sockaddr struct, with [.Size] of 0 if [IpAddress] is invalid. */
 
 external bool AddListeningSocket(ts_protocol Protocol, u16 Port);
 
 /* Creates a new socket for the defined [Protocol], binds it to the specified [Port]
  |  number and sets it up for listening. The socket is added to an internal structure
- |  that keeps track of listening sockets.
+ |  that keeps track of listening sockets. UDP sockets are only bound, since they
+ |  take no connections; see AcceptConn().
+|--- Return: true if successful, false if not. */
+
+external bool AddConfiguredListeningSocket(ts_protocol Protocol, u16 Port,
+                                           ts_listen_config* Config);
+
+/* Same as AddListeningSocket(), with the socket set up as in [Config]. With
+ |  [.DeferAcceptSeconds], connections are only reported by ListenForConnections()
+ |  once the peer sent data, so ones that never do cost no wake-ups. [.Conn],
+ |  if given, must stay valid for as long as the server runs.
 |--- Return: true if successful, false if not. */
 
 
@@ -165,10 +230,18 @@ external ts_io* WaitOnIoQueue(void);
 |            indicating if the connection is still standing or has been aborted, and
  |            [.BytesTransferred] updated to that of the latest transaction. */
 
+external usz GetIoQueueDepth(void);
+
+/* Counts the completed operations waiting to be dequeued by WaitOnIoQueue(). A
+ |  depth that keeps growing means the IO threads can't keep up, which is what
+ |  load shedding is based on (see tinyserver-admission.h).
+|--- Return: number of operations waiting. */
+
 external bool SendToIoQueue(ts_io* Conn);
 
 /* Sends the socket in [Conn] back to the [IoQueue]. No bytes are transferred
- |  during the operation.
+ |  during the operation. Fails if the queue stays full for a while, since the
+ |  calling IO thread may be one that would have to make room.
 |--- Return: true if successful, false if not. */
 
 
@@ -183,19 +256,30 @@ external bool SendToIoQueue(ts_io* Conn);
 bool (*AcceptConn)(ts_listen Listening, ts_io* Conn);
 
 /* Accepts an incoming connection on [Listening], assigns it to [Conn.Socket],
- |  and binds that socket to the IO queue. Optionally, the user can assign a
- |  memory buffer to [.IoBuffer] and its size to [.IoSize], and a read will be
- |  posted immediately upon establishing a connection. If left blank, no such read
- |  will be performed.
+ |  its remote address to [.Peer], and binds that socket to the IO queue.
+ |  Optionally, the user can assign a memory buffer to [.IoBuffer] and its size
+ |  to [.IoSize], and a read will be performed upon establishing a connection:
+ |  right away if data already arrived (as it has with [.DeferAcceptSeconds] of
+ |  ts_listen_config), or posted otherwise. Either way, [Conn] is dequeued as a
+ |  completed Op_RecvData. If left blank, no such read will be performed.
+|  If [Listening] is a UDP socket, the listening socket itself is assigned to
+|  [Conn.Socket] and moved to the IO queue, and is not returned again by
+|  ListenForConnections(). The optional read is then RecvDatagrams(), with
+|  [.IoDatagrams] and [.IoSize] assigned instead. A TCP connection that can't be
+|  queued (e.g. with the queue full, see SendToIoQueue()) is closed.
 |--- Return: true if successful, false if not. */
 
 bool (*CreateConn)(ts_io* Conn, ts_sockaddr SockAddr);
 
 /* Creates a new connection on the socket in [Conn], binding it to the address at
-|  [SockAddr], created with CreateSockAddr(). Optionally, the user can assign a
- |  data buffer to [.IoBuffer] and its size to [.IoSize], and a send will be
- |  posted immediately upon establishing a connection. If left blank, no such send
- |  will be performed.
+|  [SockAddr], created with CreateSockAddr(). If [.Socket] is INVALID_FILE, a TCP
+|  socket for the address is opened. The connection is made asynchronously, and
+|  dequeued by WaitOnIoQueue() with [.Status] Status_Connected once made, or
+|  Status_Error if it failed, or wasn't made within [.Timeout] milliseconds (if
+|  not 0). Optionally, the user can assign a data buffer to [.IoBuffer] and its
+|  size to [.IoSize], and a send will be posted immediately upon establishing a
+|  connection, so the send is dequeued instead. If left blank, no such send will
+|  be performed.
 |--- Return: true if successful, false if not. */
 
 bool (*DisconnectSocket)(ts_io* Conn, int Type);
@@ -224,9 +308,23 @@ bool (*SendData)(ts_io* Conn);
 bool (*SendFile)(ts_io* Conn);
 
 /* Sends a file to the socket in [Conn]. The user must assign the file handle to
- |  [.IoFile] and the number of bytes to send to [.IoSize] by the user. The operation
- |  happens asynchronously, and its completion status, as well as number of bytes
- |  transmitted, is gotten by calling WaitOnIoQueue().
+ |  [.IoFile], the number of bytes to send to [.IoSize], and the file offset to
+ |  start from to [.IoOffset]. The file position is not used nor changed, so the
+ |  same handle can be sent on many connections at once. [.IoOffset] is advanced
+ |  by the bytes sent, so a partial send can be posted again as is, after
+ |  reducing [.IoSize]. The operation happens asynchronously, and its completion
+ |  status, as well as number of bytes transmitted, is gotten by calling
+ |  WaitOnIoQueue().
+ |--- Return: true if successful, false if not. */
+
+bool (*SendVector)(ts_io* Conn);
+
+/* Sends a list of memory buffers to the socket in [Conn], in one operation. The
+ |  user must assign an array of ts_io_vec to [.IoVec] and the number of elements
+ |  in it to [.IoSize] beforehand. The array and the buffers must be kept until
+ |  the operation completes. The operation happens asynchronously, and its
+ |  completion status, as well as number of bytes transmitted (across all
+ |  buffers), is gotten by calling WaitOnIoQueue().
  |--- Return: true if successful, false if not. */
 
 bool (*RecvData)(ts_io* Conn);
@@ -237,6 +335,67 @@ bool (*RecvData)(ts_io* Conn);
  |  transmitted, is gotten by calling WaitOnIoQueue().
  |--- Return: true if successful, false if not. */
 
+bool (*RecvDatagrams)(ts_io* Conn);
+
+/* Reads many datagrams from the UDP socket in [Conn] at once. The user must
+|  assign an array of ts_datagram to [.IoDatagrams], each with a buffer in [.Base]
+|  and its size in [.Size], and the number of elements to [.IoSize] beforehand.
+|  Upon completion, [.BytesTransferred] of [Conn] has how many datagrams were
+|  read (up to TS_MAX_DATAGRAMS), and each of those has its size in
+|  [.BytesTransferred] and its source in [.Peer]. A datagram larger than its
+|  buffer is cut. If coalescing was enabled with EnableDatagramCoalescing(),
+|  [.SegmentSize] is set when many datagrams from the same source were joined in
+|  one buffer, all of that size except maybe the last. No datagrams read is not
+|  an error.
+|--- Return: true if successful, false if not. */
+
+bool (*SendDatagrams)(ts_io* Conn);
+
+/* Sends many datagrams from the UDP socket in [Conn] at once. The user must
+|  assign an array of ts_datagram to [.IoDatagrams], each with its data in
+|  [.Base] and [.Size] and its destination in [.Peer] (created with
+|  CreateSockAddr(), or taken from a received datagram), and the number of
+|  elements to [.IoSize] beforehand. If [.SegmentSize] is not 0, the data is sent
+|  as many datagrams of that size (the last one may be smaller), all to [.Peer],
+|  which the kernel splits as late as possible (UDP GSO). Upon completion,
+|  [.BytesTransferred] of [Conn] has how many datagrams were sent, and each of
+|  those has the bytes sent in its [.BytesTransferred].
+|--- Return: true if successful, false if not. */
+
+bool (*ProxyData)(ts_io* Conn);
+
+/* Moves data received on the socket in [Conn] to the socket assigned to
+|  [.IoFile], without copying it to user memory. The user must assign the
+|  destination socket to [.IoFile] and the most bytes to move at once to [.IoSize]
+|  beforehand, and keep the same destination for as long as the connection is
+|  proxied. The operation completes once data was moved, and [.BytesTransferred]
+|  has the bytes delivered to the destination; it may be 0 if the destination
+|  couldn't take them yet, in which case they are kept and delivered first on
+|  the next call. When the source closes, [.Status] is Status_Aborted. To relay
+|  both ways, use one ts_io per direction.
+|--- Return: true if successful, false if not. */
+
+external bool EnableDatagramCoalescing(ts_io* Conn);
+
+/* Lets the kernel join many datagrams from the same source into one buffer on
+|  the UDP socket in [Conn] (UDP GRO), so RecvDatagrams() has far fewer to go
+|  through under load. Buffers should then be about 64KB.
+|--- Return: true if successful, false if not supported. */
+
+external bool ConfigureConn(ts_io* Conn, ts_conn_config* Config);
+
+/* Sets up the TCP connection in [Conn] as in [Config]. Done by AcceptConn() for
+|  listeners that have a connection config, and may be done for any other, e.g.
+|  after CreateConn().
+|--- Return: true if successful, false if any option was refused. */
+
+external bool CorkConn(ts_io* Conn, bool Corked);
+
+/* Holds back partial packets on the TCP connection in [Conn] while [Corked],
+|  so that e.g. a header sent with SendData and the file sent after it with
+|  SendFile leave in full packets. Pending data is sent once uncorked.
+|--- Return: true if successful, false if not. */
+
 
 #if !defined(TINYSERVER_STATIC_LINKING)
 # if defined(TT_WINDOWS)